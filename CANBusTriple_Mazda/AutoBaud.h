@@ -0,0 +1,221 @@
+/*
+*  Automatic bitrate detection
+*
+*  Puts a controller in LISTEN mode, which never ACKs or sends error frames,
+*  so a wrong guess can not disturb the bus. Each candidate rate gets
+*  AUTOBAUD_DWELL ms: AUTOBAUD_FRAMES valid frames without a single error
+*  (MERRF, a new EFLG error bit or REC going up) accepts it, any error drops
+*  it right away. The saved rate is tried first, then the usual automotive
+*  rates. All three busses are scanned at once from tick(), so the whole
+*  scan takes at most (AUTOBAUD_RATES + 1) * AUTOBAUD_DWELL ms.
+*
+*  Frames still pending are aborted and the scan only starts once CANSTAT
+*  shows LISTEN. A candidate is skipped if the rate could not be set or the
+*  controller did not return to LISTEN after it.
+*
+*  Only once a rate is found does the bus go back to NORMAL and the rate get
+*  saved. If nothing is found the old rate is restored. While a bus is being
+*  scanned the main loop leaves its RX buffers alone and drops frames for it.
+*
+*  RAM: the scan state is taken from the heap by start(), 17 bytes per bus,
+*  and given back when no bus is being scanned. Otherwise it costs 6 bytes.
+*/
+
+#define AUTOBAUD_DWELL 120        // ms per candidate
+#define AUTOBAUD_FRAMES 4         // Clean frames needed to accept a rate
+#define AUTOBAUD_RATES 10
+
+#define AUTOBAUD_IDLE 0
+#define AUTOBAUD_SCANNING 1
+
+#define EFLG_ERRORS (EWARN | RXWAR | RXEP)
+#define MODE_LISTEN 0x60          // CANSTAT OPMOD
+
+const unsigned long autobaudRates[AUTOBAUD_RATES] PROGMEM = {
+  500000, 250000, 125000, 1000000, 83333, 33333, 100000, 50000, 800000, 20000
+};
+
+struct autobaudBus {
+  byte state;
+  byte candidate;             // 0 = saved rate, then autobaudRates + 1
+  byte frames;
+  byte rec;                   // REC when the candidate started
+  byte eflg;                  // EFLG error bits when the candidate started
+  unsigned long rate;
+  unsigned long since;        // millis() the candidate started
+  unsigned long startedAt;
+};
+
+
+class AutoBaud
+{
+  private:
+    static CANBus *busses;
+    static Stream *out;
+    static struct autobaudBus *scans;    // One per bus, NULL while no scan runs
+    static boolean tryCandidate( byte i );
+    static boolean listening( CANBus &bus );
+    static void finish( byte i, boolean found );
+  public:
+    static void init( CANBus *b );
+    static boolean start( byte busMask, Stream *s );
+    static void tick();
+    static boolean scanning( byte busId );
+};
+
+
+CANBus *AutoBaud::busses;
+Stream *AutoBaud::out = &Serial;
+struct autobaudBus *AutoBaud::scans = NULL;
+
+
+void AutoBaud::init( CANBus *b )
+{
+  busses = b;
+}
+
+
+// busMask bit 0 = Bus 1, false if there is not enough free RAM to scan
+boolean AutoBaud::start( byte busMask, Stream *s )
+{
+  if( scans == NULL ) scans = (struct autobaudBus *) calloc( 3, sizeof(struct autobaudBus) );
+  if( scans == NULL ) return false;
+  out = s;
+
+  for( byte i=0; i<3; i++ ){
+    if( !(busMask & (1 << i)) ) continue;
+
+    CANBus &bus = busses[i];
+    struct autobaudBus *a = &scans[i];
+    a->state = AUTOBAUD_SCANNING;
+    a->candidate = 0;
+    a->startedAt = millis();
+
+    // Nothing may go out during the scan, pending frames included
+    bus.modifyRegister( CANCTRL, ABAT, ABAT );
+    bus.setMode(LISTEN);
+    boolean listen = listening( bus );
+    bus.modifyRegister( CANCTRL, ABAT, 0 );
+    bus.modifyRegister( RXB0CTRL, RXM_MASK, RXM_ANY );
+    bus.modifyRegister( RXB1CTRL, RXM_MASK, RXM_ANY );
+
+    if( !listen || !tryCandidate(i) ) finish( i, false );
+  }
+  return true;
+}
+
+
+boolean AutoBaud::scanning( byte busId )
+{
+  return scans != NULL && busId >= 1 && busId <= 3 && scans[busId-1].state == AUTOBAUD_SCANNING;
+}
+
+
+// Wait for the controller to be in LISTEN mode, false if it is not within MODE_TIMEOUT
+boolean AutoBaud::listening( CANBus &bus )
+{
+  unsigned long start = millis();
+  while( (bus.readRegister( CANSTAT ) & 0xE0) != MODE_LISTEN )
+    if( millis() - start >= MODE_TIMEOUT ) return false;
+  return true;
+}
+
+
+// Set up the next rate that is not a repeat of the saved one, false when out of rates
+boolean AutoBaud::tryCandidate( byte i )
+{
+  CANBus &bus = busses[i];
+  struct autobaudBus *a = &scans[i];
+  unsigned long saved = Settings::busRate( i+1 );
+
+  while( a->candidate <= AUTOBAUD_RATES ){
+    unsigned long rate = a->candidate == 0 ? saved : pgm_read_dword( &autobaudRates[a->candidate-1] );
+    a->candidate++;
+    if( a->candidate > 1 && rate == saved ) continue;
+    if( !bus.setBitrate( rate ) || !listening( bus ) ) continue;
+
+    a->rate = rate;
+    a->frames = 0;
+    bus.modifyRegister( CANINTF, RX0IF | RX1IF | ERRIF | MERRF, 0 );
+    bus.modifyRegister( EFLG, RX0OVR | RX1OVR, 0 );
+    a->rec = bus.readRegister( REC );
+    a->eflg = bus.readRegister( EFLG ) & EFLG_ERRORS;
+    a->since = millis();
+    return true;
+  }
+
+  return false;
+}
+
+
+void AutoBaud::tick()
+{
+  if( scans == NULL ) return;
+  boolean busy = false;
+
+  for( byte i=0; i<3; i++ ){
+    struct autobaudBus *a = &scans[i];
+    if( a->state != AUTOBAUD_SCANNING ) continue;
+
+    CANBus &bus = busses[i];
+    byte flags = bus.readRegister( CANINTF );
+    byte eflg = bus.readRegister( EFLG ) & EFLG_ERRORS;
+
+    boolean error = (flags & MERRF)
+                    || (eflg & ~a->eflg)
+                    || bus.readRegister( REC ) > a->rec;
+
+    if( !error && (flags & (RX0IF | RX1IF)) ){
+      // Only counting, the frames themselves are dropped
+      if( flags & RX0IF ) a->frames++;
+      if( flags & RX1IF ) a->frames++;
+      bus.modifyRegister( CANINTF, RX0IF | RX1IF, 0 );
+
+      if( a->frames >= AUTOBAUD_FRAMES ){
+        finish( i, true );
+        continue;
+      }
+    }
+
+    if( error || millis() - a->since >= AUTOBAUD_DWELL ){
+      if( !tryCandidate(i) ) finish( i, false );
+    }
+    busy |= a->state == AUTOBAUD_SCANNING;
+  }
+
+  // All done, give the scan state back
+  if( !busy ){
+    free( scans );
+    scans = NULL;
+  }
+}
+
+
+void AutoBaud::finish( byte i, boolean found )
+{
+  CANBus &bus = busses[i];
+  struct autobaudBus *a = &scans[i];
+
+  if( found )
+    Settings::setBusRate( i+1, a->rate );
+  else
+    bus.setBitrate( Settings::busRate( i+1 ) );
+
+  bus.modifyRegister( CANINTF, RX0IF | RX1IF | ERRIF | MERRF, 0 );
+  bus.modifyRegister( RXB0CTRL, RXM_MASK, 0 );
+  bus.modifyRegister( RXB1CTRL, RXM_MASK, 0 );
+  bus.setMode(NORMAL);
+  a->state = AUTOBAUD_IDLE;
+
+  out->print( F("{\"event\":\"autobaud\", \"bus\":\"") );
+  out->print( i+1 );
+  out->print( F("\", \"rate\":\"") );
+  out->print( bus.bitRate );
+  out->print( F("\", \"frames\":\"") );
+  out->print( a->frames );
+  out->print( F("\", \"ms\":\"") );
+  out->print( millis() - a->startedAt );
+  out->print( F("\", \"result\":\"") );
+  out->print( found ? F("success") : F("failure") );
+  out->println( F("\"}") );
+}
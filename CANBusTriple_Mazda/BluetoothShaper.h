@@ -0,0 +1,247 @@
+/*
+*  Bluetooth output shaper
+*
+*  Serial1 to the BLE112 runs at 57600 baud, roughly 5KB/s. Frames headed for
+*  Bluetooth are parked in a small table of slots, one per message ID, and a
+*  token bucket releases them at a rate the UART can drain. The bucket is
+*  smaller than the UART TX buffer, and command replies also go out on
+*  Serial1 outside the bucket, so consume() checks availableForWrite() as
+*  well and Serial1.write() never blocks the CAN pipeline. Everything
+*  streamed to Serial1 goes through consume(): these records, the ServiceCall
+*  sensor packets and Signals updates. A newer frame for an ID replaces the pending one (coalesced)
+*  instead of queueing behind it, so the phone always gets the latest value.
+*  When all slots are taken a new ID reuses the least recently sent slot
+*  that has nothing pending and no policy set, IDs with a policy keep theirs.
+*/
+
+#include "Middleware.h"
+
+#define BT_SHAPER_SLOTS 8
+#define BT_SHAPER_BYTES_PER_MS 5     // ~5000 bytes/s, headroom under 57600 baud
+#define BT_SHAPER_BURST 48           // Bucket depth, kept under the 64 byte UART TX buffer
+#define BT_LOG_RECORD_SIZE 15        // 0x03 logging record, see SerialCommand::printMessageToSerial
+
+#define BT_PRIORITY_HIGH 0
+#define BT_PRIORITY_NORMAL 1
+#define BT_PRIORITY_LOW 2
+
+struct btSlot {
+  byte busId;                 // 0 = unused slot
+  unsigned short frame_id;
+  byte priority;
+  byte decimation;            // Forward every Nth frame, 1 = all
+  byte decimationCount;
+  unsigned int minInterval;   // Minimum ms between frames sent for this ID
+  unsigned long lastSent;
+  boolean pending;
+  byte length;
+  byte busStatus;
+  byte frame_data[8];
+};
+
+
+class BluetoothShaper : Middleware
+{
+  private:
+    static struct btSlot slots[BT_SHAPER_SLOTS];
+    static unsigned int tokens;
+    static unsigned long lastRefill;
+    static void refill();
+    static boolean take( unsigned int bytes );
+    static struct btSlot* findSlot( byte busId, unsigned short frame_id, boolean create );
+    static struct btSlot* nextEligible();
+    static void writeRecord( struct btSlot *slot );
+  public:
+    static void tick();
+    static void offer( Message msg );
+    static boolean consume( unsigned int bytes );
+    static boolean setPolicy( byte busId, unsigned short frame_id, unsigned int minInterval, byte decimation, byte priority );
+    static void resetStats();
+    static void printStats( Stream *out );
+    static unsigned long sent;
+    static unsigned long coalesced;
+    static unsigned long dropped;
+    static unsigned long refused;
+};
+
+
+struct btSlot BluetoothShaper::slots[BT_SHAPER_SLOTS];
+unsigned int BluetoothShaper::tokens = BT_SHAPER_BURST;
+unsigned long BluetoothShaper::lastRefill = 0;
+unsigned long BluetoothShaper::sent = 0;
+unsigned long BluetoothShaper::coalesced = 0;
+unsigned long BluetoothShaper::dropped = 0;
+unsigned long BluetoothShaper::refused = 0;
+
+
+void BluetoothShaper::tick()
+{
+  refill();
+
+  struct btSlot *slot;
+  while( (slot = nextEligible()) != NULL ){
+    if( !take(BT_LOG_RECORD_SIZE) ) break;
+    writeRecord( slot );
+  }
+}
+
+
+void BluetoothShaper::refill()
+{
+  unsigned long now = millis();
+  unsigned long elapsed = now - lastRefill;
+  if( elapsed == 0 ) return;
+  lastRefill = now;
+
+  if( elapsed > BT_SHAPER_BURST ) elapsed = BT_SHAPER_BURST;
+  tokens += elapsed * BT_SHAPER_BYTES_PER_MS;
+  if( tokens > BT_SHAPER_BURST ) tokens = BT_SHAPER_BURST;
+}
+
+
+/*
+*  Take bytes from the bucket. Callers writing straight to Serial1 must check
+*  this first and drop or retry later when it returns false. Also false when
+*  the UART buffer has no room for them, whatever the bucket holds.
+*/
+boolean BluetoothShaper::consume( unsigned int bytes )
+{
+  refill();
+  if( take(bytes) ) return true;
+  refused++;
+  return false;
+}
+
+
+boolean BluetoothShaper::take( unsigned int bytes )
+{
+  if( tokens < bytes || Serial1.availableForWrite() < (int) bytes ) return false;
+  tokens -= bytes;
+  return true;
+}
+
+
+void BluetoothShaper::offer( Message msg )
+{
+  struct btSlot *slot = findSlot( msg.busId, msg.frame_id, true );
+  if( slot == NULL ){
+    dropped++;
+    return;
+  }
+
+  // Skipped by decimation on purpose, not a drop
+  if( ++slot->decimationCount < slot->decimation ) return;
+  slot->decimationCount = 0;
+
+  if( slot->pending ) coalesced++;
+
+  slot->pending = true;
+  slot->length = msg.length;
+  slot->busStatus = msg.busStatus;
+  memcpy( slot->frame_data, msg.frame_data, 8 );
+}
+
+
+boolean BluetoothShaper::setPolicy( byte busId, unsigned short frame_id, unsigned int minInterval, byte decimation, byte priority )
+{
+  struct btSlot *slot = findSlot( busId, frame_id, true );
+  if( slot == NULL ) return false;
+
+  slot->minInterval = minInterval;
+  slot->decimation = decimation > 0 ? decimation : 1;
+  slot->priority = priority > BT_PRIORITY_LOW ? BT_PRIORITY_LOW : priority;
+  return true;
+}
+
+
+struct btSlot* BluetoothShaper::findSlot( byte busId, unsigned short frame_id, boolean create )
+{
+  struct btSlot *freeSlot = NULL;
+  struct btSlot *idleSlot = NULL;
+
+  for( int i=0; i<BT_SHAPER_SLOTS; i++ ){
+    struct btSlot *slot = &slots[i];
+    if( slot->busId == busId && slot->frame_id == frame_id )
+      return slot;
+    if( freeSlot == NULL && slot->busId == 0 )
+      freeSlot = slot;
+
+    // Idle and without a policy, can be given to another ID
+    if( slot->busId != 0 && !slot->pending && slot->minInterval == 0 && slot->decimation == 1 &&
+        slot->priority == BT_PRIORITY_NORMAL && (idleSlot == NULL || slot->lastSent < idleSlot->lastSent) )
+      idleSlot = slot;
+  }
+
+  if( freeSlot == NULL ) freeSlot = idleSlot;
+  if( !create || freeSlot == NULL ) return NULL;
+
+  memset( freeSlot, 0, sizeof(struct btSlot) );
+  freeSlot->busId = busId;
+  freeSlot->frame_id = frame_id;
+  freeSlot->priority = BT_PRIORITY_NORMAL;
+  freeSlot->decimation = 1;
+  return freeSlot;
+}
+
+
+// Highest priority class first, least recently sent within a class
+struct btSlot* BluetoothShaper::nextEligible()
+{
+  struct btSlot *best = NULL;
+  unsigned long now = millis();
+
+  for( int i=0; i<BT_SHAPER_SLOTS; i++ ){
+    struct btSlot *slot = &slots[i];
+    if( !slot->pending ) continue;
+    if( now - slot->lastSent < slot->minInterval ) continue;
+
+    if( best == NULL ||
+        slot->priority < best->priority ||
+        (slot->priority == best->priority && slot->lastSent < best->lastSent) )
+      best = slot;
+  }
+
+  return best;
+}
+
+
+void BluetoothShaper::writeRecord( struct btSlot *slot )
+{
+  byte out[BT_LOG_RECORD_SIZE];
+  out[0] = 0x03; // Same record as the logging command
+  out[1] = slot->busId;
+  out[2] = slot->frame_id >> 8;
+  out[3] = slot->frame_id;
+  memcpy( &out[4], slot->frame_data, 8 );
+  out[12] = slot->length;
+  out[13] = slot->busStatus;
+  out[14] = '\r';
+
+  Serial1.write( out, BT_LOG_RECORD_SIZE );
+
+  slot->pending = false;
+  slot->lastSent = millis();
+  sent++;
+}
+
+
+void BluetoothShaper::resetStats()
+{
+  sent = coalesced = dropped = refused = 0;
+}
+
+
+void BluetoothShaper::printStats( Stream *out )
+{
+  out->print( F("{\"event\":\"btShaper\", \"sent\":\"") );
+  out->print( sent );
+  out->print( F("\", \"coalesced\":\"") );
+  out->print( coalesced );
+  out->print( F("\", \"dropped\":\"") );
+  out->print( dropped );
+  out->print( F("\", \"refused\":\"") );
+  out->print( refused );
+  out->print( F("\", \"tokens\":\"") );
+  out->print( tokens );
+  out->println( F("\"}") );
+}
@@ -0,0 +1,256 @@
+/*
+*  Bus health monitor
+*
+*  Every HEALTH_PERIOD ms each controller's TEC, REC and EFLG are read. RX
+*  overflow flags are counted and cleared, so every count is at least one
+*  lost frame. Transitions between active, warning, error passive and bus
+*  off are counted and kept in a short history.
+*
+*  A controller that goes TX error passive or bus off usually has nobody
+*  ACKing or a wrong bitrate, and would retry the same frame forever with
+*  the TX buffers and writeQueue stuck behind it. Its pending frames are
+*  aborted and the bus rests, frames for it are dropped, for a backoff that
+*  doubles on every relapse up to HEALTH_BACKOFF_MAX. The MCP2515 leaves bus
+*  off by itself after 128 x 11 recessive bits, resting gives it the time.
+*  HEALTH_STABLE ms of error active resets the backoff.
+*/
+
+#define HEALTH_PERIOD 20           // ms between samples
+#define HEALTH_BACKOFF_MIN 100     // ms
+#define HEALTH_BACKOFF_MAX 6400
+#define HEALTH_STABLE 5000
+#define HEALTH_HISTORY 8
+
+#define HEALTH_ACTIVE 0
+#define HEALTH_WARNING 1
+#define HEALTH_PASSIVE 2
+#define HEALTH_BUSOFF 3
+
+struct busHealth {
+  byte state;
+  byte tec;
+  byte rec;
+  byte maxTec;
+  byte maxRec;
+  unsigned long rx0Overflows;
+  unsigned long rx1Overflows;
+  unsigned int warnings;
+  unsigned int passives;
+  unsigned int busOffs;
+  unsigned int recoveries;        // Rests started
+  unsigned int backoff;           // ms, next rest
+  byte resumeTec;                 // TEC when the last rest ended
+  unsigned long restUntil;        // millis(), 0 = not resting
+  unsigned long stateSince;
+};
+
+struct healthEvent {
+  unsigned long ms;
+  byte busId;
+  byte state;
+  byte tec;
+  byte rec;
+};
+
+
+class BusHealth
+{
+  private:
+    static CANBus *busses;
+    static struct busHealth health[3];
+    static struct healthEvent history[HEALTH_HISTORY];
+    static byte historyNext;
+    static byte historyCount;
+    static unsigned long lastSample;
+    static void sample( byte i, unsigned long now );
+    static void rest( byte i, unsigned long now );
+  public:
+    static void init( CANBus *b );
+    static void tick();
+    static boolean resting( byte busId );
+    static void reset();
+    static void printStats( Stream *out );
+    static void printHistory( Stream *out );
+    static unsigned long errors;          // Overflows and error passive / bus off entries, all busses
+};
+
+
+CANBus *BusHealth::busses;
+struct busHealth BusHealth::health[3];
+struct healthEvent BusHealth::history[HEALTH_HISTORY];
+byte BusHealth::historyNext = 0;
+byte BusHealth::historyCount = 0;
+unsigned long BusHealth::lastSample = 0;
+unsigned long BusHealth::errors = 0;
+
+
+void BusHealth::init( CANBus *b )
+{
+  busses = b;
+  reset();
+}
+
+
+void BusHealth::reset()
+{
+  unsigned long now = millis();
+  for( byte i=0; i<3; i++ ){
+    byte state = health[i].state;
+    unsigned long restUntil = health[i].restUntil;
+    memset( &health[i], 0, sizeof(struct busHealth) );
+    health[i].state = state;
+    health[i].restUntil = restUntil;
+    health[i].backoff = HEALTH_BACKOFF_MIN;
+    health[i].stateSince = now;
+  }
+  historyNext = 0;
+  historyCount = 0;
+}
+
+
+boolean BusHealth::resting( byte busId )
+{
+  return busId >= 1 && busId <= 3 && health[busId-1].restUntil != 0;
+}
+
+
+void BusHealth::tick()
+{
+  unsigned long now = millis();
+  if( now - lastSample < HEALTH_PERIOD ) return;
+  lastSample = now;
+
+  for( byte i=0; i<3; i++ ){
+    // AutoBaud owns the error flags while it scans
+    if( AutoBaud::scanning(i+1) ) continue;
+    sample( i, now );
+  }
+}
+
+
+void BusHealth::sample( byte i, unsigned long now )
+{
+  CANBus &bus = busses[i];
+  struct busHealth *h = &health[i];
+
+  byte eflg = bus.readRegister( EFLG );
+  h->tec = bus.readRegister( TEC );
+  h->rec = bus.readRegister( REC );
+  if( h->tec > h->maxTec ) h->maxTec = h->tec;
+  if( h->rec > h->maxRec ) h->maxRec = h->rec;
+
+  if( eflg & (RX0OVR | RX1OVR) ){
+    if( eflg & RX0OVR ) h->rx0Overflows++;
+    if( eflg & RX1OVR ) h->rx1Overflows++;
+    errors++;
+    bus.modifyRegister( EFLG, RX0OVR | RX1OVR, 0 );
+  }
+
+  byte state = (eflg & TXBO) ? HEALTH_BUSOFF
+             : (eflg & (TXEP | RXEP)) ? HEALTH_PASSIVE
+             : (eflg & EWARN) ? HEALTH_WARNING
+             : HEALTH_ACTIVE;
+
+  if( state != h->state ){
+    switch( state ){
+      case HEALTH_WARNING: h->warnings++; break;
+      case HEALTH_PASSIVE: h->passives++; break;
+      case HEALTH_BUSOFF:  h->busOffs++;  break;
+    }
+    if( state > h->state && state >= HEALTH_PASSIVE ) errors++;
+
+    struct healthEvent *e = &history[historyNext];
+    e->ms = now;
+    e->busId = i+1;
+    e->state = state;
+    e->tec = h->tec;
+    e->rec = h->rec;
+    historyNext = (historyNext + 1) % HEALTH_HISTORY;
+    if( historyCount < HEALTH_HISTORY ) historyCount++;
+
+    h->state = state;
+    h->stateSince = now;
+  }
+
+  if( h->restUntil && (long)(now - h->restUntil) >= 0 ){
+    bus.modifyRegister( CANCTRL, ABAT, 0 );
+    h->restUntil = 0;
+    h->resumeTec = h->tec;
+  }
+  if( h->tec < h->resumeTec ) h->resumeTec = h->tec;
+
+  // Still bus off rests again, error passive only once TEC climbs again,
+  // it can only come down by getting frames out
+  if( !h->restUntil && (state == HEALTH_BUSOFF || ((eflg & TXEP) && h->tec > h->resumeTec)) )
+    rest( i, now );
+
+  if( state == HEALTH_ACTIVE && now - h->stateSince >= HEALTH_STABLE )
+    h->backoff = HEALTH_BACKOFF_MIN;
+}
+
+
+// Abort what is stuck in the TX buffers and stop sending for a while
+void BusHealth::rest( byte i, unsigned long now )
+{
+  struct busHealth *h = &health[i];
+
+  busses[i].modifyRegister( CANCTRL, ABAT, ABAT );
+  h->restUntil = (now + h->backoff) | 1;
+  h->recoveries++;
+  if( h->backoff < HEALTH_BACKOFF_MAX ) h->backoff *= 2;
+}
+
+
+void BusHealth::printStats( Stream *out )
+{
+  for( byte i=0; i<3; i++ ){
+    struct busHealth *h = &health[i];
+    out->print( F("{\"event\":\"busHealth\", \"bus\":\"") );
+    out->print( i+1 );
+    out->print( F("\", \"state\":\"") );
+    out->print( h->state );
+    out->print( F("\", \"tec\":\"") );
+    out->print( h->tec );
+    out->print( F("\", \"rec\":\"") );
+    out->print( h->rec );
+    out->print( F("\", \"maxTec\":\"") );
+    out->print( h->maxTec );
+    out->print( F("\", \"maxRec\":\"") );
+    out->print( h->maxRec );
+    out->print( F("\", \"rx0Overflows\":\"") );
+    out->print( h->rx0Overflows );
+    out->print( F("\", \"rx1Overflows\":\"") );
+    out->print( h->rx1Overflows );
+    out->print( F("\", \"warnings\":\"") );
+    out->print( h->warnings );
+    out->print( F("\", \"passives\":\"") );
+    out->print( h->passives );
+    out->print( F("\", \"busOffs\":\"") );
+    out->print( h->busOffs );
+    out->print( F("\", \"recoveries\":\"") );
+    out->print( h->recoveries );
+    out->print( F("\", \"resting\":\"") );
+    out->print( h->restUntil ? 1 : 0 );
+    out->println( F("\"}") );
+  }
+}
+
+
+// Oldest first
+void BusHealth::printHistory( Stream *out )
+{
+  for( byte n=0; n<historyCount; n++ ){
+    struct healthEvent *e = &history[(historyNext + HEALTH_HISTORY - historyCount + n) % HEALTH_HISTORY];
+    out->print( F("{\"event\":\"busState\", \"ms\":\"") );
+    out->print( e->ms );
+    out->print( F("\", \"bus\":\"") );
+    out->print( e->busId );
+    out->print( F("\", \"state\":\"") );
+    out->print( e->state );
+    out->print( F("\", \"tec\":\"") );
+    out->print( e->tec );
+    out->print( F("\", \"rec\":\"") );
+    out->print( e->rec );
+    out->println( F("\"}") );
+  }
+}
@@ -0,0 +1,248 @@
+/*
+*  Bus load and per ID frame rates
+*
+*  Every frame received or sent adds its length in bits to its bus: the
+*  fixed fields, 8 bits per data byte, and half the worst case stuff bits
+*  (one per 4 bits from SOF to the CRC), as a realistic middle. Load is
+*  kept in per mille of the bitrate for the last 100ms window, the peak
+*  100ms window and the last 1s window.
+*
+*  While ID rates are on the frames of every bus / ID are also counted in
+*  an open addressing table, linear probing, keyed by idKey() with 0 =
+*  empty. Rate is the number of frames in the last 1s window, 255 means
+*  255 or more. When the table is 7/8 full new IDs are only counted as
+*  untracked.
+*
+*  RAM: about 50 bytes. The ID table is taken from the heap while ID rates
+*  are on, 6 bytes per slot, 1152 for STATS_ID_SLOTS. When that much is not
+*  free it is halved until it fits, down to STATS_ID_MIN_SLOTS.
+*/
+
+#define STATS_ID_SLOTS 192          // At most 255
+#define STATS_ID_MIN_SLOTS 24
+
+#define STATS_WINDOW 100            // ms
+#define STATS_WINDOWS 10            // 100ms windows per 1s window
+
+struct busLoad {
+  unsigned long bits;         // Current 100ms window
+  unsigned long bitsSecond;   // Current 1s window
+  unsigned int load;          // Per mille, last 100ms window
+  unsigned int peak;          // Per mille, highest 100ms window
+  unsigned int loadSecond;    // Per mille, last 1s window
+};
+
+struct idRate {
+  unsigned long key;          // idKey(), 0 = empty
+  byte count;                 // Current 1s window
+  byte rate;                  // Last 1s window
+};
+
+
+class BusStats
+{
+  private:
+    static CANBus *busses;
+    static struct busLoad loads[3];
+    static unsigned long windowEnd;
+    static byte windows;
+    static unsigned int frameBits( Message *msg );
+    static struct idRate *ids;      // slots, NULL while ID rates are off
+    static byte slots;
+    static byte tracked;
+    static void countId( Message *msg );
+  public:
+    static void init( CANBus *b );
+    static void tick();
+    static void frame( Message *msg );
+    static void reset();
+    static boolean setIdRates( boolean on );
+    static void dumpLoad( Stream *out );
+    static unsigned long idKey( Message *msg );
+    static byte idHash( unsigned long key );
+    static void dumpIds( Stream *out );
+    static unsigned long untracked;
+};
+
+
+CANBus *BusStats::busses;
+struct busLoad BusStats::loads[3];
+unsigned long BusStats::windowEnd = 0;
+byte BusStats::windows = 0;
+struct idRate *BusStats::ids = NULL;
+byte BusStats::slots = 0;
+byte BusStats::tracked = 0;
+unsigned long BusStats::untracked = 0;
+
+
+void BusStats::init( CANBus *b )
+{
+  busses = b;
+  reset();
+}
+
+
+void BusStats::reset()
+{
+  memset( loads, 0, sizeof(loads) );
+  windowEnd = millis() + STATS_WINDOW;
+  windows = 0;
+  if( ids ) memset( ids, 0, sizeof(struct idRate) * slots );
+  tracked = 0;
+  untracked = 0;
+}
+
+
+// False if there is not enough free RAM for the smallest table
+boolean BusStats::setIdRates( boolean on )
+{
+  free( ids );
+  ids = NULL;
+  slots = 0;
+  tracked = 0;
+  untracked = 0;
+  if( !on ) return true;
+
+  for( byte n=STATS_ID_SLOTS; n>=STATS_ID_MIN_SLOTS; n /= 2 ){
+    ids = (struct idRate *) calloc( n, sizeof(struct idRate) );
+    if( ids != NULL ){
+      slots = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+unsigned int BusStats::frameBits( Message *msg )
+{
+  // SOF to end of CRC, the stuffed part
+  unsigned int stuffed = (msg->extended ? 54 : 34) + 8 * msg->length;
+  // CRC delimiter, ACK, EOF and intermission are never stuffed
+  return stuffed + (stuffed - 1) / 8 + 13;
+}
+
+
+void BusStats::frame( Message *msg )
+{
+  if( msg->busId < 1 || msg->busId > 3 ) return;
+
+  unsigned int bits = frameBits( msg );
+  loads[msg->busId-1].bits += bits;
+  loads[msg->busId-1].bitsSecond += bits;
+
+  if( ids ) countId( msg );
+}
+
+
+void BusStats::tick()
+{
+  unsigned long now = millis();
+  if( (long)(now - windowEnd) < 0 ) return;
+
+  // A stalled loop ends one window late instead of bursting through the missed ones
+  windowEnd += STATS_WINDOW;
+  if( (long)(now - windowEnd) >= 0 ) windowEnd = now + STATS_WINDOW;
+  boolean second = ++windows >= STATS_WINDOWS;
+  if( second ) windows = 0;
+
+  for( byte i=0; i<3; i++ ){
+    struct busLoad *l = &loads[i];
+    unsigned long rate = busses[i].bitRate;
+    if( rate ){
+      // At most rate bits per second, * 1000 stays under 2^32 up to 1Mbps
+      l->load = l->bits * (1000000UL / STATS_WINDOW) / rate;
+      if( l->load > l->peak ) l->peak = l->load;
+      if( second ) l->loadSecond = l->bitsSecond * 1000UL / rate;
+    }
+    l->bits = 0;
+    if( second ) l->bitsSecond = 0;
+  }
+
+  if( second && ids ){
+    for( byte i=0; i<slots; i++ ){
+      ids[i].rate = ids[i].count;
+      ids[i].count = 0;
+    }
+  }
+}
+
+
+// ID | extended << 29 | bus << 30, never 0 for a frame from a bus
+unsigned long BusStats::idKey( Message *msg )
+{
+  return (msg->frame_id & 0x1FFFFFFF) | ((unsigned long) msg->extended << 29) | ((unsigned long) msg->busId << 30);
+}
+
+
+byte BusStats::idHash( unsigned long key )
+{
+  return (byte) key ^ (byte)(key >> 8) ^ (byte)(key >> 16) ^ (byte)(key >> 24);
+}
+
+
+void BusStats::countId( Message *msg )
+{
+  unsigned long key = idKey( msg );
+  byte i = idHash( key ) % slots;
+
+  for( byte probe=0; probe<slots; probe++ ){
+    struct idRate *e = &ids[i];
+    if( ++i == slots ) i = 0;
+    if( e->key == key ){
+      if( e->count < 255 ) e->count++;
+      return;
+    }
+    if( e->key == 0 ){
+      if( tracked >= slots - slots / 8 ) break;
+      e->key = key;
+      e->count = 1;
+      tracked++;
+      return;
+    }
+  }
+
+  untracked++;
+}
+
+
+/*
+*  0x0F 0x01, per bus 1..3: load, peak, 1s load, all per mille, high byte first, 0x0D
+*/
+void BusStats::dumpLoad( Stream *out )
+{
+  out->write( 0x0F );
+  out->write( 0x01 );
+  for( byte i=0; i<3; i++ ){
+    out->write( loads[i].load >> 8 );
+    out->write( loads[i].load & 0xFF );
+    out->write( loads[i].peak >> 8 );
+    out->write( loads[i].peak & 0xFF );
+    out->write( loads[i].loadSecond >> 8 );
+    out->write( loads[i].loadSecond & 0xFF );
+  }
+  out->write( 0x0D );
+}
+
+
+/*
+*  0x0F 0x02 Count, then Count records of  Bus Id3 Id2 Id1 Id0 Rate, 0x0D
+*  Bus has 0x80 set for an extended ID
+*/
+void BusStats::dumpIds( Stream *out )
+{
+  out->write( 0x0F );
+  out->write( 0x02 );
+  out->write( tracked );
+  for( byte i=0; ids && i<slots; i++ ){
+    struct idRate *e = &ids[i];
+    if( e->key == 0 ) continue;
+    out->write( (byte)(e->key >> 30) | ((e->key & (1UL << 29)) ? 0x80 : 0) );
+    out->write( (byte)(e->key >> 24) & 0x1F );
+    out->write( (byte)(e->key >> 16) );
+    out->write( (byte)(e->key >> 8) );
+    out->write( (byte) e->key );
+    out->write( e->rate );
+  }
+  out->write( 0x0D );
+}
@@ -12,6 +12,7 @@
 
 // #define DEBUG_BUILD
 #define USE_MIDDLEWARE
+// #define AUTOBAUD_ON_BOOT       // Detect the bitrate of every bus at power up
 
 
 // CANBus Triple Rev E
@@ -37,27 +38,52 @@
 #define BT_RESET 8
 
 
+#include "EepromWriter.h"
+#include "Journal.h"
 #include "Settings.h"
+#include "AutoBaud.h"
+#include "BusHealth.h"
+#include "BusStats.h"
+#include "CycleModel.h"
+#include "Capture.h"
+#include "Census.h"
 #include "WheelButton.h"
 #include "ChannelSwap.h"
+#include "BluetoothShaper.h"
+#include "Signals.h"
+#include "CyclicTransmit.h"
+#include "TraceReplay.h"
+#include "IsoTp.h"
+#include "PidMatcher.h"
+#include "PidStats.h"
+#include "DiagCache.h"
+#include "PidDiscovery.h"
+#include "ServiceCall.h"
 #include "SerialCommand.h"
 #include "MazdaLED.h"
-#include "ServiceCall.h"
 
 
 
 
-CANBus CANBus1(CAN1SELECT, CAN1RESET, 1, "Bus 1");
-CANBus CANBus2(CAN2SELECT, CAN2RESET, 2, "Bus 2");
-CANBus CANBus3(CAN3SELECT, CAN3RESET, 3, "Bus 3");
+// One instance per controller, everything else takes a reference or a bus id
+const char bus1Name[] PROGMEM = "Bus 1";
+const char bus2Name[] PROGMEM = "Bus 2";
+const char bus3Name[] PROGMEM = "Bus 3";
+
+CANBus busses[] = {
+  CANBus(CAN1SELECT, CAN1RESET, 1, (const __FlashStringHelper*) bus1Name),
+  CANBus(CAN2SELECT, CAN2RESET, 2, (const __FlashStringHelper*) bus2Name),
+  CANBus(CAN3SELECT, CAN3RESET, 3, (const __FlashStringHelper*) bus3Name)
+};
+CANBus &CANBus1 = busses[0];
+CANBus &CANBus2 = busses[1];
+CANBus &CANBus3 = busses[2];
 
 
 byte rx_status;
 QueueArray<Message> readQueue;
 QueueArray<Message> writeQueue;
 
-CANBus busses[] = { CANBus1, CANBus2, CANBus3 };
-CANBus SerialCommand::busses[] = { CANBus1, CANBus2, CANBus3 }; // TODO do this better, pass into via init method
 
 byte wheelButton = 0;
 
@@ -80,7 +106,8 @@ void setup(){
   pinMode( BOOT_LED, OUTPUT );
   
   
-  Settings::init();
+  Settings::init( SerialCommand::activeSerial );
+  Signals::init();
   
   for (int b = 0; b<2; b++) {
     digitalWrite( BOOT_LED, HIGH );
@@ -89,23 +116,29 @@ void setup(){
     delay(50);
   }
   
-  // Setup CAN Busses 
+  // Setup CAN Busses, with AUTOBAUD_ON_BOOT they only listen until the rate is known
+  #ifdef AUTOBAUD_ON_BOOT
+    #define BOOT_MODE LISTEN
+  #else
+    #define BOOT_MODE NORMAL
+  #endif
+  
   CANBus1.begin();
-  CANBus1.baudConfig(125);
+  CANBus1.setBitrate( Settings::busRate(1) );
   CANBus1.setRxInt(true);
-  CANBus1.setMode(NORMAL);
+  CANBus1.setMode(BOOT_MODE);
   // attachInterrupt(CAN1INT, handleInterrupt1, LOW);
   
   CANBus2.begin();
-  CANBus2.baudConfig(500);
+  CANBus2.setBitrate( Settings::busRate(2) );
   CANBus2.setRxInt(true);
-  CANBus2.setMode(NORMAL);
+  CANBus2.setMode(BOOT_MODE);
   // attachInterrupt(CAN2INT, handleInterrupt2, LOW);
   
   CANBus3.begin();
-  CANBus3.baudConfig(125);
+  CANBus3.setBitrate( Settings::busRate(3) );
   CANBus3.setRxInt(true);
-  CANBus3.setMode(NORMAL);
+  CANBus3.setMode(BOOT_MODE);
   // Manually configure INT6 for Bus 3
   // EICRB |= (1<<ISC60)|(1<<ISC61); // sets the interrupt type
   // EIMSK |= (1<<INT6); // activates the interrupt
@@ -117,8 +150,18 @@ void setup(){
   
   // Middleware setup
   SerialCommand::init( &writeQueue, busses );
+  AutoBaud::init( busses );
+  BusHealth::init( busses );
+  BusStats::init( busses );
+  #ifdef AUTOBAUD_ON_BOOT
+    AutoBaud::start( 0x07, &Serial );
+  #endif
+  CyclicTransmit::init( &writeQueue );
+  TraceReplay::init( &writeQueue );
   
   #ifdef USE_MIDDLEWARE
+    IsoTp::init( &writeQueue );
+    PidDiscovery::init( &writeQueue );
     ServiceCall::init( &writeQueue );
     MazdaLED::init( &writeQueue, cbt_settings.displayEnabled );
   #endif
@@ -147,15 +190,25 @@ void loop()
 {
   // All Middleware ticks (Like loop() for middleware)
   SerialCommand::tick();
+  BluetoothShaper::tick();
+  CyclicTransmit::tick();
+  TraceReplay::tick();
+  AutoBaud::tick();
+  BusHealth::tick();
+  BusStats::tick();
+  CycleModel::tick();
+  Capture::tick();
   
   #ifdef USE_MIDDLEWARE
+    IsoTp::tick();
+    PidDiscovery::tick();
     ServiceCall::tick();
     MazdaLED::tick();
   #endif
   
-  if( digitalRead(CAN1INT_D) == 0 ) readBus(CANBus1);
-  if( digitalRead(CAN2INT_D) == 0 ) readBus(CANBus2);
-  if( digitalRead(CAN3INT_D) == 0 ) readBus(CANBus3);
+  if( digitalRead(CAN1INT_D) == 0 && !AutoBaud::scanning(1) ) readBus(CANBus1);
+  if( digitalRead(CAN2INT_D) == 0 && !AutoBaud::scanning(2) ) readBus(CANBus2);
+  if( digitalRead(CAN3INT_D) == 0 && !AutoBaud::scanning(3) ) readBus(CANBus3);
   
   // Process message stack
   if( !readQueue.isEmpty() && !writeQueue.isFull() ){
@@ -175,7 +228,7 @@ void loop()
   while( !writeQueue.isEmpty() && success )
   {
       Message msg = writeQueue.pop();
-      CANBus channel = busses[msg.busId-1];
+      CANBus &channel = busses[msg.busId-1];
     
       //SerialCommand::printMessageToSerial(msg);
       success = sendMessage( msg, channel );
@@ -186,7 +239,8 @@ void loop()
           writeQueue.push(msg);
       
           #ifdef DEBUG_BUILD
-              SerialCommand::activeSerial->println("ALL TX BUFFERS FULL ON " + busses[msg.busId-1].name );
+              SerialCommand::activeSerial->print(F("ALL TX BUFFERS FULL ON "));
+              SerialCommand::activeSerial->println( busses[msg.busId-1].name );
           #endif
       }
    }
@@ -216,6 +270,15 @@ void loop()
        case (B_INFO_BACK | B_ARROW_RIGHT):
          toggleMazdaLed();
        break;
+       
+       case (B_INFO_BACK | B_ARROW_LEFT):
+         // Session mean / max of the displayed PID
+         MazdaLED::showStats = !MazdaLED::showStats;
+         if( MazdaLED::showStats )
+           MazdaLED::showStatusMessage(F("  MEAN MAX  "), 1500);
+         else
+           MazdaLED::showStatusMessage(F("   VALUES   "), 1500);
+       break;
      }
   }
 } // End loop()
@@ -225,31 +288,37 @@ void loop()
 void toggleMazdaLed()
 {
     cbt_settings.displayEnabled = MazdaLED::enabled = !MazdaLED::enabled;
-    EEPROM.write( offsetof(struct cbt_settings, displayEnabled), cbt_settings.displayEnabled);
+    Journal::write( JOURNAL_DISPLAY_ENABLED, cbt_settings.displayEnabled );
     if(MazdaLED::enabled)
-        MazdaLED::showStatusMessage("MazdaLED ON ", 2000);
+        MazdaLED::showStatusMessage(F("MazdaLED ON "), 2000);
 }
 
 
-boolean sendMessage( Message msg, CANBus bus ){
+boolean sendMessage( Message msg, CANBus &bus ){
   
   if( msg.dispatch == false ) return true;
   
+  // Listen only while the bitrate is being detected, or resting after bus off, drop it
+  if( AutoBaud::scanning( bus.busId ) || BusHealth::resting( bus.busId ) ){
+    CyclicTransmit::dropped( &msg );
+    return true;
+  }
+  
   digitalWrite( BOOT_LED, HIGH );
   
   int ch = bus.getNextTxBuffer();
   
   switch( ch ){
     case 0:
-      bus.load_ff_0( msg.length, msg.frame_id, msg.frame_data );
+      bus.load_ff_0( msg.length, msg.frame_id, msg.frame_data, msg.extended );
       bus.send_0();
       break;
     case 1:
-      bus.load_ff_1( msg.length, msg.frame_id, msg.frame_data );
+      bus.load_ff_1( msg.length, msg.frame_id, msg.frame_data, msg.extended );
       bus.send_1();
       break;
     case 2:
-      bus.load_ff_2( msg.length, msg.frame_id, msg.frame_data );
+      bus.load_ff_2( msg.length, msg.frame_id, msg.frame_data, msg.extended );
       bus.send_2();
       break;
     default:
@@ -258,6 +327,9 @@ boolean sendMessage( Message msg, CANBus bus ){
       break;
   }
   
+  BusStats::frame( &msg );
+  CyclicTransmit::transmitted( &msg );
+  
   #ifdef DEBUG_BUILD
     SerialCommand::activeSerial->print(F("Sent a message on TXB"));
     SerialCommand::activeSerial->print( ch, DEC );
@@ -271,7 +343,7 @@ boolean sendMessage( Message msg, CANBus bus ){
 }
 
 
-void readBus( CANBus bus )
+void readBus( CANBus &bus )
 {
   // TODO Cleanup and optimize
   
@@ -282,11 +354,14 @@ void readBus( CANBus bus )
   
   // Check buffer RX0
   if( (rx_status & 0x1) == 0x1 ){
-    Message msg;
-    msg.busStatus = rx_status;
-    msg.busId = bus.busId;
-    bus.readDATA_ff_0( &msg.length, msg.frame_data, &msg.frame_id );
-    readQueue.push(msg);
+    Message *msg = Capture::next();
+    msg->busStatus = rx_status;
+    msg->busId = bus.busId;
+    bus.readDATA_ff_0( &msg->length, msg->frame_data, &msg->frame_id, &msg->extended );
+    Capture::commit();
+    BusStats::frame( msg );
+    CycleModel::frame( msg );
+    readQueue.push(*msg);
   }
   
   // Abort if readQueue is full
@@ -294,11 +369,14 @@ void readBus( CANBus bus )
   
   // Check buffer RX1
   if( (rx_status & 0x2) == 0x2 ) {
-    Message msg;
-    msg.busStatus = rx_status;
-    msg.busId = bus.busId;
-    bus.readDATA_ff_1( &msg.length, msg.frame_data, &msg.frame_id );
-    readQueue.push(msg);
+    Message *msg = Capture::next();
+    msg->busStatus = rx_status;
+    msg->busId = bus.busId;
+    bus.readDATA_ff_1( &msg->length, msg->frame_data, &msg->frame_id, &msg->extended );
+    Capture::commit();
+    BusStats::frame( msg );
+    CycleModel::frame( msg );
+    readQueue.push(*msg);
   }
   
 }
@@ -306,8 +384,12 @@ void readBus( CANBus bus )
 
 void processMessage( Message msg ){
   
+  Census::frame( &msg );
+  
   // All Middleware process calls (Augment incoming CAN packets)
   msg = SerialCommand::process( msg );
+  msg = DiagCache::process( msg );
+  Signals::process( &msg );
   
   #ifdef USE_MIDDLEWARE
     msg = ServiceCall::process( msg );
@@ -331,9 +413,9 @@ void longButtonPressHandler()
         WheelButton::controlsEnabled = !WheelButton::controlsEnabled;
          
         if (WheelButton::controlsEnabled)
-          MazdaLED::showStatusMessage("Controls On", 1500);
+          MazdaLED::showStatusMessage(F("Controls On"), 1500);
         else
-          MazdaLED::showStatusMessage("Controls Off", 1500);
+          MazdaLED::showStatusMessage(F("Controls Off"), 1500);
         break;
     }
 }
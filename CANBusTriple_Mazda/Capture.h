@@ -0,0 +1,237 @@
+/*
+*  Pre / post trigger capture
+*
+*  Like a logic analyser: while armed every received frame goes into a
+*  ring of pre + 1 + post frames with its micros() timestamp, until a trigger
+*  fires. Then post more frames are taken and the ring freezes, holding
+*  pre frames before the trigger frame, the trigger frame and post after
+*  it, for download over serial at whatever speed the link manages.
+*
+*  Trigger on a frame: bus (0 = any), ID, and 8 data bytes under a mask.
+*  Trigger on an error: the next frame after BusHealth counts an overflow,
+*  error passive or bus off.
+*
+*  The RX path reads the frame from the controller straight into the ring
+*  slot and queues it from there, recording adds no copy. When not armed
+*  or frozen frames are read into a scratch Message instead.
+*
+*  RAM: the ring is taken from the heap by arm(), 23 bytes per frame, and
+*  given back once a complete capture has been downloaded or on stop().
+*  Otherwise it costs about 60 bytes.
+*/
+
+#define CAPTURE_IDLE 0
+#define CAPTURE_ARMED 1
+#define CAPTURE_POST 2
+#define CAPTURE_DONE 3
+
+#define CAPTURE_ON_FRAME 0x01
+#define CAPTURE_ON_ERROR 0x02
+
+struct captureFrame {
+  unsigned long time;         // micros()
+  Message msg;
+};
+
+struct captureTrigger {
+  byte kind;
+  byte busId;                 // 0 = any bus
+  unsigned long frame_id;
+  bool extended;
+  byte mask[8];
+  byte value[8];
+};
+
+
+class Capture
+{
+  private:
+    static struct captureFrame *ring;     // size frames, NULL while idle
+    static byte size;
+    static Message scratch;
+    static struct captureTrigger trigger;
+    static byte head;                 // Next slot written
+    static byte count;                // Frames in the ring, up to size
+    static byte pre;
+    static byte post;
+    static byte preTaken;
+    static byte postLeft;
+    static byte triggerSlot;
+    static boolean fireNext;          // Take the next frame as the trigger frame
+    static byte reported;
+    static unsigned long errorsAtArm;
+    static Stream *out;
+    static boolean matches( Message *msg );
+  public:
+    static Message *next();
+    static void commit();
+    static void tick();
+    static boolean arm( struct captureTrigger *t, byte preFrames, byte postFrames, Stream *s );
+    static void force();
+    static void stop();
+    static void download( Stream *out );
+    static byte state;
+};
+
+
+struct captureFrame *Capture::ring = NULL;
+byte Capture::size = 0;
+Message Capture::scratch;
+struct captureTrigger Capture::trigger;
+byte Capture::head = 0;
+byte Capture::count = 0;
+byte Capture::pre = 0;
+byte Capture::post = 0;
+byte Capture::preTaken = 0;
+byte Capture::postLeft = 0;
+byte Capture::triggerSlot = 0;
+boolean Capture::fireNext = false;
+byte Capture::reported = CAPTURE_IDLE;
+unsigned long Capture::errorsAtArm = 0;
+Stream *Capture::out = &Serial;
+byte Capture::state = CAPTURE_IDLE;
+
+
+// Where the RX path reads the next frame into, commit() once it is filled in
+Message *Capture::next()
+{
+  Message *msg = &scratch;
+  if( state == CAPTURE_ARMED || state == CAPTURE_POST ){
+    ring[head].time = micros();
+    msg = &ring[head].msg;
+  }
+
+  // As a new Message would be
+  msg->dispatch = false;
+  msg->extended = false;
+  memset( msg->frame_data, 0, 8 );
+  return msg;
+}
+
+
+void Capture::commit()
+{
+  if( state != CAPTURE_ARMED && state != CAPTURE_POST ) return;
+
+  byte slot = head;
+  if( ++head == size ) head = 0;
+  if( count < size ) count++;
+
+  if( state == CAPTURE_ARMED ){
+    if( fireNext || matches( &ring[slot].msg ) ){
+      triggerSlot = slot;
+      preTaken = count - 1 < pre ? count - 1 : pre;
+      postLeft = post;
+      state = CAPTURE_POST;
+    }
+  }else{
+    postLeft--;
+  }
+
+  if( state == CAPTURE_POST && postLeft == 0 ) state = CAPTURE_DONE;
+}
+
+
+boolean Capture::matches( Message *msg )
+{
+  if( trigger.kind != CAPTURE_ON_FRAME ) return false;
+  if( trigger.busId && msg->busId != trigger.busId ) return false;
+  if( msg->frame_id != trigger.frame_id || msg->extended != trigger.extended ) return false;
+
+  for( byte i=0; i<8; i++ ){
+    if( !trigger.mask[i] ) continue;
+    if( i >= msg->length || (msg->frame_data[i] & trigger.mask[i]) != trigger.value[i] ) return false;
+  }
+  return true;
+}
+
+
+void Capture::tick()
+{
+  if( state == CAPTURE_ARMED && trigger.kind == CAPTURE_ON_ERROR && BusHealth::errors != errorsAtArm )
+    fireNext = true;
+
+  if( state == CAPTURE_DONE && reported != CAPTURE_DONE ){
+    out->print( F("{\"event\":\"capture\", \"frames\":\"") );
+    out->print( preTaken + 1 + post );
+    out->print( F("\", \"pre\":\"") );
+    out->print( preTaken );
+    out->println( F("\"}") );
+  }
+  reported = state;
+}
+
+
+// False if the frames do not fit the ring size or the free RAM
+boolean Capture::arm( struct captureTrigger *t, byte preFrames, byte postFrames, Stream *s )
+{
+  stop();
+  if( (unsigned int) preFrames + 1 + postFrames > 255 ) return false;
+  size = preFrames + 1 + postFrames;
+  ring = (struct captureFrame *) malloc( sizeof(struct captureFrame) * size );
+  if( ring == NULL ){
+    size = 0;
+    return false;
+  }
+
+  trigger = *t;
+  pre = preFrames;
+  post = postFrames;
+  out = s;
+  head = 0;
+  count = 0;
+  fireNext = false;
+  reported = CAPTURE_ARMED;     // A capture done before the next tick is still reported
+  errorsAtArm = BusHealth::errors;
+  state = CAPTURE_ARMED;
+  return true;
+}
+
+
+// Trigger on the next frame whatever it is
+void Capture::force()
+{
+  if( state == CAPTURE_ARMED ) fireNext = true;
+}
+
+
+void Capture::stop()
+{
+  state = CAPTURE_IDLE;
+  free( ring );
+  ring = NULL;
+  size = 0;
+}
+
+
+/*
+*  0x11 Count, then Count times  Bus Id3 Id2 Id1 Id0 Time3-0 length data 0-7, then 0x0D
+*  Bus | 0x80 = extended ID, Time in us relative to the trigger frame, signed.
+*  A complete capture is freed once it is written.
+*/
+void Capture::download( Stream *out )
+{
+  byte n = state == CAPTURE_DONE ? preTaken + 1 + post : 0;
+  byte slot = n ? ((unsigned int) triggerSlot + size - preTaken) % size : 0;
+  unsigned long t0 = n ? ring[triggerSlot].time : 0;
+
+  out->write( 0x11 );
+  out->write( n );
+  for( byte i=0; i<n; i++ ){
+    struct captureFrame *f = &ring[((unsigned int) slot + i) % size];
+    long t = f->time - t0;
+    out->write( f->msg.busId | (f->msg.extended ? 0x80 : 0) );
+    out->write( (byte)(f->msg.frame_id >> 24) );
+    out->write( (byte)(f->msg.frame_id >> 16) );
+    out->write( (byte)(f->msg.frame_id >> 8) );
+    out->write( (byte) f->msg.frame_id );
+    out->write( (byte)(t >> 24) );
+    out->write( (byte)(t >> 16) );
+    out->write( (byte)(t >> 8) );
+    out->write( (byte) t );
+    out->write( f->msg.length );
+    out->write( f->msg.frame_data, 8 );
+  }
+  out->write( 0x0D );
+  if( n ) stop();
+}
@@ -0,0 +1,162 @@
+/*
+*  ID census
+*
+*  For exploring an unknown car from a phone: every ID on one bus is
+*  recorded without logging every frame. A 2048 bit bitmap marks each
+*  standard ID seen. The first IDs, extended ones too, also
+*  get a slot in an open addressing table with the frame count, first and
+*  last seen time, last payload and a mask of every payload bit that has
+*  ever changed, which is where the signals are. IDs that find no slot in
+*  CENSUS_PROBES probes are only counted as overflow (and set their bit).
+*
+*  RAM: the bitmap and slots are taken from the heap while a census runs,
+*  256 bytes of bitmap and 30 bytes per slot. start() asks for
+*  CENSUS_SLOTS and 8 fewer each time malloc fails, which leaves the stack
+*  its margin, down to CENSUS_MIN_SLOTS: 1696 bytes at most, 496 at least.
+*  Otherwise it costs 13 bytes.
+*/
+
+#define CENSUS_SLOTS 48
+#define CENSUS_MIN_SLOTS 8
+#define CENSUS_PROBES 8
+
+struct censusEntry {
+  unsigned long key;          // ID | extended << 29 | 1 << 30 so 0 = empty
+  unsigned int count;         // Saturates at 65535
+  unsigned long first;        // ms since the census started
+  unsigned long last;
+  byte data[8];
+  byte changed[8];            // Bits that ever differed from the frame before
+};
+
+
+class Census
+{
+  private:
+    static byte *seen;                    // 256 bytes, NULL while no census runs
+    static struct censusEntry *table;     // slots, after the bitmap
+    static byte slots;
+    static byte entries;
+    static unsigned long startedAt;
+    static unsigned int overflow;
+  public:
+    static boolean start( byte busId );
+    static void frame( Message *msg );
+    static void dump( Stream *out );
+    static byte busId;                // 0 = off
+};
+
+
+byte *Census::seen = NULL;
+struct censusEntry *Census::table = NULL;
+byte Census::slots = 0;
+byte Census::entries = 0;
+unsigned long Census::startedAt = 0;
+unsigned int Census::overflow = 0;
+byte Census::busId = 0;
+
+
+// Bus 0 stops the census and frees its RAM, false if there is not enough to start
+boolean Census::start( byte bus )
+{
+  busId = 0;
+  free( seen );
+  seen = NULL;
+  table = NULL;
+  slots = 0;
+  entries = 0;
+  overflow = 0;
+  if( bus == 0 ) return true;
+
+  for( byte n=CENSUS_SLOTS; seen == NULL && n>=CENSUS_MIN_SLOTS; n -= 8 ){
+    seen = (byte *) calloc( 1, 256 + sizeof(struct censusEntry) * n );
+    slots = n;
+  }
+  if( seen == NULL ){
+    slots = 0;
+    return false;
+  }
+  table = (struct censusEntry *) &seen[256];
+  startedAt = millis();
+  busId = bus;
+  return true;
+}
+
+
+void Census::frame( Message *msg )
+{
+  if( busId == 0 || msg->busId != busId ) return;
+
+  unsigned long now = millis() - startedAt;
+  if( !msg->extended )
+    seen[(msg->frame_id >> 3) & 0xFF] |= 1 << (msg->frame_id & 0x07);
+
+  unsigned long key = (msg->frame_id & 0x1FFFFFFF) | ((unsigned long) msg->extended << 29) | (1UL << 30);
+  byte i = BusStats::idHash( key ) % slots;
+
+  for( byte probe=0; probe<CENSUS_PROBES; probe++ ){
+    struct censusEntry *e = &table[i];
+    if( ++i == slots ) i = 0;
+
+    if( e->key == key ){
+      for( byte i=0; i<8; i++ ){
+        e->changed[i] |= e->data[i] ^ msg->frame_data[i];
+        e->data[i] = msg->frame_data[i];
+      }
+      if( e->count < 0xFFFF ) e->count++;
+      e->last = now;
+      return;
+    }
+
+    if( e->key == 0 ){
+      e->key = key;
+      e->count = 1;
+      e->first = e->last = now;
+      memcpy( e->data, msg->frame_data, 8 );
+      entries++;
+      return;
+    }
+  }
+
+  if( overflow < 0xFFFF ) overflow++;
+}
+
+
+/*
+*  0x12 Bus Count Slots OverflowH OverflowL, standard ID bitmap (256 bytes, bit n of byte id / 8 = id), then Count times
+*  Id3 Id2 Id1 Id0 CountH CountL First3-0 Last3-0 data 0-7 changed 0-7, then 0x0D
+*  Id3 | 0x80 = extended ID, times in ms since the census started
+*/
+void Census::dump( Stream *out )
+{
+  out->write( 0x12 );
+  out->write( busId );
+  out->write( entries );
+  out->write( slots );
+  out->write( overflow >> 8 );
+  out->write( overflow & 0xFF );
+  for( unsigned int i=0; i<256; i++ )
+    out->write( seen ? seen[i] : 0 );
+
+  for( byte i=0; table && i<slots; i++ ){
+    struct censusEntry *e = &table[i];
+    if( e->key == 0 ) continue;
+    out->write( ((byte)(e->key >> 24) & 0x1F) | ((e->key & (1UL << 29)) ? 0x80 : 0) );
+    out->write( (byte)(e->key >> 16) );
+    out->write( (byte)(e->key >> 8) );
+    out->write( (byte) e->key );
+    out->write( e->count >> 8 );
+    out->write( e->count & 0xFF );
+    out->write( (byte)(e->first >> 24) );
+    out->write( (byte)(e->first >> 16) );
+    out->write( (byte)(e->first >> 8) );
+    out->write( (byte) e->first );
+    out->write( (byte)(e->last >> 24) );
+    out->write( (byte)(e->last >> 16) );
+    out->write( (byte)(e->last >> 8) );
+    out->write( (byte) e->last );
+    out->write( e->data, 8 );
+    out->write( e->changed, 8 );
+  }
+  out->write( 0x0D );
+}
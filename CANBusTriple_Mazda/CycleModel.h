@@ -0,0 +1,367 @@
+/*
+*  Learned cycle time per ID
+*
+*  Every received frame updates its ID's period and jitter (mean absolute
+*  deviation) as exponentially weighted moving averages in 28.4 / 12.4
+*  fixed point microseconds, 1/4 weight while the first CYCLE_LEARN
+*  intervals are learned, 1/16 after. Once learned an interval outside
+*  period +- tolerance is late or early (a second sender, possibly an
+*  injected frame), and no frame for CYCLE_MISSING periods is missing.
+*  Tolerance is 4 x jitter, at least period / 8 and CYCLE_MIN_TOL.
+*  Anomalous intervals are not learned, CYCLE_RELEARN of them in a row and
+*  the ID learns its period again.
+*
+*  IDs get a slot in order of appearance, at most CYCLE_PROBES slots are
+*  looked at per frame so the cost is bounded, the time spent per frame is
+*  measured. When the probes find neither the ID nor a free slot, the one
+*  silent longest is taken over if it has been silent for CYCLE_STALE and
+*  CYCLE_MISSING periods, otherwise the frame is only counted as untracked.
+*  Events are queued from the RX path and written as log records from
+*  tick(). Off until turned on with 0x10 0x01.
+*
+*  RAM: the slots and event queue are taken from the heap while the model
+*  is on, 16 bytes per slot and 13 per event, 308 for 16 slots. Off it
+*  costs about 40 bytes of counters.
+*/
+
+#define CYCLE_SLOTS 16              // Power of 2
+#define CYCLE_PROBES 4
+#define CYCLE_LEARN 16              // Intervals before anomalies are flagged
+#define CYCLE_RELEARN 4
+#define CYCLE_MISSING 3             // Periods without a frame
+#define CYCLE_STALE 2000000UL       // us silent before a slot can be taken over
+#define CYCLE_MIN_TOL 500           // us
+#define CYCLE_EVENTS 4
+#define CYCLE_CHECK 10              // ms between missing frame checks
+
+#define CYCLE_LATE 1
+#define CYCLE_EARLY 2
+#define CYCLE_MISSED 3
+
+#define CYCLE_FLAG_MISSING 0x80     // In anomalies, missing already reported
+
+struct cycleEntry {
+  unsigned long key;          // BusStats::idKey, 0 = empty
+  unsigned long last;         // micros() of the last frame
+  unsigned long period;       // us, 28.4 fixed point
+  unsigned int jitter;        // us, 12.4 fixed point
+  byte samples;               // Intervals learned, up to CYCLE_LEARN
+  byte anomalies;             // In a row, | CYCLE_FLAG_MISSING
+};
+
+struct cycleEvent {
+  unsigned long key;
+  byte kind;
+  unsigned long interval;     // us
+  unsigned long period;       // us
+};
+
+
+class CycleModel
+{
+  private:
+    static struct cycleEntry *table;          // CYCLE_SLOTS, NULL while off
+    static struct cycleEvent *events;         // CYCLE_EVENTS, after the slots
+    static byte eventHead;
+    static byte eventCount;
+    static unsigned long lastCheck;
+    static Stream *out;
+    static struct cycleEntry *find( unsigned long key, unsigned long now );
+    static unsigned long tolerance( struct cycleEntry *e );
+    static void learn( struct cycleEntry *e, unsigned long interval );
+    static void flag( struct cycleEntry *e, byte kind, unsigned long interval );
+    static void writeEvent( struct cycleEvent *ev );
+  public:
+    static void frame( Message *msg );
+    static void tick();
+    static boolean setEnabled( boolean on, Stream *s );
+    static void reset();
+    static void printModel( Stream *out );
+    static void printStats( Stream *out );
+    static boolean enabled;
+    static unsigned long frames;
+    static unsigned long untracked;
+    static unsigned long evicted;
+    static unsigned long late;
+    static unsigned long early;
+    static unsigned long missing;
+    static unsigned long eventsDropped;
+    static unsigned long busyUs;          // Time spent in frame()
+    static unsigned int maxUs;
+};
+
+
+struct cycleEntry *CycleModel::table = NULL;
+struct cycleEvent *CycleModel::events = NULL;
+byte CycleModel::eventHead = 0;
+byte CycleModel::eventCount = 0;
+unsigned long CycleModel::lastCheck = 0;
+Stream *CycleModel::out = &Serial;
+boolean CycleModel::enabled = false;
+unsigned long CycleModel::frames = 0;
+unsigned long CycleModel::untracked = 0;
+unsigned long CycleModel::evicted = 0;
+unsigned long CycleModel::late = 0;
+unsigned long CycleModel::early = 0;
+unsigned long CycleModel::missing = 0;
+unsigned long CycleModel::eventsDropped = 0;
+unsigned long CycleModel::busyUs = 0;
+unsigned int CycleModel::maxUs = 0;
+
+
+// False if there is not enough free RAM to turn it on
+boolean CycleModel::setEnabled( boolean on, Stream *s )
+{
+  out = s;
+  if( on && !enabled ){
+    table = (struct cycleEntry *) malloc( sizeof(struct cycleEntry) * CYCLE_SLOTS + sizeof(struct cycleEvent) * CYCLE_EVENTS );
+    if( table == NULL ) return false;
+    events = (struct cycleEvent *) &table[CYCLE_SLOTS];
+    enabled = true;
+    reset();
+  }else if( !on && enabled ){
+    enabled = false;
+    free( table );
+    table = NULL;
+    events = NULL;
+  }
+  return true;
+}
+
+
+void CycleModel::reset()
+{
+  if( table ) memset( table, 0, sizeof(struct cycleEntry) * CYCLE_SLOTS );
+  eventCount = 0;
+  frames = untracked = evicted = late = early = missing = eventsDropped = busyUs = 0;
+  maxUs = 0;
+}
+
+
+// Slot of key, a free or stale one emptied if it is new, NULL when neither is found
+struct cycleEntry *CycleModel::find( unsigned long key, unsigned long now )
+{
+  byte h = BusStats::idHash( key );
+  struct cycleEntry *stale = NULL;
+  unsigned long staleFor = CYCLE_STALE;
+
+  for( byte probe=0; probe<CYCLE_PROBES; probe++ ){
+    struct cycleEntry *e = &table[(h + probe) & (CYCLE_SLOTS - 1)];
+    if( e->key == key || e->key == 0 ) return e;
+
+    unsigned long silent = now - e->last;
+    if( silent > staleFor && silent > (e->period >> 4) * CYCLE_MISSING ){
+      stale = e;
+      staleFor = silent;
+    }
+  }
+
+  if( stale ){
+    memset( stale, 0, sizeof(struct cycleEntry) );
+    evicted++;
+  }
+  return stale;
+}
+
+
+unsigned long CycleModel::tolerance( struct cycleEntry *e )
+{
+  unsigned long period = e->period >> 4;
+  unsigned long tol = (unsigned long)(e->jitter >> 4) * 4;
+  if( tol < period / 8 ) tol = period / 8;
+  if( tol < CYCLE_MIN_TOL ) tol = CYCLE_MIN_TOL;
+  return tol;
+}
+
+
+void CycleModel::frame( Message *msg )
+{
+  if( !enabled ) return;
+
+  unsigned long now = micros();
+  unsigned long key = BusStats::idKey( msg );
+  struct cycleEntry *e = find( key, now );
+  frames++;
+
+  if( e == NULL ){
+    untracked++;
+  }else if( e->key == 0 ){
+    e->key = key;
+    e->last = now;
+  }else{
+    unsigned long interval = now - e->last;
+    e->last = now;
+
+    if( e->anomalies & CYCLE_FLAG_MISSING ){
+      // Back after a gap, the gap itself was reported
+      e->anomalies = 0;
+    }else if( e->samples >= CYCLE_LEARN ){
+      unsigned long period = e->period >> 4;
+      unsigned long tol = tolerance( e );
+      if( interval > period + tol )
+        flag( e, CYCLE_LATE, interval );
+      else if( period > tol && interval < period - tol )
+        flag( e, CYCLE_EARLY, interval );
+      else{
+        e->anomalies = 0;
+        learn( e, interval );
+      }
+    }else{
+      learn( e, interval );
+    }
+  }
+
+  unsigned int spent = micros() - now;
+  busyUs += spent;
+  if( spent > maxUs ) maxUs = spent;
+}
+
+
+void CycleModel::learn( struct cycleEntry *e, unsigned long interval )
+{
+  if( interval > 0x0FFFFFFF ) interval = 0x0FFFFFFF;     // 28.4 range, 268s
+
+  if( e->samples == 0 ){
+    e->period = interval << 4;
+    e->jitter = 0;
+    e->samples = 1;
+    return;
+  }
+
+  byte shift = e->samples < CYCLE_LEARN ? 2 : 4;
+  e->period += ((long)(interval << 4) - (long) e->period) >> shift;
+
+  unsigned long period = e->period >> 4;
+  unsigned long dev = interval > period ? interval - period : period - interval;
+  if( dev > 0x0FFF ) dev = 0x0FFF;
+  e->jitter += ((long)(dev << 4) - (long) e->jitter) >> shift;
+
+  if( e->samples < CYCLE_LEARN ) e->samples++;
+}
+
+
+void CycleModel::flag( struct cycleEntry *e, byte kind, unsigned long interval )
+{
+  switch( kind ){
+    case CYCLE_LATE:   late++;    break;
+    case CYCLE_EARLY:  early++;   break;
+    case CYCLE_MISSED: missing++; break;
+  }
+
+  if( kind == CYCLE_MISSED )
+    e->anomalies |= CYCLE_FLAG_MISSING;
+  else if( ++e->anomalies >= CYCLE_RELEARN ){
+    // The period itself changed, learn it again
+    e->samples = 0;
+    e->anomalies = 0;
+  }
+
+  if( eventCount >= CYCLE_EVENTS ){
+    eventsDropped++;
+    return;
+  }
+  struct cycleEvent *ev = &events[(eventHead + eventCount) % CYCLE_EVENTS];
+  ev->key = e->key;
+  ev->kind = kind;
+  ev->interval = interval;
+  ev->period = e->period >> 4;
+  eventCount++;
+}
+
+
+void CycleModel::tick()
+{
+  if( !enabled ) return;
+
+  while( eventCount > 0 ){
+    writeEvent( &events[eventHead] );
+    eventHead = (eventHead + 1) % CYCLE_EVENTS;
+    eventCount--;
+  }
+
+  if( millis() - lastCheck < CYCLE_CHECK ) return;
+  lastCheck = millis();
+
+  unsigned long now = micros();
+  for( byte i=0; i<CYCLE_SLOTS; i++ ){
+    struct cycleEntry *e = &table[i];
+    if( e->key == 0 || e->samples < CYCLE_LEARN || (e->anomalies & CYCLE_FLAG_MISSING) ) continue;
+
+    unsigned long silent = now - e->last;
+    if( silent > (e->period >> 4) * CYCLE_MISSING + tolerance(e) )
+      flag( e, CYCLE_MISSED, silent );
+  }
+}
+
+
+/*
+*  Log record  0x10 Bus Id3 Id2 Id1 Id0 Kind IntervalH IntervalL PeriodH PeriodL 0x0D
+*  Bus | 0x80 = extended ID, Kind 1 = late, 2 = early, 3 = missing, times in 0.1ms
+*/
+void CycleModel::writeEvent( struct cycleEvent *ev )
+{
+  unsigned long interval = ev->interval / 100;
+  unsigned long period = ev->period / 100;
+  if( interval > 0xFFFF ) interval = 0xFFFF;
+  if( period > 0xFFFF ) period = 0xFFFF;
+
+  out->write( 0x10 );
+  out->write( (byte)(ev->key >> 30) | ((ev->key & (1UL << 29)) ? 0x80 : 0) );
+  out->write( (byte)(ev->key >> 24) & 0x1F );
+  out->write( (byte)(ev->key >> 16) );
+  out->write( (byte)(ev->key >> 8) );
+  out->write( (byte) ev->key );
+  out->write( ev->kind );
+  out->write( (byte)(interval >> 8) );
+  out->write( (byte) interval );
+  out->write( (byte)(period >> 8) );
+  out->write( (byte) period );
+  out->write( 0x0D );
+}
+
+
+void CycleModel::printModel( Stream *out )
+{
+  for( byte i=0; table && i<CYCLE_SLOTS; i++ ){
+    struct cycleEntry *e = &table[i];
+    if( e->key == 0 ) continue;
+
+    out->print( F("{\"event\":\"cycleModel\", \"bus\":\"") );
+    out->print( e->key >> 30 );
+    out->print( F("\", \"id\":\"") );
+    out->print( e->key & 0x1FFFFFFF, HEX );
+    out->print( F("\", \"periodUs\":\"") );
+    out->print( e->period >> 4 );
+    out->print( F("\", \"jitterUs\":\"") );
+    out->print( e->jitter >> 4 );
+    out->print( F("\", \"learned\":\"") );
+    out->print( e->samples >= CYCLE_LEARN ? 1 : 0 );
+    out->println( F("\"}") );
+  }
+}
+
+
+void CycleModel::printStats( Stream *out )
+{
+  out->print( F("{\"event\":\"cycleStats\", \"frames\":\"") );
+  out->print( frames );
+  out->print( F("\", \"untracked\":\"") );
+  out->print( untracked );
+  out->print( F("\", \"evicted\":\"") );
+  out->print( evicted );
+  out->print( F("\", \"slots\":\"") );
+  out->print( CYCLE_SLOTS );
+  out->print( F("\", \"late\":\"") );
+  out->print( late );
+  out->print( F("\", \"early\":\"") );
+  out->print( early );
+  out->print( F("\", \"missing\":\"") );
+  out->print( missing );
+  out->print( F("\", \"eventsDropped\":\"") );
+  out->print( eventsDropped );
+  out->print( F("\", \"meanCycles\":\"") );
+  out->print( frames ? busyUs * (F_CPU / 1000000) / frames : 0 );
+  out->print( F("\", \"maxUs\":\"") );
+  out->print( maxUs );
+  out->println( F("\"}") );
+}
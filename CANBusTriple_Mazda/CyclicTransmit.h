@@ -0,0 +1,280 @@
+/*
+*  Cyclic transmit
+*
+*  A table of periodic TX jobs for simulating ECUs and keep-alives. Jobs are
+*  kept in a deadline queue ordered by their next due time in micros() so
+*  tick() only has to look at the head. Each job can bump a rolling counter
+*  byte and recompute a checksum byte before it is queued.
+*
+*  Lateness is measured where the frame is loaded into an MCP2515 TX
+*  buffer, sendMessage() calls transmitted(), so it includes the wait in
+*  the write queue and for a free TX buffer, not only the loop. Jitter is
+*  the spread between the least and most late send. Frames a job has
+*  waiting are taken in order, one with the same bus and ID sent from
+*  elsewhere meanwhile counts for the oldest of them.
+*
+*  RAM: the job table is taken from the heap when the first job is set, 37
+*  bytes per slot, and given back when the last one is cleared. Otherwise
+*  it costs 13 bytes.
+*/
+
+#include "Middleware.h"
+
+#define CYCLIC_MAX_JOBS 8
+#define CYCLIC_NO_BYTE 0xFF
+
+struct cyclicJob {
+  byte busId;                 // 0 = unused slot
+  unsigned short frame_id;
+  byte length;
+  byte frame_data[8];
+  unsigned int period;        // ms
+  byte counterByte;           // Payload byte incremented each send, CYCLIC_NO_BYTE = none
+  byte checksumByte;          // Payload byte set to the 8 bit sum of the others, CYCLIC_NO_BYTE = none
+  unsigned long deadline;     // micros() of next send
+  unsigned long due;          // Deadline of the oldest frame waiting to be transmitted
+  byte waiting;               // Frames queued and not yet in a TX buffer
+  unsigned long sentCount;
+  unsigned long latenessSum;  // us, for mean lateness
+  unsigned int latenessMin;
+  unsigned int latenessMax;
+};
+
+
+class CyclicTransmit : Middleware
+{
+  private:
+    static QueueArray<Message>* mainQueue;
+    static struct cyclicJob *jobs;       // CYCLIC_MAX_JOBS, NULL while there are none
+    static byte queue[CYCLIC_MAX_JOBS];  // Job slots ordered by deadline
+    static byte queued;
+    static void schedule( byte slot );
+    static void unschedule( byte slot );
+    static void send( byte slot );
+    static struct cyclicJob* waitingJob( Message *msg );
+  public:
+    static void init( QueueArray<Message> *q );
+    static void tick();
+    static boolean setJob( byte slot, byte busId, unsigned short frame_id, byte length, byte *data, unsigned int period, byte counterByte, byte checksumByte );
+    static void clearJob( byte slot );
+    static void clearAll();
+    static void resetStats();
+    static void printStats( Stream *out );
+    static void transmitted( Message *msg );
+    static void dropped( Message *msg );
+};
+
+
+QueueArray<Message>* CyclicTransmit::mainQueue;
+struct cyclicJob *CyclicTransmit::jobs = NULL;
+byte CyclicTransmit::queue[CYCLIC_MAX_JOBS];
+byte CyclicTransmit::queued = 0;
+
+
+void CyclicTransmit::init( QueueArray<Message> *q )
+{
+  mainQueue = q;
+  clearAll();
+}
+
+
+void CyclicTransmit::tick()
+{
+  unsigned long now = micros();
+
+  while( queued > 0 && (long)(now - jobs[queue[0]].deadline) >= 0 ){
+    byte slot = queue[0];
+    unschedule( slot );
+    send( slot );
+
+    struct cyclicJob *job = &jobs[slot];
+    job->deadline += (unsigned long)job->period * 1000;
+
+    // Missed a whole period (loop stalled), resync instead of bursting
+    if( (long)(now - job->deadline) >= 0 )
+      job->deadline = now + (unsigned long)job->period * 1000;
+
+    schedule( slot );
+  }
+}
+
+
+void CyclicTransmit::send( byte slot )
+{
+  struct cyclicJob *job = &jobs[slot];
+
+  // Measured in transmitted()
+  if( job->waiting == 0 ) job->due = job->deadline;
+  if( job->waiting < 0xFF ) job->waiting++;
+
+  if( job->counterByte < 8 )
+    job->frame_data[job->counterByte]++;
+
+  if( job->checksumByte < 8 ){
+    byte sum = 0;
+    for( byte i=0; i<job->length; i++ )
+      if( i != job->checksumByte ) sum += job->frame_data[i];
+    job->frame_data[job->checksumByte] = sum;
+  }
+
+  Message msg;
+  msg.busId = job->busId;
+  msg.frame_id = job->frame_id;
+  msg.length = job->length;
+  memcpy( msg.frame_data, job->frame_data, 8 );
+  msg.dispatch = true;
+  mainQueue->push( msg );
+}
+
+
+// Job with a frame waiting on msg's bus and ID, NULL if none
+struct cyclicJob* CyclicTransmit::waitingJob( Message *msg )
+{
+  if( queued == 0 || msg->extended ) return NULL;
+
+  for( byte i=0; i<CYCLIC_MAX_JOBS; i++ ){
+    struct cyclicJob *job = &jobs[i];
+    if( job->waiting && job->busId == msg->busId && job->frame_id == msg->frame_id ) return job;
+  }
+  return NULL;
+}
+
+
+// From sendMessage() once msg is in a TX buffer
+void CyclicTransmit::transmitted( Message *msg )
+{
+  struct cyclicJob *job = waitingJob( msg );
+  if( job == NULL ) return;
+
+  unsigned long late = micros() - job->due;
+  if( late > 0xFFFF ) late = 0xFFFF;
+  if( job->sentCount == 0 || late < job->latenessMin ) job->latenessMin = late;
+  if( late > job->latenessMax ) job->latenessMax = late;
+  job->latenessSum += late;
+  job->sentCount++;
+
+  // The next one waiting was due a period later
+  job->waiting--;
+  job->due += (unsigned long)job->period * 1000;
+}
+
+
+// From sendMessage() when msg is dropped, the bus is listen only
+void CyclicTransmit::dropped( Message *msg )
+{
+  struct cyclicJob *job = waitingJob( msg );
+  if( job == NULL ) return;
+  job->waiting--;
+  job->due += (unsigned long)job->period * 1000;
+}
+
+
+// Insert slot into the deadline queue, earliest first
+void CyclicTransmit::schedule( byte slot )
+{
+  byte i = queued;
+  while( i > 0 && (long)(jobs[slot].deadline - jobs[queue[i-1]].deadline) < 0 ){
+    queue[i] = queue[i-1];
+    i--;
+  }
+  queue[i] = slot;
+  queued++;
+}
+
+
+void CyclicTransmit::unschedule( byte slot )
+{
+  for( byte i=0; i<queued; i++ ){
+    if( queue[i] != slot ) continue;
+    memmove( &queue[i], &queue[i+1], queued-i-1 );
+    queued--;
+    return;
+  }
+}
+
+
+// False if the job is not valid or there is not enough free RAM for the table
+boolean CyclicTransmit::setJob( byte slot, byte busId, unsigned short frame_id, byte length, byte *data, unsigned int period, byte counterByte, byte checksumByte )
+{
+  if( slot >= CYCLIC_MAX_JOBS || busId < 1 || busId > 3 || length > 8 || period == 0 )
+    return false;
+
+  clearJob( slot );
+  if( jobs == NULL ){
+    jobs = (struct cyclicJob *) calloc( CYCLIC_MAX_JOBS, sizeof(struct cyclicJob) );
+    if( jobs == NULL ) return false;
+  }
+
+  struct cyclicJob *job = &jobs[slot];
+  job->busId = busId;
+  job->frame_id = frame_id;
+  job->length = length;
+  memcpy( job->frame_data, data, 8 );
+  job->period = period;
+  job->counterByte = counterByte;
+  job->checksumByte = checksumByte;
+  job->deadline = micros();
+
+  schedule( slot );
+  return true;
+}
+
+
+// The last job cleared gives the table back
+void CyclicTransmit::clearJob( byte slot )
+{
+  if( slot >= CYCLIC_MAX_JOBS || jobs == NULL ) return;
+  if( jobs[slot].busId ) unschedule( slot );
+  memset( &jobs[slot], 0, sizeof(struct cyclicJob) );
+  if( queued == 0 ) clearAll();
+}
+
+
+void CyclicTransmit::clearAll()
+{
+  free( jobs );
+  jobs = NULL;
+  queued = 0;
+}
+
+
+void CyclicTransmit::resetStats()
+{
+  if( jobs == NULL ) return;
+  for( byte i=0; i<CYCLIC_MAX_JOBS; i++ ){
+    jobs[i].sentCount = 0;
+    jobs[i].latenessSum = 0;
+    jobs[i].latenessMin = 0;
+    jobs[i].latenessMax = 0;
+  }
+}
+
+
+void CyclicTransmit::printStats( Stream *out )
+{
+  if( jobs == NULL ) return;
+  for( byte i=0; i<CYCLIC_MAX_JOBS; i++ ){
+    struct cyclicJob *job = &jobs[i];
+    if( !job->busId ) continue;
+
+    out->print( F("{\"event\":\"cyclicTx\", \"slot\":\"") );
+    out->print( i );
+    out->print( F("\", \"bus\":\"") );
+    out->print( job->busId );
+    out->print( F("\", \"id\":\"") );
+    out->print( job->frame_id, HEX );
+    out->print( F("\", \"period\":\"") );
+    out->print( job->period );
+    out->print( F("\", \"sent\":\"") );
+    out->print( job->sentCount );
+    out->print( F("\", \"lateMinUs\":\"") );
+    out->print( job->latenessMin );
+    out->print( F("\", \"lateMaxUs\":\"") );
+    out->print( job->latenessMax );
+    out->print( F("\", \"lateMeanUs\":\"") );
+    out->print( job->sentCount ? job->latenessSum / job->sentCount : 0 );
+    out->print( F("\", \"jitterUs\":\"") );
+    out->print( job->latenessMax - job->latenessMin );
+    out->println( F("\"}") );
+  }
+}
@@ -0,0 +1,232 @@
+/*
+*  Diagnostic response cache
+*
+*  The phone app, laptop tools and ServiceCall often ask the ECU for the same
+*  PIDs. Positive single frame responses (mode 0x01 PIDs and mode 0x22 DIDs)
+*  are cached per bus, request ID, service and PID. A host request the cache
+*  can answer within the TTL gets a synthesized response frame instead of
+*  going to the ECU, and a request identical to one already in flight is
+*  dropped since the pending response answers both. That response is not
+*  repeated per request, the host sees it once on the bus log.
+*
+*  Functional requests (0x7DF) are answered from the engine ECU (0x7E0).
+*/
+
+#include "Middleware.h"
+
+#define DIAG_CACHE_SIZE 8
+#define DIAG_INFLIGHT_SIZE 4
+#define DIAG_DEFAULT_TTL 250        // ms
+#define DIAG_INFLIGHT_TIMEOUT 100   // ms before an unanswered request stops coalescing
+#define DIAG_FUNCTIONAL_ID 0x7DF
+#define DIAG_ENGINE_ID 0x7E0
+#define DIAG_ID_MIN 0x700           // Responses are only looked for in the diagnostic ID range
+
+#define DIAG_MISS 0
+#define DIAG_HIT 1
+#define DIAG_COALESCED 2
+
+struct diagKey {
+  byte busId;                 // 0 = unused
+  unsigned short reqId;
+  byte service;
+  unsigned short pid;
+};
+
+struct diagEntry {
+  struct diagKey key;
+  byte frame_data[8];         // Response frame as received
+  unsigned long time;
+};
+
+struct diagInflight {
+  struct diagKey key;
+  unsigned long sentAt;
+};
+
+
+class DiagCache : Middleware
+{
+  private:
+    static struct diagEntry entries[DIAG_CACHE_SIZE];
+    static struct diagInflight inflight[DIAG_INFLIGHT_SIZE];
+    static boolean requestKey( byte busId, unsigned short id, byte *payload, byte length, struct diagKey *key );
+    static boolean sameKey( struct diagKey *a, struct diagKey *b );
+    static struct diagEntry* find( struct diagKey *key );
+    static struct diagInflight* findInflight( struct diagKey *key );
+  public:
+    static Message process( Message msg );
+    static byte request( Message *msg, Message *reply );
+    static void noteRequest( byte busId, unsigned short id, byte *payload, byte length );
+    static void flush();
+    static void printStats( Stream *out );
+    static unsigned int ttl;
+    static unsigned long hits;
+    static unsigned long misses;
+    static unsigned long coalesced;
+};
+
+
+struct diagEntry DiagCache::entries[DIAG_CACHE_SIZE];
+struct diagInflight DiagCache::inflight[DIAG_INFLIGHT_SIZE];
+unsigned int DiagCache::ttl = DIAG_DEFAULT_TTL;
+unsigned long DiagCache::hits = 0;
+unsigned long DiagCache::misses = 0;
+unsigned long DiagCache::coalesced = 0;
+
+
+// Store positive single frame responses
+Message DiagCache::process( Message msg )
+{
+  byte len = msg.frame_data[0];
+  byte sid = msg.frame_data[1];
+  if( msg.extended || msg.frame_id < DIAG_ID_MIN || len < 3 || len > 7 || (sid != 0x41 && sid != 0x62) ) return msg;
+
+  struct diagKey key;
+  key.busId = msg.busId;
+  key.reqId = msg.frame_id - 8;
+  key.service = sid - 0x40;
+  key.pid = sid == 0x41 ? msg.frame_data[2] : (msg.frame_data[2] << 8) + msg.frame_data[3];
+
+  struct diagInflight *f = findInflight( &key );
+  if( f != NULL ) f->key.busId = 0;
+
+  // Reuse this key's entry, else a free one, else the oldest
+  struct diagEntry *e = find( &key );
+  if( e == NULL ){
+    e = &entries[0];
+    for( byte i=0; i<DIAG_CACHE_SIZE; i++ ){
+      if( entries[i].key.busId == 0 ){ e = &entries[i]; break; }
+      if( entries[i].time < e->time ) e = &entries[i];
+    }
+  }
+
+  e->key = key;
+  memcpy( e->frame_data, msg.frame_data, 8 );
+  e->time = millis();
+  return msg;
+}
+
+
+/*
+*  Check a host request. DIAG_HIT fills reply with a synthesized response,
+*  DIAG_COALESCED means an identical request is already on the bus. Either
+*  way the request should not be sent. DIAG_MISS requests are tracked as in
+*  flight and should be sent.
+*/
+byte DiagCache::request( Message *msg, Message *reply )
+{
+  struct diagKey key;
+  if( !requestKey( msg->busId, msg->frame_id, &msg->frame_data[1], msg->frame_data[0], &key ) ) return DIAG_MISS;
+
+  struct diagEntry *e = find( &key );
+  if( e != NULL && millis() - e->time < ttl ){
+    reply->busId = e->key.busId;
+    reply->frame_id = e->key.reqId + 8;
+    memcpy( reply->frame_data, e->frame_data, 8 );
+    reply->length = 8;
+    reply->extended = false;
+    reply->busStatus = 0;
+    hits++;
+    return DIAG_HIT;
+  }
+
+  if( findInflight( &key ) != NULL ){
+    coalesced++;
+    return DIAG_COALESCED;
+  }
+
+  misses++;
+  noteRequest( msg->busId, msg->frame_id, &msg->frame_data[1], msg->frame_data[0] );
+  return DIAG_MISS;
+}
+
+
+// Track a request we are sending so identical ones can be coalesced. payload is without PCI
+void DiagCache::noteRequest( byte busId, unsigned short id, byte *payload, byte length )
+{
+  struct diagKey key;
+  if( !requestKey( busId, id, payload, length, &key ) ) return;
+
+  struct diagInflight *f = findInflight( &key );
+  if( f == NULL ){
+    f = &inflight[0];
+    for( byte i=0; i<DIAG_INFLIGHT_SIZE; i++ ){
+      if( inflight[i].key.busId == 0 ){ f = &inflight[i]; break; }
+      if( inflight[i].sentAt < f->sentAt ) f = &inflight[i];
+    }
+  }
+
+  f->key = key;
+  f->sentAt = millis();
+}
+
+
+// Single frame mode 0x01 (one PID) and mode 0x22 (one DID) requests only
+boolean DiagCache::requestKey( byte busId, unsigned short id, byte *payload, byte length, struct diagKey *key )
+{
+  if( length == 2 && payload[0] == 0x01 )
+    key->pid = payload[1];
+  else if( length == 3 && payload[0] == 0x22 )
+    key->pid = (payload[1] << 8) + payload[2];
+  else
+    return false;
+
+  key->busId = busId;
+  key->reqId = id == DIAG_FUNCTIONAL_ID ? DIAG_ENGINE_ID : id;
+  key->service = payload[0];
+  return true;
+}
+
+
+boolean DiagCache::sameKey( struct diagKey *a, struct diagKey *b )
+{
+  return a->busId == b->busId && a->reqId == b->reqId && a->service == b->service && a->pid == b->pid;
+}
+
+
+struct diagEntry* DiagCache::find( struct diagKey *key )
+{
+  for( byte i=0; i<DIAG_CACHE_SIZE; i++ )
+    if( sameKey( &entries[i].key, key ) ) return &entries[i];
+  return NULL;
+}
+
+
+struct diagInflight* DiagCache::findInflight( struct diagKey *key )
+{
+  for( byte i=0; i<DIAG_INFLIGHT_SIZE; i++ ){
+    if( !sameKey( &inflight[i].key, key ) ) continue;
+    if( millis() - inflight[i].sentAt < DIAG_INFLIGHT_TIMEOUT ) return &inflight[i];
+    inflight[i].key.busId = 0;
+  }
+  return NULL;
+}
+
+
+void DiagCache::flush()
+{
+  memset( entries, 0, sizeof(entries) );
+  memset( inflight, 0, sizeof(inflight) );
+  hits = misses = coalesced = 0;
+}
+
+
+void DiagCache::printStats( Stream *out )
+{
+  unsigned long total = hits + misses + coalesced;
+
+  out->print( F("{\"event\":\"diagCache\", \"ttl\":\"") );
+  out->print( ttl );
+  out->print( F("\", \"hits\":\"") );
+  out->print( hits );
+  out->print( F("\", \"misses\":\"") );
+  out->print( misses );
+  out->print( F("\", \"coalesced\":\"") );
+  out->print( coalesced );
+  out->print( F("\", \"hitRate\":\"") );
+  out->print( total ? (hits + coalesced) * 100 / total : 0 );
+  out->print( F("\", \"ecuRequestsSaved\":\"") );
+  out->print( hits + coalesced );
+  out->println( F("\"}") );
+}
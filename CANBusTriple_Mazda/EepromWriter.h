@@ -0,0 +1,281 @@
+/*
+*  Background EEPROM writer
+*
+*  An EEPROM byte takes about 3.3ms to program, so writing settings inline
+*  stalls the main loop and CAN traffic with it. write() only queues a range
+*  of EEPROM addresses together with the RAM copy it should hold, and the
+*  EEPROM ready interrupt programs one byte at a time in the background.
+*  Bytes that already hold the right value are skipped, which saves the
+*  time and the cell wear. The RAM copy is read when the byte is written,
+*  so queueing the same range again before it is done costs nothing extra.
+*
+*  Data that does not stay in RAM, like a record built on the stack, goes
+*  through copy() instead, which copies it into an EEWRITER_BUFFER byte
+*  FIFO that the interrupt writes from. fill() queues a range of one value.
+*  Ranges are written in the order queued. When the queue or the FIFO is
+*  full the caller waits for room rather than writing around it, and
+*  read() gives the value a byte will hold once everything queued is
+*  written, so reads see queued writes at once.
+*
+*  The interrupt must not start a write while the main loop reads or writes
+*  EEPROM itself, so any other EEPROM access has to sit between hold() and
+*  release().
+*/
+
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#define EEWRITER_QUEUE 4
+#define EEWRITER_BUFFER 48
+#define EEWRITER_MAX_LENGTH 0xFFFF  // Longest range write() takes
+
+#define EEWRITER_RAM 0              // Bytes from src
+#define EEWRITER_COPY 1             // Bytes from the FIFO
+#define EEWRITER_FILL 2             // Every byte the same
+
+struct eeRange {
+  unsigned int addr;
+  const byte *src;            // RAM copy, must stay valid until written
+  unsigned int length;
+  unsigned int offset;        // Next byte to write
+  byte kind;
+  byte data;                  // Fill value, or FIFO index of the first byte of a copy
+};
+
+
+class EepromWriter
+{
+  private:
+    static struct eeRange queue[EEWRITER_QUEUE];
+    static volatile byte head;
+    static volatile byte count;
+    static byte holds;
+    static byte buffer[EEWRITER_BUFFER];
+    static volatile byte bufHead;
+    static volatile byte bufCount;
+    static struct eeRange *add( unsigned int addr, unsigned int length, byte kind );
+    static void makeRoom( byte bytes );
+  public:
+    static void write( unsigned int addr, const void *src, unsigned int length );
+    static void copy( unsigned int addr, const void *src, unsigned int length );
+    static void fill( unsigned int addr, byte value, unsigned int length );
+    static byte read( unsigned int addr );
+    static void readBlock( void *dst, unsigned int addr, unsigned int length );
+    static void service();
+    static void hold();
+    static void release();
+    static void flush();
+    static byte pending();
+    static volatile unsigned long written;
+    static volatile unsigned long skipped;
+};
+
+
+struct eeRange EepromWriter::queue[EEWRITER_QUEUE];
+volatile byte EepromWriter::head = 0;
+volatile byte EepromWriter::count = 0;
+byte EepromWriter::holds = 0;
+byte EepromWriter::buffer[EEWRITER_BUFFER];
+volatile byte EepromWriter::bufHead = 0;
+volatile byte EepromWriter::bufCount = 0;
+volatile unsigned long EepromWriter::written = 0;
+volatile unsigned long EepromWriter::skipped = 0;
+
+
+ISR(EE_READY_vect)
+{
+  EepromWriter::service();
+}
+
+
+// Wait until a range and bytes of FIFO fit, writing from here so it also works while held
+void EepromWriter::makeRoom( byte bytes )
+{
+  if( count < EEWRITER_QUEUE && EEWRITER_BUFFER - bufCount >= bytes ) return;
+
+  hold();
+  while( count >= EEWRITER_QUEUE || EEWRITER_BUFFER - bufCount < bytes ){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+      service();
+    }
+    while( EECR & _BV(EEPE) );
+  }
+  release();
+}
+
+
+// Next free range, interrupts off and makeRoom() done
+struct eeRange *EepromWriter::add( unsigned int addr, unsigned int length, byte kind )
+{
+  struct eeRange *r = &queue[(head + count) % EEWRITER_QUEUE];
+  r->addr = addr;
+  r->src = NULL;
+  r->length = length;
+  r->offset = 0;
+  r->kind = kind;
+  count++;
+  return r;
+}
+
+
+void EepromWriter::write( unsigned int addr, const void *src, unsigned int length )
+{
+  boolean queued = false;
+  makeRoom( 0 );
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    // Already queued with nothing after it in the way, restart it so every
+    // byte is checked against the new values
+    for( byte i=0; i<count; i++ ){
+      struct eeRange *r = &queue[(head + i) % EEWRITER_QUEUE];
+      if( r->kind == EEWRITER_RAM && r->addr == addr && r->src == src && r->length == length ){
+        r->offset = 0;
+        queued = true;
+      }else if( queued && r->addr < addr + length && addr < r->addr + r->length ){
+        queued = false;
+      }
+    }
+
+    if( !queued ) add( addr, length, EEWRITER_RAM )->src = (const byte*) src;
+  }
+
+  if( holds == 0 ) EECR |= _BV(EERIE);
+}
+
+
+void EepromWriter::copy( unsigned int addr, const void *src, unsigned int length )
+{
+  const byte *b = (const byte*) src;
+
+  while( length > 0 ){
+    byte n = length < EEWRITER_BUFFER ? length : EEWRITER_BUFFER;
+    makeRoom( n );
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+      byte at = (bufHead + bufCount) % EEWRITER_BUFFER;
+      add( addr, n, EEWRITER_COPY )->data = at;
+      for( byte i=0; i<n; i++ ) buffer[(at + i) % EEWRITER_BUFFER] = b[i];
+      bufCount += n;
+    }
+
+    addr += n;
+    b += n;
+    length -= n;
+  }
+
+  if( holds == 0 ) EECR |= _BV(EERIE);
+}
+
+
+void EepromWriter::fill( unsigned int addr, byte value, unsigned int length )
+{
+  makeRoom( 0 );
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    add( addr, length, EEWRITER_FILL )->data = value;
+  }
+  if( holds == 0 ) EECR |= _BV(EERIE);
+}
+
+
+// What addr holds once the queue is written, between hold() and release()
+byte EepromWriter::read( unsigned int addr )
+{
+  byte value = eeprom_read_byte( (uint8_t*)(uintptr_t) addr );
+
+  for( byte i=0; i<count; i++ ){
+    struct eeRange *r = &queue[(head + i) % EEWRITER_QUEUE];
+    if( addr < r->addr + r->offset || addr >= r->addr + r->length ) continue;
+    unsigned int k = addr - r->addr;
+    if( r->kind == EEWRITER_FILL ) value = r->data;
+    else if( r->kind == EEWRITER_COPY ) value = buffer[(r->data + k) % EEWRITER_BUFFER];
+    else value = r->src[k];
+  }
+  return value;
+}
+
+
+void EepromWriter::readBlock( void *dst, unsigned int addr, unsigned int length )
+{
+  for( unsigned int i=0; i<length; i++ )
+    ((byte*) dst)[i] = read( addr + i );
+}
+
+
+// From the EEPROM ready interrupt: program the next byte that differs
+void EepromWriter::service()
+{
+  while( count > 0 ){
+    struct eeRange *r = &queue[head];
+    if( r->offset >= r->length ){
+      head = (head + 1) % EEWRITER_QUEUE;
+      count--;
+      continue;
+    }
+
+    unsigned int addr = r->addr + r->offset;
+    byte value;
+    if( r->kind == EEWRITER_FILL ){
+      value = r->data;
+    }else if( r->kind == EEWRITER_COPY ){
+      value = buffer[bufHead];
+      bufHead = (bufHead + 1) % EEWRITER_BUFFER;
+      bufCount--;
+    }else{
+      value = r->src[r->offset];
+    }
+    r->offset++;
+
+    EEAR = addr;
+    EECR |= _BV(EERE);
+    if( EEDR == value ){
+      skipped++;
+      continue;
+    }
+
+    EEDR = value;
+    EECR = (EECR & ~(_BV(EEPM1) | _BV(EEPM0))) | _BV(EEMPE);   // Erase and write
+    EECR |= _BV(EEPE);
+    written++;
+    return;
+  }
+
+  EECR &= ~_BV(EERIE);
+}
+
+
+// Stop background writes and wait for the byte in progress
+void EepromWriter::hold()
+{
+  holds++;
+  EECR &= ~_BV(EERIE);
+  while( EECR & _BV(EEPE) );
+}
+
+
+void EepromWriter::release()
+{
+  if( holds > 0 ) holds--;
+  if( holds == 0 && count > 0 ) EECR |= _BV(EERIE);
+}
+
+
+// Write everything queued now, for before a reset
+void EepromWriter::flush()
+{
+  hold();
+  while( count > 0 ){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+      service();
+    }
+    while( EECR & _BV(EEPE) );
+  }
+  EECR &= ~_BV(EERIE);
+  release();
+}
+
+
+byte EepromWriter::pending()
+{
+  return count;
+}
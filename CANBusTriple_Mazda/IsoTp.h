@@ -0,0 +1,361 @@
+/*
+*  ISO-TP (ISO 15765-2) transport for diagnostic requests and responses
+*
+*  Payloads longer than a single frame are split into a First Frame plus
+*  Consecutive Frames, with the receiver pacing the sender by Flow Control
+*  (block size and STmin). Each channel reassembles into its own fixed
+*  buffer, so several ECUs can answer at once.
+*
+*  To keep random bus traffic from opening channels and making us send Flow
+*  Control frames, a multi-frame response is only accepted on an ID we sent
+*  a request to with send(). Responses come back on the request ID + 8.
+*  receive() reads byte 0 of any frame as PCI, so only frames on such an
+*  ID should be fed to it, see expecting().
+*
+*  Flow Control and Consecutive Frames get the N_Bs / N_Cr timeout of
+*  ISO 15765-2, 1000ms. A channel waits ISOTP_P2_TIMEOUT for the response
+*  to start, and P2* instead once the ECU answered response pending.
+*/
+
+#include "Middleware.h"
+
+#define ISOTP_CHANNELS 3
+#define ISOTP_BUFFER_SIZE 48
+#define ISOTP_TIMEOUT 1000          // N_Bs / N_Cr, ms to wait for Flow Control or the next Consecutive Frame
+#define ISOTP_P2_TIMEOUT 150        // ms for the response to start, over REQUEST_TIMEOUT in ServiceCall
+#define ISOTP_P2_EXT_TIMEOUT 5000   // P2*, ms after a response pending
+#define ISOTP_BLOCK_SIZE 0          // BS we ask senders for, 0 = send everything
+#define ISOTP_STMIN 0               // STmin we ask senders for, ms
+
+#define ISOTP_PCI_SF 0x00
+#define ISOTP_PCI_FF 0x10
+#define ISOTP_PCI_CF 0x20
+#define ISOTP_PCI_FC 0x30
+
+#define ISOTP_FC_CTS 0x00
+#define ISOTP_FC_WAIT 0x01
+#define ISOTP_FC_OVERFLOW 0x02
+
+#define ISOTP_NEGATIVE 0x7F         // Negative response SID, 7F SID NRC
+#define ISOTP_NRC_PENDING 0x78      // Request received, response pending
+
+#define ISOTP_IDLE 0
+#define ISOTP_AWAIT 1               // Request sent, waiting for the response to start
+#define ISOTP_RX 2                  // Receiving consecutive frames
+#define ISOTP_TX_WAIT_FC 3          // Sent FF or a full block, waiting for Flow Control
+#define ISOTP_TX 4                  // Sending consecutive frames
+#define ISOTP_AWAIT_PENDING 5       // ECU answered response pending, waiting up to P2*
+
+struct isotpChannel {
+  byte state;
+  byte busId;
+  unsigned short txId;        // ID we send requests / FC on
+  unsigned int length;        // Total payload length
+  unsigned int offset;        // Bytes received or sent so far
+  byte sequence;              // Next expected or sent sequence number
+  byte blockSize;             // TX, BS granted by the receiver
+  byte blockCount;            // Frames sent / received in this block
+  byte stMin;                 // TX, ms between consecutive frames
+  unsigned long timer;        // Last activity, or earliest next CF when sending
+  byte data[ISOTP_BUFFER_SIZE];
+};
+
+
+class IsoTp : Middleware
+{
+  private:
+    static QueueArray<Message>* mainQueue;
+    static struct isotpChannel channels[ISOTP_CHANNELS];
+    static struct isotpChannel* findChannel( byte busId, unsigned short rxId );
+    static void sendFrame( byte busId, unsigned short id, byte *data, byte length );
+    static void sendFlowControl( struct isotpChannel *ch, byte status );
+    static void sendConsecutive( struct isotpChannel *ch );
+  public:
+    static void init( QueueArray<Message> *q );
+    static void tick();
+    static byte* receive( Message *msg, unsigned int *length );
+    static boolean send( byte busId, unsigned short txId, byte *data, unsigned int length );
+    static boolean expecting( byte busId, unsigned short rxId );
+    static boolean receiving( byte busId, unsigned short rxId );
+    static unsigned long completed;
+    static unsigned long timeouts;
+    static unsigned long overflows;
+    static unsigned long sequenceErrors;
+};
+
+
+QueueArray<Message>* IsoTp::mainQueue;
+struct isotpChannel IsoTp::channels[ISOTP_CHANNELS];
+unsigned long IsoTp::completed = 0;
+unsigned long IsoTp::timeouts = 0;
+unsigned long IsoTp::overflows = 0;
+unsigned long IsoTp::sequenceErrors = 0;
+
+
+void IsoTp::init( QueueArray<Message> *q )
+{
+  mainQueue = q;
+  memset( channels, 0, sizeof(channels) );
+}
+
+
+void IsoTp::tick()
+{
+  unsigned long now = millis();
+
+  for( byte c=0; c<ISOTP_CHANNELS; c++ ){
+    struct isotpChannel *ch = &channels[c];
+
+    switch( ch->state ){
+      case ISOTP_AWAIT:
+        if( now - ch->timer > ISOTP_P2_TIMEOUT ) ch->state = ISOTP_IDLE;
+      break;
+      case ISOTP_AWAIT_PENDING:
+        if( now - ch->timer > ISOTP_P2_EXT_TIMEOUT ) ch->state = ISOTP_IDLE;
+      break;
+      case ISOTP_RX:
+      case ISOTP_TX_WAIT_FC:
+        if( now - ch->timer > ISOTP_TIMEOUT ){
+          timeouts++;
+          ch->state = ISOTP_IDLE;
+        }
+      break;
+      case ISOTP_TX:
+        if( now - ch->timer >= ch->stMin )
+          sendConsecutive( ch );
+      break;
+    }
+  }
+}
+
+
+/*
+*  Feed every received frame through here. Returns the payload (without PCI)
+*  of a single frame, or of a multi-frame response once it is complete, and
+*  NULL otherwise. The pointer is only valid until the next call.
+*/
+byte* IsoTp::receive( Message *msg, unsigned int *length )
+{
+  byte pci = msg->frame_data[0] & 0xF0;
+  struct isotpChannel *ch;
+
+  switch( pci ){
+    case ISOTP_PCI_SF:
+      *length = msg->frame_data[0] & 0x0F;
+      if( *length == 0 || *length > 7 || *length >= msg->length ) return NULL;
+
+      // Close out a request that was waiting on this answer, unless the answer is still to come
+      ch = findChannel( msg->busId, msg->frame_id );
+      if( ch != NULL && (ch->state == ISOTP_AWAIT || ch->state == ISOTP_AWAIT_PENDING) ){
+        if( *length == 3 && msg->frame_data[1] == ISOTP_NEGATIVE && msg->frame_data[3] == ISOTP_NRC_PENDING ){
+          ch->state = ISOTP_AWAIT_PENDING;
+          ch->timer = millis();
+        }else{
+          ch->state = ISOTP_IDLE;
+        }
+      }
+      return &msg->frame_data[1];
+
+    case ISOTP_PCI_FF:
+      ch = findChannel( msg->busId, msg->frame_id );
+      if( ch == NULL || (ch->state != ISOTP_AWAIT && ch->state != ISOTP_AWAIT_PENDING && ch->state != ISOTP_RX) ) return NULL;
+
+      // Anything under 8 bytes has to come as a single frame, ignore it
+      *length = ((msg->frame_data[0] & 0x0F) << 8) + msg->frame_data[1];
+      if( msg->length < 8 || *length < 8 ) return NULL;
+
+      ch->length = *length;
+      if( ch->length > ISOTP_BUFFER_SIZE ){
+        overflows++;
+        sendFlowControl( ch, ISOTP_FC_OVERFLOW );
+        ch->state = ISOTP_IDLE;
+        return NULL;
+      }
+
+      memcpy( ch->data, &msg->frame_data[2], 6 );
+      ch->offset = 6;
+      ch->sequence = 1;
+      ch->blockCount = 0;
+      ch->state = ISOTP_RX;
+      ch->timer = millis();
+      sendFlowControl( ch, ISOTP_FC_CTS );
+      return NULL;
+
+    case ISOTP_PCI_CF:
+      ch = findChannel( msg->busId, msg->frame_id );
+      if( ch == NULL || ch->state != ISOTP_RX ) return NULL;
+
+      if( (msg->frame_data[0] & 0x0F) != ch->sequence ){
+        sequenceErrors++;
+        ch->state = ISOTP_IDLE;
+        return NULL;
+      }
+
+      {
+        unsigned int n = ch->length - ch->offset;
+        if( n > 7 ) n = 7;
+        memcpy( &ch->data[ch->offset], &msg->frame_data[1], n );
+        ch->offset += n;
+      }
+      ch->sequence = (ch->sequence + 1) & 0x0F;
+      ch->timer = millis();
+
+      if( ch->offset >= ch->length ){
+        ch->state = ISOTP_IDLE;
+        completed++;
+        *length = ch->length;
+        return ch->data;
+      }
+
+      #if ISOTP_BLOCK_SIZE
+      if( ++ch->blockCount >= ISOTP_BLOCK_SIZE ){
+        ch->blockCount = 0;
+        sendFlowControl( ch, ISOTP_FC_CTS );
+      }
+      #endif
+      return NULL;
+
+    case ISOTP_PCI_FC:
+      ch = findChannel( msg->busId, msg->frame_id );
+      if( ch == NULL || ch->state != ISOTP_TX_WAIT_FC ) return NULL;
+
+      ch->timer = millis();
+      switch( msg->frame_data[0] & 0x0F ){
+        case ISOTP_FC_CTS:
+          ch->blockSize = msg->frame_data[1];
+          ch->blockCount = 0;
+          // 0xF1-0xF9 are 100-900us, round up to the 1ms we can time
+          ch->stMin = msg->frame_data[2] <= 0x7F ? msg->frame_data[2] : 1;
+          ch->state = ISOTP_TX;
+        break;
+        case ISOTP_FC_WAIT:
+        break;
+        default:
+          overflows++;
+          ch->state = ISOTP_IDLE;
+        break;
+      }
+      return NULL;
+  }
+
+  return NULL;
+}
+
+
+/*
+*  Send a request, segmented if it does not fit a single frame, and open a
+*  channel for the response on txId + 8.
+*/
+boolean IsoTp::send( byte busId, unsigned short txId, byte *data, unsigned int length )
+{
+  if( length == 0 || length > ISOTP_BUFFER_SIZE ) return false;
+
+  // Don't clobber a response that is still being reassembled
+  struct isotpChannel *ch = findChannel( busId, txId + 8 );
+  if( ch != NULL && ch->state == ISOTP_RX ) return false;
+  if( ch == NULL ){
+    for( byte c=0; c<ISOTP_CHANNELS; c++ ){
+      if( channels[c].state == ISOTP_IDLE ){
+        ch = &channels[c];
+        break;
+      }
+    }
+  }
+  if( ch == NULL ) return false;
+
+  ch->busId = busId;
+  ch->txId = txId;
+  ch->timer = millis();
+
+  byte frame[8] = {0};
+
+  if( length <= 7 ){
+    frame[0] = ISOTP_PCI_SF | length;
+    memcpy( &frame[1], data, length );
+    sendFrame( busId, txId, frame, 8 );
+    ch->state = ISOTP_AWAIT;
+    return true;
+  }
+
+  memcpy( ch->data, data, length );
+  ch->length = length;
+  frame[0] = ISOTP_PCI_FF | (length >> 8);
+  frame[1] = length & 0xFF;
+  memcpy( &frame[2], data, 6 );
+  sendFrame( busId, txId, frame, 8 );
+
+  ch->offset = 6;
+  ch->sequence = 1;
+  ch->state = ISOTP_TX_WAIT_FC;
+  return true;
+}
+
+
+void IsoTp::sendConsecutive( struct isotpChannel *ch )
+{
+  byte frame[8] = {0};
+  unsigned int n = ch->length - ch->offset;
+  if( n > 7 ) n = 7;
+
+  frame[0] = ISOTP_PCI_CF | ch->sequence;
+  memcpy( &frame[1], &ch->data[ch->offset], n );
+  sendFrame( ch->busId, ch->txId, frame, 8 );
+
+  ch->offset += n;
+  ch->sequence = (ch->sequence + 1) & 0x0F;
+  ch->timer = millis();
+
+  if( ch->offset >= ch->length )
+    ch->state = ISOTP_AWAIT;                    // Now wait for the response
+  else if( ch->blockSize && ++ch->blockCount >= ch->blockSize )
+    ch->state = ISOTP_TX_WAIT_FC;
+}
+
+
+void IsoTp::sendFlowControl( struct isotpChannel *ch, byte status )
+{
+  byte frame[8] = {0};
+  frame[0] = ISOTP_PCI_FC | status;
+  frame[1] = ISOTP_BLOCK_SIZE;
+  frame[2] = ISOTP_STMIN;
+  sendFrame( ch->busId, ch->txId, frame, 8 );
+}
+
+
+void IsoTp::sendFrame( byte busId, unsigned short id, byte *data, byte length )
+{
+  Message msg;
+  msg.busId = busId;
+  msg.frame_id = id;
+  msg.length = length;
+  memcpy( msg.frame_data, data, length );
+  msg.dispatch = true;
+  mainQueue->push( msg );
+}
+
+
+// A request is waiting for an answer on rxId
+boolean IsoTp::expecting( byte busId, unsigned short rxId )
+{
+  return findChannel( busId, rxId ) != NULL;
+}
+
+
+// A multi-frame response is being reassembled on rxId
+boolean IsoTp::receiving( byte busId, unsigned short rxId )
+{
+  struct isotpChannel *ch = findChannel( busId, rxId );
+  return ch != NULL && ch->state == ISOTP_RX;
+}
+
+
+// Channel whose responses arrive on rxId
+struct isotpChannel* IsoTp::findChannel( byte busId, unsigned short rxId )
+{
+  for( byte c=0; c<ISOTP_CHANNELS; c++ ){
+    struct isotpChannel *ch = &channels[c];
+    if( ch->state != ISOTP_IDLE && ch->busId == busId && ch->txId + 8 == rxId )
+      return ch;
+  }
+  return NULL;
+}
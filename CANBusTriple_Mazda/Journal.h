@@ -0,0 +1,158 @@
+/*
+*  Wear leveled EEPROM journal for settings that change while driving
+*
+*  Writing displayIndex to the same byte on every wheel button press wears
+*  that cell out in a few years. Instead every change is appended to a ring
+*  of JOURNAL_SLOTS 4 byte slots, so each cell sees 1 / JOURNAL_SLOTS of the
+*  writes. Slot: sequence, key, value, check. The check byte is written
+*  last, a slot torn by a reset fails it and is ignored.
+*
+*  Boot reads the ring once: the newest valid slot per key is its value, the
+*  newest slot overall is where appending carries on. Sequence numbers are
+*  a byte and compared mod 256, fine while the ring is under 128 slots.
+*
+*  Before the ring overwrites the only copy of a key it is copied forward,
+*  the extra slots written that way are counted against write().
+*/
+
+#define JOURNAL_START 0x380
+#define JOURNAL_SLOTS 32
+#define JOURNAL_KEYS 4
+#define JOURNAL_EMPTY 0xFF              // Key of an erased slot
+
+#define JOURNAL_DISPLAY_INDEX 0
+#define JOURNAL_DISPLAY_ENABLED 1
+
+struct journalSlot {
+  byte seq;
+  byte key;
+  byte value;
+  byte check;
+};
+
+
+class Journal
+{
+  private:
+    static struct journalSlot records[JOURNAL_KEYS];   // Last slot per key, also the source for EepromWriter
+    static byte slotOf[JOURNAL_KEYS];
+    static byte next;
+    static byte seq;
+    static boolean present[JOURNAL_KEYS];
+    static byte checkOf( struct journalSlot *s );
+    static void append( byte key );
+  public:
+    static void init();
+    static void clear();
+    static boolean read( byte key, byte *value );
+    static void write( byte key, byte value );
+    static unsigned long writes;
+    static unsigned long slotsWritten;
+    static unsigned int scanMicros;
+};
+
+
+struct journalSlot Journal::records[JOURNAL_KEYS];
+byte Journal::slotOf[JOURNAL_KEYS];
+byte Journal::next = 0;
+byte Journal::seq = 0;
+boolean Journal::present[JOURNAL_KEYS];
+unsigned long Journal::writes = 0;
+unsigned long Journal::slotsWritten = 0;
+unsigned int Journal::scanMicros = 0;
+
+
+byte Journal::checkOf( struct journalSlot *s )
+{
+  return (s->seq + s->key + s->value) ^ 0x5A;
+}
+
+
+// Single pass over the ring
+void Journal::init()
+{
+  unsigned long start = micros();
+  boolean any = false;
+  byte newest = 0;
+
+  memset( present, 0, sizeof(present) );
+
+  EepromWriter::hold();
+  for( byte i=0; i<JOURNAL_SLOTS; i++ ){
+    struct journalSlot s;
+    EepromWriter::readBlock( &s, JOURNAL_START + i * sizeof(struct journalSlot), sizeof(s) );
+    if( s.key >= JOURNAL_KEYS || s.check != checkOf(&s) ) continue;
+
+    if( !present[s.key] || (int8_t)(s.seq - records[s.key].seq) > 0 ){
+      records[s.key] = s;
+      slotOf[s.key] = i;
+      present[s.key] = true;
+    }
+    if( !any || (int8_t)(s.seq - seq) > 0 ){
+      seq = s.seq;
+      newest = i;
+      any = true;
+    }
+  }
+  EepromWriter::release();
+
+  next = any ? (newest + 1) % JOURNAL_SLOTS : 0;
+  seq = any ? seq + 1 : 0;
+  scanMicros = micros() - start;
+}
+
+
+// For a factory reset, queued. Every byte erased, the key alone would do but fits no single range
+void Journal::clear()
+{
+  EepromWriter::fill( JOURNAL_START, JOURNAL_EMPTY, JOURNAL_SLOTS * sizeof(struct journalSlot) );
+
+  memset( present, 0, sizeof(present) );
+  next = 0;
+  seq = 0;
+}
+
+
+boolean Journal::read( byte key, byte *value )
+{
+  if( key >= JOURNAL_KEYS || !present[key] ) return false;
+  *value = records[key].value;
+  return true;
+}
+
+
+void Journal::write( byte key, byte value )
+{
+  if( key >= JOURNAL_KEYS ) return;
+  if( present[key] && records[key].value == value ) return;
+
+  writes++;
+  records[key].value = value;
+  append( key );
+}
+
+
+void Journal::append( byte key )
+{
+  // Keep the only copy of another key from being overwritten
+  byte k = 0;
+  while( k < JOURNAL_KEYS ){
+    if( k != key && present[k] && slotOf[k] == next ){
+      append( k );
+      k = 0;
+    }else{
+      k++;
+    }
+  }
+
+  struct journalSlot *s = &records[key];
+  s->seq = seq++;
+  s->key = key;
+  s->check = checkOf( s );
+  slotOf[key] = next;
+  present[key] = true;
+
+  EepromWriter::write( JOURNAL_START + next * sizeof(struct journalSlot), s, sizeof(struct journalSlot) );
+  next = (next + 1) % JOURNAL_SLOTS;
+  slotsWritten++;
+}
@@ -10,12 +10,15 @@ class MazdaLED : Middleware
     static unsigned long updateCounter;
     static void pushNewMessage();
     static int fastUpdateDelay;
+    static void printValue( char *dst, char label, boolean decimal, unsigned int value );
+    static void printPid( char *dst, byte i );
   public:
     static void init( QueueArray<Message> *q, byte enabled );
     static void tick();
     static void showNewPageMessage();
     static boolean enabled;
     static void showStatusMessage(char* str, int time);
+    static void showStatusMessage(const __FlashStringHelper* str, int time);
     static char lcdString[13];
     static char lcdStockString[13];
     static char lcdStatusString[13];
@@ -26,12 +29,14 @@ class MazdaLED : Middleware
     static unsigned long animationCounter;
     static Message process( Message msg );
     static char* currentLcdString();
+    static boolean showStats;
     
 };
 
 boolean MazdaLED::enabled = cbt_settings.displayEnabled;
 unsigned long MazdaLED::updateCounter = 0;
 int MazdaLED::fastUpdateDelay = 500;
+boolean MazdaLED::showStats = false;
 QueueArray<Message>* MazdaLED::mainQueue;
 char MazdaLED::lcdString[13] = "CANBusTriple";
 char MazdaLED::lcdStockString[13] = "            ";
@@ -71,6 +76,13 @@ void MazdaLED::showStatusMessage(char* str, int time){
   MazdaLED::setStatusTime(time);
 }
 
+// Fixed messages, straight from flash
+void MazdaLED::showStatusMessage(const __FlashStringHelper* str, int time){
+  strncpy_P( MazdaLED::lcdStatusString, (PGM_P) str, sizeof(lcdStatusString)-1 );
+  MazdaLED::lcdStatusString[sizeof(lcdStatusString)-1] = 0;
+  MazdaLED::setStatusTime(time);
+}
+
 
 void MazdaLED::pushNewMessage(){
   
@@ -147,7 +159,7 @@ void MazdaLED::setStatusTime( int n ){
 
 Message MazdaLED::process(Message msg)
 {
-  if(!enabled){
+  if(!enabled || msg.extended){
     return msg;
   }
   
@@ -227,31 +239,22 @@ Message MazdaLED::process(Message msg)
   }
   
   // TODO: Make float compat
-  byte incIndex = ( cbt_settings.displayIndex+1 > Settings::pidLength-1 ) ? 0 : cbt_settings.displayIndex+1;
+  byte incIndex = ( cbt_settings.displayIndex+1 > Settings::pidCount-1 ) ? 0 : cbt_settings.displayIndex+1;
   
-  char buffer[6] = "     ";
   
   
+  sprintf_P(lcdString, PSTR("            "));
   
-  sprintf(lcdString, "            ");
+  printPid( lcdString, cbt_settings.displayIndex );
+  printPid( lcdString+6, incIndex );
   
-  // TODO: Tidy up with a loop
-  if( cbt_settings.pids[cbt_settings.displayIndex].settings & B00000001 == B00000001 ){ // add decimal flag
-  sprintf(lcdString, "%c:%d.%d", cbt_settings.pids[cbt_settings.displayIndex].name[0], 
-                                   cbt_settings.pids[cbt_settings.displayIndex].value/10,
-                                   cbt_settings.pids[cbt_settings.displayIndex].value%10);
-  }else{
-    sprintf(lcdString, "%c:%d", cbt_settings.pids[cbt_settings.displayIndex].name[0], 
-                                   cbt_settings.pids[cbt_settings.displayIndex].value);
-  }
-  
-  if( cbt_settings.pids[incIndex].settings & B00000001 == B00000001 ){ // add decimal flag
-  sprintf(lcdString+6, "%c:%d.%d", cbt_settings.pids[incIndex].name[0], 
-                                    cbt_settings.pids[incIndex].value/10,
-                                    cbt_settings.pids[incIndex].value%10);
-  }else{
-    sprintf(lcdString+6, "%c:%d", cbt_settings.pids[incIndex].name[0], 
-                                   cbt_settings.pids[incIndex].value);
+  // Session mean and max of the displayed PID instead, see PidStats
+  if( showStats ){
+    byte i = cbt_settings.displayIndex;
+    boolean decimal = cbt_settings.pids[i].settings & B00000001;
+    sprintf_P(lcdString, PSTR("            "));
+    printValue( lcdString, '~', decimal, PidStats::mean(i) );
+    printValue( lcdString+6, '^', decimal, PidStats::stats[i].max );
   }
   
   
@@ -272,20 +275,41 @@ Message MazdaLED::process(Message msg)
 }
 
 
-void MazdaLED::showNewPageMessage()
+// One 6 character half of the display, label then value, without the decimal when it does not fit
+void MazdaLED::printValue( char *dst, char label, boolean decimal, unsigned int value )
 {
-  char msgBuffer[13] = "            ";
-  sprintf( msgBuffer, " %c%c%c%c  %c%c%c%c ", cbt_settings.pids[cbt_settings.displayIndex].name[0], 
-                                              cbt_settings.pids[cbt_settings.displayIndex].name[1], 
-                                              cbt_settings.pids[cbt_settings.displayIndex].name[2],
-                                              cbt_settings.pids[cbt_settings.displayIndex].name[3],
-                                              
-                                              cbt_settings.pids[cbt_settings.displayIndex+1].name[0],
-                                              cbt_settings.pids[cbt_settings.displayIndex+1].name[1],
-                                              cbt_settings.pids[cbt_settings.displayIndex+1].name[2],
-                                              cbt_settings.pids[cbt_settings.displayIndex+1].name[3]);
-  MazdaLED::showStatusMessage(msgBuffer, 2000);
+  if( decimal && value < 10000 )
+    snprintf_P( dst, 7, PSTR("%c%u.%u"), label, value/10, value%10 );
+  else
+    snprintf_P( dst, 7, PSTR("%c%u"), label, (uint16_t)(decimal ? value/10 : value) );   // 5 digits at most
 }
 
 
+// PID i in one half of the display, label colon value. The whole number
+// when the decimal does not fit, held at 9999 when that does not either
+void MazdaLED::printPid( char *dst, byte i )
+{
+  unsigned int value = cbt_settings.pids[i].value;
+  boolean decimal = cbt_settings.pids[i].settings & B00000001;
+  
+  if( decimal && value < 1000 ){
+    snprintf_P( dst, 7, PSTR("%c:%u.%u"), cbt_settings.pids[i].label, value/10, value%10 );
+  }else{
+    if( decimal ) value /= 10;
+    if( value > 9999 ) value = 9999;
+    snprintf_P( dst, 7, PSTR("%c:%u"), cbt_settings.pids[i].label, value );
+  }
+}
+
 
+void MazdaLED::showNewPageMessage()
+{
+  byte incIndex = ( cbt_settings.displayIndex+1 > Settings::pidCount-1 ) ? 0 : cbt_settings.displayIndex+1;
+  char msgBuffer[13] = "            ";
+  char name[PID_NAME_LENGTH], incName[PID_NAME_LENGTH];
+  Settings::pidName( cbt_settings.displayIndex, name );
+  Settings::pidName( incIndex, incName );
+  sprintf_P( msgBuffer, PSTR(" %c%c%c%c  %c%c%c%c "), name[0], name[1], name[2], name[3],
+                                              incName[0], incName[1], incName[2], incName[3]);
+  MazdaLED::showStatusMessage(msgBuffer, 2000);
+}
@@ -12,7 +12,7 @@ class Middleware
 
 Message Middleware::process( Message* msg )
 {
-  
+  return *msg;
 }
 
 
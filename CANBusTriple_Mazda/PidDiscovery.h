@@ -0,0 +1,422 @@
+/*
+*  Supported PID discovery
+*
+*  Probes a list of ECUs for the mode 0x01 PIDs they support and for the
+*  known Mazda mode 0x22 DIDs, then fills the PID table from the presets
+*  that were found, the first PID_TABLE_SIZE of them.
+*
+*  All ECUs are probed at once, one request in flight each. Mode 0x01 starts
+*  with a single request for all six support ranges (0x00, 0x20 .. 0xA0);
+*  ranges the ECU left out are then walked one at a time, following the
+*  "next range supported" bit. ECUs that don't answer within
+*  DISCOVERY_TIMEOUT are dropped after two tries and the whole run stops at
+*  DISCOVERY_BUDGET, so a full pass takes well under a second on a car.
+*
+*  Results go to EEPROM at DISCOVERY_EEPROM as variable length records:
+*
+*  Byte   Value
+*  0      DISCOVERY_MAGIC
+*  1      N                ECUs that answered
+*  2..    N records of
+*           reqH reqL  latMin latMax  didsH didsL  R  R*4 support bitmap bytes
+*
+*  latMin / latMax are response times in ms, dids bit d = defaultPids[d]
+*  answered, R is the number of mode 0x01 ranges stored from 0x00.
+*
+*  RAM: the ECU table is taken from the heap by start(), 41 bytes per ECU,
+*  and given back when the run is over. Otherwise it costs 12 bytes.
+*/
+
+#include "Middleware.h"
+
+#define DISCOVERY_MAX_ECUS 4
+#define DISCOVERY_RANGES 6
+#define DISCOVERY_TIMEOUT 50        // ms per request
+#define DISCOVERY_BUDGET 3000       // ms for the whole run
+#define DISCOVERY_EEPROM 0x200
+#define DISCOVERY_MAGIC 0xD1
+
+#define DISC_IDLE 0
+#define DISC_MODE01 1
+#define DISC_DIDS 2
+#define DISC_DONE 3
+
+#define DISC_ASK_ALL 0xFF           // Multi range mode 0x01 request
+
+struct discoveryEcu {
+  unsigned short reqId;
+  byte state;
+  byte asking;                // Range or preset index in flight
+  byte requests;              // Requests sent, for dropping silent ECUs
+  boolean waiting;
+  boolean present;
+  byte known;                 // bit r = range r bitmap received
+  byte tried;                 // bit r = range r asked for on its own
+  byte bitmaps[DISCOVERY_RANGES][4];
+  unsigned short dids;        // bit d = preset d answered (mode 0x22 presets only)
+  byte latencyMin;
+  byte latencyMax;
+  unsigned long sentAt;
+};
+
+
+// ECUs probed, Mazda request IDs
+const unsigned short discoveryEcuIds[DISCOVERY_MAX_ECUS] PROGMEM = {
+  0x7E0,    // PCM
+  0x7E1,    // TCM
+  0x760,    // ABS
+  0x737,    // RCM
+};
+
+#define DISCOVERY_PRESETS DEFAULT_PIDS
+
+
+class PidDiscovery : Middleware
+{
+  private:
+    static QueueArray<Message>* mainQueue;
+    static struct discoveryEcu *ecus;    // DISCOVERY_MAX_ECUS, NULL while not running
+    static byte busId;
+    static boolean populate;
+    static unsigned long startedAt;
+    static Stream *out;
+    static void advance( struct discoveryEcu *ecu, unsigned long now );
+    static void request( struct discoveryEcu *ecu, byte *data, byte length, unsigned long now );
+    static byte nextRange( struct discoveryEcu *ecu );
+    static byte nextDid( byte from );
+    static boolean supports( struct discoveryEcu *ecu, struct pidDef *preset );
+    static void finish();
+    static void save();
+    static byte fillPidTable();
+  public:
+    static void init( QueueArray<Message> *q );
+    static void tick();
+    static boolean start( byte bus, boolean fill, Stream *s );
+    static boolean running();
+    static boolean response( byte bus, unsigned short frame_id, byte *payload, unsigned int length );
+    static void printResults( Stream *out );
+};
+
+
+QueueArray<Message>* PidDiscovery::mainQueue;
+struct discoveryEcu *PidDiscovery::ecus = NULL;
+byte PidDiscovery::busId = 0;
+boolean PidDiscovery::populate = false;
+unsigned long PidDiscovery::startedAt = 0;
+Stream *PidDiscovery::out = &Serial;
+
+
+void PidDiscovery::init( QueueArray<Message> *q )
+{
+  mainQueue = q;
+}
+
+
+// False if there is not enough free RAM for the ECU table
+boolean PidDiscovery::start( byte bus, boolean fill, Stream *s )
+{
+  free( ecus );
+  busId = 0;
+  ecus = (struct discoveryEcu *) calloc( DISCOVERY_MAX_ECUS, sizeof(struct discoveryEcu) );
+  if( ecus == NULL ) return false;
+
+  for( byte e=0; e<DISCOVERY_MAX_ECUS; e++ ){
+    ecus[e].reqId = pgm_read_word( &discoveryEcuIds[e] );
+    ecus[e].state = DISC_MODE01;
+    ecus[e].asking = DISC_ASK_ALL;
+    ecus[e].latencyMin = 0xFF;
+  }
+
+  busId = bus;
+  populate = fill;
+  out = s;
+  startedAt = millis();
+  return true;
+}
+
+
+boolean PidDiscovery::running()
+{
+  return busId != 0;
+}
+
+
+void PidDiscovery::tick()
+{
+  if( !running() ) return;
+
+  unsigned long now = millis();
+  boolean done = true;
+
+  for( byte e=0; e<DISCOVERY_MAX_ECUS; e++ ){
+    struct discoveryEcu *ecu = &ecus[e];
+    if( ecu->state == DISC_DONE ) continue;
+    done = false;
+
+    if( ecu->waiting ){
+      if( now - ecu->sentAt < DISCOVERY_TIMEOUT ) continue;
+
+      // No answer. Nobody home after two tries, else skip this question
+      ecu->waiting = false;
+      if( !ecu->present && ecu->requests >= 2 ){
+        ecu->state = DISC_DONE;
+        continue;
+      }
+      if( ecu->state == DISC_DIDS ) ecu->asking++;
+    }
+
+    advance( ecu, now );
+  }
+
+  if( done || now - startedAt > DISCOVERY_BUDGET )
+    finish();
+}
+
+
+// Send the next question for an idle ECU, or move it on to the next phase
+void PidDiscovery::advance( struct discoveryEcu *ecu, unsigned long now )
+{
+  byte data[7];
+
+  if( ecu->state == DISC_MODE01 ){
+    if( ecu->asking == DISC_ASK_ALL && ecu->requests == 0 ){
+      data[0] = 0x01;
+      for( byte r=0; r<DISCOVERY_RANGES; r++ ) data[r+1] = r * 0x20;
+      request( ecu, data, 7, now );
+      return;
+    }
+
+    byte r = nextRange( ecu );
+    if( r < DISCOVERY_RANGES ){
+      ecu->asking = r;
+      ecu->tried |= 1 << r;
+      data[0] = 0x01;
+      data[1] = r * 0x20;
+      request( ecu, data, 2, now );
+      return;
+    }
+
+    ecu->state = DISC_DIDS;
+    ecu->asking = nextDid( 0 );
+  }
+
+  if( ecu->state == DISC_DIDS ){
+    ecu->asking = nextDid( ecu->asking );
+    if( ecu->asking >= DISCOVERY_PRESETS ){
+      ecu->state = DISC_DONE;
+      return;
+    }
+    data[0] = 0x22;
+    data[1] = pgm_read_byte( &defaultPids[ecu->asking].txd[3] );
+    data[2] = pgm_read_byte( &defaultPids[ecu->asking].txd[4] );
+    request( ecu, data, 3, now );
+  }
+}
+
+
+void PidDiscovery::request( struct discoveryEcu *ecu, byte *data, byte length, unsigned long now )
+{
+  // All ISO-TP channels busy, try again next tick
+  if( !IsoTp::send( busId, ecu->reqId, data, length ) ) return;
+
+  ecu->waiting = true;
+  ecu->requests++;
+  ecu->sentAt = now;
+}
+
+
+// First range still to ask for: range 0, or one the previous range says is supported
+byte PidDiscovery::nextRange( struct discoveryEcu *ecu )
+{
+  for( byte r=0; r<DISCOVERY_RANGES; r++ ){
+    if( ecu->known & (1 << r) || ecu->tried & (1 << r) ) continue;
+    if( r == 0 ) return r;
+    if( (ecu->known & (1 << (r-1))) && (ecu->bitmaps[r-1][3] & 0x01) ) return r;
+  }
+  return DISCOVERY_RANGES;
+}
+
+
+byte PidDiscovery::nextDid( byte from )
+{
+  while( from < DISCOVERY_PRESETS && pgm_read_byte( &defaultPids[from].txd[2] ) != 0x22 )
+    from++;
+  return from;
+}
+
+
+/*
+*  Responses are handed over by ServiceCall::process() after ISO-TP
+*  reassembly. Returns true if the frame answered a discovery request.
+*/
+boolean PidDiscovery::response( byte bus, unsigned short frame_id, byte *payload, unsigned int length )
+{
+  if( !running() || bus != busId || length < 2 ) return false;
+
+  struct discoveryEcu *ecu = NULL;
+  for( byte e=0; e<DISCOVERY_MAX_ECUS; e++ )
+    if( ecus[e].waiting && ecus[e].reqId + 8 == frame_id ) ecu = &ecus[e];
+  if( ecu == NULL ) return false;
+
+  unsigned long now = millis();
+
+  // Response pending, give the ECU another timeout
+  if( payload[0] == 0x7F && length >= 3 && payload[2] == 0x78 ){
+    ecu->sentAt = now;
+    return true;
+  }
+
+  switch( payload[0] ){
+    case 0x41:
+      // 41 pid b b b b [pid b b b b ...]
+      for( unsigned int i=1; i+4 < length; i += 5 ){
+        byte r = payload[i] / 0x20;
+        if( payload[i] % 0x20 || r >= DISCOVERY_RANGES ) continue;
+        memcpy( ecu->bitmaps[r], &payload[i+1], 4 );
+        ecu->known |= 1 << r;
+      }
+    break;
+    case 0x62:
+      if( ecu->state == DISC_DIDS ) ecu->dids |= 1 << ecu->asking;
+    break;
+  }
+
+  byte latency = min( now - ecu->sentAt, 0xFFUL );
+  if( latency < ecu->latencyMin ) ecu->latencyMin = latency;
+  if( latency > ecu->latencyMax ) ecu->latencyMax = latency;
+
+  ecu->present = true;
+  ecu->waiting = false;
+  if( ecu->state == DISC_DIDS ) ecu->asking++;
+  return true;
+}
+
+
+boolean PidDiscovery::supports( struct discoveryEcu *ecu, struct pidDef *preset )
+{
+  if( preset->txd[2] == 0x01 ){
+    byte p = preset->txd[3] - 1;                    // Bit 0 of range 0 is PID 0x01
+    byte r = p / 0x20;
+    return (ecu->known & (1 << r)) && (ecu->bitmaps[r][(p % 0x20) / 8] & (0x80 >> (p % 8)));
+  }
+
+  for( byte d=0; d<DISCOVERY_PRESETS; d++ ){
+    if( memcmp_P( &preset->txd[2], &defaultPids[d].txd[2], 3 ) == 0 )
+      return ecu->dids & (1 << d);
+  }
+  return false;
+}
+
+
+void PidDiscovery::finish()
+{
+  save();
+
+  byte filled = 0;
+  if( populate ) filled = fillPidTable();
+
+  out->print( F("{\"event\":\"pidDiscovery\", \"ms\":\"") );
+  out->print( millis() - startedAt );
+  out->print( F("\", \"pidsFilled\":\"") );
+  out->print( filled );
+  out->println( F("\"}") );
+
+  busId = 0;
+  free( ecus );
+  ecus = NULL;
+}
+
+
+// Write answering ECUs to the EEPROM table, see top of file
+void PidDiscovery::save()
+{
+  int addr = DISCOVERY_EEPROM + 2;
+  byte count = 0;
+
+  for( byte e=0; e<DISCOVERY_MAX_ECUS; e++ ){
+    struct discoveryEcu *ecu = &ecus[e];
+    if( !ecu->present ) continue;
+
+    byte ranges = DISCOVERY_RANGES;
+    while( ranges > 0 && !(ecu->known & (1 << (ranges-1))) ) ranges--;
+
+    byte record[7] = { (byte)(ecu->reqId >> 8), (byte) ecu->reqId, ecu->latencyMin, ecu->latencyMax,
+                       (byte)(ecu->dids >> 8), (byte) ecu->dids, ranges };
+    EepromWriter::copy( addr, record, sizeof(record) );
+    addr += sizeof(record);
+    EepromWriter::copy( addr, ecu->bitmaps, ranges * 4 );
+    addr += ranges * 4;
+    count++;
+  }
+
+  byte header[2] = { DISCOVERY_MAGIC, count };
+  EepromWriter::copy( DISCOVERY_EEPROM, header, sizeof(header) );
+}
+
+
+// Replace the PID table with the supported presets, first ECU that answers each wins
+byte PidDiscovery::fillPidTable()
+{
+  byte filled = 0;
+  int addr = PID_TABLE_START;
+
+  for( byte p=0; p<DISCOVERY_PRESETS && addr && filled < PID_TABLE_SIZE; p++ ){
+    struct pidDef preset;
+    memcpy_P( &preset, &defaultPids[p], sizeof(struct pidDef) );
+
+    for( byte e=0; e<DISCOVERY_MAX_ECUS; e++ ){
+      if( !ecus[e].present || !supports( &ecus[e], &preset ) ) continue;
+
+      preset.busId = busId;
+      preset.txd[0] = ecus[e].reqId >> 8;
+      preset.txd[1] = ecus[e].reqId & 0xFF;
+      addr = Settings::writePid( addr, &preset );
+      if( addr ) filled++;
+      break;
+    }
+  }
+
+  Settings::endPids( addr );
+  cbt_settings.displayIndex = 0;
+  Settings::seal();
+  Settings::loadPids();
+  PidMatcher::compile();
+  PidStats::reset();
+  return filled;
+}
+
+
+// Print the table saved by the last run
+void PidDiscovery::printResults( Stream *out )
+{
+  int addr = DISCOVERY_EEPROM;
+  EepromWriter::hold();
+  if( EepromWriter::read( addr++ ) != DISCOVERY_MAGIC ){
+    EepromWriter::release();
+    out->println( F("{\"event\":\"pidDiscovery\", \"result\":\"none\"}") );
+    return;
+  }
+
+  byte count = EepromWriter::read( addr++ );
+  for( byte e=0; e<count; e++ ){
+    byte record[7];
+    for( byte i=0; i<7; i++ ) record[i] = EepromWriter::read( addr++ );
+
+    out->print( F("{\"event\":\"pidSupport\", \"ecu\":\"") );
+    out->print( (record[0] << 8) + record[1], HEX );
+    out->print( F("\", \"latencyMin\":\"") );
+    out->print( record[2] );
+    out->print( F("\", \"latencyMax\":\"") );
+    out->print( record[3] );
+    out->print( F("\", \"dids\":\"") );
+    out->print( (record[4] << 8) + record[5], HEX );
+    out->print( F("\", \"mode01\":\"") );
+    for( byte i=0; i<record[6]*4; i++ ){
+      byte b = EepromWriter::read( addr++ );
+      if( b < 0x10 ) out->print( '0' );
+      out->print( b, HEX );
+    }
+    out->println( F("\"}") );
+  }
+  EepromWriter::release();
+}
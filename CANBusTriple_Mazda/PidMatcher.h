@@ -0,0 +1,307 @@
+/*
+*  Precompiled PID response matcher
+*
+*  The PID table is compiled into a match table sorted by response ID, so a
+*  frame is checked against only the PIDs that answer on its ID. Each entry
+*  holds the response match bytes as plain offset / value pairs and replaces
+*  the soft float  base / div * mult + add  with a fixed point multiply:
+*
+*    value = ((base * coef) >> shift) + add    coef = ceil(mult * 2^shift / div)
+*
+*  shift is picked so base_max * div <= 2^shift, which makes the product equal
+*  floor(base * mult / div) for every possible base. The float version rounds
+*  along the way and can land one below that, so an entry only switches to
+*  fixed point once it gives the same answer as the float code for every base.
+*  8 bit PIDs are checked in compile(), 16 bit PIDs MATCH_VERIFY_SLICE bases
+*  per tick() and use the float code until they pass. Only two soft float
+*  scalings are added to a loop, a 16 bit PID passes after 32768 loops.
+*
+*  Passive PIDs (no request) read broadcast frames as they are, so their
+*  entries are MATCH_RAW and offsets count from frame_data[0], as they did
+*  before ISO-TP. requested() tells ServiceCall which IDs carry responses.
+*/
+
+#include "Middleware.h"
+
+#define MATCH_MAX_BYTES 3
+#define MATCH_VERIFY_SLICE 2        // 16 bit bases checked per tick, power of 2
+
+#define MATCH_16BIT 0x01
+#define MATCH_FLOAT 0x02            // Scale with the float code
+#define MATCH_VERIFYING 0x04        // 16 bit fixed point check in progress
+#define MATCH_RAW 0x08              // Passive PID, offsets into the raw frame
+
+struct pidMatch {
+  unsigned short rxId;              // Response ID, request + 8
+  byte pid;                         // Index into cbt_settings.pids
+  byte flags;
+  byte matchCount;
+  byte matchOffset[MATCH_MAX_BYTES];  // ScanGauge offsets, see byteAt()
+  byte matchValue[MATCH_MAX_BYTES];
+  byte dataOffset;
+  byte shift;
+  unsigned long coef;
+  unsigned int mult;
+  unsigned int div;
+  unsigned int add;
+};
+
+
+class PidMatcher
+{
+  private:
+    static struct pidMatch table[ Settings::pidLength ];
+    static byte count;
+    static byte verifyEntry;
+    static unsigned int verifyBase;
+    static boolean compileEntry( struct pidMatch *m, byte i );
+    static boolean verify( struct pidMatch *m, unsigned int from, unsigned int to );
+    static unsigned int scaleFloat( struct pidMatch *m, unsigned int base );
+    static unsigned int scaleFixed( struct pidMatch *m, unsigned int base );
+    static byte at( struct pidMatch *m, byte *payload, unsigned int length, int i );
+  public:
+    static void compile();
+    static void tick();
+    static struct pidMatch* lookup( unsigned short rxId );
+    static struct pidMatch* next( struct pidMatch *m );
+    static boolean requested( unsigned short rxId );
+    static boolean match( struct pidMatch *m, byte *payload, unsigned int length, unsigned int *value );
+    static byte byteAt( byte *payload, unsigned int length, int i );
+    static void benchmark( Stream *out );
+};
+
+
+struct pidMatch PidMatcher::table[ Settings::pidLength ];
+byte PidMatcher::count = 0;
+byte PidMatcher::verifyEntry = 0;
+unsigned int PidMatcher::verifyBase = 0;
+
+
+void PidMatcher::compile()
+{
+  count = 0;
+
+  for( byte i=0; i<Settings::pidCount; i++ ){
+    if( cbt_settings.pids[i].txId == 0 )
+      continue;
+
+    // Insertion sort on response ID
+    struct pidMatch m;
+    if( !compileEntry( &m, i ) )
+      continue;
+    byte e = count++;
+    while( e > 0 && table[e-1].rxId > m.rxId ){
+      table[e] = table[e-1];
+      e--;
+    }
+    table[e] = m;
+  }
+
+  verifyEntry = 0;
+  verifyBase = 0;
+}
+
+
+// Match entry from the full PID definition in EEPROM
+boolean PidMatcher::compileEntry( struct pidMatch *m, byte i )
+{
+  struct pidDef def;
+  struct pidDef *pid = &def;
+  if( !Settings::readPid( i, pid ) ) return false;
+  memset( m, 0, sizeof(struct pidMatch) );
+
+  m->pid = i;
+  m->rxId = (pid->txd[0]<<8) + pid->txd[1] + 0x08;
+  if( cbt_settings.pids[i].txLen == 0 ) m->flags |= MATCH_RAW;
+
+  // use rxf -3 as scangauge is 1 indexed and assumes 2 byes of pid data
+  for( byte r=0; r<6 && pid->rxf[r] && m->matchCount < MATCH_MAX_BYTES; r += 2 ){
+    m->matchOffset[m->matchCount] = pid->rxf[r] - 3;
+    m->matchValue[m->matchCount] = pid->rxf[r+1];
+    m->matchCount++;
+  }
+
+  // Remove two bytes of length to compensate for the fact PID is not in this array. For ScanGauge compat
+  m->dataOffset = (pid->rxd[0]/8) - 2;
+  if( pid->rxd[1] == 16 ) m->flags |= MATCH_16BIT;
+
+  unsigned int mult = m->mult = (pid->mth[0] << 8) + pid->mth[1];
+  unsigned int div  = m->div  = (pid->mth[2] << 8) + pid->mth[3];
+  m->add = (pid->mth[4] << 8) + pid->mth[5];
+  if( div == 0 ) div = 1;
+
+  unsigned long long baseMax = (m->flags & MATCH_16BIT) ? 0xFFFF : 0xFF;
+  m->shift = 16;
+  while( m->shift < 32 && (baseMax * div) > (1ULL << m->shift) )
+    m->shift++;
+
+  unsigned long long coef = (((unsigned long long) mult << m->shift) + div - 1) / div;
+  if( coef > 0xFFFFFFFFULL ){
+    m->flags |= MATCH_FLOAT;
+    return true;
+  }
+  m->coef = coef;
+
+  if( m->flags & MATCH_16BIT )
+    m->flags |= MATCH_FLOAT | MATCH_VERIFYING;
+  else if( !verify( m, 0, 0xFF ) )
+    m->flags |= MATCH_FLOAT;
+  return true;
+}
+
+
+// Check fixed point against the float code for bases from..to
+boolean PidMatcher::verify( struct pidMatch *m, unsigned int from, unsigned int to )
+{
+  for( unsigned long base=from; base<=to; base++ )
+    if( scaleFixed( m, base ) != scaleFloat( m, base ) ) return false;
+  return true;
+}
+
+
+void PidMatcher::tick()
+{
+  while( verifyEntry < count && !(table[verifyEntry].flags & MATCH_VERIFYING) )
+    verifyEntry++;
+  if( verifyEntry >= count ) return;
+
+  struct pidMatch *m = &table[verifyEntry];
+  unsigned int to = verifyBase + MATCH_VERIFY_SLICE - 1;
+
+  if( !verify( m, verifyBase, to ) ){
+    m->flags &= ~MATCH_VERIFYING;    // Stays on float
+    verifyBase = 0;
+    return;
+  }
+
+  verifyBase = to + 1;
+  if( verifyBase == 0 ){             // Wrapped, all 65536 bases agree
+    m->flags &= ~(MATCH_VERIFYING | MATCH_FLOAT);
+  }
+}
+
+
+// First entry for rxId, NULL if no PID answers on it
+struct pidMatch* PidMatcher::lookup( unsigned short rxId )
+{
+  if( count == 0 || rxId < table[0].rxId || rxId > table[count-1].rxId )
+    return NULL;
+
+  byte lo = 0, hi = count;
+  while( lo < hi ){
+    byte mid = (lo + hi) / 2;
+    if( table[mid].rxId < rxId ) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return ( lo < count && table[lo].rxId == rxId ) ? &table[lo] : NULL;
+}
+
+
+// Next entry on the same response ID, NULL at the end
+struct pidMatch* PidMatcher::next( struct pidMatch *m )
+{
+  if( m + 1 >= &table[count] || (m+1)->rxId != m->rxId ) return NULL;
+  return m + 1;
+}
+
+
+// A PID with a request answers on rxId, so its frames are ISO-TP
+boolean PidMatcher::requested( unsigned short rxId )
+{
+  for( struct pidMatch *m = lookup( rxId ); m != NULL; m = next( m ) )
+    if( !(m->flags & MATCH_RAW) ) return true;
+  return false;
+}
+
+
+boolean PidMatcher::match( struct pidMatch *m, byte *payload, unsigned int length, unsigned int *value )
+{
+  for( byte i=0; i<m->matchCount; i++ )
+    if( at( m, payload, length, m->matchOffset[i] ) != m->matchValue[i] ) return false;
+
+  unsigned int base = at( m, payload, length, m->dataOffset );
+  if( m->flags & MATCH_16BIT )
+    base = (base << 8) + at( m, payload, length, m->dataOffset+1 );
+
+  *value = (m->flags & MATCH_FLOAT) ? scaleFloat( m, base ) : scaleFixed( m, base );
+  return true;
+}
+
+
+/*
+*  PID offsets are ScanGauge style, counted in a single frame including its
+*  PCI byte. byteAt() maps them onto the payload so the same PID definitions
+*  work for multi-frame responses. Out of range reads return 0.
+*/
+byte PidMatcher::byteAt( byte *payload, unsigned int length, int i )
+{
+  if( i == 0 ) return length;
+  if( i < 0 || (unsigned int) i > length ) return 0;
+  return payload[i-1];
+}
+
+
+// Offsets of passive PIDs are plain frame_data indexes
+byte PidMatcher::at( struct pidMatch *m, byte *payload, unsigned int length, int i )
+{
+  if( !(m->flags & MATCH_RAW) ) return byteAt( payload, length, i );
+  if( i < 0 || (unsigned int) i >= length ) return 0;
+  return payload[i];
+}
+
+
+unsigned int PidMatcher::scaleFixed( struct pidMatch *m, unsigned int base )
+{
+  // 16x32 bit product in two 16x16 halves, shift is always >= 16
+  unsigned long hi = (unsigned long) base * (m->coef >> 16);
+  unsigned long lo = (unsigned long) base * (m->coef & 0xFFFF);
+  return ((hi + (lo >> 16)) >> (m->shift - 16)) + m->add;
+}
+
+
+unsigned int PidMatcher::scaleFloat( struct pidMatch *m, unsigned int base )
+{
+  unsigned int mult = m->mult;
+  unsigned int div  = m->div;
+
+  if(div == 0) div = 1;
+
+  float divResult;
+  divResult = (float)base / (float)div;
+  divResult = divResult * mult;
+  return divResult + m->add;
+}
+
+
+// Average CPU cycles per scaling, fixed point vs float, over the compiled PIDs
+void PidMatcher::benchmark( Stream *out )
+{
+  const unsigned int runs = 100;
+  volatile unsigned int sink = 0;
+  unsigned long fixedUs = 0, floatUs = 0, start;
+
+  for( byte e=0; e<count; e++ ){
+    start = micros();
+    for( unsigned int r=0; r<runs; r++ ) sink += scaleFixed( &table[e], r * 97 );
+    fixedUs += micros() - start;
+
+    start = micros();
+    for( unsigned int r=0; r<runs; r++ ) sink += scaleFloat( &table[e], r * 97 );
+    floatUs += micros() - start;
+  }
+
+  unsigned long n = (unsigned long) runs * (count ? count : 1);
+  out->print( F("{\"event\":\"scaleBench\", \"pids\":\"") );
+  out->print( count );
+  out->print( F("\", \"fixedCycles\":\"") );
+  out->print( fixedUs * (F_CPU / 1000000) / n );
+  out->print( F("\", \"floatCycles\":\"") );
+  out->print( floatUs * (F_CPU / 1000000) / n );
+  out->print( F("\", \"fixedPids\":\"") );
+  byte fixedPids = 0;
+  for( byte e=0; e<count; e++ )
+    if( !(table[e].flags & MATCH_FLOAT) ) fixedPids++;
+  out->print( fixedPids );
+  out->println( F("\"}") );
+}
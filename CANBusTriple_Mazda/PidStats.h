@@ -0,0 +1,165 @@
+/*
+*  Per PID session statistics
+*
+*  Every sample updates min, max, count and a running sum in O(1), the mean
+*  is the sum over the count worked out when it is read. The sum is 64 bits
+*  so it holds 2^48 samples of 16 bits, more than the 32 bit count reaches,
+*  and both stop when the count is full. Rate is samples per second since
+*  the last reset.
+*
+*  With PID_HISTORY defined each PID also keeps a ring of the last
+*  PID_HISTORY_SIZE block averages, one per decimation samples.
+*
+*  RAM: 16 bytes per PID, 128 for PID_TABLE_SIZE 8. PID_HISTORY adds
+*  PID_HISTORY_SIZE * 2 + 6 bytes per PID, 176 for 8 PIDs of 8 points.
+*/
+
+#include "Middleware.h"
+
+// #define PID_HISTORY
+#define PID_HISTORY_SIZE 8
+#define PID_HISTORY_DECIMATION 10   // Default samples per history point
+
+struct pidStat {
+  unsigned int min;
+  unsigned int max;
+  unsigned long count;
+  unsigned long long sum;
+};
+
+#ifdef PID_HISTORY
+struct pidHistory {
+  unsigned int points[PID_HISTORY_SIZE];
+  unsigned long blockSum;
+  byte blockCount;
+  byte head;                  // Next point written, oldest when full
+};
+#endif
+
+
+class PidStats
+{
+  public:
+    static void update( byte i, unsigned int value );
+    static void reset();
+    static unsigned int mean( byte i );
+    static unsigned int rate( byte i );
+    static void printStats( Stream *out );
+    static struct pidStat stats[ Settings::pidLength ];
+    static unsigned long resetAt;
+    #ifdef PID_HISTORY
+    static void printHistory( Stream *out, byte i );
+    static struct pidHistory history[ Settings::pidLength ];
+    static byte decimation;
+    #endif
+};
+
+
+struct pidStat PidStats::stats[ Settings::pidLength ];
+unsigned long PidStats::resetAt = 0;
+#ifdef PID_HISTORY
+struct pidHistory PidStats::history[ Settings::pidLength ];
+byte PidStats::decimation = PID_HISTORY_DECIMATION;
+#endif
+
+
+void PidStats::update( byte i, unsigned int value )
+{
+  struct pidStat *s = &stats[i];
+
+  if( value < s->min ) s->min = value;
+  if( value > s->max ) s->max = value;
+
+  if( s->count < 0xFFFFFFFFUL ){
+    s->count++;
+    s->sum += value;
+  }
+
+  #ifdef PID_HISTORY
+  struct pidHistory *h = &history[i];
+  h->blockSum += value;
+  if( ++h->blockCount >= decimation ){
+    h->points[h->head] = h->blockSum / h->blockCount;
+    h->head = (h->head + 1) % PID_HISTORY_SIZE;
+    h->blockSum = 0;
+    h->blockCount = 0;
+  }
+  #endif
+}
+
+
+void PidStats::reset()
+{
+  memset( stats, 0, sizeof(stats) );
+  for( byte i=0; i<Settings::pidLength; i++ )
+    stats[i].min = 0xFFFF;
+
+  #ifdef PID_HISTORY
+  memset( history, 0, sizeof(history) );
+  #endif
+
+  resetAt = millis();
+}
+
+
+unsigned int PidStats::mean( byte i )
+{
+  if( stats[i].count == 0 ) return 0;
+  return (stats[i].sum + stats[i].count / 2) / stats[i].count;
+}
+
+
+unsigned int PidStats::rate( byte i )
+{
+  unsigned long elapsed = millis() - resetAt;
+  if( elapsed < 1000 ) return 0;
+  return stats[i].count / (elapsed / 1000);
+}
+
+
+void PidStats::printStats( Stream *out )
+{
+  for( byte i=0; i<Settings::pidLength; i++ ){
+    if( cbt_settings.pids[i].txId == 0 ) continue;
+    char name[PID_NAME_LENGTH];
+    Settings::pidName( i, name );
+
+    struct pidStat *s = &stats[i];
+    out->print( F("{\"event\":\"pidStats\", \"pid\":\"") );
+    out->print( i );
+    out->print( F("\", \"name\":\"") );
+    out->write( (const uint8_t*) name, sizeof(name) );
+    out->print( F("\", \"count\":\"") );
+    out->print( s->count );
+    out->print( F("\", \"min\":\"") );
+    out->print( s->count ? s->min : 0 );
+    out->print( F("\", \"max\":\"") );
+    out->print( s->max );
+    out->print( F("\", \"mean\":\"") );
+    out->print( mean(i) );
+    out->print( F("\", \"rate\":\"") );
+    out->print( rate(i) );
+    out->println( F("\"}") );
+  }
+}
+
+
+#ifdef PID_HISTORY
+// Oldest point first
+void PidStats::printHistory( Stream *out, byte i )
+{
+  if( i >= Settings::pidLength ) return;
+  struct pidHistory *h = &history[i];
+
+  out->print( F("{\"event\":\"pidHistory\", \"pid\":\"") );
+  out->print( i );
+  out->print( F("\", \"decimation\":\"") );
+  out->print( decimation );
+  out->print( F("\", \"points\":\"") );
+  for( byte p=0; p<PID_HISTORY_SIZE; p++ ){
+    out->print( h->points[(h->head + p) % PID_HISTORY_SIZE] );
+    if( p < PID_HISTORY_SIZE-1 ) out->print( ',' );
+  }
+  out->println( F("\"}") );
+}
+#endif
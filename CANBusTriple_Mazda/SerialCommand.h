@@ -8,10 +8,15 @@ System Info and EEPROM
 0x01 0x02        Dump eeprom value
 0x01 0x03        read and save eeprom
 0x01 0x04        restore eeprom to stock values
+0x01 0x05        Print settings version, CRC, background EEPROM writer and journal counters
 0x01 0x10 0x01   Print Bus 1 Debug to Serial
 0x01 0x10 0x02   Print Bus 1 Debug to Serial
 0x01 0x10 0x03   Print Bus 1 Debug to Serial
 0x01 0x16        Reboot to bootloader
+0x01 0x20 Bus Rate(4 bytes, bps)   Set and save the bitrate of a bus, 0 prints it. Any rate the 16MHz MCP2515 can make within 0.5%,
+                                   e.g. 0x00008235 33.3k single wire GMLAN, 0x00014585 83.3k, 0x000C3500 800k
+0x01 0x21 Bus mask                 Detect and save the bitrate in listen only mode, bit 0 = Bus 1, 0x07 = all.
+                                   Reports {"event":"autobaud"} per bus within 1.3s, 0x80 if 51 bytes of RAM are not free
 
 
 Send CAN Packet
@@ -20,11 +25,111 @@ Cmd    Bus id  PID    data 0-7                  length
 0x02   01      290    00 00 00 00 00 00 00 00   8
 
 
+Bulk send CAN Packets, replies with one ACK
+-------------------------------------------
+Cmd    Count  Frames (Count times)                         Checksum
+0x07   K      Bus id  PID    length  data 0-(length-1)     8 bit sum of Count and all frame bytes
+              01      290    03      00 00 00
+ACK    0x07 Sent Cached 0xFF 0x0D    // All K frames taken, Sent + Cached = K
+       0x07 0x00 0x00   0x80 0x0D    // Malformed, timed out, bad checksum or no free RAM, nothing queued
+Sent frames were queued for the bus. Cached ones are diagnostic requests answered from the
+response cache or already in flight, see 0x0A 0x10, and are not sent again.
+At most BULK_MAX_FRAMES frames per command. The next command can follow as soon as the ACK arrives.
+The frames are read as they arrive, a slow link doesn't stall the loop, BULK_TIMEOUT ms without
+a byte ends the command with an error.
+
+
 Set logging output (Filters are optional)
 --------------------------------------------------
 Cmd  Bus  On/Off Message ID 1   Message ID 2
 0x03 0x01 0x01   0x290          0x291   // Set logging on Bus 1 to ON
 0x03 0x01 0x00                          // Set logging on Bus 1 to OFF
+Log record  0x03 Bus IdH IdL data 0-7 length status 0x0D
+
+
+Extended 29 bit frames
+----------------------
+Cmd  Bus  ID (4 bytes)   data 0-7                  length
+0x0B 0x01 0x18DAF110     02 01 0C 00 00 00 00 00   8          // Send an extended frame
+Cmd  Bus  On/Off ID 1 (4 bytes)  ID 2 (4 bytes)
+0x0C 0x01 0x01   0x18FEF100      0x18FEF200        // Log on Bus 1, filters for extended IDs only
+Extended frames are logged as  0x0C Bus Id3 Id2 Id1 Id0 data 0-7 length status 0x0D
+
+
+Bus health
+----------
+Cmd  Sub
+0x0E 0x01        Print TEC / REC, max TEC / REC, RX0 / RX1 overflows, warning / error passive / bus off counts and recoveries per bus
+0x0E 0x02        Print the last bus state changes, state 0 = active, 1 = warning, 2 = error passive, 3 = bus off
+0x0E 0x03        Reset the counts and history
+A bus that goes TX error passive or bus off has its pending frames aborted and
+frames for it dropped for 100ms, doubling on every relapse up to 6.4s.
+
+
+Bus load and ID rates
+---------------------
+Cmd  Sub
+0x0F 0x01        Load per bus in per mille of the bitrate, binary:
+                 0x0F 0x01 then for Bus 1..3  Load(100ms) Peak(100ms) Load(1s), 2 bytes each, then 0x0D
+0x0F 0x02        Frames per second per bus / ID seen, up to 168 IDs, binary:
+                 0x0F 0x02 Count, then Count times  Bus Id3 Id2 Id1 Id0 Rate, then 0x0D.
+                 Bus | 0x80 = extended ID. Count 0 while ID rates are off
+0x0F 0x03        Reset load peaks and ID rates
+0x0F 0x04 On/Off  Count frames per ID, off by default. Takes up to 1152 bytes of RAM while on, fewer IDs are
+                  tracked when that much is not free, 0x80 if not even 144 bytes are
+Frame length is estimated from the DLC and ID type with half the worst case stuff bits.
+
+
+Cycle time model
+----------------
+Cmd  Sub
+0x10 0x01 On/Off  Learn periods and report anomalies, off by default. Turning it on starts learning again,
+                  0x80 if there is not enough free RAM for it
+0x10 0x02         Print the learned period and jitter per ID
+0x10 0x03         Print late / early / missing counts and CPU cycles spent per received frame. 16 IDs are
+                  tracked, untracked counts frames of IDs without a slot, evicted IDs silent 2s that gave theirs up
+0x10 0x04         Forget all periods and reset the counts
+Anomalies are logged as  0x10 Bus Id3 Id2 Id1 Id0 Kind Interval(2 bytes) Period(2 bytes) 0x0D
+Bus | 0x80 = extended ID, Kind 0x01 late, 0x02 early (second sender?), 0x03 missing, times in 0.1ms
+
+
+Capture
+-------
+Cmd  Sub  Kind Bus  ID (4 bytes)  Mask 0-7                  Value 0-7                 Pre  Post
+0x11 0x01 0x01 0x02 0x0000028F    FF 00 00 00 00 00 00 00   12 00 00 00 00 00 00 00   0x03 0x04   // Arm, trigger on 0x28F byte 0 = 0x12 on Bus 2
+0x11 0x01 0x02 ...                                                                    0x07 0x00   // Arm, trigger on the next overflow, error passive or bus off
+0x11 0x02        Trigger now
+0x11 0x03        Download, binary:  0x11 Count, then Count times  Bus Id3 Id2 Id1 Id0 Time3-0 length data 0-7, then 0x0D
+                 Time in us relative to the trigger frame, signed. Count 0 until the capture is complete,
+                 a complete capture is dropped once downloaded
+0x11 0x04        Stop
+Bus 0x00 = any bus, Bus | 0x80 = extended ID. Mask bytes 0x00 are not compared. Pre + 1 + Post <= 255 frames,
+arming takes 23 bytes of RAM per frame until the download or stop, 0x80 if they are not free.
+Prints a capture event when the post trigger frames are in.
+
+
+ID census
+---------
+Cmd  Sub
+0x12 0x01 Bus    Start a census of every ID seen on Bus, 0x00 stops it and drops the results. Takes up to 1696 bytes
+                 of RAM for 48 ID entries, fewer entries when that much is not free, 0x80 if not even 496 bytes are
+0x12 0x02        Export, binary:  0x12 Bus Count Slots Overflow(2 bytes), standard ID seen bitmap (256 bytes, bit id % 8 of byte id / 8),
+                 then Count times  Id3 Id2 Id1 Id0 Frames(2) FirstSeen(4) LastSeen(4) data 0-7 changedBits 0-7, then 0x0D
+                 Id3 | 0x80 = extended ID, times in ms since the start. Slots is how many ID entries the census got,
+                 Overflow counts frames of IDs that found none
+
+
+Signals
+-------
+Cmd  Sub  Index Bus  ID (4 bytes)  Start  Length  Mult    Div     Offset  Deadband  Heartbeat(ms)
+0x13 0x02 0x00  0x01 0x00000201    0x00   0x10    0x0001  0x0004  0x0000  0x0019    0x03E8        // RPM, 16 bit Intel at bit 0, / 4, report 25 rpm moves or every 1s
+0x13 0x01 On/Off   Stream signal updates  0x13 Index Value3-0 0x0D  (value signed, high byte first), 0x80 if 91 bytes of RAM are not free
+0x13 0x03          Delete all definitions
+0x13 0x04          Print definitions, last values and bytes sent vs logging every frame of their IDs
+0x13 0x05          Reset the byte counts
+0x13 0x06 On/Off   Also feed frames played by trace replay (0x09) in, to measure the saving on a recorded trace
+Bus | 0x80 = extended ID. Length is 1-32 bits | 0x80 Motorola (start is the MSB, DBC numbering) | 0x40 signed.
+value = raw * Mult / Div + Offset, Mult and Offset signed. Up to 7 definitions, saved to EEPROM.
 
 
 Set Bluetooth Message ID filter
@@ -34,6 +139,72 @@ Cmd  Bus  Message ID 1 Message ID 2
 0x04 0x01 0x0000       0x0000         // Disable
 
 
+Bluetooth output shaper
+-----------------------
+Cmd  Sub  Bus  Message ID  Interval(ms)  Decimation  Priority
+0x05 0x01 0x01 0x290       0x0064        0x01        0x01      // Send 0x290 at most every 100ms
+0x05 0x01 0x01 0x28F       0x0000        0x04        0x02      // Send every 4th 0x28F, low priority
+0x05 0x02                                                      // Print sent / coalesced / dropped / refused counts
+0x05 0x03                                                      // Reset counts
+Priority 0x00 = high, 0x01 = normal, 0x02 = low
+8 slots, an idle ID without a policy gives its slot up to a new ID. Frames skipped by decimation are not dropped.
+Refused counts sensor packets and signal updates held back because the bucket or the UART TX buffer was full.
+
+
+Cyclic transmit
+---------------
+Cmd  Sub  Slot Bus  Message ID  data 0-7                  length  Period(ms)  Counter  Checksum
+0x06 0x01 0x00 0x01 0x290       00 00 00 00 00 00 00 00   8       0x0064      0x07     0xFF   // Send every 100ms, byte 7 counts up
+0x06 0x02 0x00                                                                                // Stop job in slot 0
+0x06 0x03                                                                                     // Stop all jobs
+0x06 0x04                                                                                     // Print per job lateness into a TX buffer and jitter in us
+0x06 0x05                                                                                     // Reset jitter statistics
+Counter / Checksum are payload byte indexes, 0xFF = not used. Checksum is the 8 bit sum of the other payload bytes.
+0x80 if the job is not valid or the job table, 296 bytes, does not fit in the free RAM. Stopping the last job frees it.
+
+
+Trace replay
+------------
+Cmd  Sub
+0x09 0x01 Bus  Lead(ms)            // Arm replay. Bus 0x00 = use each frame's bus id. Playback starts when
+                                   // the buffer is full or Lead ms after arming
+0x09 0x02 N    Frames (N times)    // Stream frames into the jitter buffer
+               Offset(us, 4 bytes)  Bus id  PID  length  data 0-(length-1)
+               00 00 27 10          01      290  03      00 00 00
+0x09 0x03                          // End of trace, play out what is buffered
+0x09 0x04                          // Abort
+0x09 0x05                          // Print played / underruns / overflows and lateness histogram
+                                   // Histogram buckets: <50 <100 <250 <500 <1000 <2500 <5000 >=5000 us
+Reply to 0x01-0x04: 0x09 Credits 0x0D    Free buffer slots, never send more frames than this
+0 credits right after 0x01: the buffer, 192 bytes, does not fit in the free RAM.
+Frames of a 0x02 batch are read as they arrive, the reply follows the last one. N = 0 just asks for credits.
+A frame with a bus id outside 1-3 or a length over 8 drops the rest of the batch.
+
+
+Diagnostics (ServiceCall)
+-------------------------
+Cmd  Sub
+0x0A 0x01        Print achieved samples/second and poll interval per PID, and request timeouts
+0x0A 0x02        Benchmark PID scaling, CPU cycles per response fixed point vs float
+0x0A 0x10        Print response cache hits / misses / coalesced requests, hit rate and ECU requests saved
+0x0A 0x11 TTL    Set response cache TTL in ms, 2 bytes. 0x0000 disables serving from the cache
+0x0A 0x12        Flush the response cache and reset its counts
+                 A cached answer to a 0x02 / 0x07 request is printed at once as a 0x03 log record. A request
+                 identical to one in flight gets no reply of its own, the one response is logged as usual
+0x0A 0x20 Bus Fill  Discover supported mode 0x01 PIDs and Mazda mode 0x22 DIDs on Bus.
+                    Fill 0x01 = replace the PID table with the first 8 supported presets and save it.
+                    Prints a pidDiscovery event when done, 0x80 if its 164 bytes of RAM are not free
+0x0A 0x21        Print the ECUs and supported PIDs found by the last discovery
+0x0A 0x30        Print per PID session count / min / max / mean / samples per second
+0x0A 0x31        Reset PID session statistics
+0x0A 0x32 PID    Print the decimated history of PID (PID_HISTORY builds only)
+0x0A 0x33 N      Average N samples per history point (PID_HISTORY builds only)
+
+Single frame mode 0x01 and 0x22 requests sent with 0x02 or 0x07 are answered from
+the response cache when a fresh response is held, with a synthesized 0x03 log frame.
+A request identical to one still awaiting its response is not sent again.
+
+
 Bluetooth Functions
 -------------------
 Cmd  Function
@@ -49,6 +220,8 @@ TODO: Implenent this ^^^
 #define COMMAND_OK 0xFF
 #define COMMAND_ERROR 0x80
 #define NEWLINE "\r"
+#define BULK_MAX_FRAMES 16
+#define BULK_TIMEOUT 50
 
 #include "Middleware.h"
 
@@ -57,7 +230,7 @@ class SerialCommand : Middleware
 {
   public:
     // static unsigned int logOutputFilter;
-    static CANBus busses[];
+    static CANBus *busses;
     static Stream* activeSerial;
     static void init( QueueArray<Message> *q, CANBus b[] );
     static void tick();
@@ -68,20 +241,55 @@ class SerialCommand : Middleware
     static int freeRam();
     static QueueArray<Message>* mainQueue;
     static void printChannelDebug();
-    static void printChannelDebug(CANBus);
+    static void printChannelDebug(CANBus &);
     static void processCommand(int command);
     static int  getCommandBody( byte* cmd, int length );
+    static int  getCommandBody( byte* cmd, int length, unsigned int timeout );
     static void clearBuffer();
     static void getAndSend();
+    static void getAndSendExt();
+    static boolean cacheOrCoalesce( Message *msg );
+    static void bulkSend();
+    static void bulkFrames();
+    static void bulkEnd( boolean valid );
+    static void bulkAck( byte sent, byte cached, byte status );
+    static void replayCommand();
+    static void replayFrames();
+    static void replayCredits();
+    static void diagnosticsCommand();
     static void printSystemDebug();
     static void settingsCall();
     static void dumpEeprom();
+    static void printEepromStatus();
+    static void bitrateCommand();
     static void getAndSaveEeprom();
     static void logCommand();
+    static void logExtCommand();
     static void bluetooth();
     static void setBluetoothFilter();
-    static char btMessageIdFilters[][2];
+    static void btShaperCommand();
+    static void cyclicCommand();
+    static void healthCommand();
+    static void statsCommand();
+    static void cycleCommand();
+    static void captureCommand();
+    static void censusCommand();
+    static void signalsCommand();
+    static unsigned short btMessageIdFilters[][2];
     static boolean passthroughMode;
+    static Stream* replaySerial;
+    static byte replayLeft;
+    static byte replayPos;
+    static byte replayIn[16];
+    static unsigned long replayLastByte;
+    static Stream* bulkSerial;
+    static byte bulkCount;
+    static byte bulkLeft;
+    static byte bulkPos;
+    static byte bulkLen;
+    static byte bulkSum;
+    static byte *bulkIn;
+    static unsigned long bulkLastByte;
     static byte busLogEnabled;
     static Message newMessage;
     static byte buffer[];
@@ -92,11 +300,30 @@ class SerialCommand : Middleware
 
 // Defaults
 QueueArray<Message> *SerialCommand::mainQueue;
+CANBus *SerialCommand::busses;
 byte SerialCommand::busLogEnabled = 0;               // Start with all busses logging disabled
 boolean SerialCommand::passthroughMode = false;
 Stream* SerialCommand::activeSerial = &Serial;
 
-char SerialCommand::btMessageIdFilters[][2] = {
+// Trace replay frame batch coming in, see replayFrames()
+Stream* SerialCommand::replaySerial = NULL;
+byte SerialCommand::replayLeft = 0;
+byte SerialCommand::replayPos = 0;
+byte SerialCommand::replayIn[16];
+unsigned long SerialCommand::replayLastByte = 0;
+
+// Bulk send coming in, see bulkFrames()
+Stream* SerialCommand::bulkSerial = NULL;
+byte SerialCommand::bulkCount = 0;
+byte SerialCommand::bulkLeft = 0;
+byte SerialCommand::bulkPos = 0;
+byte SerialCommand::bulkLen = 0;
+byte SerialCommand::bulkSum = 0;
+byte *SerialCommand::bulkIn = NULL;
+unsigned long SerialCommand::bulkLastByte = 0;
+
+unsigned short SerialCommand::btMessageIdFilters[][2] = {
+                    {0x0,0x0},     // Unused, indexed by bus id
                     {0x28F,0x290},
                     {0x0,0x0},
                     {0x28F,0x290},
@@ -108,8 +335,7 @@ void SerialCommand::init( QueueArray<Message> *q, CANBus b[] )
   Serial.begin( 115200 );
   Serial1.begin( 57600 );
   
-  // TODO use passed in busses!
-  // busses = { b[0], b[1], b[2] };
+  busses = b;
   
   mainQueue = q;
 }
@@ -124,12 +350,18 @@ void SerialCommand::tick()
     return;
   }
   
-  if( Serial1.available() > 0 ){
+  // Bytes on that port belong to the frame batch until it is all in
+  if( replaySerial != NULL )
+    replayFrames();
+  if( bulkSerial != NULL )
+    bulkFrames();
+  
+  if( Serial1.available() > 0 && replaySerial != &Serial1 && bulkSerial != &Serial1 ){
     activeSerial = &Serial1;
     processCommand( Serial1.read() );
   }
   
-  if( Serial.available() > 0 ){
+  if( Serial.available() > 0 && replaySerial != &Serial && bulkSerial != &Serial ){
     activeSerial = &Serial;
     processCommand( Serial.read() );
   }
@@ -177,15 +409,23 @@ void SerialCommand::printMessageToSerial( Message msg )
     
   #else
     
-    // Bluetooth filter
-    // TODO TEST
-    if( activeSerial == &Serial1 &&
-        btMessageIdFilters[msg.busId][0] != msg.frame_id &&
-        btMessageIdFilters[msg.busId][1] != msg.frame_id
-        ) return;
+    // Bluetooth filter, matching frames are paced by the shaper
+    if( activeSerial == &Serial1 ){
+      if( !msg.extended && ( btMessageIdFilters[msg.busId][0] == msg.frame_id ||
+                             btMessageIdFilters[msg.busId][1] == msg.frame_id ) )
+        BluetoothShaper::offer( msg );
+      return;
+    }
     
-    activeSerial->write( 0x03 ); // Prefix with logging command
-    activeSerial->write( msg.busId );
+    if( msg.extended ){
+      activeSerial->write( 0x0C ); // Extended record, 4 byte ID
+      activeSerial->write( msg.busId );
+      activeSerial->write( msg.frame_id >> 24 );
+      activeSerial->write( msg.frame_id >> 16 );
+    }else{
+      activeSerial->write( 0x03 ); // Prefix with logging command
+      activeSerial->write( msg.busId );
+    }
     activeSerial->write( msg.frame_id >> 8 );
     activeSerial->write( msg.frame_id );
     
@@ -206,6 +446,16 @@ void SerialCommand::printMessageToSerial( Message msg )
 void SerialCommand::processCommand(int command)
 {
   
+  // Length prefixed commands read their own body, no need to wait for it to settle
+  switch( command ){
+    case 0x07:
+      bulkSend();
+      return;
+    case 0x09:
+      replayCommand();
+      return;
+  }
+  
   delay(20);
   
   switch( command ){
@@ -221,9 +471,42 @@ void SerialCommand::processCommand(int command)
     case 0x04:
       setBluetoothFilter();
     break;
+    case 0x05:
+      btShaperCommand();
+    break;
+    case 0x06:
+      cyclicCommand();
+    break;
     case 0x08:
       bluetooth();
     break;
+    case 0x0A:
+      diagnosticsCommand();
+    break;
+    case 0x0B:
+      getAndSendExt();
+    break;
+    case 0x0C:
+      logExtCommand();
+    break;
+    case 0x0E:
+      healthCommand();
+    break;
+    case 0x0F:
+      statsCommand();
+    break;
+    case 0x10:
+      cycleCommand();
+    break;
+    case 0x11:
+      captureCommand();
+    break;
+    case 0x12:
+      censusCommand();
+    break;
+    case 0x13:
+      signalsCommand();
+    break;
   }
   
   SerialCommand::clearBuffer();
@@ -233,8 +516,8 @@ void SerialCommand::processCommand(int command)
 void SerialCommand::settingsCall()
 {
   
-  byte cmd[1];
-  int bytesRead = getCommandBody( cmd, 1 );
+  byte cmd[1] = {0};
+  getCommandBody( cmd, 1 );
   
   // Debug Command
   switch( cmd[0] ){
@@ -249,7 +532,12 @@ void SerialCommand::settingsCall()
       getAndSaveEeprom();
     break;
     case 0x04:
-      Settings::firstbootSetup();
+      Settings::firstbootSetup( activeSerial );
+      PidMatcher::compile();
+      PidStats::reset();
+    break;
+    case 0x05:
+      printEepromStatus();
     break;
     case 0x10:
         printChannelDebug();
@@ -257,6 +545,13 @@ void SerialCommand::settingsCall()
     case 0x16:
       resetToBootloader();
     break;
+    case 0x20:
+      bitrateCommand();
+    break;
+    case 0x21:
+      getCommandBody( cmd, 1 );
+      if( !AutoBaud::start( cmd[0] & 0x07, activeSerial ) ) activeSerial->write(COMMAND_ERROR);
+    break;
   }
   
   
@@ -269,7 +564,7 @@ void SerialCommand::setBluetoothFilter(){
   byte cmd[5];
   int bytesRead = getCommandBody( cmd, 5 );
   
-  if( cmd[0] >= 0 && cmd[0] <= 3 ){
+  if( bytesRead == 5 && cmd[0] <= 3 ){
     SerialCommand::btMessageIdFilters[cmd[0]][0] = (cmd[1] << 8)+cmd[2];
     SerialCommand::btMessageIdFilters[cmd[0]][1] = (cmd[3] << 8)+cmd[4];
   }
@@ -278,6 +573,250 @@ void SerialCommand::setBluetoothFilter(){
 
 
 
+void SerialCommand::btShaperCommand()
+{
+  byte cmd[8] = {0};
+  int bytesRead = getCommandBody( cmd, 8 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      if( bytesRead < 8 || cmd[1] < 1 || cmd[1] > 3 ||
+          !BluetoothShaper::setPolicy( cmd[1], (cmd[2]<<8) + cmd[3], (cmd[4]<<8) + cmd[5], cmd[6], cmd[7] ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    case 0x02:
+      BluetoothShaper::printStats( activeSerial );
+      return;
+    case 0x03:
+      BluetoothShaper::resetStats();
+    break;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
+void SerialCommand::cyclicCommand()
+{
+  byte cmd[18] = {0};
+  int bytesRead = getCommandBody( cmd, 18 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      if( bytesRead < 18 ||
+          !CyclicTransmit::setJob( cmd[1], cmd[2], (cmd[3]<<8) + cmd[4], cmd[13], &cmd[5], (cmd[14]<<8) + cmd[15], cmd[16], cmd[17] ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    case 0x02:
+      CyclicTransmit::clearJob( cmd[1] );
+    break;
+    case 0x03:
+      CyclicTransmit::clearAll();
+    break;
+    case 0x04:
+      CyclicTransmit::printStats( activeSerial );
+      return;
+    case 0x05:
+      CyclicTransmit::resetStats();
+    break;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
+void SerialCommand::healthCommand()
+{
+  byte cmd[1] = {0};
+  getCommandBody( cmd, 1 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      BusHealth::printStats( activeSerial );
+      return;
+    case 0x02:
+      BusHealth::printHistory( activeSerial );
+      return;
+    case 0x03:
+      BusHealth::reset();
+    break;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
+void SerialCommand::statsCommand()
+{
+  byte cmd[2] = {0};
+  getCommandBody( cmd, 2 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      BusStats::dumpLoad( activeSerial );
+      return;
+    case 0x02:
+      BusStats::dumpIds( activeSerial );
+      return;
+    case 0x03:
+      BusStats::reset();
+    break;
+    case 0x04:
+      if( !BusStats::setIdRates( cmd[1] ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    default:
+      activeSerial->write(COMMAND_ERROR);
+      return;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
+void SerialCommand::cycleCommand()
+{
+  byte cmd[2] = {0};
+  getCommandBody( cmd, 2 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      if( !CycleModel::setEnabled( cmd[1], activeSerial ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    case 0x02:
+      CycleModel::printModel( activeSerial );
+      return;
+    case 0x03:
+      CycleModel::printStats( activeSerial );
+      return;
+    case 0x04:
+      CycleModel::reset();
+    break;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
+void SerialCommand::captureCommand()
+{
+  byte cmd[25] = {0};
+  int bytesRead = getCommandBody( cmd, 25 );
+  struct captureTrigger t;
+  
+  switch( cmd[0] ){
+    case 0x01:
+      t.kind = cmd[1];
+      t.busId = cmd[2] & 0x7F;
+      t.extended = cmd[2] & 0x80;
+      t.frame_id = ((unsigned long) cmd[3] << 24) + ((unsigned long) cmd[4] << 16) + ((unsigned int) cmd[5] << 8) + cmd[6];
+      memcpy( t.mask, &cmd[7], 8 );
+      memcpy( t.value, &cmd[15], 8 );
+      if( bytesRead < 25 || !Capture::arm( &t, cmd[23], cmd[24], activeSerial ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    case 0x02:
+      Capture::force();
+    break;
+    case 0x03:
+      Capture::download( activeSerial );
+      return;
+    case 0x04:
+      Capture::stop();
+    break;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
+void SerialCommand::censusCommand()
+{
+  byte cmd[2] = {0};
+  getCommandBody( cmd, 2 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      if( cmd[1] > 3 || !Census::start( cmd[1] ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    case 0x02:
+      Census::dump( activeSerial );
+      return;
+    default:
+      activeSerial->write(COMMAND_ERROR);
+      return;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
+void SerialCommand::signalsCommand()
+{
+  byte cmd[19] = {0};
+  int bytesRead = getCommandBody( cmd, 19 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      if( !Signals::setEnabled( cmd[1], activeSerial ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    case 0x02:
+      if( bytesRead < 19 || !Signals::define( cmd[1], &cmd[2] ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+    break;
+    case 0x03:
+      Signals::clear();
+    break;
+    case 0x04:
+      Signals::printStats( activeSerial );
+      return;
+    case 0x05:
+      Signals::resetStats();
+    break;
+    case 0x06:
+      Signals::tapReplay = cmd[1];
+    break;
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+}
+
+
+
 void SerialCommand::logCommand()
 {
   byte cmd[6] = {0};
@@ -287,7 +826,7 @@ void SerialCommand::logCommand()
     activeSerial->write(COMMAND_ERROR);
     return;
   }
-  CANBus bus = busses[ cmd[0]-1 ];
+  CANBus &bus = busses[ cmd[0]-1 ];
   
   if( cmd[1] )
     SerialCommand::busLogEnabled |= cmd[1] << (cmd[0]-1);
@@ -311,25 +850,61 @@ void SerialCommand::logCommand()
 }
 
 
+void SerialCommand::logExtCommand()
+{
+  byte cmd[10] = {0};
+  int bytesRead = getCommandBody( cmd, 10 );
+  
+  if( cmd[0] < 1 || cmd[0] > 3 ){
+    activeSerial->write(COMMAND_ERROR);
+    return;
+  }
+  CANBus &bus = busses[ cmd[0]-1 ];
+  
+  if( cmd[1] )
+    SerialCommand::busLogEnabled |= cmd[1] << (cmd[0]-1);
+    else
+    SerialCommand::busLogEnabled &= cmd[1] << (cmd[0]-1);
+  
+  if( bytesRead > 2 ){
+    
+    unsigned long id1 = ((unsigned long) cmd[2] << 24) + ((unsigned long) cmd[3] << 16) + ((unsigned int) cmd[4] << 8) + cmd[5];
+    unsigned long id2 = ((unsigned long) cmd[6] << 24) + ((unsigned long) cmd[7] << 16) + ((unsigned int) cmd[8] << 8) + cmd[9];
+    bus.setMode(CONFIGURATION);
+    bus.clearFilters();
+    if( id1 | id2 )
+      bus.setFilterExt( id1, id2 );
+    bus.setMode(NORMAL);
+    
+  }
+  
+  activeSerial->write(COMMAND_OK);
+  activeSerial->write(NEWLINE);
+  
+}
+
+
 void SerialCommand::getAndSaveEeprom()
 {
   
   #define CHUNK_SIZE 32
   
-  byte* settings = (byte *) &cbt_settings;
-  byte cmd[CHUNK_SIZE+1];
+  byte cmd[CHUNK_SIZE+2];
   int bytesRead = getCommandBody( cmd, CHUNK_SIZE+2 );
   
-  if( bytesRead == CHUNK_SIZE+2 && cmd[CHUNK_SIZE+1] == 0xA1 ){
-      
-    memcpy( settings+(cmd[0]*CHUNK_SIZE), &cmd[1], CHUNK_SIZE );
+  if( bytesRead == CHUNK_SIZE+2 && cmd[CHUNK_SIZE+1] == 0xA1 && cmd[0] < SETTINGS_SIZE/CHUNK_SIZE ){
+    
+    // Queued, the PID records are only held in EEPROM and read back through the queue
+    EepromWriter::copy( cmd[0]*CHUNK_SIZE, &cmd[1], CHUNK_SIZE );
     
     activeSerial->print( F("{\"event\":\"eepromData\", \"result\":\"success\", \"chunk\":\"") );
     activeSerial->print(cmd[0]);
     activeSerial->println(F("\"}"));
     
-    if( cmd[0]+1 == 512/CHUNK_SIZE ){ // At last chunk
-      Settings::save(&cbt_settings);
+    if( cmd[0]+1 == SETTINGS_SIZE/CHUNK_SIZE ){ // At last chunk
+      Settings::load( true, activeSerial );           // Migrates older images and stamps a new CRC
+      PidMatcher::compile();
+      PidStats::reset();
       activeSerial->println(F("{\"event\":\"eepromSave\", \"result\":\"success\"}"));
     }
     
@@ -343,11 +918,32 @@ void SerialCommand::getAndSaveEeprom()
 }
 
 
+void SerialCommand::getAndSendExt()
+{
+  
+  byte cmd[14];
+  int bytesRead = getCommandBody( cmd, 14 );
+  if( bytesRead < 14 || cmd[0] < 1 || cmd[0] > 3 ) return;
+  
+  Message msg;
+  msg.busId = cmd[0];
+  msg.frame_id = ((unsigned long) (cmd[1] & 0x1F) << 24) + ((unsigned long) cmd[2] << 16) + ((unsigned int) cmd[3] << 8) + cmd[4];
+  msg.extended = true;
+  memcpy( msg.frame_data, &cmd[5], 8 );
+  msg.length = min( cmd[13], (byte) 8 );
+  msg.dispatch = true;
+  
+  mainQueue->push( msg );
+  
+}
+
+
 void SerialCommand::getAndSend()
 {
   
   byte cmd[12];
   int bytesRead = getCommandBody( cmd, 12 );
+  if( bytesRead < 12 ) return;
   
   Message msg;
   msg.busId = cmd[0];
@@ -363,16 +959,311 @@ void SerialCommand::getAndSend()
   msg.length = cmd[11];
   msg.dispatch = true;
   
-  mainQueue->push( msg );
+  if( !cacheOrCoalesce( &msg ) )
+    mainQueue->push( msg );
   
 }
 
 
+// Answer or drop a diagnostic request the cache can serve, true if it should not be sent.
+// A coalesced request is not answered here, the host gets the in flight response when it is logged
+boolean SerialCommand::cacheOrCoalesce( Message *msg )
+{
+  Message reply;
+  
+  switch( DiagCache::request( msg, &reply ) ){
+    case DIAG_HIT:
+      printMessageToSerial( reply );
+      return true;
+    case DIAG_COALESCED:
+      return true;
+  }
+  return false;
+}
+
+
+
+/*
+*  Validate every frame before queueing any of them, so the host either gets
+*  all K frames on the bus or none and a single ACK telling it which. The
+*  body is taken from tick() as it arrives, like a replay batch, into a
+*  buffer from the heap that is only held until the ACK.
+*/
+void SerialCommand::bulkSend()
+{
+  // One bulk command at a time, and only with the RAM for it
+  if( bulkSerial == NULL ) bulkIn = (byte *) malloc( BULK_MAX_FRAMES * 12 );
+  if( bulkSerial != NULL || bulkIn == NULL ){
+    clearBuffer();
+    bulkAck( 0, 0, COMMAND_ERROR );
+    return;
+  }
+  
+  bulkSerial = activeSerial;
+  bulkCount = bulkLeft = bulkPos = bulkLen = bulkSum = 0;
+  bulkLastByte = millis();
+  bulkFrames();
+}
+
+
+/*
+*  Count, then each frame as its 4 byte header and data, then the checksum.
+*  Frames are collected in bulkIn one after the other.
+*/
+void SerialCommand::bulkFrames()
+{
+  activeSerial = bulkSerial;
+  
+  while( activeSerial->available() ){
+    byte b = activeSerial->read();
+    bulkLastByte = millis();
+    
+    if( bulkCount == 0 ){
+      if( b == 0 || b > BULK_MAX_FRAMES ){
+        bulkEnd( false );
+        return;
+      }
+      bulkCount = bulkLeft = bulkSum = b;
+      continue;
+    }
+    
+    if( bulkLeft == 0 ){
+      bulkEnd( b == bulkSum );
+      return;
+    }
+    
+    byte *frame = &bulkIn[bulkLen];
+    frame[bulkPos++] = b;
+    bulkSum += b;
+    if( bulkPos == 4 && (frame[0] < 1 || frame[0] > 3 || frame[3] > 8) ){
+      bulkEnd( false );
+      return;
+    }
+    if( bulkPos >= 4 && bulkPos == 4 + frame[3] ){
+      bulkLen += bulkPos;
+      bulkPos = 0;
+      bulkLeft--;
+    }
+  }
+  
+  if( millis() - bulkLastByte >= BULK_TIMEOUT ) bulkEnd( false );
+}
+
+
+void SerialCommand::bulkEnd( boolean valid )
+{
+  byte sent = 0, cached = 0;
+  bulkSerial = NULL;
+  
+  for( int i=0; valid && i<bulkLen; i += 4 + bulkIn[i+3] ){
+    Message msg;
+    msg.busId = bulkIn[i];
+    msg.frame_id = (bulkIn[i+1]<<8) + bulkIn[i+2];
+    msg.length = bulkIn[i+3];
+    memset( msg.frame_data, 0, 8 );
+    memcpy( msg.frame_data, &bulkIn[i+4], msg.length );
+    msg.dispatch = true;
+    if( cacheOrCoalesce( &msg ) ){
+      cached++;
+    }else{
+      mainQueue->push( msg );
+      sent++;
+    }
+  }
+  
+  free( bulkIn );
+  bulkIn = NULL;
+  
+  if( !valid ){
+    clearBuffer();
+    bulkAck( 0, 0, COMMAND_ERROR );
+    return;
+  }
+  
+  bulkAck( sent, cached, COMMAND_OK );
+}
+
+
+void SerialCommand::bulkAck( byte sent, byte cached, byte status )
+{
+  activeSerial->write( 0x07 );
+  activeSerial->write( sent );
+  activeSerial->write( cached );
+  activeSerial->write( status );
+  activeSerial->write( NEWLINE );
+}
+
+
+
+void SerialCommand::replayCommand()
+{
+  byte cmd[4] = {0};
+  if( getCommandBody( cmd, 1, BULK_TIMEOUT ) != 1 ) return;
+  
+  switch( cmd[0] ){
+    case 0x01:
+      getCommandBody( &cmd[1], 3, BULK_TIMEOUT );
+      TraceReplay::start( cmd[1], (cmd[2]<<8) + cmd[3] );
+    break;
+    case 0x02:
+      // Read from tick() as the frames come in, a slow link doesn't stall the loop
+      if( getCommandBody( &replayLeft, 1, BULK_TIMEOUT ) != 1 ) return;
+      replaySerial = activeSerial;
+      replayPos = 0;
+      replayLastByte = millis();
+      replayFrames();
+      return;
+    case 0x03:
+      TraceReplay::end();
+    break;
+    case 0x04:
+      TraceReplay::stop();
+    break;
+    case 0x05:
+      TraceReplay::printStats( activeSerial );
+      return;
+  }
+  
+  replayCredits();
+}
+
+
+// Grant the host credits for the free buffer slots
+void SerialCommand::replayCredits()
+{
+  activeSerial->write( 0x09 );
+  activeSerial->write( TraceReplay::credits() );
+  activeSerial->write( NEWLINE );
+}
+
+
+/*
+*  Takes whatever part of the frame batch has arrived, without waiting for
+*  the rest. Each frame is the 8 byte header then its data, collected in
+*  replayIn and pushed once complete. The reply goes out after the last
+*  frame, or when the host stops sending part way.
+*/
+void SerialCommand::replayFrames()
+{
+  activeSerial = replaySerial;
+  
+  while( replayLeft > 0 ){
+    byte *hdr = replayIn;
+    byte want = 8;
+    if( replayPos >= 8 ){
+      if( hdr[4] < 1 || hdr[4] > 3 || hdr[7] > 8 ){
+        clearBuffer();
+        break;
+      }
+      want += hdr[7];
+    }
+    
+    if( replayPos < want ){
+      int n = getCommandBody( &replayIn[replayPos], want - replayPos );
+      if( n == 0 ){
+        if( millis() - replayLastByte < BULK_TIMEOUT ) return;
+        clearBuffer();
+        break;
+      }
+      replayPos += n;
+      replayLastByte = millis();
+      continue;
+    }
+    
+    struct replayFrame frame;
+    frame.offset = ((unsigned long)hdr[0] << 24) | ((unsigned long)hdr[1] << 16) | ((unsigned long)hdr[2] << 8) | hdr[3];
+    frame.busId = hdr[4];
+    frame.frame_id = (hdr[5]<<8) + hdr[6];
+    frame.length = hdr[7];
+    memcpy( frame.frame_data, &hdr[8], hdr[7] );
+    TraceReplay::push( &frame );
+    
+    replayPos = 0;
+    replayLeft--;
+  }
+  
+  replayLeft = 0;
+  replaySerial = NULL;
+  replayCredits();
+}
+
+
+
+void SerialCommand::diagnosticsCommand()
+{
+  byte cmd[3] = {0};
+  int bytesRead = getCommandBody( cmd, 3 );
+  
+  switch( cmd[0] ){
+    case 0x01:
+      ServiceCall::printRates( activeSerial );
+    break;
+    case 0x02:
+      PidMatcher::benchmark( activeSerial );
+    break;
+    case 0x10:
+      DiagCache::printStats( activeSerial );
+    break;
+    case 0x11:
+      if( bytesRead < 3 ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+      DiagCache::ttl = (cmd[1]<<8) + cmd[2];
+      activeSerial->write(COMMAND_OK);
+      activeSerial->write(NEWLINE);
+    break;
+    case 0x12:
+      DiagCache::flush();
+      activeSerial->write(COMMAND_OK);
+      activeSerial->write(NEWLINE);
+    break;
+    case 0x20:
+      if( bytesRead < 2 || cmd[1] < 1 || cmd[1] > 3 ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+      if( !PidDiscovery::start( cmd[1], cmd[2] == 0x01, activeSerial ) ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+      activeSerial->write(COMMAND_OK);
+      activeSerial->write(NEWLINE);
+    break;
+    case 0x21:
+      PidDiscovery::printResults( activeSerial );
+    break;
+    case 0x30:
+      PidStats::printStats( activeSerial );
+    break;
+    case 0x31:
+      PidStats::reset();
+      activeSerial->write(COMMAND_OK);
+      activeSerial->write(NEWLINE);
+    break;
+    #ifdef PID_HISTORY
+    case 0x32:
+      PidStats::printHistory( activeSerial, cmd[1] );
+    break;
+    case 0x33:
+      if( bytesRead < 2 || cmd[1] == 0 ){
+        activeSerial->write(COMMAND_ERROR);
+        return;
+      }
+      PidStats::decimation = cmd[1];
+      activeSerial->write(COMMAND_OK);
+      activeSerial->write(NEWLINE);
+    break;
+    #endif
+  }
+}
+
+
 
 void SerialCommand::bluetooth(){
 
-  byte cmd[1];
-  int bytesRead = getCommandBody( cmd, 1 );
+  byte cmd[1] = {0};
+  getCommandBody( cmd, 1 );
   
   switch( cmd[0] ){
     case 1:
@@ -401,7 +1292,7 @@ void SerialCommand::bluetooth(){
 
 int SerialCommand::getCommandBody( byte* cmd, int length )
 {
-  unsigned int i = 0;
+  int i = 0;
   
   // Loop until requested amount of bytes are sent. Needed for BT latency
   //while( activeSerial->available() && i < length ){
@@ -414,6 +1305,22 @@ int SerialCommand::getCommandBody( byte* cmd, int length )
   return i;
 }
 
+// Wait up to timeout ms between bytes for the rest of a command body
+int SerialCommand::getCommandBody( byte* cmd, int length, unsigned int timeout )
+{
+  int i = 0;
+  unsigned long lastByte = millis();
+  
+  while( i < length && millis() - lastByte < timeout ){
+    if( activeSerial->available() ){
+      cmd[i++] = activeSerial->read();
+      lastByte = millis();
+    }
+  }
+  
+  return i;
+}
+
 void SerialCommand::clearBuffer()
 {
   while(activeSerial->available())
@@ -430,16 +1337,16 @@ void SerialCommand::printSystemDebug()
 
 void SerialCommand::printChannelDebug(){
   
-  byte cmd[1];
+  byte cmd[1] = {0};
   getCommandBody( cmd, 1 );
   
-  if( cmd[0] > -1 && cmd[0] <= 3 )
+  if( cmd[0] >= 1 && cmd[0] <= 3 )
     printChannelDebug( busses[cmd[0]-1] );
   
   
 }
 
-void SerialCommand::printChannelDebug(CANBus channel){
+void SerialCommand::printChannelDebug(CANBus &channel){
   
   activeSerial->print( F("{\"e\":\"busdgb\", \"name\":\"") );
   activeSerial->print( channel.name );
@@ -451,6 +1358,8 @@ void SerialCommand::printChannelDebug(CANBus channel){
   activeSerial->print( channel.readRegister(EFLG), HEX );
   activeSerial->print( F("\", \"nextTxBuffer\":\""));
   activeSerial->print( channel.getNextTxBuffer(), DEC );
+  activeSerial->print( F("\", \"bitrate\":\""));
+  activeSerial->print( channel.bitRate );
   activeSerial->println(F("\"}"));
   
 }
@@ -458,6 +1367,7 @@ void SerialCommand::printChannelDebug(CANBus channel){
 
 void SerialCommand::resetToBootloader()
 {
+  EepromWriter::flush();          // Don't lose a queued settings write
   cli();
   UDCON = 1;
   USBCON = (1<<FRZCLK);  // disable USB
@@ -472,17 +1382,78 @@ void SerialCommand::resetToBootloader()
 void SerialCommand::dumpEeprom()
 {
   // dump eeprom
+  EepromWriter::hold();
   for(int i=0; i<512; i++){
-    activeSerial->print( EEPROM.read(i), HEX );
-    if(i<511) activeSerial->print( ":" );
+    activeSerial->print( EepromWriter::read(i), HEX );
+    if(i<511) activeSerial->print( ':' );
   }
+  EepromWriter::release();
   
 }
 
+
+void SerialCommand::bitrateCommand()
+{
+  byte cmd[5] = {0};
+  getCommandBody( cmd, 5 );
+  if( cmd[0] < 1 || cmd[0] > 3 ){
+    activeSerial->write(COMMAND_ERROR);
+    return;
+  }
+  
+  CANBus &bus = busses[cmd[0]-1];
+  unsigned long rate = ((unsigned long) cmd[1] << 24) + ((unsigned long) cmd[2] << 16) + ((unsigned int) cmd[3] << 8) + cmd[4];
+  boolean ok = true;
+  if( rate ){
+    ok = bus.setBitrate( rate );
+    if( ok ) Settings::setBusRate( cmd[0], rate );
+  }
+  
+  struct bitTiming t;
+  activeSerial->print( F("{\"event\":\"bitrate\", \"bus\":\"") );
+  activeSerial->print( cmd[0] );
+  activeSerial->print( F("\", \"rate\":\"") );
+  activeSerial->print( bus.bitRate );
+  if( CANBus::calcBitTiming( bus.bitRate, CAN_OSC_HZ, &t ) ){
+    byte tq = 1 + t.prop + t.ps1 + t.ps2;
+    activeSerial->print( F("\", \"brp\":\"") );
+    activeSerial->print( t.brp );
+    activeSerial->print( F("\", \"tq\":\"") );
+    activeSerial->print( tq );
+    activeSerial->print( F("\", \"samplePoint\":\"") );
+    activeSerial->print( (1 + t.prop + t.ps1) * 1000U / tq );     // per mille
+  }
+  activeSerial->print( F("\", \"result\":\"") );
+  activeSerial->print( ok ? F("success") : F("failure") );
+  activeSerial->println( F("\"}") );
+}
+
+
+void SerialCommand::printEepromStatus()
+{
+  activeSerial->print( F("{\"event\":\"eeprom\", \"version\":\"") );
+  activeSerial->print( cbt_settings.version );
+  activeSerial->print( F("\", \"crc\":\"") );
+  activeSerial->print( cbt_settings.crc, HEX );
+  activeSerial->print( F("\", \"pending\":\"") );
+  activeSerial->print( EepromWriter::pending() );
+  activeSerial->print( F("\", \"written\":\"") );
+  activeSerial->print( EepromWriter::written );
+  activeSerial->print( F("\", \"skipped\":\"") );
+  activeSerial->print( EepromWriter::skipped );
+  activeSerial->print( F("\", \"journalWrites\":\"") );
+  activeSerial->print( Journal::writes );
+  activeSerial->print( F("\", \"journalSlots\":\"") );   // slots / writes = write amplification
+  activeSerial->print( Journal::slotsWritten );
+  activeSerial->print( F("\", \"journalScanUs\":\"") );
+  activeSerial->print( Journal::scanMicros );
+  activeSerial->println( F("\"}") );
+}
+
 int SerialCommand::freeRam (){
   extern int __heap_start, *__brkval; 
-  int v; 
-  return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval); 
+  char v;
+  return &v - (__brkval == 0 ? (char*) &__heap_start : (char*) __brkval);
 }
 
 
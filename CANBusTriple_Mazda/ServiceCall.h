@@ -1,8 +1,63 @@
 
+/*
+// Bluetooth sensor packet
+
+PID values that changed since the last packet are collected and flushed to
+Serial1 as one packet every BT_SENSOR_INTERVAL ms. Values that do not fit in
+a packet, or that are held back by the Bluetooth shaper, stay pending and go
+out with the next one so the app always ends up with the latest value.
+
+Byte   Value
+0      0xE7
+1      0x84             Multi sensor update
+2      N                Number of entries
+3..    N entries, either
+         idx  valH valL                          idx = PID index + 1
+         idx|0x80  valH valL minH minL maxH maxL  Min / max since the last stats reset
+last   0x0D 0x0A
+
+Min / max are included for PIDs with bit 1 of pid.settings set.
+*/
+
+/*
+// Request scheduling
+
+Each ECU (request ID + bus) has at most one request in flight. When an ECU is
+free the scheduler picks its next due PID, the two displayed PIDs ahead of
+background ones, and the most overdue within each class. A response frees the
+ECU straight away so displayed PIDs poll as fast as the ECU answers. No
+response within REQUEST_TIMEOUT is retried REQUEST_RETRIES times before the
+PID is skipped until its next interval. A response that has started, or a
+response pending (7F SID 78), holds the ECU instead: the first until IsoTp
+finishes or drops it, the second for up to REQUEST_PENDING_TIMEOUT. Any
+other negative response frees the ECU at once, is counted in negatives and
+skips the PID until its next interval, the same as running out of retries.
+
+Poll interval per PID is the upper nibble of pid.settings in 100ms steps.
+0 = displayed PIDs as fast as possible, background every BACKGROUND_INTERVAL.
+*/
+
 #include "Middleware.h"
 
 #define NUM_PID_TO_PROCESS 2
 #define BLUETOOTH_SENSORS
+#define BT_SENSOR_INTERVAL 100
+#define MAX_ECUS 4
+#define REQUEST_TIMEOUT 100
+#define REQUEST_PENDING_TIMEOUT ISOTP_P2_EXT_TIMEOUT
+#define REQUEST_RETRIES 2
+#define BACKGROUND_INTERVAL 1000
+#define RATE_WINDOW 1000
+#define NO_PID 0xFF
+
+struct ecuState {
+  byte busId;                 // 0 = unused
+  unsigned short txId;
+  byte pending;               // PID index in flight, NO_PID if idle
+  byte retries;
+  boolean responsePending;    // ECU answered 0x78, allow REQUEST_PENDING_TIMEOUT
+  unsigned long sentAt;
+};
 
 class ServiceCall : Middleware
 {
@@ -11,135 +66,328 @@ class ServiceCall : Middleware
     static QueueArray<Message>* mainQueue;
     static void saveSettings();
     static byte* index;
+    static unsigned long dirtyPids;
+    static unsigned long lastSensorFlush;
+    static void flushBTSensors();
+    static struct ecuState ecus[ MAX_ECUS ];
+    static unsigned long nextPoll[ Settings::pidLength ];
+    static unsigned int sampleCount[ Settings::pidLength ];
+    static unsigned long rateWindowStart;
+    static struct ecuState* ecuFor( struct pid *pid );
+    static boolean isDisplayed( byte i );
+    static unsigned int pollInterval( byte i );
+    static void checkTimeouts( unsigned long now );
+    static void scheduleRequests( unsigned long now );
+    static void updateRates( unsigned long now );
+    static void recordSample( byte i, unsigned int value );
+    static void processResponse( unsigned short frame_id, byte *payload, unsigned int length, boolean raw );
+    static void negativeResponse( byte busId, unsigned short frame_id, byte *payload );
   public:
     static void init( QueueArray<Message> *q );
     static void tick();
     static Message process(Message msg);
-    static unsigned long lastServiceCallSent;
-    static void sendNextServiceCall( struct pid pid[] );
+    static void sendServiceCall( byte i );
     static void setServiceIndex(byte i);
     static byte getServiceIndex();
     static byte incServiceIndex();
     static byte decServiceIndex();
     static void setFilterPids();
-    static byte filterPids[ NUM_PID_TO_PROCESS ];
-    static void updateBTSensors( pid *pid );
+    static void printRates( Stream *out );
+    static unsigned short filterPids[ NUM_PID_TO_PROCESS ];
+    static unsigned int sampleRate[ Settings::pidLength ];
+    static unsigned long timeouts;
+    static unsigned long negatives;
+    static byte lastNrc;
 };
 
 
 QueueArray<Message>* ServiceCall::mainQueue;
-unsigned long ServiceCall::lastServiceCallSent = millis();
 byte * ServiceCall::index = &cbt_settings.displayIndex;
-byte ServiceCall::filterPids[NUM_PID_TO_PROCESS];
+unsigned short ServiceCall::filterPids[NUM_PID_TO_PROCESS];
+unsigned long ServiceCall::dirtyPids = 0;
+unsigned long ServiceCall::lastSensorFlush = 0;
+struct ecuState ServiceCall::ecus[ MAX_ECUS ];
+unsigned long ServiceCall::nextPoll[ Settings::pidLength ];
+unsigned int ServiceCall::sampleCount[ Settings::pidLength ];
+unsigned int ServiceCall::sampleRate[ Settings::pidLength ];
+unsigned long ServiceCall::rateWindowStart = 0;
+unsigned long ServiceCall::timeouts = 0;
+unsigned long ServiceCall::negatives = 0;
+byte ServiceCall::lastNrc = 0;
 
 
 void ServiceCall::init( QueueArray<Message> *q )
 {
   mainQueue = q;
   setFilterPids();
+  PidMatcher::compile();
+  
+  PidStats::reset();
+  memset( nextPoll, 0, sizeof(nextPoll) );
+  
+  memset( ecus, 0, sizeof(ecus) );
+  for( byte e=0; e<MAX_ECUS; e++ )
+    ecus[e].pending = NO_PID;
 }
 
 
 void ServiceCall::tick()
 {
-  // Send service calls every ~100ms
-  if( millis() > ServiceCall::lastServiceCallSent + 30 ){
-    ServiceCall::lastServiceCallSent = millis();
-    ServiceCall::sendNextServiceCall( cbt_settings.pids );
+  unsigned long now = millis();
+  
+  PidMatcher::tick();
+  checkTimeouts( now );
+  if( !PidDiscovery::running() )        // Leave the ECUs to discovery while it runs
+    scheduleRequests( now );
+  updateRates( now );
+  
+  #ifdef BLUETOOTH_SENSORS
+  if( now - lastSensorFlush >= BT_SENSOR_INTERVAL ){
+    lastSensorFlush = now;
+    flushBTSensors();
   }
+  #endif
   
 }
 
 
+void ServiceCall::checkTimeouts( unsigned long now )
+{
+  for( byte e=0; e<MAX_ECUS; e++ ){
+    struct ecuState *ecu = &ecus[e];
+    unsigned int limit = ecu->responsePending ? REQUEST_PENDING_TIMEOUT : REQUEST_TIMEOUT;
+    if( ecu->pending == NO_PID || now - ecu->sentAt < limit )
+      continue;
+    if( IsoTp::receiving( ecu->busId, ecu->txId + 8 ) )   // Answer under way
+      continue;
+    
+    timeouts++;
+    byte i = ecu->pending;
+    ecu->responsePending = false;
+    
+    if( ecu->retries < REQUEST_RETRIES ){
+      ecu->retries++;
+      ecu->sentAt = now;
+      sendServiceCall( i );
+    }else{
+      ecu->pending = NO_PID;
+      nextPoll[i] = now + max( pollInterval(i), (unsigned int) REQUEST_TIMEOUT );
+    }
+  }
+}
+
+
+// One request per idle ECU: displayed PIDs first, then the most overdue
+void ServiceCall::scheduleRequests( unsigned long now )
+{
+  byte best[ MAX_ECUS ];
+  memset( best, NO_PID, sizeof(best) );
+  
+  for( byte i=0; i<Settings::pidLength; i++ ){
+    struct pid *pid = &cbt_settings.pids[i];
+    if( pid->txLen == 0 || pid->busId < 1 )       // No service call data, passive PID
+      continue;
+    if( (long)(now - nextPoll[i]) < 0 )
+      continue;
+    
+    struct ecuState *ecu = ecuFor( pid );
+    if( ecu == NULL || ecu->pending != NO_PID )
+      continue;
+    
+    byte e = ecu - ecus;
+    if( best[e] == NO_PID ||
+        (isDisplayed(i) && !isDisplayed(best[e])) ||
+        (isDisplayed(i) == isDisplayed(best[e]) && (long)(nextPoll[i] - nextPoll[best[e]]) < 0) )
+      best[e] = i;
+  }
+  
+  for( byte e=0; e<MAX_ECUS; e++ ){
+    byte i = best[e];
+    if( i == NO_PID ) continue;
+    
+    ecus[e].pending = i;
+    ecus[e].retries = 0;
+    ecus[e].responsePending = false;
+    ecus[e].sentAt = now;
+    nextPoll[i] = now + pollInterval(i);
+    sendServiceCall( i );
+  }
+}
+
+
+void ServiceCall::updateRates( unsigned long now )
+{
+  if( now - rateWindowStart < RATE_WINDOW ) return;
+  rateWindowStart = now;
+  
+  memcpy( sampleRate, sampleCount, sizeof(sampleRate) );
+  memset( sampleCount, 0, sizeof(sampleCount) );
+}
+
+
+struct ecuState* ServiceCall::ecuFor( struct pid *pid )
+{
+  unsigned short txId = pid->txId;
+  struct ecuState *freeEcu = NULL;
+  
+  for( byte e=0; e<MAX_ECUS; e++ ){
+    if( ecus[e].busId == pid->busId && ecus[e].txId == txId )
+      return &ecus[e];
+    if( freeEcu == NULL && ecus[e].busId == 0 )
+      freeEcu = &ecus[e];
+  }
+  
+  if( freeEcu != NULL ){
+    freeEcu->busId = pid->busId;
+    freeEcu->txId = txId;
+    freeEcu->pending = NO_PID;
+  }
+  return freeEcu;
+}
+
+
+boolean ServiceCall::isDisplayed( byte i )
+{
+  return i == *index || ( Settings::pidCount && i == (*index + 1) % Settings::pidCount );
+}
+
+
+unsigned int ServiceCall::pollInterval( byte i )
+{
+  byte code = cbt_settings.pids[i].settings >> 4;
+  if( code ) return code * 100;
+  return isDisplayed(i) ? 0 : BACKGROUND_INTERVAL;
+}
+
+
 Message ServiceCall::process(Message msg){
   
+  if( msg.extended ) return msg;    // Diagnostics here are 11 bit only
   
-  // Process service call responses 
-  for( int i=*index; i<*index+NUM_PID_TO_PROCESS; i++ ){
+  // Broadcast traffic is not ISO-TP, passive PIDs read it as it is
+  if( !IsoTp::expecting( msg.busId, msg.frame_id ) && !PidMatcher::requested( msg.frame_id ) ){
+    processResponse( msg.frame_id, msg.frame_data, msg.length, true );
+    return msg;
+  }
+  
+  // Single frames come straight back, multi-frame responses once reassembled
+  unsigned int length;
+  byte *payload = IsoTp::receive( &msg, &length );
+  if( payload == NULL || PidDiscovery::response( msg.busId, msg.frame_id, payload, length ) )
+    return msg;
+  
+  if( length >= 3 && payload[0] == ISOTP_NEGATIVE )
+    negativeResponse( msg.busId, msg.frame_id, payload );
+  else
+    processResponse( msg.frame_id, payload, length, false );
+  
+  return msg;
+}
+
+
+void ServiceCall::processResponse( unsigned short frame_id, byte *payload, unsigned int length, boolean raw )
+{
+  
+  // Only the PIDs that answer on this ID, see PidMatcher
+  for( struct pidMatch *m = PidMatcher::lookup( frame_id ); m != NULL; m = PidMatcher::next( m ) ){
+    
+    if( ((m->flags & MATCH_RAW) != 0) != raw )
+      continue;
+    
+    unsigned int value;
+    if( !PidMatcher::match( m, payload, length, &value ) )
+      continue;
     
+    byte i = m->pid;
     struct pid *pid = &cbt_settings.pids[i];
-    if( pid->txd[0] == 0 && pid->txd[1] == 0 )
+    recordSample( i, value );
+    
+    // Response is in, the ECU can take the next request
+    struct ecuState *ecu = pid->txLen ? ecuFor( pid ) : NULL;
+    if( ecu != NULL && ecu->pending == i )
+      ecu->pending = NO_PID;
+    
+  }
+  
+}
+
+
+// 7F SID NRC on the response ID of an ECU with a request of that SID in flight
+void ServiceCall::negativeResponse( byte busId, unsigned short frame_id, byte *payload )
+{
+  for( byte e=0; e<MAX_ECUS; e++ ){
+    struct ecuState *ecu = &ecus[e];
+    if( ecu->pending == NO_PID || ecu->busId != busId || ecu->txId + 8 != frame_id )
+      continue;
+    
+    byte request[6];
+    Settings::pidRequest( ecu->pending, request );
+    if( payload[1] != request[0] )
       continue;
     
-    // If the PID returned is 8 higher than the request pid we've recieved a response
-    if(msg.frame_id == ((pid->txd[0]<<8)+pid->txd[1]+0x08) ){
-      
-      // Match RXF
-      int rxfi = 0;
-      boolean match = true;
-      while( rxfi < 6 && pid->rxf[rxfi] ){
-        if( msg.frame_data[ pid->rxf[rxfi]-3 ] != pid->rxf[rxfi+1]){ // use rxf -3 as scangauge is 1 indexed and assumes 2 byes of pid data 
-          match = false;
-          break;
-        };
-        rxfi += 2;
-      }
-      
-      if(match){
-        /*
-        Serial.print("Got response packet for PID ");
-        Serial.println( pid->name );
-        SerialCommand::printMessageToSerial( msg );
-        */
-        
-        // Remove two bytes of length to compensate for the fact PID is not in this array. For ScanGauge compat
-        byte start = (pid->rxd[0]/8) - 2;
-        byte A = msg.frame_data[start];
-        byte B;
-        
-        if( pid->rxd[1] == 16 )
-          B = msg.frame_data[start+1];
-        else
-          B = 0;
-        
-        // Do math
-        unsigned int base;
-        base = 0;
-        if( pid->rxd[1] == 16 )
-          base = (A << 8) + B;
-        else
-          base = A;
-        
-        unsigned int mult = (pid->mth[0] << 8) + pid->mth[1];
-        unsigned int div  = (pid->mth[2] << 8) + pid->mth[3];
-        unsigned int add  = (pid->mth[4] << 8) + pid->mth[5];
-        
-        if(div == 0) div = 1;
-        
-        float divResult;
-        divResult = (float)base / (float)div;
-        divResult = divResult * mult;
-        base = divResult + add;
-        
-        if( pid->value != base ){
-          pid->value = base;
-          
-          #ifdef BLUETOOTH_SENSORS
-          // Send over UART to Bluetooth
-          char out[7];
-          out[0] = 0xe7;
-          out[1] = 0x83;
-          out[2] = i+1;
-          out[3] = base >> 8;
-          out[4] = base & 0xFF;
-          out[5] = 0x0D;
-          out[6] = 0x0A;
-          delay(10);
-          Serial1.print(out);
-          #endif
-          
-        }
-        
-        
-        
-      }
-      
+    // The answer follows, don't retry over it
+    if( payload[2] == ISOTP_NRC_PENDING ){
+      ecu->responsePending = true;
+      ecu->sentAt = millis();
+      continue;
     }
     
+    // Refused, retrying won't change that
+    byte i = ecu->pending;
+    negatives++;
+    lastNrc = payload[2];
+    ecu->pending = NO_PID;
+    ecu->responsePending = false;
+    nextPoll[i] = millis() + max( pollInterval(i), (unsigned int) REQUEST_TIMEOUT );
+  }
+}
+
+
+void ServiceCall::recordSample( byte i, unsigned int value )
+{
+  struct pid *pid = &cbt_settings.pids[i];
+  sampleCount[i]++;
+  PidStats::update( i, value );
+  
+  if( pid->value != value ){
+    pid->value = value;
+    
+    #ifdef BLUETOOTH_SENSORS
+    // Sent from tick() with any other changed values
+    dirtyPids |= 1UL << i;
+    #endif
+    
+  }
+}
+
+
+void ServiceCall::printRates( Stream *out )
+{
+  for( byte i=0; i<Settings::pidLength; i++ ){
+    if( cbt_settings.pids[i].txId == 0 ) continue;
+    char name[PID_NAME_LENGTH];
+    Settings::pidName( i, name );
+    
+    out->print( F("{\"event\":\"pidRate\", \"pid\":\"") );
+    out->print( i );
+    out->print( F("\", \"name\":\"") );
+    out->write( (const uint8_t*) name, sizeof(name) );
+    out->print( F("\", \"interval\":\"") );
+    out->print( pollInterval(i) );
+    out->print( F("\", \"samplesPerSec\":\"") );
+    out->print( sampleRate[i] );
+    out->println( F("\"}") );
   }
   
+  out->print( F("{\"event\":\"pidTimeouts\", \"count\":\"") );
+  out->print( timeouts );
+  out->println( F("\"}") );
   
-  return msg;
+  out->print( F("{\"event\":\"pidNegative\", \"count\":\"") );
+  out->print( negatives );
+  out->print( F("\", \"lastNrc\":\"") );
+  out->print( lastNrc, HEX );
+  out->println( F("\"}") );
 }
 
 
@@ -160,7 +408,7 @@ void ServiceCall::setServiceIndex(byte i)
 byte ServiceCall::incServiceIndex()
 {
   
-  if( (*index+1) > Settings::pidLength-1 )
+  if( (*index+1) > Settings::pidCount-1 )
    *index = 0;
   else
    *index = *index + 1;
@@ -175,7 +423,7 @@ byte ServiceCall::decServiceIndex()
 {
   
   if( (*index-1) < 0 )
-   *index = Settings::pidLength-1;
+   *index = Settings::pidCount ? Settings::pidCount-1 : 0;
   else
    *index = *index-1;
   
@@ -188,51 +436,81 @@ byte ServiceCall::decServiceIndex()
 void ServiceCall::setFilterPids()
 {
   
-  byte ii = 0;
-  for( int i=*index; i<*index+NUM_PID_TO_PROCESS; i++ ){
-    filterPids[ii] = (cbt_settings.pids[i].txd[0] << 8) + cbt_settings.pids[i].txd[1];
-    ii++;
+  for( byte ii=0; ii<NUM_PID_TO_PROCESS; ii++ ){
+    byte i = Settings::pidCount ? (*index + ii) % Settings::pidCount : 0;
+    filterPids[ii] = cbt_settings.pids[i].txId;
   }
   
 }
 
 
-void ServiceCall::saveSettings()
+/*
+*  Pack changed PID values into one 0xE7 0x84 packet, see top of file.
+*  Never waits on Serial1, anything not sent stays dirty for the next flush.
+*/
+void ServiceCall::flushBTSensors()
 {
-  EEPROM.write( offsetof(struct cbt_settings, displayIndex), cbt_settings.displayIndex);
-}
-
-
-void ServiceCall::sendNextServiceCall( struct pid pid[] ){
+  if( dirtyPids == 0 ) return;
   
+  byte out[BT_SHAPER_BURST];
+  byte len = 3;
+  byte count = 0;
+  unsigned long sentPids = 0;
   
-  /* TODO
-   * Make this look down to 0 when the index is 7, right now it just increments up one which could try to access a non-existant index of 9.
-   * Same with the read response function.
-  */
-  for( int i=*index; i<*index+NUM_PID_TO_PROCESS; i++ ){
+  for( byte i=0; i<Settings::pidLength; i++ ){
+    if( !(dirtyPids & (1UL << i)) ) continue;
     
-    // if( pid[i].txd[0] == 0 && pid[i].txd[1] == 0 ) // Aborts if we have no PID
-    if( pid[i].txd[2] == 0 || pid[i].busId < 1 )      // Aborts if we have no service call data. Allows us to match on passive PIDs
-      continue;
+    struct pid *pid = &cbt_settings.pids[i];
+    boolean withRange = (pid->settings & B00000010) == B00000010;
     
-    Message msg;
-    msg.busId = pid[i].busId;
-    msg.frame_id = (pid[i].txd[0] << 8) + pid[i].txd[1];
+    // Leave room for the trailing CR LF
+    if( len + (withRange ? 7 : 3) + 2 > (int) sizeof(out) ) break;
     
-    int ii = 0;
-    while( ii <= 5 && pid[i].txd[ii+2] != 0 ){
-      msg.frame_data[ii+1] = pid[i].txd[ii+2];
-      ii++;
+    out[len++] = (i+1) | (withRange ? 0x80 : 0x00);
+    out[len++] = pid->value >> 8;
+    out[len++] = pid->value & 0xFF;
+    if( withRange ){
+      out[len++] = PidStats::stats[i].min >> 8;
+      out[len++] = PidStats::stats[i].min & 0xFF;
+      out[len++] = PidStats::stats[i].max >> 8;
+      out[len++] = PidStats::stats[i].max & 0xFF;
     }
-      
-    msg.frame_data[0] = ii;
-    
-    msg.length = 8;
-    msg.dispatch = true;
-    mainQueue->push(msg);
-    
     
+    sentPids |= 1UL << i;
+    count++;
   }
   
+  out[0] = 0xE7;
+  out[1] = 0x84;
+  out[2] = count;
+  out[len++] = 0x0D;
+  out[len++] = 0x0A;
+  
+  if( !BluetoothShaper::consume( len ) ) return;
+  
+  Serial1.write( out, len );
+  dirtyPids &= ~sentPids;
 }
+
+
+void ServiceCall::saveSettings()
+{
+  Journal::write( JOURNAL_DISPLAY_INDEX, cbt_settings.displayIndex );
+}
+
+
+void ServiceCall::sendServiceCall( byte i ){
+  
+  struct pid *pid = &cbt_settings.pids[i];
+  
+  // Request bytes live in EEPROM only, see Settings.h
+  byte data[6];
+  byte len = Settings::pidRequest( i, data );
+  
+  if( IsoTp::send( pid->busId, pid->txId, data, len ) )
+    DiagCache::noteRequest( pid->busId, pid->txId, data, len );
+  
+}
+
+
+
@@ -2,8 +2,89 @@
 
 
 #include <avr/eeprom.h>
+#include <util/crc16.h>
 
-struct pid {
+/*
+*  EEPROM layout
+*
+*  0x000  Header, the first 8 bytes of struct cbt_settings
+*  0x008  Packed PID records, up to SETTINGS_SIZE
+*  0x200  PID discovery results, see PidDiscovery.h
+*  0x2F0  Bus bitrates, struct busRates
+*  0x300  Signal definitions, see Signals.h
+*  0x380  Journal, see Journal.h
+*
+*  The header carries a schema version and a CRC16 over the version and
+*  the whole record area. Older images are migrated step by step on load:
+*  version 0 is the old fixed 8 x 34 byte layout, version 1 packed records
+*  without a CRC. An image that fails its CRC is replaced by the defaults.
+*  displayEnabled and displayIndex change at runtime, the header only holds
+*  their defaults and changes go to the wear leveled Journal.
+*
+*  Every write goes through EepromWriter and is done in the background,
+*  reads go through EepromWriter::read() so they see what is still queued.
+*  Events like eepromCorrupt go to the stream passed in, the port the
+*  command came from or the one setup() picked.
+*
+*  Each PID is stored as a variable length record, optional fields only
+*  present when their flag is set. The table is limited to PID_TABLE_SIZE
+*  records: each loaded PID costs about 54 bytes of RAM across Settings,
+*  PidMatcher, PidStats and ServiceCall, and more than 8 does not fit the
+*  2.5KB of SRAM next to the rest of the sketch. The image would hold
+*  about 32 typical records, but discovery and first boot write at most
+*  PID_TABLE_SIZE and loadPids() ignores any after that in an uploaded
+*  image.
+*
+*  Byte   Value
+*  0      Record length, 0x00 or 0xFF ends the table
+*  1      Flags   bit 0-1  bus id
+*                 bit 2    settings byte present (else 0)
+*                 bit 3    16 bit value (else 8 bit)
+*                 bit 4    mult / div are 2 bytes each (else 1 byte each)
+*                 bit 5    add present (else 0)
+*                 bit 6    match list present, else implied by the request
+*                 bit 7    request ID left out, same as the previous record
+*  [2]    settings
+*  [..]   Request ID high, low
+*  ..     R, request length, 0 = passive PID that is only listened for
+*  ..     R request bytes, service first
+*  [..]   M, match count, then M ScanGauge offset / value pairs
+*  ..     Data offset in bits, ScanGauge rxd[0]
+*  ..     mult, div
+*  [..]   add, high low
+*  ..     Name, the rest of the record, up to 8 characters
+*
+*  The implied match list is what a standard response to the request
+*  carries: service + 0x40 at offset 4, then the PID / DID bytes at 5, 6.
+*
+*  Only what the hot path needs stays in RAM (struct pid below plus the
+*  PidMatcher table), names and request bytes are read from EEPROM when
+*  used.
+*/
+
+#define SETTINGS_SIZE 512
+#define PID_TABLE_START 8
+#define PID_TABLE_SIZE 8            // PIDs in the table, about 54 bytes of RAM each across all modules
+#define PID_RECORD_MAX 34
+#define PID_NAME_LENGTH 8
+
+#define SETTINGS_V_FIXED 0          // 8 x struct pidDef, before packed records
+#define SETTINGS_V_PACKED 1         // Packed records, no CRC
+#define SETTINGS_VERSION 2
+
+#define BUSRATE_EEPROM 0x2F0
+#define BUSRATE_MAGIC 0xB5
+
+#define PIDREC_BUS 0x03
+#define PIDREC_SETTINGS 0x04
+#define PIDREC_16BIT 0x08
+#define PIDREC_WIDE 0x10
+#define PIDREC_ADD 0x20
+#define PIDREC_MATCH 0x40
+#define PIDREC_SAME_ID 0x80
+
+// Full PID definition, the old fixed EEPROM layout
+struct pidDef {
   byte busId;
   byte settings; // unused, unused, unused, unused, unused, unused, unused, add decimal flag
   unsigned int value;
@@ -15,164 +96,480 @@ struct pid {
   char name[8];
 };
 
+// RAM view of a PID
+struct pid {
+  byte busId;
+  byte settings;
+  unsigned int value;
+  unsigned short txId;        // Request ID, responses on txId + 8. 0 = unused entry
+  byte txLen;                 // Request bytes, 0 = passive PID
+  char label;                 // First character of the name, for the cluster
+  unsigned short record;      // EEPROM address of the packed record
+};
+
 struct cbt_settings {
   byte displayEnabled;
   byte firstboot;
   byte displayIndex;
-  byte placeholder3;
+  byte version;
   byte placeholder4;
   byte placeholder5;
-  byte placeholder6;
-  byte placeholder7;
-  struct pid pids[8];
-  byte padding[32];
+  unsigned short crc;         // Version and PID records, see imageCrc()
+  struct pid pids[PID_TABLE_SIZE];
 } cbt_settings;
 
+#define SETTINGS_HEADER_SIZE offsetof(struct cbt_settings, pids)
+
+// Bitrate per bus in bps, outside the CRC image so changing one doesn't reseal it
+struct busRates {
+  byte magic;
+  unsigned long rate[3];
+  byte check;
+};
+
+const unsigned long defaultBusRates[3] PROGMEM = { 125000, 500000, 125000 };
+
+// Stock PID table and discovery candidates, kept in flash. The first STOCK_PIDS
+// are written to EEPROM on first boot, discovery sets busId and txd[0..1] itself
+const struct pidDef defaultPids[] PROGMEM = {
+  { 2, B00000000, 0, { 0x07, 0xE0, 0x01, 0x3C, 0, 0, 0, 0 }, { 0x04, 0x41, 0x05, 0x3C, 0x00, 0x00 }, { 0x28, 0x10 }, { 0x00, 0x01, 0x00, 0x0A, 0xFF, 0xD8 }, { 'E','G','T',' ',' ',' ',' ',' ' } },
+  { 2, B00000001, 0, { 0x07, 0xE0, 0x01, 0x34, 0, 0, 0, 0 }, { 0x04, 0x41, 0x05, 0x34, 0x00, 0x00 }, { 0x28, 0x10 }, { 0x00, 0x0F, 0x0D, 0x20, 0x00, 0x00 }, { 'A','F',' ',' ',' ',' ',' ',' ' } },
+  { 2, B00000001, 0, { 0x07, 0xE0, 0x22, 0xDA, 0x85, 0, 0, 0 }, { 0x04, 0x62, 0x05, 0xDA, 0x06, 0x85 }, { 0x30, 0x08 }, { 0x00, 0x17, 0x00, 0x14, 0x00, 0x00 }, { 'A','F','R','O','B','D',' ',' ' } },
+  { 2, B00000000, 0, { 0x07, 0xE0, 0x22, 0x03, 0xEC, 0, 0, 0 }, { 0x04, 0x62, 0x05, 0x03, 0x06, 0xEC }, { 0x30, 0x10 }, { 0x00, 0x01, 0x00, 0x05, 0x00, 0x00 }, { 'K','N','O','C','K',' ',' ',' ' } },
+  { 2, B00000000, 0, { 0x07, 0xE0, 0x22, 0xF4, 0x23, 0, 0, 0 }, { 0x04, 0x62, 0x05, 0xF4, 0x06, 0x23 }, { 0x30, 0x10 }, { 0x00, 0x1D, 0x00, 0x14, 0x00, 0x00 }, { 'F','P','R',' ',' ',' ',' ',' ' } },
+  { 2, B00000000, 0, { 0x07, 0xE0, 0x22, 0x03, 0x18, 0, 0, 0 }, { 0x04, 0x62, 0x05, 0x03, 0x06, 0x18 }, { 0x30, 0x10 }, { 0x00, 0x06, 0x00, 0x01, 0x00, 0x00 }, { 'C','A','M','D','E','G',' ',' ' } },
+  { 2, B00000000, 0, { 0x07, 0x37, 0x22, 0x59, 0x6A, 0, 0, 0 }, { 0x04, 0x62, 0x05, 0x59, 0x06, 0x6A }, { 0x30, 0x10 }, { 0x00, 0x0B, 0x00, 0x64, 0x00, 0x00 }, { 'P','W','E','I','G','H','T',' ' } },
+  { 2, B00000000, 0, { 0x07, 0xE0, 0x22, 0x03, 0xCA, 0, 0, 0 }, { 0x04, 0x62, 0x05, 0x03, 0x06, 0xCA }, { 0x30, 0x08 }, { 0x00, 0x09, 0x00, 0x05, 0xFF, 0xD8 }, { 'B','A','T','T','E','R','Y',' ' } },
+  { 0, B00000000, 0, { 0, 0, 0x01, 0x0C, 0, 0, 0, 0 }, { 0x04, 0x41, 0x05, 0x0C, 0x00, 0x00 }, { 0x28, 0x10 }, { 0x00, 0x01, 0x00, 0x04, 0x00, 0x00 }, { 'R','P','M',' ',' ',' ',' ',' ' } },
+  { 0, B00000000, 0, { 0, 0, 0x01, 0x0D, 0, 0, 0, 0 }, { 0x04, 0x41, 0x05, 0x0D, 0x00, 0x00 }, { 0x28, 0x08 }, { 0x00, 0x01, 0x00, 0x01, 0x00, 0x00 }, { 'S','P','E','E','D',' ',' ',' ' } },
+  { 0, B00000000, 0, { 0, 0, 0x01, 0x05, 0, 0, 0, 0 }, { 0x04, 0x41, 0x05, 0x05, 0x00, 0x00 }, { 0x28, 0x08 }, { 0x00, 0x01, 0x00, 0x01, 0xFF, 0xD8 }, { 'C','O','O','L','A','N','T',' ' } },
+  { 0, B00000000, 0, { 0, 0, 0x01, 0x0F, 0, 0, 0, 0 }, { 0x04, 0x41, 0x05, 0x0F, 0x00, 0x00 }, { 0x28, 0x08 }, { 0x00, 0x01, 0x00, 0x01, 0xFF, 0xD8 }, { 'I','A','T',' ',' ',' ',' ',' ' } },
+  { 0, B00000000, 0, { 0, 0, 0x01, 0x11, 0, 0, 0, 0 }, { 0x04, 0x41, 0x05, 0x11, 0x00, 0x00 }, { 0x28, 0x08 }, { 0x00, 0x64, 0x00, 0xFF, 0x00, 0x00 }, { 'T','H','R','O','T','T','L','E' } },
+};
+
+#define STOCK_PIDS 8
+#define DEFAULT_PIDS (sizeof(defaultPids) / sizeof(struct pidDef))
+
+static_assert( STOCK_PIDS <= PID_TABLE_SIZE, "First boot writes more PIDs than the table holds" );
+
+
 
 class Settings
 {
   public:
-   static void init();
+   static void init( Stream *out );
+   static void load( boolean trusted, Stream *out );
    static void save( struct cbt_settings *settings );
+   static void seal();
    static void clear();
-   static void firstbootSetup();
-   const static int pidLength = 8;
+   static void firstbootSetup( Stream *out );
+   static void loadPids();
+   static int writePid( int addr, struct pidDef *def );
+   static void endPids( int addr );
+   static boolean readPid( byte i, struct pidDef *def );
+   static byte pidRequest( byte i, byte *data );
+   static void pidName( byte i, char *name );
+   static void loadBusRates( boolean defaults );
+   static unsigned long busRate( byte busId );
+   static void setBusRate( byte busId, unsigned long rate );
+   const static int pidLength = PID_TABLE_SIZE;
+   static byte pidCount;
+  private:
+   static boolean readRecord( int addr, struct pidDef *def, unsigned short prevId );
+   static unsigned short lastTxId;
+   static void migrate();
+   static unsigned short imageCrc();
+   static byte busRatesCheck();
+   static struct busRates busRates;
 };
 
 
-void Settings::init()
+byte Settings::pidCount = 0;
+unsigned short Settings::lastTxId = 0;
+struct busRates Settings::busRates;
+
+
+void Settings::init( Stream *out )
+{
+  load( false, out );
+  loadBusRates( false );
+}
+
+
+// trusted: the image was just written by the host, seal it instead of checking it
+void Settings::load( boolean trusted, Stream *out )
 {
   memset(&cbt_settings, 0, sizeof(cbt_settings));
-  eeprom_read_block((void*)&cbt_settings, (void*)0, sizeof(cbt_settings));
-  if( cbt_settings.firstboot == 0 || cbt_settings.firstboot == 0xFF )
-    Settings::firstbootSetup();
+  EepromWriter::hold();
+  EepromWriter::readBlock( &cbt_settings, 0, SETTINGS_HEADER_SIZE );
+  EepromWriter::release();
+  if( cbt_settings.firstboot == 0 || cbt_settings.firstboot == 0xFF ){
+    Settings::firstbootSetup( out );
+    return;
+  }
+  
+  // Migrations, each case falls through to the next version
+  switch( cbt_settings.version ){
+    case SETTINGS_V_FIXED:
+      migrate();
+      // Falls through
+    case SETTINGS_V_PACKED:
+      trusted = true;                 // Nothing to check against yet
+      break;
+  }
+  
+  if( trusted ){
+    seal();
+  }else if( cbt_settings.version != SETTINGS_VERSION || cbt_settings.crc != imageCrc() ){
+    out->println( F("{\"event\":\"eepromCorrupt\", \"action\":\"reset\"}") );
+    Settings::firstbootSetup( out );
+    return;
+  }
+  
+  // The header only holds their defaults, changes go to the journal
+  Journal::init();
+  Journal::read( JOURNAL_DISPLAY_INDEX, &cbt_settings.displayIndex );
+  Journal::read( JOURNAL_DISPLAY_ENABLED, &cbt_settings.displayEnabled );
+  
+  loadPids();
 }
 
 
+// Header only, PID records are written with writePid(). Queued, returns at once
 void Settings::save( struct cbt_settings *settings )
 {
-  eeprom_write_block((const void*)settings, (void*)0, sizeof(cbt_settings));
+  EepromWriter::write( 0, settings, SETTINGS_HEADER_SIZE );
 }
 
 
+// Stamp the current version and CRC after the PID records changed, and save
+void Settings::seal()
+{
+  cbt_settings.version = SETTINGS_VERSION;
+  cbt_settings.crc = imageCrc();
+  save( &cbt_settings );
+}
+
+
+unsigned short Settings::imageCrc()
+{
+  unsigned short crc = _crc16_update( 0xFFFF, cbt_settings.version );
+  EepromWriter::hold();
+  for( int addr = PID_TABLE_START; addr < SETTINGS_SIZE; addr++ )
+    crc = _crc16_update( crc, EepromWriter::read( addr ) );
+  EepromWriter::release();
+  return crc;
+}
+
+
+// Queued like every other write
 void Settings::clear()
 {
-  for (int i = 0; i < 512; i++)
-    EEPROM.write(i, 0);
+  EepromWriter::fill( 0, 0, SETTINGS_SIZE );
 }
 
-void Settings::firstbootSetup()
+
+// Build the RAM view from the packed records
+void Settings::loadPids()
+{
+  int addr = PID_TABLE_START;
+  pidCount = 0;
+  memset( cbt_settings.pids, 0, sizeof(cbt_settings.pids) );
+  EepromWriter::hold();
+  
+  while( pidCount < PID_TABLE_SIZE && addr < SETTINGS_SIZE ){
+    struct pidDef def;
+    byte len = EepromWriter::read( addr );
+    if( !readRecord( addr, &def, pidCount ? cbt_settings.pids[pidCount-1].txId : 0 ) ) break;
+    
+    struct pid *pid = &cbt_settings.pids[pidCount++];
+    pid->busId = def.busId;
+    pid->settings = def.settings;
+    pid->txId = (def.txd[0] << 8) + def.txd[1];
+    while( pid->txLen < 6 && def.txd[pid->txLen+2] ) pid->txLen++;
+    pid->label = def.name[0];
+    pid->record = addr;
+    addr += len;
+  }
+  
+  EepromWriter::release();
+  if( cbt_settings.displayIndex >= pidCount ) cbt_settings.displayIndex = 0;
+}
+
+
+/*
+*  Pack def into a record at addr, see top of file. Returns the address
+*  after it, or 0 once the table is full.
+*/
+int Settings::writePid( int addr, struct pidDef *def )
+{
+  byte rec[PID_RECORD_MAX];
+  byte n = 2;
+  byte flags = def->busId & PIDREC_BUS;
+  
+  if( def->settings ){
+    flags |= PIDREC_SETTINGS;
+    rec[n++] = def->settings;
+  }
+  
+  // Most PIDs come from the same ECU, only store the ID when it changes
+  unsigned short txId = (def->txd[0] << 8) + def->txd[1];
+  if( addr == PID_TABLE_START ) lastTxId = 0;
+  if( txId == lastTxId && txId != 0 ){
+    flags |= PIDREC_SAME_ID;
+  }else{
+    rec[n++] = def->txd[0];
+    rec[n++] = def->txd[1];
+  }
+  
+  byte reqLen = 0;
+  while( reqLen < 6 && def->txd[reqLen+2] ) reqLen++;
+  rec[n++] = reqLen;
+  memcpy( &rec[n], &def->txd[2], reqLen );
+  n += reqLen;
+  
+  // Standard response match bytes can be rebuilt from the request
+  byte implied[6] = {0};
+  for( byte k=0; k<reqLen && k<3; k++ ){
+    implied[k*2] = 0x04 + k;
+    implied[k*2+1] = k == 0 ? def->txd[2] + 0x40 : def->txd[k+2];
+  }
+  if( memcmp( implied, def->rxf, 6 ) != 0 ){
+    flags |= PIDREC_MATCH;
+    byte m = 0;
+    while( m < 3 && def->rxf[m*2] ) m++;
+    rec[n++] = m;
+    memcpy( &rec[n], def->rxf, m*2 );
+    n += m*2;
+  }
+  
+  rec[n++] = def->rxd[0];
+  if( def->rxd[1] == 16 ) flags |= PIDREC_16BIT;
+  
+  if( def->mth[0] || def->mth[2] ){
+    flags |= PIDREC_WIDE;
+    memcpy( &rec[n], def->mth, 4 );
+    n += 4;
+  }else{
+    rec[n++] = def->mth[1];
+    rec[n++] = def->mth[3];
+  }
+  
+  if( def->mth[4] || def->mth[5] ){
+    flags |= PIDREC_ADD;
+    rec[n++] = def->mth[4];
+    rec[n++] = def->mth[5];
+  }
+  
+  byte nameLen = PID_NAME_LENGTH;
+  while( nameLen > 0 && (def->name[nameLen-1] == ' ' || def->name[nameLen-1] == 0) ) nameLen--;
+  memcpy( &rec[n], def->name, nameLen );
+  n += nameLen;
+  
+  rec[0] = n;
+  rec[1] = flags;
+  
+  // Table full, end it here so nothing stale follows
+  if( addr == 0 ) return 0;
+  if( addr + n > SETTINGS_SIZE ){
+    endPids( addr );
+    return 0;
+  }
+  EepromWriter::copy( addr, rec, n );
+  lastTxId = txId;
+  return addr + n;
+}
+
+
+// Terminate the table after the last record written
+void Settings::endPids( int addr )
+{
+  if( addr > 0 && addr < SETTINGS_SIZE ) EepromWriter::fill( addr, 0, 1 );
+}
+
+
+boolean Settings::readRecord( int addr, struct pidDef *def, unsigned short prevId )
+{
+  byte rec[PID_RECORD_MAX];
+  byte len = EepromWriter::read( addr );
+  if( len < 6 || len > PID_RECORD_MAX || addr + len > SETTINGS_SIZE ) return false;
+  EepromWriter::readBlock( rec, addr, len );
+  
+  memset( def, 0, sizeof(struct pidDef) );
+  memset( def->name, ' ', PID_NAME_LENGTH );
+  
+  byte flags = rec[1];
+  byte n = 2;
+  def->busId = flags & PIDREC_BUS;
+  if( flags & PIDREC_SETTINGS ) def->settings = rec[n++];
+  if( flags & PIDREC_SAME_ID ){
+    def->txd[0] = prevId >> 8;
+    def->txd[1] = prevId & 0xFF;
+  }else{
+    def->txd[0] = rec[n++];
+    def->txd[1] = rec[n++];
+  }
+  
+  byte reqLen = rec[n++];     // Not inside min(), it evaluates its arguments twice
+  if( reqLen > 6 ) reqLen = 6;
+  memcpy( &def->txd[2], &rec[n], reqLen );
+  n += reqLen;
+  
+  if( flags & PIDREC_MATCH ){
+    byte m = rec[n++];
+    if( m > 3 ) m = 3;
+    memcpy( def->rxf, &rec[n], m*2 );
+    n += m*2;
+  }else{
+    for( byte k=0; k<reqLen && k<3; k++ ){
+      def->rxf[k*2] = 0x04 + k;
+      def->rxf[k*2+1] = k == 0 ? def->txd[2] + 0x40 : def->txd[k+2];
+    }
+  }
+  
+  def->rxd[0] = rec[n++];
+  def->rxd[1] = (flags & PIDREC_16BIT) ? 16 : 8;
+  
+  if( flags & PIDREC_WIDE ){
+    memcpy( def->mth, &rec[n], 4 );
+    n += 4;
+  }else{
+    def->mth[1] = rec[n++];
+    def->mth[3] = rec[n++];
+  }
+  
+  if( flags & PIDREC_ADD ){
+    def->mth[4] = rec[n++];
+    def->mth[5] = rec[n++];
+  }
+  
+  if( n > len ) return false;
+  memcpy( def->name, &rec[n], min( (byte)(len - n), (byte) PID_NAME_LENGTH ) );
+  return true;
+}
+
+
+boolean Settings::readPid( byte i, struct pidDef *def )
+{
+  if( i >= pidCount ) return false;
+  // The view already holds the resolved request ID
+  EepromWriter::hold();
+  boolean ok = readRecord( cbt_settings.pids[i].record, def, cbt_settings.pids[i].txId );
+  EepromWriter::release();
+  if( !ok ) return false;
+  def->value = cbt_settings.pids[i].value;
+  return true;
+}
+
+
+// Request bytes of PID i straight from its record, returns their count
+byte Settings::pidRequest( byte i, byte *data )
+{
+  struct pid *pid = &cbt_settings.pids[i];
+  EepromWriter::hold();
+  byte flags = EepromWriter::read( pid->record + 1 );
+  int addr = pid->record + 2;
+  if( flags & PIDREC_SETTINGS ) addr++;
+  if( !(flags & PIDREC_SAME_ID) ) addr += 2;
+  
+  EepromWriter::readBlock( data, addr + 1, pid->txLen );
+  EepromWriter::release();
+  return pid->txLen;
+}
+
+
+// 8 characters, space padded, not terminated
+void Settings::pidName( byte i, char *name )
+{
+  struct pidDef def;
+  if( readPid( i, &def ) )
+    memcpy( name, def.name, PID_NAME_LENGTH );
+  else
+    memset( name, ' ', PID_NAME_LENGTH );
+}
+
+
+void Settings::loadBusRates( boolean defaults )
+{
+  EepromWriter::hold();
+  EepromWriter::readBlock( &busRates, BUSRATE_EEPROM, sizeof(busRates) );
+  EepromWriter::release();
+  if( !defaults && busRates.magic == BUSRATE_MAGIC && busRates.check == busRatesCheck() ) return;
+  
+  busRates.magic = BUSRATE_MAGIC;
+  memcpy_P( busRates.rate, defaultBusRates, sizeof(busRates.rate) );
+  busRates.check = busRatesCheck();
+  EepromWriter::write( BUSRATE_EEPROM, &busRates, sizeof(busRates) );
+}
+
+
+byte Settings::busRatesCheck()
+{
+  byte check = 0x5A;
+  byte *b = (byte*) busRates.rate;
+  for( byte i=0; i<sizeof(busRates.rate); i++ ) check += b[i];
+  return check;
+}
+
+
+unsigned long Settings::busRate( byte busId )
+{
+  if( busId < 1 || busId > 3 ) return 0;
+  return busRates.rate[busId-1];
+}
+
+
+// Written in the background
+void Settings::setBusRate( byte busId, unsigned long rate )
+{
+  if( busId < 1 || busId > 3 ) return;
+  busRates.rate[busId-1] = rate;
+  busRates.check = busRatesCheck();
+  EepromWriter::write( BUSRATE_EEPROM, &busRates, sizeof(busRates) );
+}
+
+
+// Version 0 to 1, repack an image in the old fixed layout in place, packed records are never longer than the old ones
+void Settings::migrate()
+{
+  int addr = PID_TABLE_START;
+  
+  for( byte i=0; i<8; i++ ){
+    struct pidDef def;
+    EepromWriter::hold();
+    EepromWriter::readBlock( &def, PID_TABLE_START + i * sizeof(struct pidDef), sizeof(struct pidDef) );
+    EepromWriter::release();
+    if( def.txd[0] == 0 && def.txd[1] == 0 ) continue;
+    addr = writePid( addr, &def );
+  }
+  
+  endPids( addr );
+}
+
+void Settings::firstbootSetup( Stream *out )
 {
   
   Settings::clear();
+  Journal::clear();
+  loadBusRates( true );
+  
+  memset( &cbt_settings, 0, SETTINGS_HEADER_SIZE );
+  cbt_settings.displayEnabled = 1;
+  cbt_settings.firstboot = 1;
+  cbt_settings.displayIndex = 0;
   
-  struct cbt_settings stockSettings = {
-    1, // displayEnabled
-    1, // firstboot
-    0, // displayIndex
-    0, // placeholder3
-    0, // placeholder4
-    0, // placeholder5
-    0, // placeholder6
-    0, // placeholder7
-    {
-      {
-        // EGT 
-        2,
-        B00000000, // Setting flags
-        0, // Value
-        { 0x07, 0xE0, 0x01, 0x3C, 0x00, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x41, 0x05, 0x3c, 0x00, 0x00 },               /* RXF */
-        { 0x28, 0x10 },                                       /* RXD */
-        { 0x00, 0x01, 0x00, 0x0A, 0xFF, 0xD8 },               /* MTH */
-        { 0x45, 0x47, 0x54, 0x20, 0x20, 0x20, 0x20, 0x20 }    /* NAM */
-      },
-      {
-        // AFR
-        2,
-        B00000001, // Setting flags
-        0, // Value
-        { 0x07, 0xE0, 0x01, 0x34, 0x00, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x41, 0x05, 0x34, 0x00, 0x00 },   /* RXF */
-        { 0x28, 0x10 },                                       /* RXD */
-        // { 0x00, 0x0F, 0x80, 0x00, 0x00, 0x00 },            /* MTH */
-        // { 0x00, 0x0F, 0x83, 0xD7, 0x00, 0x00 },            /* MTH */ // ?? Calibrated
-        { 0x00, 0x0F, 0x0D, 0x20, 0x00, 0x00 },   /* MTH */
-        { 0x41, 0x46, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20 }    /* NAM */
-      },
-      {
-      // AFR from OBD II PID 
-        2,
-        B00000001, // Setting flags
-        0, // Value
-        { 0x07, 0xE0, 0x22, 0xDA, 0x85, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x62, 0x05, 0xDA, 0x06, 0x85 },               /* RXF */
-        { 0x30, 0x08 },                                       /* RXD */
-        { 0x00, 0x17, 0x00, 0x14, 0x00, 0x00 },               /* MTH */
-        { 0x41, 0x46, 0x52, 0x4F, 0x42, 0x44, 0x20, 0x20 }    /* NAM */
-      },
-      {
-        // KNOCK  
-        2,
-        B00000000, // Setting flags
-        0, // Value
-        { 0x07, 0xE0, 0x22, 0x03, 0xEC, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x62, 0x05, 0x03, 0x06, 0xEC },               /* RXF */
-        { 0x30, 0x10 },                                       /* RXD */
-        { 0x00, 0x01, 0x00, 0x05, 0x00, 0x00 },               /* MTH */
-        { 0x4b, 0x4e, 0x4f, 0x43, 0x4b, 0x20, 0x20, 0x20 }    /* NAM */
-      },
-      {
-        // Fuel Pressure at rail
-        2,
-        B00000000, // Setting flags
-        0, // Value
-        { 0x07, 0xE0, 0x22, 0xF4, 0x23, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x62, 0x05, 0xF4, 0x06, 0x23 },               /* RXF */
-        { 0x30, 0x10 },                                       /* RXD */
-        { 0x00, 0x1D, 0x00, 0x14, 0x00, 0x00 },               /* MTH */
-        { 0x46, 0x50, 0x52, 0x00, 0x4b, 0x20, 0x20, 0x20 }    /* NAM */
-      },
-      {
-        // VAR CAM TIMING
-        2,
-        B00000000, // Setting flags
-        0, // Value
-        { 0x07, 0xE0, 0x22, 0x03, 0x18, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x62, 0x05, 0x03, 0x06, 0x18 },               /* RXF */
-        { 0x30, 0x10 },                                       /* RXD */
-        { 0x00, 0x06, 0x00, 0x01, 0x00, 0x00 },               /* MTH */
-        { 0x43, 0x41, 0x4d, 0x44, 0x45, 0x47, 0x20, 0x20 }    /* NAM */
-      },
-      {
-        // Passenger Weight
-        2,
-        B00000000, // Setting flags
-        0, // Value
-        { 0x07, 0x37, 0x22, 0x59, 0x6A, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x62, 0x05, 0x59, 0x06, 0x6A },               /* RXF */
-        { 0x30, 0x10 },                                       /* RXD */
-        { 0x00, 0x0B, 0x00, 0x64, 0x00, 0x00 },               /* MTH */
-        { 0x50, 0x57, 0x45, 0x49, 0x47, 0x48, 0x54, 0x20 }    /* NAM */
-      },
-      {
-        // Battery 
-        2,
-        B00000000, // Setting flags
-        0, // Value
-        { 0x07, 0xE0, 0x22, 0x03, 0xCA, 0x00, 0x00, 0x00 },   /* TXD */
-        { 0x04, 0x62, 0x05, 0x03, 0x06, 0xCA },               /* RXF */
-        { 0x30, 0x08 },                                       /* RXD */
-        { 0x00, 0x09, 0x00, 0x5, 0xFF, 0xD8 },               /* MTH */
-        { 0x42, 0x41, 0x54, 0x54, 0x45, 0x52, 0x59, 0x20 }    /* NAM */
-      }
-    },
-    { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } // padding for future changes
-  };
-  
-  Settings::save(&stockSettings);
-  Settings::init();
-  Serial.println( F("{\"event\":\"eepromReset\", \"result\":\"success\"}" ));
+  // Streamed from flash one at a time
+  int addr = PID_TABLE_START;
+  for( byte i=0; i<STOCK_PIDS; i++ ){
+    struct pidDef def;
+    memcpy_P( &def, &defaultPids[i], sizeof(struct pidDef) );
+    addr = writePid( addr, &def );
+  }
+  endPids( addr );
+  Settings::seal();
+  
+  Settings::loadPids();
+  out->println( F("{\"event\":\"eepromReset\", \"result\":\"success\"}" ));
   
   // Slow flash to show first boot successful
   for(int i=0;i<6;i++){
@@ -184,5 +581,3 @@ void Settings::firstbootSetup()
   
   
 }
-
-
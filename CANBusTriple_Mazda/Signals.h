@@ -0,0 +1,287 @@
+/*
+*  Signal change detection
+*
+*  A frame repeated every 10ms with the same payload costs as much to log as
+*  one that changed. Each signal definition picks a bit field out of one
+*  ID's payload, Intel or Motorola (DBC) bit order, optionally signed, and
+*  scales it:  value = raw * mult / div + offset. A compact update is only
+*  written when the value moved more than its deadband from the last one
+*  sent, or heartbeat ms passed since, so a steady signal still shows it
+*  is alive. The raw value is kept so unchanged frames skip the scaling.
+*
+*  Definitions live in EEPROM at SIGNALS_EEPROM and are written from the
+*  RAM table by EepromWriter. Bandwidth is measured against logging every
+*  frame of the defined IDs: frameBytes at BT_LOG_RECORD_SIZE per frame vs
+*  updateBytes. With the replay tap on, frames played by TraceReplay are fed
+*  in too, so the saving can be measured on a recorded trace.
+*
+*  RAM: 17 bytes per definition, 122 for the table. The 13 bytes of state
+*  per signal, 91, are taken from the heap while updates are streamed.
+*/
+
+#define SIGNALS_EEPROM 0x300
+#define SIGNALS_MAGIC 0x5C
+#define SIGNALS_MAX 7               // 3 + 7 * 17 bytes fit in 0x300 - 0x37F
+#define SIGNAL_UPDATE_SIZE 7
+
+#define SIGNAL_MOTOROLA 0x80        // In length
+#define SIGNAL_SIGNED 0x40
+#define SIGNAL_LENGTH 0x3F
+
+struct signalDef {
+  byte busId;                 // 0 = unused, | 0x80 extended ID
+  unsigned long frame_id;
+  byte startBit;              // Intel: LSB, Motorola: MSB, DBC numbering
+  byte length;                // 1 - 32 bits | SIGNAL_MOTOROLA | SIGNAL_SIGNED
+  int mult;
+  unsigned int div;
+  int offset;
+  unsigned int deadband;      // In scaled units
+  unsigned int heartbeat;     // ms, 0 = only on change
+};
+
+struct signalTable {
+  byte magic;
+  byte count;
+  struct signalDef defs[SIGNALS_MAX];
+  byte check;
+};
+
+static_assert( sizeof(struct signalTable) <= EEWRITER_MAX_LENGTH, "EepromWriter cannot write the signal table in one range" );
+#ifdef __AVR__
+static_assert( sizeof(struct signalTable) <= 0x80, "Signal table overruns 0x300 - 0x37F" );
+#endif
+
+struct signalState {
+  unsigned long raw;
+  long sent;                  // Last value written
+  unsigned long sentAt;       // millis()
+  boolean valid;
+};
+
+
+class Signals
+{
+  private:
+    static struct signalTable table;
+    static struct signalState *state;     // NULL while not enabled
+    static Stream *out;
+    static byte check();
+    static unsigned long extract( struct signalDef *d, byte *data );
+    static void emit( byte i, long value );
+  public:
+    static void init();
+    static void process( Message *msg );
+    static boolean define( byte i, byte *def );
+    static void clear();
+    static boolean setEnabled( boolean on, Stream *s );
+    static void resetStats();
+    static void printStats( Stream *out );
+    static boolean enabled;
+    static boolean tapReplay;
+    static unsigned long frameBytes;
+    static unsigned long updateBytes;
+};
+
+
+struct signalTable Signals::table;
+struct signalState *Signals::state = NULL;
+Stream *Signals::out = &Serial;
+boolean Signals::enabled = false;
+boolean Signals::tapReplay = false;
+unsigned long Signals::frameBytes = 0;
+unsigned long Signals::updateBytes = 0;
+
+
+void Signals::init()
+{
+  EepromWriter::hold();
+  EepromWriter::readBlock( &table, SIGNALS_EEPROM, sizeof(table) );
+  EepromWriter::release();
+
+  if( table.magic != SIGNALS_MAGIC || table.count > SIGNALS_MAX || table.check != check() ){
+    memset( &table, 0, sizeof(table) );
+    table.magic = SIGNALS_MAGIC;
+  }
+}
+
+
+byte Signals::check()
+{
+  byte c = 0x5A;
+  byte *b = (byte*) table.defs;
+  for( unsigned int i=0; i<sizeof(table.defs); i++ ) c += b[i];
+  return c + table.count;
+}
+
+
+// Definition bytes as in the 0x13 0x02 command, all values high byte first
+boolean Signals::define( byte i, byte *def )
+{
+  byte bits = def[6] & SIGNAL_LENGTH;
+  if( i >= SIGNALS_MAX || def[5] > 63 || bits == 0 || bits > 32 ) return false;
+
+  struct signalDef *d = &table.defs[i];
+  d->busId = def[0];
+  d->frame_id = ((unsigned long) def[1] << 24) + ((unsigned long) def[2] << 16) + ((unsigned int) def[3] << 8) + def[4];
+  d->startBit = def[5];
+  d->length = def[6];
+  d->mult = (int16_t) ((def[7] << 8) | def[8]);
+  d->div = (def[9] << 8) + def[10];
+  d->offset = (int16_t) ((def[11] << 8) | def[12]);
+  d->deadband = (def[13] << 8) + def[14];
+  d->heartbeat = (def[15] << 8) + def[16];
+
+  if( i >= table.count ) table.count = i + 1;
+  if( state != NULL ) state[i].valid = false;
+  table.check = check();
+  EepromWriter::write( SIGNALS_EEPROM, &table, sizeof(table) );
+  return true;
+}
+
+
+void Signals::clear()
+{
+  memset( &table, 0, sizeof(table) );
+  table.magic = SIGNALS_MAGIC;
+  table.check = check();
+  if( state != NULL ) memset( state, 0, SIGNALS_MAX * sizeof(struct signalState) );
+  EepromWriter::write( SIGNALS_EEPROM, &table, sizeof(table) );
+}
+
+
+// false if there is not enough free RAM for the state
+boolean Signals::setEnabled( boolean on, Stream *s )
+{
+  enabled = false;
+  free( state );
+  state = NULL;
+  if( !on ) return true;
+
+  state = (struct signalState *) calloc( SIGNALS_MAX, sizeof(struct signalState) );
+  if( state == NULL ) return false;
+  out = s;
+  enabled = true;
+  return true;
+}
+
+
+void Signals::resetStats()
+{
+  frameBytes = 0;
+  updateBytes = 0;
+}
+
+
+unsigned long Signals::extract( struct signalDef *d, byte *data )
+{
+  byte bits = d->length & SIGNAL_LENGTH;
+  byte pos = d->startBit;
+  unsigned long raw = 0;
+
+  if( d->length & SIGNAL_MOTOROLA ){
+    // MSB first, moving to the next byte's MSB after bit 0 of a byte
+    for( byte i=0; i<bits && pos<64; i++ ){
+      raw = (raw << 1) | ((data[pos >> 3] >> (pos & 0x07)) & 0x01);
+      pos = (pos & 0x07) == 0 ? pos + 15 : pos - 1;
+    }
+  }else{
+    for( byte i=0; i<bits && pos<64; i++, pos++ )
+      if( (data[pos >> 3] >> (pos & 0x07)) & 0x01 ) raw |= 1UL << i;
+  }
+
+  if( (d->length & SIGNAL_SIGNED) && bits < 32 && (raw & (1UL << (bits - 1))) )
+    raw |= ~0UL << bits;
+  return raw;
+}
+
+
+void Signals::process( Message *msg )
+{
+  if( !enabled ) return;
+
+  byte bus = msg->busId | (msg->extended ? 0x80 : 0);
+  boolean defined = false;
+
+  for( byte i=0; i<table.count; i++ ){
+    struct signalDef *d = &table.defs[i];
+    if( d->busId != bus || d->frame_id != msg->frame_id ) continue;
+    defined = true;
+
+    struct signalState *s = &state[i];
+    unsigned long raw = extract( d, msg->frame_data );
+    boolean beat = d->heartbeat && millis() - s->sentAt >= d->heartbeat;
+    if( s->valid && raw == s->raw && !beat ) continue;
+    s->raw = raw;
+
+    long value = (long) raw * d->mult / (d->div ? d->div : 1) + d->offset;
+    long moved = value - s->sent;
+    if( !s->valid || beat || moved > (long) d->deadband || -moved > (long) d->deadband )
+      emit( i, value );
+  }
+
+  // What logging every frame of this ID would have cost
+  if( defined ) frameBytes += BT_LOG_RECORD_SIZE;
+}
+
+
+/*
+*  0x13 Index Value3 Value2 Value1 Value0 0x0D
+*/
+void Signals::emit( byte i, long value )
+{
+  struct signalState *s = &state[i];
+
+  // Paced like everything else on Bluetooth, a refused update goes on the next frame
+  if( out == &Serial1 && !BluetoothShaper::consume(SIGNAL_UPDATE_SIZE) ){
+    s->valid = false;
+    return;
+  }
+
+  s->sent = value;
+  s->sentAt = millis();
+  s->valid = true;
+  updateBytes += SIGNAL_UPDATE_SIZE;
+
+  out->write( 0x13 );
+  out->write( i );
+  out->write( (byte)(value >> 24) );
+  out->write( (byte)(value >> 16) );
+  out->write( (byte)(value >> 8) );
+  out->write( (byte) value );
+  out->write( 0x0D );
+}
+
+
+void Signals::printStats( Stream *out )
+{
+  for( byte i=0; i<table.count; i++ ){
+    struct signalDef *d = &table.defs[i];
+    if( !d->busId ) continue;
+    out->print( F("{\"event\":\"signal\", \"index\":\"") );
+    out->print( i );
+    out->print( F("\", \"bus\":\"") );
+    out->print( d->busId & 0x7F );
+    out->print( F("\", \"id\":\"") );
+    out->print( d->frame_id, HEX );
+    out->print( F("\", \"startBit\":\"") );
+    out->print( d->startBit );
+    out->print( F("\", \"length\":\"") );
+    out->print( d->length & SIGNAL_LENGTH );
+    out->print( F("\", \"deadband\":\"") );
+    out->print( d->deadband );
+    out->print( F("\", \"heartbeat\":\"") );
+    out->print( d->heartbeat );
+    out->print( F("\", \"value\":\"") );
+    out->print( state != NULL ? state[i].sent : 0 );
+    out->println( F("\"}") );
+  }
+
+  out->print( F("{\"event\":\"signalStats\", \"frameBytes\":\"") );
+  out->print( frameBytes );
+  out->print( F("\", \"updateBytes\":\"") );
+  out->print( updateBytes );
+  out->print( F("\", \"saved\":\"") );        // per mille
+  out->print( frameBytes >= 1000 && frameBytes > updateBytes ? (frameBytes - updateBytes) / (frameBytes / 1000) : 0 );
+  out->println( F("\"}") );
+}
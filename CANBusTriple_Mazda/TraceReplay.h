@@ -0,0 +1,225 @@
+/*
+*  Trace replay
+*
+*  Plays back a captured trace with its original timing. The host streams
+*  frames stamped with a microsecond offset from the start of the trace into
+*  a small jitter buffer, and only sends as many frames as the device has
+*  granted credits for (free buffer slots). Playback starts once the buffer
+*  is full or the lead time has passed, then each frame is queued when its
+*  offset comes due.
+*
+*  If the host cannot keep up and a frame arrives after its due time, that is
+*  counted as an underrun and the time base slips forward so the rest of the
+*  trace keeps its relative timing. Send lateness goes into a histogram.
+*
+*  RAM: the jitter buffer is taken from the heap by start(), 16 bytes per
+*  frame, and given back when playback is over or stopped. Otherwise it
+*  costs 64 bytes, most of it the statistics.
+*/
+
+#include "Middleware.h"
+
+#define REPLAY_BUFFER_SIZE 12
+#define REPLAY_SLIP_US 5000      // Late by more than this after running dry = underrun
+#define REPLAY_HIST_BUCKETS 8
+
+#define REPLAY_IDLE 0
+#define REPLAY_BUFFERING 1
+#define REPLAY_PLAYING 2
+
+struct replayFrame {
+  unsigned long offset;       // us from start of trace
+  byte busId;
+  unsigned short frame_id;
+  byte length;
+  byte frame_data[8];
+};
+
+
+class TraceReplay : Middleware
+{
+  private:
+    static QueueArray<Message>* mainQueue;
+    static struct replayFrame *buffer;   // REPLAY_BUFFER_SIZE frames, NULL while idle
+    static byte head;
+    static byte count;
+    static byte state;
+    static byte forceBus;
+    static boolean ended;
+    static boolean starved;
+    static unsigned int leadTime;
+    static unsigned long armedAt;
+    static unsigned long base;
+    static const unsigned int histBounds[REPLAY_HIST_BUCKETS-1];      // In flash
+    static void play( struct replayFrame *frame, unsigned long late );
+  public:
+    static void init( QueueArray<Message> *q );
+    static void tick();
+    static void start( byte bus, unsigned int lead );
+    static void stop();
+    static void end();
+    static boolean push( struct replayFrame *frame );
+    static byte credits();
+    static void printStats( Stream *out );
+    static unsigned long played;
+    static unsigned long underruns;
+    static unsigned long overflows;
+    static unsigned long hist[REPLAY_HIST_BUCKETS];
+};
+
+
+QueueArray<Message>* TraceReplay::mainQueue;
+struct replayFrame *TraceReplay::buffer = NULL;
+byte TraceReplay::head = 0;
+byte TraceReplay::count = 0;
+byte TraceReplay::state = REPLAY_IDLE;
+byte TraceReplay::forceBus = 0;
+boolean TraceReplay::ended = false;
+boolean TraceReplay::starved = false;
+unsigned int TraceReplay::leadTime = 0;
+unsigned long TraceReplay::armedAt = 0;
+unsigned long TraceReplay::base = 0;
+unsigned long TraceReplay::played = 0;
+unsigned long TraceReplay::underruns = 0;
+unsigned long TraceReplay::overflows = 0;
+unsigned long TraceReplay::hist[REPLAY_HIST_BUCKETS];
+
+// Upper bound in us of each histogram bucket, last bucket is everything above
+const unsigned int TraceReplay::histBounds[REPLAY_HIST_BUCKETS-1] PROGMEM = { 50, 100, 250, 500, 1000, 2500, 5000 };
+
+
+void TraceReplay::init( QueueArray<Message> *q )
+{
+  mainQueue = q;
+}
+
+
+void TraceReplay::tick()
+{
+  if( state == REPLAY_IDLE ) return;
+
+  if( state == REPLAY_BUFFERING ){
+    if( count == 0 ) return;
+    if( count < REPLAY_BUFFER_SIZE && !ended && millis() - armedAt < leadTime ) return;
+
+    // First frame plays now, the rest relative to it
+    state = REPLAY_PLAYING;
+    base = micros() - buffer[head].offset;
+  }
+
+  while( count > 0 ){
+    struct replayFrame *frame = &buffer[head];
+    unsigned long now = micros();
+    unsigned long due = base + frame->offset;
+    if( (long)(now - due) < 0 ) break;
+
+    unsigned long late = now - due;
+    if( starved && late > REPLAY_SLIP_US ){
+      underruns++;
+      base += late;
+      late = 0;
+    }
+    starved = false;
+
+    play( frame, late );
+    head = (head + 1) % REPLAY_BUFFER_SIZE;
+    count--;
+  }
+
+  if( count == 0 ){
+    if( ended ) stop();
+    else starved = true;
+  }
+}
+
+
+void TraceReplay::play( struct replayFrame *frame, unsigned long late )
+{
+  byte b = 0;
+  while( b < REPLAY_HIST_BUCKETS-1 && late >= pgm_read_word( &histBounds[b] ) ) b++;
+  hist[b]++;
+  played++;
+
+  Message msg;
+  msg.busId = forceBus ? forceBus : frame->busId;
+  msg.frame_id = frame->frame_id;
+  msg.length = frame->length;
+  memcpy( msg.frame_data, frame->frame_data, 8 );
+  msg.dispatch = true;
+  if( Signals::tapReplay ) Signals::process( &msg );
+  mainQueue->push( msg );
+}
+
+
+// Stays idle, no credits, if there is not enough free RAM for the buffer
+void TraceReplay::start( byte bus, unsigned int lead )
+{
+  stop();
+  buffer = (struct replayFrame *) malloc( sizeof(struct replayFrame) * REPLAY_BUFFER_SIZE );
+  if( buffer == NULL ) return;
+
+  head = count = 0;
+  forceBus = bus <= 3 ? bus : 0;
+  leadTime = lead;
+  armedAt = millis();
+  ended = starved = false;
+  played = underruns = overflows = 0;
+  memset( hist, 0, sizeof(hist) );
+  state = REPLAY_BUFFERING;
+}
+
+
+void TraceReplay::stop()
+{
+  state = REPLAY_IDLE;
+  head = count = 0;
+  free( buffer );
+  buffer = NULL;
+}
+
+
+// No more frames coming, play out what is buffered
+void TraceReplay::end()
+{
+  ended = true;
+}
+
+
+boolean TraceReplay::push( struct replayFrame *frame )
+{
+  if( state == REPLAY_IDLE || count == REPLAY_BUFFER_SIZE ){
+    overflows++;
+    return false;
+  }
+
+  memcpy( &buffer[(head + count) % REPLAY_BUFFER_SIZE], frame, sizeof(struct replayFrame) );
+  count++;
+  return true;
+}
+
+
+byte TraceReplay::credits()
+{
+  return state == REPLAY_IDLE ? 0 : REPLAY_BUFFER_SIZE - count;
+}
+
+
+void TraceReplay::printStats( Stream *out )
+{
+  out->print( F("{\"event\":\"replay\", \"state\":\"") );
+  out->print( state );
+  out->print( F("\", \"played\":\"") );
+  out->print( played );
+  out->print( F("\", \"buffered\":\"") );
+  out->print( count );
+  out->print( F("\", \"underruns\":\"") );
+  out->print( underruns );
+  out->print( F("\", \"overflows\":\"") );
+  out->print( overflows );
+  out->print( F("\", \"lateUs\":\"") );
+  for( byte b=0; b<REPLAY_HIST_BUCKETS; b++ ){
+    out->print( hist[b] );
+    if( b < REPLAY_HIST_BUCKETS-1 ) out->print( ',' );
+  }
+  out->println( F("\"}") );
+}
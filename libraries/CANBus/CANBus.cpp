@@ -11,19 +11,24 @@ Modified by Derek Kuschel for use with multiple MCP2515
 
 
 
-CANBus::CANBus( int ss, int reset, unsigned int bid, String nameString )
+CANBus::CANBus( int ss, int reset, unsigned int bid, const __FlashStringHelper *nameString )
 {
     _ss = ss;
     _reset = reset;
     busId = bid;
+    bitRate = 0;
     name = nameString;
 }
 
 CANBus::CANBus( int ss, int reset ){
-    CANBus( ss, reset, 0, "Default" );
+    _ss = ss;
+    _reset = reset;
+    busId = 0;
+    bitRate = 0;
+    name = F("Default");
 }
 
-void CANBus::setName( String s ){
+void CANBus::setName( const __FlashStringHelper *s ){
     name = s;
 }
 
@@ -50,95 +55,110 @@ void CANBus::begin()//constructor for initializing can module.
 	delay(50);
 	digitalWrite(_reset,HIGH);
 	delay(100);
+
+	clearFilters();	//Out of reset every filter is for standard frames
 }
 
 
 void CANBus::baudConfig(int bitRate)//sets bitrate for CAN node
 {
-	byte config0, config1, config2;
-
-	switch (bitRate)
-	{
-case 10:
-		config0 = 0x31;
-		config1 = 0xB8;
-		config2 = 0x05;
-		break;
-
-case 20:
-		config0 = 0x18;
-		config1 = 0xB8;
-		config2 = 0x05;
-		break;
-
-case 50:
-		config0 = 0x09;
-		config1 = 0xB8;
-		config2 = 0x05;
-		break;
-
-case 100:
-		config0 = 0x04;
-		config1 = 0xB8;
-		config2 = 0x05;
-		break;
-
-case 125:
-		config0 = 0x03;
-		config1 = 0xB8;
-		config2 = 0x05;
-		break;
-
-case 250:
-		config0 = 0x01;
-		config1 = 0xB8;
-		config2 = 0x05;
-		break;
-
-case 500:
-		config0 = 0x00;
-		config1 = 0xB8;
-		config2 = 0x05;
-		break;
-case 1000:
-	//1 megabit mode added by Patrick Cruce(pcruce_at_igpp.ucla.edu)
-	//Faster communications enabled by shortening bit timing phases(3 Tq. PS1 & 3 Tq. PS2) Note that this may exacerbate errors due to synchronization or arbitration.
-	config0 = 0x80;
-	config1 = 0x90;
-	config2 = 0x02;
-	}
-    
-    
-	digitalWrite(_ss, LOW);
-	delay(10);
-	SPI.transfer(WRITE);
-	SPI.transfer(CNF0);
-	SPI.transfer(config0);
-	delay(10);
-	digitalWrite(_ss, HIGH);
-	delay(10);
+	setBitrate( (unsigned long) bitRate * 1000 );
+}
 
-	digitalWrite(_ss, LOW);
-	delay(10);
-	SPI.transfer(WRITE);
-	SPI.transfer(CNF1);
-	SPI.transfer(config1);
-	delay(10);
-	digitalWrite(_ss, HIGH);
-	delay(10);
 
-	digitalWrite(_ss, LOW);
-	delay(10);
-	SPI.transfer(WRITE);
-	SPI.transfer(CNF2);
-	SPI.transfer(config2);
-	delay(10);
-	digitalWrite(_ss, HIGH);
-	delay(10);
-}
+/*
+Derive the bit timing for bitRate instead of looking it up, so 33.3 kbps
+(single wire GMLAN), 83.3 and 800 kbps work as well as the usual rates.
+Tries 25 down to 8 Tq per bit and keeps the divider with the smallest rate
+error, rates within 0.01% of each other count as equal and the one closer
+to the sample point target wins. The target follows CiA practice: 87.5% up
+to 500 kbps, 80% up to 800 kbps, 75% above.
+
+Worked out at runtime rather than read from a PROGMEM table: the rate comes
+from a serial command or the per bus settings in EEPROM, so it is only known
+at runtime and a table could only hold the rates picked in advance. The
+search is 18 rounds of integer math, run once per bitrate change.
+*/
+bool CANBus::calcBitTiming(unsigned long bitRate, unsigned long oscHz, struct bitTiming *t)
+{
+	if( bitRate == 0 ) return false;
+
+	unsigned int sp = bitRate > 800000 ? 750 : bitRate > 500000 ? 800 : 875;   // per mille
+	unsigned long bestErr = 0xFFFFFFFF;
+	unsigned int bestSpErr = 0xFFFF;
+	bool found = false;
+
+	for( byte ntq = 25; ntq >= 8; ntq-- ){
+		unsigned long perBrp = 2UL * ntq * bitRate;
+		unsigned long brp = (oscHz + perBrp / 2) / perBrp;
+		if( brp < 1 || brp > 64 ) continue;
+
+		unsigned long actual = perBrp * brp;
+		unsigned long err = (actual > oscHz ? actual - oscHz : oscHz - actual) / (oscHz / 10000 + 1);
+		if( err > 50 ) continue;                                                // 0.5%
+
+		// Split the bit, sync + prop + ps1 before the sample point, ps2 after
+		byte tseg1 = (ntq * sp + 500) / 1000 - 1;
+		byte ps2 = ntq - 1 - tseg1;
+		if( ps2 < 2 ) ps2 = 2;
+		if( ps2 > 8 ) ps2 = 8;
+		tseg1 = ntq - 1 - ps2;
+		if( tseg1 > 16 ){
+			tseg1 = 16;
+			ps2 = ntq - 17;
+		}
+		if( ps2 > 8 ) continue;
+
+		unsigned int at = (1 + tseg1) * 1000U / ntq;
+		unsigned int spErr = at > sp ? at - sp : sp - at;
+		if( err > bestErr || (err == bestErr && spErr >= bestSpErr) ) continue;
+
+		bestErr = err;
+		bestSpErr = spErr;
+		found = true;
+		t->brp = brp;
+		t->ps2 = ps2;
+		t->ps1 = tseg1 / 2;
+		t->prop = tseg1 - t->ps1;
+		if( t->prop > 8 ){
+			t->prop = 8;
+			t->ps1 = tseg1 - 8;
+		}
+		t->sjw = ps2 - 1 > 4 ? 4 : ps2 - 1;
+	}
 
+	return found;
+}
 
 
+// CNF registers only take writes in configuration mode, the mode in use is restored afterwards.
+// Pending frames are aborted first, a frame retrying forever would keep the controller out of it
+bool CANBus::setBitrate(unsigned long rate)
+{
+	struct bitTiming t;
+	if( !calcBitTiming( rate, CAN_OSC_HZ, &t ) ) return false;
+
+	// Datasheet CNF3, CNF2, CNF1 in register order, see the register map in CANBus.h
+	byte cnf[3];
+	cnf[0] = t.ps2 - 1;
+	cnf[1] = 0x80 | ((t.ps1 - 1) << 3) | (t.prop - 1);	//BTLMODE, PS2 length from CNF3
+	cnf[2] = ((t.sjw - 1) << 6) | (t.brp - 1);
+
+	byte ctrl = readRegister( CANCTRL ) & (0xE0 | ABAT);	//Requested mode, not CANSTAT which may still be changing
+	modifyRegister( CANCTRL, ABAT, ABAT );
+	modifyRegister( CANCTRL, 0xE0, 0x80 );
+
+	unsigned long start = millis();
+	while( (readRegister( CANSTAT ) & 0xE0) != 0x80 && millis() - start < MODE_TIMEOUT );	//Waits for the frame in progress
+	bool config = (readRegister( CANSTAT ) & 0xE0) == 0x80;
+
+	if( config ){
+		writeRegister( CNF2, cnf, 3 );
+		bitRate = rate;
+	}
+	modifyRegister( CANCTRL, 0xE0 | ABAT, ctrl );
+	return config;
+}
 
 
 int CANBus::getNextTxBuffer(){
@@ -181,9 +201,41 @@ void CANBus::setFilter( int filter0, int filter1 ){
     
 }
 
+// Same layout as setFilter(), 29 bit IDs. Standard frames no longer pass
+void CANBus::setFilterExt( unsigned long filter0, unsigned long filter1 ){
+
+    byte regs[4];
+    
+    // RXB0
+    packId( filter0, true, regs );
+    this->writeRegister(RXF0SIDH, regs, 4 );
+    this->writeRegister(RXF2SIDH, regs, 4 );
+    
+    // RXB1
+    packId( filter1, true, regs );
+    this->writeRegister(RXF1SIDH, regs, 4 );
+    this->writeRegister(RXF3SIDH, regs, 4 );
+    this->writeRegister(RXF4SIDH, regs, 4 );
+    this->writeRegister(RXF5SIDH, regs, 4 );
+    
+    // Mask the bits either ID has set, EXIDE in a mask is unimplemented and reads 0
+    packId( filter0 | filter1, true, regs );
+    regs[1] &= ~EXIDE;
+    this->writeRegister(RXM0SIDH, regs, 4 );
+    this->writeRegister(RXM1SIDH, regs, 4 );
+    
+}
+
+// A filter only takes the frame type its EXIDE says, even with the mask
+// cleared, so each buffer gets one filter for each
 void CANBus::clearFilters(){
-    this->writeRegister(RXM0SIDH, 0, 0 );
-    this->writeRegister(RXM1SIDH, 0, 0 );
+    byte zero[4] = { 0, 0, 0, 0 };
+    this->writeRegister(RXM0SIDH, zero, 4 );
+    this->writeRegister(RXM1SIDH, zero, 4 );
+    this->writeRegister(RXF0SIDL, 0 );
+    this->writeRegister(RXF1SIDL, EXIDE );
+    this->writeRegister(RXF2SIDL, 0 );
+    this->writeRegister(RXF3SIDL, EXIDE );
 }
 
 
@@ -272,7 +324,7 @@ void CANBus::setClkPre(int mode){
 //Method added to enable testing in loopback mode.(pcruce_at_igpp.ucla.edu)
 void CANBus::setMode(CANMode mode) { //put CAN controller in one of five modes
 
-	byte writeVal,mask,readVal;
+	byte writeVal,mask;
 
 	switch(mode) {
   	case CONFIGURATION:
@@ -294,12 +346,7 @@ void CANBus::setMode(CANMode mode) { //put CAN controller in one of five modes
 
 	mask = 0xE0;
 
-	digitalWrite(_ss, LOW);
-	SPI.transfer(BIT_MODIFY);
-	SPI.transfer(CANCTRL);
-	SPI.transfer(mask);
-	SPI.transfer(writeVal);
-	digitalWrite(_ss, HIGH);
+	modifyRegister( CANCTRL, mask, writeVal );
 
 }
 
@@ -385,37 +432,38 @@ char CANBus::readDATA_1()//reads data in recieve buffer 1
 	//extending CAN data read to full frames(pcruce_at_igpp.ucla.edu)
 	//It is the responsibility of the user to allocate memory for output.
 	//If you don't know what length the bus frames will be, data_out should be 8-bytes
-void CANBus::readDATA_ff_0(byte* length_out,byte *data_out,unsigned short *id_out){
+void CANBus::readDATA_ff_0(byte* length_out,byte *data_out,unsigned long *id_out,bool *extended_out){
 
 	byte len,i;
-	unsigned short id_h,id_l;
+	byte id[4];
 
 	digitalWrite(_ss, LOW);
 	SPI.transfer(READ_RX_BUF_0_ID);
-	id_h = (unsigned short) SPI.transfer(0xFF); //id high
-	id_l = (unsigned short) SPI.transfer(0xFF); //id low
-	SPI.transfer(0xFF); //extended id high(unused)
-	SPI.transfer(0xFF); //extended id low(unused)
+	id[0] = SPI.transfer(0xFF); //id high
+	id[1] = SPI.transfer(0xFF); //id low
+	id[2] = SPI.transfer(0xFF); //extended id high
+	id[3] = SPI.transfer(0xFF); //extended id low
 	len = (SPI.transfer(0xFF) & 0x0F); //data length code
 	for (i = 0;i<len;i++) {
 		data_out[i] = SPI.transfer(0xFF);
 	}
 	digitalWrite(_ss, HIGH);
 	(*length_out) = len;
-	(*id_out) = ((id_h << 3) + ((id_l & 0xE0) >> 5)); //repack identifier
+	(*id_out) = unpackId(id, extended_out); //repack identifier
 	
 }
 
-void CANBus::readDATA_ff_1(byte* length_out,byte *data_out,unsigned short *id_out){
+void CANBus::readDATA_ff_1(byte* length_out,byte *data_out,unsigned long *id_out,bool *extended_out){
 
-	byte id_h,id_l,len,i;
+	byte len,i;
+	byte id[4];
 
 	digitalWrite(_ss, LOW);
 	SPI.transfer(READ_RX_BUF_1_ID);
-	id_h = SPI.transfer(0xFF); //id high
-	id_l = SPI.transfer(0xFF); //id low
-	SPI.transfer(0xFF); //extended id high(unused)
-	SPI.transfer(0xFF); //extended id low(unused)
+	id[0] = SPI.transfer(0xFF); //id high
+	id[1] = SPI.transfer(0xFF); //id low
+	id[2] = SPI.transfer(0xFF); //extended id high
+	id[3] = SPI.transfer(0xFF); //extended id low
 	len = (SPI.transfer(0xFF) & 0x0F); //data length code
 	for (i = 0;i<len;i++) {
 		data_out[i] = SPI.transfer(0xFF);
@@ -423,7 +471,40 @@ void CANBus::readDATA_ff_1(byte* length_out,byte *data_out,unsigned short *id_ou
 	digitalWrite(_ss, HIGH);
 
 	(*length_out) = len;
-	(*id_out) = ((((unsigned short) id_h) << 3) + ((id_l & 0xE0) >> 5)); //repack identifier
+	(*id_out) = unpackId(id, extended_out); //repack identifier
+}
+
+
+//Standard frames only look at SIDH / SIDL, same cost as before
+unsigned long CANBus::unpackId(byte *in,bool *extended)
+{
+	if( !(in[1] & EXIDE) ){
+		*extended = false;
+		return ((unsigned short) in[0] << 3) + ((in[1] & 0xE0) >> 5);
+	}
+
+	*extended = true;
+	return ((unsigned long) in[0] << 21) +
+	       ((unsigned long) (in[1] & 0xE0) << 13) +
+	       ((unsigned long) (in[1] & 0x03) << 16) +
+	       ((unsigned short) in[2] << 8) +
+	       in[3];
+}
+
+void CANBus::packId(unsigned long identifier,bool extended,byte *out)
+{
+	if( !extended ){
+		out[0] = (byte) (identifier >> 3);
+		out[1] = (byte) ((identifier << 5) & 0x00E0);
+		out[2] = 0x00;
+		out[3] = 0x00;
+		return;
+	}
+
+	out[0] = (byte) (identifier >> 21);
+	out[1] = (byte) (((identifier >> 13) & 0xE0) | EXIDE | ((identifier >> 16) & 0x03));
+	out[2] = (byte) (identifier >> 8);
+	out[3] = (byte) identifier;
 }
 
 
@@ -454,26 +535,40 @@ byte CANBus::readRegister( int addr )
 void CANBus::writeRegister( int addr, byte value )
 {
     digitalWrite(_ss, LOW);
-	delay(10);
 	SPI.transfer(WRITE);
 	SPI.transfer(addr);
 	SPI.transfer(value);
-	delay(10);
 	digitalWrite(_ss, HIGH);
-	delay(10);
 }
 
 void CANBus::writeRegister( int addr, byte value, byte value2 )
 {
     digitalWrite(_ss, LOW);
-	delay(10);
 	SPI.transfer(WRITE);
 	SPI.transfer(addr);
 	SPI.transfer(value);
     SPI.transfer(value2);
-	delay(10);
 	digitalWrite(_ss, HIGH);
-	delay(10);
+}
+
+void CANBus::writeRegister( int addr, byte *values, byte n )
+{
+    digitalWrite(_ss, LOW);
+	SPI.transfer(WRITE);
+	SPI.transfer(addr);
+	for( byte i=0; i<n; i++ )
+		SPI.transfer(values[i]);
+	digitalWrite(_ss, HIGH);
+}
+
+void CANBus::modifyRegister( int addr, byte mask, byte value )
+{
+	digitalWrite(_ss, LOW);
+	SPI.transfer(BIT_MODIFY);
+	SPI.transfer(addr);
+	SPI.transfer(mask);
+	SPI.transfer(value);
+	digitalWrite(_ss, HIGH);
 }
 
 
@@ -588,21 +683,21 @@ void CANBus::load_2(byte identifier, byte data)//loads ID and DATA into transmit
 	delay(10);
 }
 
-void CANBus::load_ff_0(byte length,unsigned short identifier,byte *data)
+void CANBus::load_ff_0(byte length,unsigned long identifier,byte *data,bool extended)
 {
 	
-	byte i,id_high,id_low;
+	byte i;
+	byte id[4];
 
 	//generate id bytes before SPI write
-	id_high = (byte) (identifier >> 3);
-	id_low = (byte) ((identifier << 5) & 0x00E0);
+	packId(identifier, extended, id);
 
 	digitalWrite(_ss, LOW);
 	SPI.transfer(LOAD_TX_BUF_0_ID);
-	SPI.transfer(id_high); //identifier high bits
-	SPI.transfer(id_low); //identifier low bits
-	SPI.transfer(0x00); //extended identifier registers(unused)
-	SPI.transfer(0x00);
+	SPI.transfer(id[0]); //identifier high bits
+	SPI.transfer(id[1]); //identifier low bits
+	SPI.transfer(id[2]); //extended identifier registers
+	SPI.transfer(id[3]);
 	SPI.transfer(length);
 	for (i=0;i<length;i++) { //load data buffer
 		SPI.transfer(data[i]);
@@ -612,21 +707,21 @@ void CANBus::load_ff_0(byte length,unsigned short identifier,byte *data)
 
 }
 
-void CANBus::load_ff_1(byte length,unsigned short identifier,byte *data)
+void CANBus::load_ff_1(byte length,unsigned long identifier,byte *data,bool extended)
 {
 	
-	byte i,id_high,id_low;
+	byte i;
+	byte id[4];
 
 	//generate id bytes before SPI write
-	id_high = (byte) (identifier >> 3);
-	id_low = (byte) ((identifier << 5) & 0x00E0);
+	packId(identifier, extended, id);
 
 	digitalWrite(_ss, LOW);
 	SPI.transfer(LOAD_TX_BUF_1_ID);
-	SPI.transfer(id_high); //identifier high bits
-	SPI.transfer(id_low); //identifier low bits
-	SPI.transfer(0x00); //extended identifier registers(unused)
-	SPI.transfer(0x00);
+	SPI.transfer(id[0]); //identifier high bits
+	SPI.transfer(id[1]); //identifier low bits
+	SPI.transfer(id[2]); //extended identifier registers
+	SPI.transfer(id[3]);
 	SPI.transfer(length);
 	for (i=0;i<length;i++) { //load data buffer
 		SPI.transfer(data[i]);
@@ -637,22 +732,22 @@ void CANBus::load_ff_1(byte length,unsigned short identifier,byte *data)
 
 }
 
-void CANBus::load_ff_2(byte length,unsigned short identifier,byte *data)
+void CANBus::load_ff_2(byte length,unsigned long identifier,byte *data,bool extended)
 {
 	
-	byte i,id_high,id_low;
+	byte i;
+	byte id[4];
 
 	//generate id bytes before SPI write
-	id_high = (byte) (identifier >> 3);
-	id_low = (byte) ((identifier << 5) & 0x00E0);
+	packId(identifier, extended, id);
 
 	digitalWrite(_ss, LOW);
 
 	SPI.transfer(LOAD_TX_BUF_2_ID);
-	SPI.transfer(id_high); //identifier high bits
-	SPI.transfer(id_low); //identifier low bits
-	SPI.transfer(0x00); //extended identifier registers(unused)
-	SPI.transfer(0x00);
+	SPI.transfer(id[0]); //identifier high bits
+	SPI.transfer(id[1]); //identifier low bits
+	SPI.transfer(id[2]); //extended identifier registers
+	SPI.transfer(id[3]);
 	SPI.transfer(length); //data length code
 	for (i=0;i<length;i++) { //load data buffer
 		SPI.transfer(data[i]);
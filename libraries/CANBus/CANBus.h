@@ -47,7 +47,7 @@ CNF2/BRGCON2    b'10111000'     0xB8
 CNF3/BRGCON3    b'00000101'     0x05
 
 800 kbps
-Not yet supported
+Not yet supported, see setBitrate() for 800 kbps, 83.3 and 33.3 kbps or any other rate
 
 1000 kbps
 Settings added by Patrick Cruce(pcruce_at_igpp.ucla.edu)
@@ -59,6 +59,10 @@ CNF3=b'00000010'=0x02 = SOF = 0  & WAKFIL = 0 & PS2 = 3
 #ifndef can_h
 #define can_h
 
+#ifndef CAN_OSC_HZ
+#define CAN_OSC_HZ 16000000UL   //MCP2515 oscillator
+#endif
+
 #define SCK 15  //spi clock line
 #define MISO 14
 #define MOSI 16
@@ -81,7 +85,7 @@ CNF3=b'00000010'=0x02 = SOF = 0  & WAKFIL = 0 & PS2 = 3
 
 #define SEND_TX_BUF_0 0x81
 #define SEND_TX_BUF_1 0x82
-#define SEND_TX_BUF_2 0x83 //SPI commands for transmitting CAN TX buffers
+#define SEND_TX_BUF_2 0x84 //SPI commands for transmitting CAN TX buffers
 
 #define READ_STATUS 0xA0
 #define RX_STATUS 0xB0
@@ -89,6 +93,10 @@ CNF3=b'00000010'=0x02 = SOF = 0  & WAKFIL = 0 & PS2 = 3
 
 
 //Registers
+//The CNF names here are one off from the datasheet's:
+//  CNF0 0x2A  datasheet CNF1  SJW, BRP
+//  CNF1 0x29  datasheet CNF2  BTLMODE, SAM, PHSEG1, PRSEG
+//  CNF2 0x28  datasheet CNF3  SOF, WAKFIL, PHSEG2
 #define CNF0 0x2A
 #define CNF1 0x29
 #define CNF2 0x28
@@ -103,6 +111,34 @@ CNF3=b'00000010'=0x02 = SOF = 0  & WAKFIL = 0 & PS2 = 3
 #define CANINTE 0x2B // Interrupt Enable
 #define CANINTF 0x2C // Interrupt Flag
 #define EFLG 0x2D // Error Register address
+#define TEC 0x1C // Transmit error counter
+#define REC 0x1D // Receive error counter
+
+// CANCTRL abort all pending transmissions
+#define ABAT 0x10
+
+// ms to wait for a mode change, longer than a frame at 10 kbps
+#define MODE_TIMEOUT 20
+
+// CANINTF bits
+#define RX0IF 0x01
+#define RX1IF 0x02
+#define ERRIF 0x20
+#define MERRF 0x80
+
+// EFLG bits
+#define EWARN 0x01
+#define RXWAR 0x02
+#define TXWAR 0x04
+#define RXEP 0x08
+#define TXEP 0x10
+#define TXBO 0x20
+#define RX0OVR 0x40
+#define RX1OVR 0x80
+
+// RXBnCTRL receive buffer operating mode, 0x60 = any frame, filters off
+#define RXM_MASK 0x60
+#define RXM_ANY 0x60
 
 
 #define RXB0CTRL 0x60
@@ -136,6 +172,7 @@ CNF3=b'00000010'=0x02 = SOF = 0  & WAKFIL = 0 & PS2 = 3
 #define RXM0SIDH	0x20
 #define RXM0SIDL	0x21
 #define RXM1SIDH	0x24
+#define EXIDE	0x08 //Extended identifier flag in xxxSIDL
 #define RXM1SIDL	0x25
 
 
@@ -153,6 +190,15 @@ struct MessageNew {
 
 enum CANMode {CONFIGURATION,NORMAL,SLEEP,LISTEN,LOOPBACK};
 
+// One bit: sync (1 Tq) + prop + ps1 + ps2, Tq = 2 * brp / oscillator
+struct bitTiming {
+    byte brp;       // 1-64
+    byte prop;      // 1-8 Tq
+    byte ps1;       // 1-8 Tq
+    byte ps2;       // 2-8 Tq
+    byte sjw;       // 1-4 Tq
+};
+
 class CANBus
 {
 private:
@@ -161,17 +207,20 @@ private:
 
 public:
     
-    String name;
+    const __FlashStringHelper *name;    // In flash, print() takes it as is
     unsigned int busId;
     
-    CANBus( int ss, int reset, unsigned int bid, String nameString );
+    CANBus( int ss, int reset, unsigned int bid, const __FlashStringHelper *nameString );
     CANBus( int ss, int reset );
     
-    void setName(String s);
+    void setName(const __FlashStringHelper *s);
     void setBusId(unsigned int n);
     
     void begin();                       //sets up MCP2515
-    void baudConfig(int bitRate);       //sets up baud
+    void baudConfig(int bitRate);       //sets up baud, kbps
+    bool setBitrate(unsigned long bitRate);   //any rate in bps, keeps the current mode. False if it can't be met within 0.5% or configuration mode was not reached
+    static bool calcBitTiming(unsigned long bitRate, unsigned long oscHz, struct bitTiming *t);
+    unsigned long bitRate;              //Last set, 0 if never
 
 	//Method added to enable testing in loopback mode.(pcruce_at_igpp.ucla.edu)
 	void setMode(CANMode mode) ;        //put CAN controller in one of five modes
@@ -181,7 +230,8 @@ public:
     
     // Set RX Filter registers
     void setFilter(int, int);
-    void clearFilters();
+    void setFilterExt(unsigned long, unsigned long);   // 29 bit IDs
+    void clearFilters();                               // Standard and extended frames pass
     
     int getNextTxBuffer();
     
@@ -192,6 +242,8 @@ public:
     byte readRegister( int addr );
     void writeRegister( int addr, byte value );
     void writeRegister( int addr, byte value, byte value2 );
+    void writeRegister( int addr, byte *values, byte n );
+    void modifyRegister( int addr, byte mask, byte value );
     
     
     // byte readTXBNCTRL(int bufferid);
@@ -208,8 +260,9 @@ public:
 
 	//extending CAN data read to full frames(pcruce_at_igpp.ucla.edu)
 	//data_out should be array of 8-bytes or frame length.
-	void readDATA_ff_0(byte* length_out,byte *data_out,unsigned short *id_out);
-	void readDATA_ff_1(byte* length_out,byte *data_out,unsigned short *id_out);
+	//extended_out is set for 29 bit frames, id_out then holds the full 29 bit identifier
+	void readDATA_ff_0(byte* length_out,byte *data_out,unsigned long *id_out,bool *extended_out);
+	void readDATA_ff_1(byte* length_out,byte *data_out,unsigned long *id_out,bool *extended_out);
 
 	//Adding can to read status register(pcruce_at_igpp.ucla.edu)
 	//can be used to determine whether a frame was received.
@@ -225,10 +278,14 @@ public:
 	void load_2(byte identifier, byte data);
 
 	//extending CAN write to full frame(pcruce_at_igpp.ucla.edu)
-	//Identifier should be a value between 0 and 2^11-1, longer identifiers will be truncated(ie does not support extended frames)
-	void load_ff_0(byte length,unsigned short identifier,byte *data);
-    void load_ff_1(byte length,unsigned short identifier,byte *data);
-	void load_ff_2(byte length,unsigned short identifier,byte *data);
+	//Identifier should be a value between 0 and 2^11-1, or 2^29-1 with extended set
+	void load_ff_0(byte length,unsigned long identifier,byte *data,bool extended = false);
+    void load_ff_1(byte length,unsigned long identifier,byte *data,bool extended = false);
+	void load_ff_2(byte length,unsigned long identifier,byte *data,bool extended = false);
+
+	//SIDH, SIDL, EID8, EID0 register values for an identifier, also used for filters and masks
+	static void packId(unsigned long identifier,bool extended,byte *out);
+	static unsigned long unpackId(byte *in,bool *extended);
 
 };
 
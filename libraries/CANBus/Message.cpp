@@ -3,6 +3,7 @@
 
 Message::Message(){
     dispatch = false;
+    extended = false;
     frame_data[0] =
     frame_data[1] =
     frame_data[2] =
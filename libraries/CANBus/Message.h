@@ -11,8 +11,9 @@ class Message {
         ~Message();
         
         byte length;
-        unsigned short frame_id;
+        unsigned long frame_id;     // 11 bit, or 29 bit when extended
         byte frame_data[8];
+        bool extended;
     
         unsigned int busStatus; // Intended to hold status of the bus imediately before reading of the buffer.
         unsigned int busId;
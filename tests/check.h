@@ -0,0 +1,31 @@
+/*
+*  Smallest test runner that will do: CHECK() reports a failure with its
+*  line and carries on, main() returns the failure count.
+*/
+
+#ifndef check_h
+#define check_h
+
+#include <stdio.h>
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if( !(cond) ){ failures++; printf( "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond ); } \
+  } while( 0 )
+
+#define CHECK_EQ(a, b) do { \
+    checks++; \
+    unsigned long long check_a = (a), check_b = (b); \
+    if( check_a != check_b ){ failures++; printf( "%s:%d: %s == %s failed, %llu != %llu\n", __FILE__, __LINE__, #a, #b, check_a, check_b ); } \
+  } while( 0 )
+
+static int checkSummary( const char *name )
+{
+  printf( "%s: %d checks, %d failed\n", name, checks, failures );
+  return failures ? 1 : 0;
+}
+
+#endif
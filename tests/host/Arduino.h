@@ -0,0 +1,154 @@
+/*
+*  Host stand-in for the Arduino core
+*
+*  Enough of the API for the firmware to build and run on a PC. Time is a
+*  simulated clock: every millis() / micros() call and SPI byte moves it on
+*  a little, as the real code would take time, and busy waits still end.
+*  Serial ports are byte queues the test writes to and reads back. Pin
+*  writes and reads go to the simulated controllers, see Mcp2515Sim.h.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <math.h>
+#include <deque>
+#include <utility>
+#include <string>
+#include <vector>
+
+#include "binary.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+#define A0 18
+#define A1 19
+
+#define PROGMEM __attribute__(( section(".progmem.data") ))
+#define PSTR(s) (s)
+#define F_CPU 16000000UL
+#define SERIAL_TX_BUFFER_SIZE 64
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper*)(s))
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define _BV(b) (1<<(b))
+
+unsigned long millis();
+unsigned long micros();
+void delay( unsigned long ms );
+void delayMicroseconds( unsigned int us );
+
+void pinMode( uint8_t pin, uint8_t mode );
+void digitalWrite( uint8_t pin, uint8_t value );
+int digitalRead( uint8_t pin );
+int analogRead( uint8_t pin );
+
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write( uint8_t b ) = 0;
+    size_t write( const uint8_t *buffer, size_t size );
+    size_t write( const char *s );
+
+    size_t print( const __FlashStringHelper *s );
+    size_t print( const char *s );
+    size_t print( char c );
+    size_t print( unsigned char n, int base = DEC );
+    size_t print( int n, int base = DEC );
+    size_t print( unsigned int n, int base = DEC );
+    size_t print( long n, int base = DEC );
+    size_t print( unsigned long n, int base = DEC );
+    size_t print( double n, int digits = 2 );
+
+    size_t println( const __FlashStringHelper *s );
+    size_t println( const char *s );
+    size_t println( char c );
+    size_t println( unsigned char n, int base = DEC );
+    size_t println( int n, int base = DEC );
+    size_t println( unsigned int n, int base = DEC );
+    size_t println( long n, int base = DEC );
+    size_t println( unsigned long n, int base = DEC );
+    size_t println( double n, int digits = 2 );
+    size_t println();
+
+  private:
+    size_t printNumber( unsigned long n, int base );
+};
+
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+};
+
+
+// rx is what the firmware reads, tx what it wrote. Bytes given to feedAt()
+// join rx once the clock reaches their time, as they would over a slow link.
+class HardwareSerial : public Stream
+{
+  public:
+    HardwareSerial() : baud( 115200 ), txQueued( 0 ), txAt( 0 ) {}
+    void begin( unsigned long b ) { baud = b; }
+    int available() { arrive(); return rx.size(); }
+    int read();
+    int peek() { arrive(); return rx.empty() ? -1 : rx.front(); }
+    void flush() { txQueued = 0; }
+    size_t write( uint8_t b );
+    int availableForWrite();
+    using Print::write;
+
+    void feed( const byte *data, size_t n ) { rx.insert( rx.end(), data, data + n ); }
+    void feedAt( byte b, unsigned long long at ) { later.push_back( std::make_pair( at, b ) ); }
+    std::string take() { std::string s; s.swap( tx ); return s; }
+
+    std::deque<byte> rx;
+    std::deque< std::pair<unsigned long long, byte> > later;
+    std::string tx;
+
+  private:
+    void arrive();
+    void drain();
+    unsigned long baud;
+    unsigned long txQueued;     // Bytes in the simulated UART TX buffer
+    unsigned long long txAt;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+
+// Simulated clock, in us
+extern unsigned long long hostMicros;
+void hostAdvance( unsigned long us );
+
+// A0 / A1 as the wheel buttons read them, nothing pressed by default
+extern int hostAnalog[2];
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+class EEPROMClass
+{
+  public:
+    uint8_t read( int addr ) { return eeprom_read_byte( (const uint8_t*) (intptr_t) addr ); }
+    void write( int addr, uint8_t value ) { eeprom_write_byte( (uint8_t*) (intptr_t) addr, value ); }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
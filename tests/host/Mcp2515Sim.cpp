@@ -0,0 +1,461 @@
+#include "Mcp2515Sim.h"
+
+// Instructions
+#define I_RESET 0xC0
+#define I_READ 0x03
+#define I_WRITE 0x02
+#define I_BIT_MODIFY 0x05
+#define I_READ_STATUS 0xA0
+#define I_RX_STATUS 0xB0
+
+// Registers
+#define R_CANSTAT 0x0E
+#define R_CANCTRL 0x0F
+#define R_TEC 0x1C
+#define R_REC 0x1D
+#define R_CNF3 0x28
+#define R_CNF2 0x29
+#define R_CNF1 0x2A
+#define R_CANINTE 0x2B
+#define R_CANINTF 0x2C
+#define R_EFLG 0x2D
+#define R_TXB0CTRL 0x30
+#define R_RXB0CTRL 0x60
+#define R_RXB1CTRL 0x70
+
+#define ABAT 0x10
+#define TXREQ 0x08
+#define TXERR 0x10
+#define ABTF 0x40
+#define BUKT 0x04
+#define EXIDE 0x08
+
+#define MODE_NORMAL 0x00
+#define MODE_LOOPBACK 0x40
+#define MODE_LISTEN 0x60
+#define MODE_CONFIG 0x80
+
+
+std::vector<Mcp2515Sim*> &Mcp2515Sim::all()
+{
+  static std::vector<Mcp2515Sim*> sims;
+  return sims;
+}
+
+
+Mcp2515Sim::Mcp2515Sim( byte ssPin, byte rst, byte intr )
+{
+  ss = ssPin;
+  resetPin = rst;
+  intPin = intr;
+  selected = false;
+  acked = true;
+  transfers = 0;
+  rxOverflows = 0;
+  reset();
+  all().push_back( this );
+}
+
+
+Mcp2515Sim::~Mcp2515Sim()
+{
+  for( size_t i=0; i<all().size(); i++ )
+    if( all()[i] == this ) all().erase( all().begin() + i );
+}
+
+
+void Mcp2515Sim::reset()
+{
+  memset( reg, 0, sizeof(reg) );
+  reg[R_CANSTAT] = 0x80;
+  reg[R_CANCTRL] = 0x87;
+  inFlight = -1;
+  doneAt = busFreeAt = 0;
+  for( int b=0; b<3; b++ ) requestedAt[b] = 0;
+}
+
+
+byte Mcp2515Sim::mode()
+{
+  return reg[R_CANSTAT] & 0xE0;
+}
+
+
+unsigned long Mcp2515Sim::bitRate()
+{
+  unsigned long brp = (reg[R_CNF1] & 0x3F) + 1;
+  unsigned long prop = (reg[R_CNF2] & 0x07) + 1;
+  unsigned long ps1 = ((reg[R_CNF2] >> 3) & 0x07) + 1;
+  unsigned long ps2 = (reg[R_CNF3] & 0x07) + 1;
+  if( !(reg[R_CNF2] & 0x80) ) ps2 = ps1 > 2 ? ps1 : 2;     // Without BTLMODE PS2 = max(PS1, IPT)
+  return 16000000UL / (2 * brp * (1 + prop + ps1 + ps2));
+}
+
+
+// Including the 3 bit intermission, without stuff bits
+unsigned long Mcp2515Sim::frameMicros( bool extended, byte length )
+{
+  unsigned long bits = (extended ? 67 : 47) + 8 * length;
+  unsigned long rate = bitRate();
+  return (bits * 1000000UL + rate - 1) / rate;
+}
+
+
+void Mcp2515Sim::update()
+{
+  unsigned long long now = hostMicros;
+
+  for(;;){
+    // ABAT aborts whatever is pending and holds back new requests while set
+    if( reg[R_CANCTRL] & ABAT ){
+      for( int b=0; b<3; b++ ){
+        byte *ctrl = &reg[R_TXB0CTRL + 0x10 * b];
+        if( *ctrl & TXREQ ) *ctrl = (*ctrl & ~TXREQ) | ABTF;
+      }
+      if( inFlight >= 0 ) busFreeAt = now;
+      inFlight = -1;
+    }
+
+    if( inFlight >= 0 ){
+      if( now < doneAt ) return;
+      finishTx( doneAt );
+      continue;
+    }
+
+    // A mode change waits for pending transmissions
+    byte requested = reg[R_CANCTRL] & 0xE0;
+    boolean sending = mode() == MODE_NORMAL || mode() == MODE_LOOPBACK;
+    if( mode() != requested && (!sending || nextTx() < 0) ){
+      reg[R_CANSTAT] = (reg[R_CANSTAT] & 0x1F) | requested;
+      sending = mode() == MODE_NORMAL || mode() == MODE_LOOPBACK;
+    }
+
+    int b = sending ? nextTx() : -1;
+    if( b < 0 ) return;
+
+    byte *buf = &reg[R_TXB0CTRL + 0x10 * b];
+    unsigned long long start = busFreeAt > requestedAt[b] ? busFreeAt : requestedAt[b];
+    inFlight = b;
+    doneAt = start + frameMicros( buf[2] & EXIDE, buf[5] & 0x0F );
+  }
+}
+
+
+// Highest TXP first, then the higher buffer
+int Mcp2515Sim::nextTx()
+{
+  int best = -1;
+  for( int b=0; b<3; b++ ){
+    byte ctrl = reg[R_TXB0CTRL + 0x10 * b];
+    if( !(ctrl & TXREQ) ) continue;
+    if( best < 0 || (ctrl & 0x03) >= (reg[R_TXB0CTRL + 0x10 * best] & 0x03) ) best = b;
+  }
+  return best;
+}
+
+
+void Mcp2515Sim::finishTx( unsigned long long at )
+{
+  byte *buf = &reg[R_TXB0CTRL + 0x10 * inFlight];
+
+  if( !acked ){
+    // ACK error: retransmit, an error passive node no longer counts them
+    *buf |= TXERR;
+    if( reg[R_TEC] < 128 ) reg[R_TEC] += 8;
+    updateErrors();
+    doneAt = at + frameMicros( buf[2] & EXIDE, buf[5] & 0x0F );
+    return;
+  }
+
+  SimFrame f;
+  f.extended = buf[2] & EXIDE;
+  if( f.extended )
+    f.id = ((unsigned long) buf[1] << 21) | ((unsigned long) (buf[2] & 0xE0) << 13) |
+           ((unsigned long) (buf[2] & 0x03) << 16) | ((unsigned long) buf[3] << 8) | buf[4];
+  else
+    f.id = ((unsigned long) buf[1] << 3) | (buf[2] >> 5);
+  f.length = buf[5] & 0x0F;
+  if( f.length > 8 ) f.length = 8;
+  memcpy( f.data, &buf[6], 8 );
+  f.at = at;
+  sent.push_back( f );
+
+  *buf &= ~(TXREQ | TXERR);
+  reg[R_CANINTF] |= 0x04 << inFlight;
+  if( reg[R_TEC] > 0 ) reg[R_TEC]--;
+  updateErrors();
+  inFlight = -1;
+  busFreeAt = at;
+}
+
+
+void Mcp2515Sim::updateErrors()
+{
+  byte tec = reg[R_TEC];
+  byte rec = reg[R_REC];
+  byte e = reg[R_EFLG] & 0xC0;
+  if( tec >= 96 ) e |= 0x04;
+  if( rec >= 96 ) e |= 0x02;
+  if( tec >= 96 || rec >= 96 ) e |= 0x01;
+  if( tec >= 128 ) e |= 0x10;
+  if( rec >= 128 ) e |= 0x08;
+  reg[R_EFLG] = e;
+}
+
+
+bool Mcp2515Sim::accepts( byte buffer, unsigned long id, bool extended )
+{
+  byte ctrl = reg[buffer ? R_RXB1CTRL : R_RXB0CTRL];
+  if( (ctrl & 0x60) == 0x60 ) return true;
+
+  static const byte filters0[] = { 0x00, 0x04 };
+  static const byte filters1[] = { 0x08, 0x10, 0x14, 0x18 };
+  const byte *filters = buffer ? filters1 : filters0;
+  byte n = buffer ? 4 : 2;
+  byte *m = &reg[buffer ? 0x24 : 0x20];
+
+  for( byte i=0; i<n; i++ ){
+    byte *f = &reg[filters[i]];
+    if( ((f[1] & EXIDE) != 0) != extended ) continue;
+
+    unsigned long fid, mid;
+    if( extended ){
+      fid = ((unsigned long) f[0] << 21) | ((unsigned long) (f[1] & 0xE0) << 13) |
+            ((unsigned long) (f[1] & 0x03) << 16) | ((unsigned long) f[2] << 8) | f[3];
+      mid = ((unsigned long) m[0] << 21) | ((unsigned long) (m[1] & 0xE0) << 13) |
+            ((unsigned long) (m[1] & 0x03) << 16) | ((unsigned long) m[2] << 8) | m[3];
+    }else{
+      fid = ((unsigned long) f[0] << 3) | (f[1] >> 5);
+      mid = ((unsigned long) m[0] << 3) | (m[1] >> 5);
+    }
+    if( ((fid ^ id) & mid) == 0 ) return true;
+  }
+  return false;
+}
+
+
+// Only the ID registers the frame uses are written, the extended ID bytes
+// of a standard frame keep whatever was there
+void Mcp2515Sim::load( byte buffer, unsigned long id, bool extended, byte length, const byte *data )
+{
+  byte *buf = &reg[buffer ? R_RXB1CTRL : R_RXB0CTRL];
+  if( extended ){
+    buf[1] = id >> 21;
+    buf[2] = ((id >> 13) & 0xE0) | EXIDE | ((id >> 16) & 0x03);
+    buf[3] = id >> 8;
+    buf[4] = id;
+  }else{
+    buf[1] = id >> 3;
+    buf[2] = (id << 5) & 0xE0;
+  }
+  buf[5] = length;
+  memcpy( &buf[6], data, length );
+  reg[R_CANINTF] |= buffer ? 0x02 : 0x01;
+}
+
+
+bool Mcp2515Sim::receive( unsigned long id, bool extended, byte length, const byte *data )
+{
+  update();
+  if( mode() != MODE_NORMAL && mode() != MODE_LISTEN ) return false;
+  if( reg[R_REC] > 0 ) reg[R_REC]--;
+
+  if( accepts( 0, id, extended ) ){
+    if( !(reg[R_CANINTF] & 0x01) ){
+      load( 0, id, extended, length, data );
+      return true;
+    }
+    if( (reg[R_RXB0CTRL] & BUKT) && !(reg[R_CANINTF] & 0x02) ){
+      load( 1, id, extended, length, data );
+      return true;
+    }
+    reg[R_EFLG] |= (reg[R_RXB0CTRL] & BUKT) ? 0x80 : 0x40;
+  }else if( accepts( 1, id, extended ) ){
+    if( !(reg[R_CANINTF] & 0x02) ){
+      load( 1, id, extended, length, data );
+      return true;
+    }
+    reg[R_EFLG] |= 0x80;
+  }else{
+    return false;
+  }
+
+  rxOverflows++;
+  return false;
+}
+
+
+byte Mcp2515Sim::readReg( byte addr )
+{
+  addr &= 0x7F;
+  if( (addr & 0x0F) == 0x0E ) return reg[R_CANSTAT];
+  if( (addr & 0x0F) == 0x0F ) return reg[R_CANCTRL];
+  return reg[addr];
+}
+
+
+void Mcp2515Sim::writeReg( byte addr, byte value )
+{
+  addr &= 0x7F;
+  if( (addr & 0x0F) == 0x0E ) return;
+  if( (addr & 0x0F) == 0x0F ) addr = R_CANCTRL;
+
+  // Filters, masks and bit timing only take writes in configuration mode
+  boolean configOnly = addr <= R_CNF1 && (addr & 0x0F) < 0x0C;
+  if( configOnly && mode() != MODE_CONFIG ) return;
+
+  switch( addr ){
+    case R_TEC:
+    case R_REC:
+      return;
+    case R_EFLG:
+      reg[addr] = (reg[addr] & 0x3F) | (value & 0xC0);
+      return;
+    case R_RXB0CTRL:
+    case R_RXB1CTRL:
+      reg[addr] = (reg[addr] & ~0x64) | (value & 0x64);
+      return;
+    case 0x30:
+    case 0x40:
+    case 0x50: {
+      byte b = (addr - R_TXB0CTRL) >> 4;
+      if( (value & TXREQ) && !(reg[addr] & TXREQ) ){
+        requestedAt[b] = hostMicros;
+        reg[addr] &= ~(ABTF | 0x20 | TXERR);
+      }
+      reg[addr] = (reg[addr] & ~0x0B) | (value & 0x0B);
+      return;
+    }
+  }
+  reg[addr] = value;
+}
+
+
+byte Mcp2515Sim::status()
+{
+  byte intf = reg[R_CANINTF];
+  return (intf & 0x03) |
+         ((reg[0x30] & TXREQ) ? 0x04 : 0) | ((intf & 0x04) ? 0x08 : 0) |
+         ((reg[0x40] & TXREQ) ? 0x10 : 0) | ((intf & 0x08) ? 0x20 : 0) |
+         ((reg[0x50] & TXREQ) ? 0x40 : 0) | ((intf & 0x10) ? 0x80 : 0);
+}
+
+
+byte Mcp2515Sim::rxStatus()
+{
+  byte intf = reg[R_CANINTF];
+  return ((intf & 0x01) ? 0x40 : 0) | ((intf & 0x02) ? 0x80 : 0);
+}
+
+
+void Mcp2515Sim::select()
+{
+  update();
+  selected = true;
+  position = 0;
+}
+
+
+void Mcp2515Sim::deselect()
+{
+  if( !selected ) return;
+  selected = false;
+
+  // Reading a receive buffer through its own instruction releases it
+  if( position > 0 && (command & 0xF9) == 0x90 )
+    reg[R_CANINTF] &= (command & 0x04) ? ~0x02 : ~0x01;
+
+  update();
+}
+
+
+byte Mcp2515Sim::exchange( byte data )
+{
+  transfers++;
+  unsigned int pos = position++;
+
+  if( pos == 0 ){
+    command = data;
+    if( command == I_RESET ){
+      reset();
+    }else if( (command & 0xF8) == 0x80 ){
+      // RTS, one bit per TX buffer
+      for( int b=0; b<3; b++ )
+        if( command & (1 << b) ) writeReg( R_TXB0CTRL + 0x10 * b, reg[R_TXB0CTRL + 0x10 * b] | TXREQ );
+    }else if( (command & 0xF9) == 0x90 ){
+      address = ((command & 0x04) ? R_RXB1CTRL : R_RXB0CTRL) + ((command & 0x02) ? 6 : 1);
+    }else if( (command & 0xF8) == 0x40 && (command & 0x07) < 6 ){
+      address = R_TXB0CTRL + 0x10 * ((command & 0x07) >> 1) + ((command & 0x01) ? 6 : 1);
+    }
+    return 0xFF;
+  }
+
+  switch( command ){
+    case I_READ:
+      if( pos == 1 ){ address = data; return 0xFF; }
+      update();
+      return readReg( address++ );
+
+    case I_WRITE:
+      if( pos == 1 ){ address = data; return 0xFF; }
+      writeReg( address++, data );
+      return 0xFF;
+
+    case I_BIT_MODIFY:
+      if( pos == 1 ) address = data;
+      else if( pos == 2 ) mask = data;
+      else if( pos == 3 ) writeReg( address, (readReg( address ) & ~mask) | (data & mask) );
+      return 0xFF;
+
+    case I_READ_STATUS:
+      update();
+      return status();
+
+    case I_RX_STATUS:
+      return rxStatus();
+  }
+
+  if( (command & 0xF9) == 0x90 ) return reg[address++ & 0x7F];
+  if( (command & 0xF8) == 0x40 && (command & 0x07) < 6 ) reg[address++ & 0x7F] = data;
+  return 0xFF;
+}
+
+
+bool Mcp2515Sim::pinWrite( byte pin, byte value )
+{
+  bool used = false;
+  for( size_t i=0; i<all().size(); i++ ){
+    Mcp2515Sim *s = all()[i];
+    if( pin == s->ss ){
+      if( value == LOW ) s->select();
+      else s->deselect();
+      used = true;
+    }
+    if( pin == s->resetPin ){
+      if( value == LOW ) s->reset();
+      used = true;
+    }
+  }
+  return used;
+}
+
+
+int Mcp2515Sim::pinRead( byte pin )
+{
+  for( size_t i=0; i<all().size(); i++ ){
+    Mcp2515Sim *s = all()[i];
+    if( pin != s->intPin ) continue;
+    s->update();
+    return (s->reg[R_CANINTE] & s->reg[R_CANINTF]) ? LOW : HIGH;
+  }
+  return -1;
+}
+
+
+byte Mcp2515Sim::transfer( byte data )
+{
+  byte in = 0xFF;
+  for( size_t i=0; i<all().size(); i++ )
+    if( all()[i]->selected ) in = all()[i]->exchange( data );
+  return in;
+}
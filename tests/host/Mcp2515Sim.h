@@ -0,0 +1,95 @@
+/*
+*  Simulated MCP2515
+*
+*  Decodes the SPI instruction set on the controller's select pin and
+*  keeps the register file: RESET, READ, WRITE, BIT MODIFY, READ STATUS,
+*  RX STATUS, READ RX BUFFER and LOAD TX BUFFER (all six start addresses)
+*  and RTS. Written straight from the datasheet, not from CANBus.cpp, so
+*  it checks the library rather than mirroring it.
+*
+*  The bus side: receive() offers a frame to the acceptance filters and
+*  masks, RXB0 first, rolling over to RXB1 only with BUKT set, otherwise
+*  the overflow flag is set. Pending TX buffers go out one at a time, by
+*  TXP priority then the higher buffer, each taking its bits at the rate
+*  CNF1-3 give at 16MHz, and are recorded in sent with the time they
+*  ended. With acked false nobody ACKs: the frame is retried, TEC climbs
+*  to error passive and TXREQ stays set.
+*
+*  A requested mode (CANCTRL REQOP) is entered once no transmission is
+*  pending, as on the chip, so a frame nobody ACKs holds off configuration
+*  mode until ABAT aborts it. RXnIF and TXnIF drive the INT pin through
+*  CANINTE.
+*/
+
+#ifndef Mcp2515Sim_h
+#define Mcp2515Sim_h
+
+#include <Arduino.h>
+#include <vector>
+
+struct SimFrame {
+  unsigned long id;
+  bool extended;
+  byte length;
+  byte data[8];
+  unsigned long long at;      // us, when it ended on the bus
+};
+
+class Mcp2515Sim
+{
+  public:
+    Mcp2515Sim( byte ssPin, byte resetPin, byte intPin );
+    ~Mcp2515Sim();
+
+    void reset();
+    void update();                        // Move the bus on to hostMicros
+    bool receive( unsigned long id, bool extended, byte length, const byte *data );
+    byte mode();                          // CANSTAT OPMOD, 0x00 normal .. 0x80 configuration
+    unsigned long bitRate();              // From CNF1-3, 0 if they give no valid timing
+    unsigned long frameMicros( bool extended, byte length );
+
+    byte reg[128];
+    std::vector<SimFrame> sent;
+    bool acked;
+    unsigned long transfers;              // SPI bytes while selected
+    unsigned long rxOverflows;
+
+    // From the host pin and SPI functions
+    static bool pinWrite( byte pin, byte value );
+    static int pinRead( byte pin );       // -1 if no controller uses the pin
+    static byte transfer( byte data );
+
+  private:
+    byte ss;
+    byte resetPin;
+    byte intPin;
+
+    // SPI instruction in progress
+    bool selected;
+    byte command;
+    unsigned int position;
+    byte address;
+    byte mask;
+
+    int inFlight;                         // TX buffer on the bus, -1 none
+    unsigned long long doneAt;
+    unsigned long long busFreeAt;
+    unsigned long long requestedAt[3];
+
+    void select();
+    void deselect();
+    byte exchange( byte data );
+    byte readReg( byte addr );
+    void writeReg( byte addr, byte value );
+    byte status();
+    byte rxStatus();
+    bool accepts( byte buffer, unsigned long id, bool extended );
+    void load( byte buffer, unsigned long id, bool extended, byte length, const byte *data );
+    int nextTx();
+    void finishTx( unsigned long long at );
+    void updateErrors();
+
+    static std::vector<Mcp2515Sim*> &all();  // Built on first use, sims may be static too
+};
+
+#endif
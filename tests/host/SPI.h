@@ -0,0 +1,23 @@
+#ifndef SPI_h
+#define SPI_h
+
+#include <Arduino.h>
+
+#define SPI_MODE0 0x00
+#define SPI_CLOCK_DIV4 0x00
+#define MSBFIRST 1
+
+// Bytes go to whichever simulated controller has its select pin low
+class SPIClass
+{
+  public:
+    void begin() {}
+    void setDataMode( uint8_t mode ) { (void) mode; }
+    void setClockDivider( uint8_t div ) { (void) div; }
+    void setBitOrder( uint8_t order ) { (void) order; }
+    uint8_t transfer( uint8_t data );
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef avr_eeprom_h
+#define avr_eeprom_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint8_t eeprom_read_byte( const uint8_t *addr );
+void eeprom_read_block( void *dst, const void *addr, size_t n );
+void eeprom_write_byte( uint8_t *addr, uint8_t value );
+void eeprom_write_block( const void *src, void *addr, size_t n );
+void eeprom_update_byte( uint8_t *addr, uint8_t value );
+void eeprom_update_block( const void *src, void *addr, size_t n );
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef avr_interrupt_h
+#define avr_interrupt_h
+
+#define ISR(vector) extern "C" void vector( void )
+
+inline void cli() {}
+inline void sei() {}
+
+// Runs the interrupts that are due, the EEPROM ready one for now
+void hostInterrupts();
+
+#endif
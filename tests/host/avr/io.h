@@ -0,0 +1,36 @@
+#ifndef avr_io_h
+#define avr_io_h
+
+#include <stdint.h>
+
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+#define EEPM0 4
+#define EEPM1 5
+#define FRZCLK 5
+
+// EECR acts on hostEeprom as it is written: EERE reads EEAR into EEDR and
+// EEPE programs EEDR at EEAR, at once. EERIE stays set until cleared, the
+// ready interrupt runs from hostInterrupts()
+class EepromControl
+{
+  public:
+    EepromControl() : bits( 0 ) {}
+    operator uint8_t() const { return bits; }
+    EepromControl &operator=( int value );
+    EepromControl &operator|=( int value ) { return *this = bits | value; }
+    EepromControl &operator&=( int value ) { return *this = bits & value; }
+  private:
+    uint8_t bits;
+};
+
+extern EepromControl EECR;
+extern volatile uint8_t EEDR;
+extern volatile uint16_t EEAR;
+extern uint8_t hostEeprom[1024];
+
+extern volatile uint8_t SREG, UDCON, USBCON, UCSR1B, EIMSK, EICRB, PCICR, SPCR, ACSR, ADCSRA, TIMSK0, TIMSK1, TIMSK3;
+
+#endif
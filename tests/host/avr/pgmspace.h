@@ -0,0 +1,18 @@
+#ifndef avr_pgmspace_h
+#define avr_pgmspace_h
+
+#include <string.h>
+#include <stdio.h>
+
+typedef const char *PGM_P;
+
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strncpy_P strncpy
+#define sprintf_P sprintf
+#define snprintf_P snprintf
+
+#endif
@@ -0,0 +1,252 @@
+#include <Arduino.h>
+#include <SPI.h>
+#include <EEPROM.h>
+#include "Mcp2515Sim.h"
+
+// What a call or an SPI byte costs on the real thing, near enough
+#define CLOCK_CALL_US 1
+#define SPI_BYTE_US 2
+
+unsigned long long hostMicros = 0;
+int hostAnalog[2] = { 800, 1008 };
+static byte pins[32];
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+SPIClass SPI;
+EEPROMClass EEPROM;
+
+uint8_t hostEeprom[1024];
+static struct EepromBlank { EepromBlank() { memset( hostEeprom, 0xFF, sizeof(hostEeprom) ); } } blank;    // As erased
+EepromControl EECR;
+volatile uint8_t EEDR;
+volatile uint16_t EEAR;
+volatile uint8_t SREG, UDCON, USBCON, UCSR1B, EIMSK, EICRB, PCICR, SPCR, ACSR, ADCSRA, TIMSK0, TIMSK1, TIMSK3;
+
+extern "C" void EE_READY_vect( void ) __attribute__((weak));
+
+// avr-libc's heap bounds, freeRam() reads them
+int __heap_start, *__brkval;
+
+
+void hostAdvance( unsigned long us )
+{
+  hostMicros += us;
+}
+
+unsigned long millis()
+{
+  hostMicros += CLOCK_CALL_US;
+  return (unsigned long) (hostMicros / 1000);
+}
+
+unsigned long micros()
+{
+  hostMicros += CLOCK_CALL_US;
+  return (unsigned long) hostMicros;
+}
+
+void delay( unsigned long ms )
+{
+  hostMicros += ms * 1000ULL;
+}
+
+void delayMicroseconds( unsigned int us )
+{
+  hostMicros += us;
+}
+
+
+void pinMode( uint8_t pin, uint8_t mode )
+{
+  (void) pin;
+  (void) mode;
+}
+
+void digitalWrite( uint8_t pin, uint8_t value )
+{
+  if( pin < sizeof(pins) ) pins[pin] = value;
+  Mcp2515Sim::pinWrite( pin, value );
+}
+
+int digitalRead( uint8_t pin )
+{
+  int level = Mcp2515Sim::pinRead( pin );
+  if( level >= 0 ) return level;
+  return pin < sizeof(pins) ? pins[pin] : LOW;
+}
+
+int analogRead( uint8_t pin )
+{
+  return pin == A0 ? hostAnalog[0] : pin == A1 ? hostAnalog[1] : 0;
+}
+
+
+uint8_t SPIClass::transfer( uint8_t data )
+{
+  hostMicros += SPI_BYTE_US;
+  return Mcp2515Sim::transfer( data );
+}
+
+
+void HardwareSerial::arrive()
+{
+  while( !later.empty() && later.front().first <= hostMicros ){
+    rx.push_back( later.front().second );
+    later.pop_front();
+  }
+}
+
+int HardwareSerial::read()
+{
+  arrive();
+  if( rx.empty() ) return -1;
+  byte b = rx.front();
+  rx.pop_front();
+  return b;
+}
+
+
+// The AVR core's 64 byte TX ring, emptied at 10 bits a byte. Writes never
+// block here, a full buffer only shows in availableForWrite()
+void HardwareSerial::drain()
+{
+  unsigned long long byteUs = 10000000ULL / baud;
+  unsigned long long gone = (hostMicros - txAt) / byteUs;
+  if( gone >= txQueued ){
+    txQueued = 0;
+    txAt = hostMicros;
+  }else{
+    txQueued -= gone;
+    txAt += gone * byteUs;
+  }
+}
+
+size_t HardwareSerial::write( uint8_t b )
+{
+  drain();
+  tx.push_back( (char) b );
+  txQueued++;
+  return 1;
+}
+
+int HardwareSerial::availableForWrite()
+{
+  drain();
+  return txQueued >= SERIAL_TX_BUFFER_SIZE - 1 ? 0 : SERIAL_TX_BUFFER_SIZE - 1 - txQueued;
+}
+
+
+/*
+*  Print, formatted as the Arduino core does
+*/
+size_t Print::write( const uint8_t *buffer, size_t size )
+{
+  for( size_t i=0; i<size; i++ ) write( buffer[i] );
+  return size;
+}
+
+size_t Print::write( const char *s )
+{
+  return s ? write( (const uint8_t*) s, strlen( s ) ) : 0;
+}
+
+size_t Print::printNumber( unsigned long n, int base )
+{
+  char buf[33];
+  char *p = &buf[32];
+  *p = 0;
+  if( base < 2 ) base = 10;
+  do {
+    int d = n % base;
+    n /= base;
+    *--p = d < 10 ? '0' + d : 'A' + d - 10;
+  } while( n );
+  return write( p );
+}
+
+size_t Print::print( const __FlashStringHelper *s ) { return write( (const char*) s ); }
+size_t Print::print( const char *s ) { return write( s ); }
+size_t Print::print( char c ) { return write( (uint8_t) c ); }
+size_t Print::print( unsigned char n, int base ) { return printNumber( n, base ); }
+size_t Print::print( int n, int base ) { return print( (long) n, base ); }
+size_t Print::print( unsigned int n, int base ) { return printNumber( n, base ); }
+size_t Print::print( unsigned long n, int base ) { return printNumber( n, base ); }
+
+size_t Print::print( long n, int base )
+{
+  if( base == 10 && n < 0 ) return write( '-' ) + printNumber( -(unsigned long) n, 10 );
+  return printNumber( (unsigned long) n, base );
+}
+
+size_t Print::print( double n, int digits )
+{
+  char buf[48];
+  snprintf( buf, sizeof(buf), "%.*f", digits, n );
+  return write( buf );
+}
+
+size_t Print::println() { return write( "\r\n" ); }
+size_t Print::println( const __FlashStringHelper *s ) { return print( s ) + println(); }
+size_t Print::println( const char *s ) { return print( s ) + println(); }
+size_t Print::println( char c ) { return print( c ) + println(); }
+size_t Print::println( unsigned char n, int base ) { return print( n, base ) + println(); }
+size_t Print::println( int n, int base ) { return print( n, base ) + println(); }
+size_t Print::println( unsigned int n, int base ) { return print( n, base ) + println(); }
+size_t Print::println( long n, int base ) { return print( n, base ) + println(); }
+size_t Print::println( unsigned long n, int base ) { return print( n, base ) + println(); }
+size_t Print::println( double n, int digits ) { return print( n, digits ) + println(); }
+
+
+/*
+*  EEPROM
+*/
+EepromControl &EepromControl::operator=( int value )
+{
+  bits = value;
+  if( bits & _BV(EERE) ){
+    EEDR = hostEeprom[EEAR % sizeof(hostEeprom)];
+    bits &= ~_BV(EERE);
+  }
+  if( bits & _BV(EEPE) ){
+    hostEeprom[EEAR % sizeof(hostEeprom)] = EEDR;
+    bits &= ~(_BV(EEPE) | _BV(EEMPE));
+  }
+  return *this;
+}
+
+uint8_t eeprom_read_byte( const uint8_t *addr )
+{
+  return hostEeprom[(uintptr_t) addr % sizeof(hostEeprom)];
+}
+
+void eeprom_read_block( void *dst, const void *addr, size_t n )
+{
+  for( size_t i=0; i<n; i++ ) ((uint8_t*) dst)[i] = eeprom_read_byte( (const uint8_t*) addr + i );
+}
+
+void eeprom_write_byte( uint8_t *addr, uint8_t value )
+{
+  hostEeprom[(uintptr_t) addr % sizeof(hostEeprom)] = value;
+}
+
+void eeprom_write_block( const void *src, void *addr, size_t n )
+{
+  for( size_t i=0; i<n; i++ ) eeprom_write_byte( (uint8_t*) addr + i, ((const uint8_t*) src)[i] );
+}
+
+void eeprom_update_byte( uint8_t *addr, uint8_t value )
+{
+  eeprom_write_byte( addr, value );
+}
+
+void eeprom_update_block( const void *src, void *addr, size_t n )
+{
+  eeprom_write_block( src, addr, n );
+}
+
+
+void hostInterrupts()
+{
+  while( EE_READY_vect && (EECR & _BV(EERIE)) ) EE_READY_vect();
+}
@@ -0,0 +1,7 @@
+#ifndef util_atomic_h
+#define util_atomic_h
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_BLOCK(type) for( int atomic_once = 1; atomic_once; atomic_once = 0 )
+
+#endif
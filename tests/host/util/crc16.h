@@ -0,0 +1,15 @@
+#ifndef util_crc16_h
+#define util_crc16_h
+
+#include <stdint.h>
+
+// As avr-libc, polynomial 0xA001
+static inline uint16_t _crc16_update( uint16_t crc, uint8_t a )
+{
+  crc ^= a;
+  for( int i=0; i<8; ++i )
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+  return crc;
+}
+
+#endif
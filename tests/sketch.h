@@ -0,0 +1,45 @@
+/*
+*  The whole sketch built for the host, as the Arduino IDE would: the
+*  prototypes it generates for functions used before their definition,
+*  then the .ino itself. Tests drive setup() and loop() against one
+*  simulated MCP2515 per bus, see runFor().
+*/
+
+#ifndef sketch_h
+#define sketch_h
+
+#include <Arduino.h>
+
+class CANBus;
+class Message;
+void toggleMazdaLed();
+boolean sendMessage( Message msg, CANBus &bus );
+void readBus( CANBus &bus );
+void processMessage( Message msg );
+void longButtonPressHandler();
+
+#include "../CANBusTriple_Mazda/CANBusTriple_Mazda.ino"
+
+#include "host/Mcp2515Sim.h"
+
+// Wired as on the board: select, reset, interrupt
+static Mcp2515Sim sim1( CAN1SELECT, CAN1RESET, CAN1INT_D );
+static Mcp2515Sim sim2( CAN2SELECT, CAN2RESET, CAN2INT_D );
+static Mcp2515Sim sim3( CAN3SELECT, CAN3RESET, CAN3INT_D );
+
+
+// loop() for ms of simulated time, calling step between iterations
+static inline void runFor( unsigned long ms, void (*step)() = NULL )
+{
+  unsigned long long end = hostMicros + ms * 1000ULL;
+  while( hostMicros < end ){
+    loop();
+    hostInterrupts();
+    sim1.update();
+    sim2.update();
+    sim3.update();
+    if( step ) step();
+  }
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+*  Bluetooth shaper: the token bucket refills at BT_SHAPER_BYTES_PER_MS up to
+*  BT_SHAPER_BURST, consume() also waits for room in the Serial1 TX buffer,
+*  and frames that find no slot are counted as dropped, frames replacing a
+*  pending one as coalesced.
+*/
+
+#include "sketch.h"
+#include "check.h"
+
+
+static void emptyBucket()
+{
+  hostAdvance( 20000 );
+  while( BluetoothShaper::consume( 1 ) );
+  BluetoothShaper::resetStats();
+}
+
+
+static void testRefill()
+{
+  emptyBucket();
+  CHECK( !BluetoothShaper::consume( 1 ) );
+  CHECK_EQ( BluetoothShaper::refused, 1 );
+
+  // 2ms buys 10 bytes and no more
+  hostAdvance( 2000 );
+  CHECK( BluetoothShaper::consume( 2 * BT_SHAPER_BYTES_PER_MS ) );
+  CHECK( !BluetoothShaper::consume( 1 ) );
+
+  // A long idle spell fills it only to the burst size
+  hostAdvance( 500000 );
+  CHECK( !BluetoothShaper::consume( BT_SHAPER_BURST + 1 ) );
+  CHECK( BluetoothShaper::consume( BT_SHAPER_BURST ) );
+  CHECK_EQ( BluetoothShaper::refused, 3 );
+}
+
+
+// A command reply filling the UART holds shaped output back, tokens or not
+static void testUartFull()
+{
+  hostAdvance( 100000 );
+  Serial1.take();
+  for( int i=0; i<60; i++ ) Serial1.write( 'x' );
+  BluetoothShaper::resetStats();
+  CHECK( !BluetoothShaper::consume( BT_LOG_RECORD_SIZE ) );
+  CHECK_EQ( BluetoothShaper::refused, 1 );
+
+  // 57600 baud drains it in about 10ms
+  hostAdvance( 12000 );
+  CHECK( BluetoothShaper::consume( BT_LOG_RECORD_SIZE ) );
+  Serial1.take();
+}
+
+
+static Message frame( unsigned short id, byte value )
+{
+  Message msg;
+  msg.busId = 1;
+  msg.frame_id = id;
+  msg.length = 8;
+  msg.extended = false;
+  msg.busStatus = 0;
+  memset( msg.frame_data, value, 8 );
+  return msg;
+}
+
+
+static void testDropsCoalesce()
+{
+  hostAdvance( 100000 );
+  BluetoothShaper::resetStats();
+
+  // Every slot held by an ID with a policy, a ninth ID has nowhere to go
+  for( byte i=0; i<BT_SHAPER_SLOTS; i++ )
+    CHECK( BluetoothShaper::setPolicy( 1, 0x400 + i, 1000, 1, BT_PRIORITY_NORMAL ) );
+  BluetoothShaper::offer( frame( 0x500, 1 ) );
+  CHECK_EQ( BluetoothShaper::dropped, 1 );
+  CHECK( !BluetoothShaper::setPolicy( 1, 0x500, 0, 1, BT_PRIORITY_NORMAL ) );
+
+  // Two frames before a tick, one record with the newer value
+  Serial1.take();
+  BluetoothShaper::offer( frame( 0x400, 1 ) );
+  BluetoothShaper::offer( frame( 0x400, 2 ) );
+  CHECK_EQ( BluetoothShaper::coalesced, 1 );
+  BluetoothShaper::tick();
+  std::string out = Serial1.take();
+  CHECK_EQ( out.size(), BT_LOG_RECORD_SIZE );
+  if( out.size() == BT_LOG_RECORD_SIZE ) CHECK_EQ( (byte) out[4], 2 );
+  CHECK_EQ( BluetoothShaper::sent, 1 );
+
+  // Skipped by decimation is neither
+  CHECK( BluetoothShaper::setPolicy( 1, 0x401, 0, 4, BT_PRIORITY_NORMAL ) );
+  for( byte i=0; i<3; i++ ) BluetoothShaper::offer( frame( 0x401, i ) );
+  CHECK_EQ( BluetoothShaper::dropped, 1 );
+  CHECK_EQ( BluetoothShaper::coalesced, 1 );
+
+  Serial.take();
+  BluetoothShaper::printStats( &Serial );
+  std::string stats = Serial.take();
+  CHECK( stats.find( "\"dropped\":\"1\"" ) != std::string::npos );
+  CHECK( stats.find( "\"refused\":\"0\"" ) != std::string::npos );
+}
+
+
+// Frames offered faster than the bucket drains leave at its rate
+static void testRate()
+{
+  for( byte i=0; i<BT_SHAPER_SLOTS; i++ )
+    BluetoothShaper::setPolicy( 1, 0x400 + i, 0, 1, BT_PRIORITY_NORMAL );
+  emptyBucket();
+  Serial1.take();
+
+  size_t most = 0;
+  for( int ms=0; ms<300; ms++ ){
+    for( byte i=0; i<BT_SHAPER_SLOTS; i++ ) BluetoothShaper::offer( frame( 0x400 + i, ms ) );
+    BluetoothShaper::tick();
+    int queued = SERIAL_TX_BUFFER_SIZE - 1 - Serial1.availableForWrite();
+    if( (size_t) queued > most ) most = queued;
+    hostAdvance( 1000 );
+  }
+
+  size_t bytes = Serial1.take().size();
+  CHECK( bytes <= 300 * BT_SHAPER_BYTES_PER_MS );
+  CHECK( bytes >= 300 * BT_SHAPER_BYTES_PER_MS - 2 * BT_LOG_RECORD_SIZE );
+  CHECK( most < SERIAL_TX_BUFFER_SIZE - 1 );
+  CHECK_EQ( BluetoothShaper::sent * BT_LOG_RECORD_SIZE, bytes );
+  CHECK_EQ( BluetoothShaper::dropped, 0 );
+  CHECK( BluetoothShaper::coalesced > 0 );
+}
+
+
+int main()
+{
+  setup();
+  Serial.take();
+
+  testRefill();
+  testUartFull();
+  testDropsCoalesce();
+  testRate();
+  return checkSummary( "test_btshaper" );
+}
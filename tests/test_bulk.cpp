@@ -0,0 +1,172 @@
+/*
+*  Bulk send (0x07) over a link as slow as Bluetooth: the frames are read
+*  as they arrive without holding up the loop, all of them reach the bus or
+*  none do, and the one ACK counts frames sent apart from requests the
+*  diagnostic cache took.
+*/
+
+#include "sketch.h"
+#include "check.h"
+
+#define BT_US_PER_BYTE 174          // 57600 baud, 10 bits a byte
+
+static unsigned long long lastStep;
+static unsigned long longestLoop;
+
+
+static void timeLoop()
+{
+  if( hostMicros - lastStep > longestLoop ) longestLoop = hostMicros - lastStep;
+  lastStep = hostMicros;
+}
+
+
+// Count, frames, 8 bit sum of both
+static std::vector<byte> bulk( const std::vector< std::vector<byte> > &frames )
+{
+  std::vector<byte> cmd;
+  cmd.push_back( 0x07 );
+  cmd.push_back( frames.size() );
+  byte sum = frames.size();
+  for( size_t i=0; i<frames.size(); i++ )
+    for( size_t k=0; k<frames[i].size(); k++ ){
+      cmd.push_back( frames[i][k] );
+      sum += frames[i][k];
+    }
+  cmd.push_back( sum );
+  return cmd;
+}
+
+
+static void feedSlow( const std::vector<byte> &cmd )
+{
+  unsigned long long at = hostMicros;
+  for( size_t i=0; i<cmd.size(); i++ ){
+    at += BT_US_PER_BYTE;
+    Serial.feedAt( cmd[i], at );
+  }
+}
+
+
+static bool ackIs( const std::string &reply, byte sent, byte cached, byte status )
+{
+  return reply.size() == 5 && (byte) reply[0] == 0x07 && (byte) reply[1] == sent &&
+         (byte) reply[2] == cached && (byte) reply[3] == status && reply[4] == '\r';
+}
+
+
+static std::vector<SimFrame> sentFrom( size_t from, unsigned short lo, unsigned short hi )
+{
+  std::vector<SimFrame> frames;
+  for( size_t i=from; i<sim1.sent.size(); i++ )
+    if( sim1.sent[i].id >= lo && sim1.sent[i].id < hi ) frames.push_back( sim1.sent[i] );
+  return frames;
+}
+
+
+static void testSlowLink()
+{
+  std::vector< std::vector<byte> > frames;
+  for( byte i=0; i<BULK_MAX_FRAMES; i++ ){
+    std::vector<byte> f;
+    f.push_back( 1 );
+    f.push_back( 0x03 );
+    f.push_back( i );
+    f.push_back( i % 9 );
+    for( byte k=0; k<i % 9; k++ ) f.push_back( i + k );
+    frames.push_back( f );
+  }
+
+  size_t from = sim1.sent.size();
+  Serial.take();
+  feedSlow( bulk( frames ) );
+  lastStep = hostMicros;
+  longestLoop = 0;
+  runFor( 100, timeLoop );
+
+  // The body takes about 20ms to arrive, no loop() waited for it
+  CHECK( longestLoop < 2000 );
+  CHECK( ackIs( Serial.take(), BULK_MAX_FRAMES, 0, COMMAND_OK ) );
+
+  // Each once, in whatever order the TX buffers took them
+  std::vector<SimFrame> out = sentFrom( from, 0x300, 0x310 );
+  CHECK_EQ( out.size(), BULK_MAX_FRAMES );
+  unsigned long seen = 0;
+  for( size_t i=0; i<out.size(); i++ ){
+    byte n = out[i].id - 0x300;
+    seen |= 1UL << n;
+    CHECK_EQ( out[i].length, n % 9 );
+    if( out[i].length > 0 ) CHECK_EQ( out[i].data[0], n );
+  }
+  CHECK_EQ( seen, (1UL << BULK_MAX_FRAMES) - 1 );
+}
+
+
+static void testRejected()
+{
+  std::vector< std::vector<byte> > frames( 2, std::vector<byte>() );
+  byte good[] = { 1, 0x03, 0x20, 2, 0xAA, 0xBB };
+  frames[0].assign( good, good + sizeof(good) );
+  frames[1].assign( good, good + sizeof(good) );
+  frames[1][2] = 0x21;
+
+  // Bad checksum, neither frame goes out
+  size_t from = sim1.sent.size();
+  std::vector<byte> cmd = bulk( frames );
+  cmd.back() ^= 0x01;
+  Serial.take();
+  feedSlow( cmd );
+  runFor( 50 );
+  CHECK( ackIs( Serial.take(), 0, 0, COMMAND_ERROR ) );
+
+  // Bus 4
+  cmd = bulk( frames );
+  cmd[2 + 6] = 4;
+  cmd.back() += 3;
+  feedSlow( cmd );
+  runFor( 50 );
+  CHECK( ackIs( Serial.take(), 0, 0, COMMAND_ERROR ) );
+
+  // The host stops half way, the command times out
+  cmd = bulk( frames );
+  cmd.resize( 8 );
+  feedSlow( cmd );
+  runFor( 20 );
+  CHECK( Serial.take().empty() );
+  runFor( BULK_TIMEOUT + 10 );
+  CHECK( ackIs( Serial.take(), 0, 0, COMMAND_ERROR ) );
+  CHECK( sentFrom( from, 0x320, 0x322 ).empty() );
+
+  // And the port takes commands again
+  feedSlow( bulk( frames ) );
+  runFor( 50 );
+  CHECK( ackIs( Serial.take(), 2, 0, COMMAND_OK ) );
+  CHECK_EQ( sentFrom( from, 0x320, 0x322 ).size(), 2 );
+}
+
+
+// The same request twice in one batch goes out once
+static void testCached()
+{
+  byte request[] = { 1, 0x07, 0xE0, 8, 0x02, 0x01, 0x0D, 0, 0, 0, 0, 0 };
+  std::vector< std::vector<byte> > frames( 2, std::vector<byte>( request, request + sizeof(request) ) );
+  size_t from = sim1.sent.size();
+
+  Serial.take();
+  feedSlow( bulk( frames ) );
+  runFor( 50 );
+  CHECK( ackIs( Serial.take(), 1, 1, COMMAND_OK ) );
+  CHECK_EQ( sentFrom( from, 0x7E0, 0x7E1 ).size(), 1 );
+}
+
+
+int main()
+{
+  setup();
+  Serial.take();
+
+  testSlowLink();
+  testRejected();
+  testCached();
+  return checkSummary( "test_bulk" );
+}
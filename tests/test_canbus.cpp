@@ -0,0 +1,276 @@
+/*
+*  CANBus library against the simulated MCP2515: identifier packing, the
+*  RX and TX paths for 11 and 29 bit frames, filters and setBitrate().
+*/
+
+#include <Arduino.h>
+#include <CANBus.h>
+#include "host/Mcp2515Sim.h"
+#include "check.h"
+
+static const byte payload[8] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 };
+
+
+static void testPackId()
+{
+  static const unsigned long standard[] = { 0x000, 0x001, 0x123, 0x7E8, 0x7FF };
+  static const unsigned long extended[] = { 0x00000000, 0x00000001, 0x0003FFFF, 0x00040000, 0x18DAF110, 0x1FFFFFFF };
+  byte regs[4];
+  bool ext;
+
+  for( size_t i=0; i<sizeof(standard)/sizeof(standard[0]); i++ ){
+    CANBus::packId( standard[i], false, regs );
+    CHECK( !(regs[1] & EXIDE) );
+    CHECK_EQ( regs[2], 0 );
+    CHECK_EQ( regs[3], 0 );
+    CHECK_EQ( CANBus::unpackId( regs, &ext ), standard[i] );
+    CHECK( !ext );
+  }
+
+  for( size_t i=0; i<sizeof(extended)/sizeof(extended[0]); i++ ){
+    CANBus::packId( extended[i], true, regs );
+    CHECK( regs[1] & EXIDE );
+    CHECK_EQ( regs[1] & 0x14, 0 );      // SRR and the unimplemented bit
+    CHECK_EQ( CANBus::unpackId( regs, &ext ), extended[i] );
+    CHECK( ext );
+  }
+
+  // A standard ID ignores whatever the extended ID registers hold
+  regs[0] = 0xFD; regs[1] = 0x00; regs[2] = 0xA5; regs[3] = 0x5A;
+  CHECK_EQ( CANBus::unpackId( regs, &ext ), 0x7E8 );
+  CHECK( !ext );
+}
+
+
+static void start( CANBus &bus )
+{
+  bus.begin();
+  CHECK( bus.setBitrate( 500000 ) );
+  bus.setRxInt( true );
+  bus.setMode( NORMAL );
+}
+
+
+static void testReceive()
+{
+  Mcp2515Sim sim( 10, 12, 2 );
+  CANBus bus( 10, 12, 2, F("Bus 2") );
+  start( bus );
+  sim.update();
+  CHECK_EQ( sim.mode(), 0x00 );
+  CHECK_EQ( sim.bitRate(), 500000 );
+  CHECK_EQ( digitalRead( 2 ), HIGH );
+
+  byte length, data[8];
+  unsigned long id;
+  bool ext;
+
+  // 29 bit first, so the extended ID registers hold something stale
+  CHECK( sim.receive( 0x18DAF110, true, 8, payload ) );
+  CHECK_EQ( digitalRead( 2 ), LOW );
+  CHECK_EQ( bus.readStatus() & 0x03, 0x01 );
+  unsigned long before = sim.transfers;
+  bus.readDATA_ff_0( &length, data, &id, &ext );
+  CHECK_EQ( sim.transfers - before, 6 + 8 );
+  CHECK_EQ( id, 0x18DAF110 );
+  CHECK( ext );
+  CHECK_EQ( length, 8 );
+  CHECK( memcmp( data, payload, 8 ) == 0 );
+  CHECK_EQ( bus.readStatus() & 0x03, 0 );
+  CHECK_EQ( digitalRead( 2 ), HIGH );
+
+  // The 11 bit path costs what it did before 29 bit IDs: instruction, 4 ID bytes, DLC, data
+  for( byte len=0; len<=8; len++ ){
+    CHECK( sim.receive( 0x7E8, false, len, payload ) );
+    before = sim.transfers;
+    bus.readDATA_ff_0( &length, data, &id, &ext );
+    CHECK_EQ( sim.transfers - before, 6 + len );
+    CHECK_EQ( id, 0x7E8 );
+    CHECK( !ext );
+    CHECK_EQ( length, len );
+    CHECK( memcmp( data, payload, len ) == 0 );
+  }
+
+  // Without rollover a second frame overflows RXB0
+  CHECK( sim.receive( 0x100, false, 1, payload ) );
+  CHECK( !sim.receive( 0x101, false, 1, payload ) );
+  CHECK( bus.readRegister( EFLG ) & RX0OVR );
+  bus.modifyRegister( EFLG, RX0OVR | RX1OVR, 0 );
+  CHECK_EQ( bus.readRegister( EFLG ) & RX0OVR, 0 );
+
+  // With it the next goes to RXB1
+  bus.modifyRegister( RXB0CTRL, 0x04, 0x04 );
+  CHECK( sim.receive( 0x1ABCDEF, true, 2, payload ) );
+  CHECK_EQ( bus.readStatus() & 0x03, 0x03 );
+  bus.readDATA_ff_1( &length, data, &id, &ext );
+  CHECK_EQ( id, 0x1ABCDEF );
+  CHECK( ext );
+  CHECK_EQ( length, 2 );
+  bus.readDATA_ff_0( &length, data, &id, &ext );
+  CHECK_EQ( id, 0x100 );
+  CHECK( !ext );
+  CHECK_EQ( bus.readStatus() & 0x03, 0 );
+}
+
+
+static void testTransmit()
+{
+  Mcp2515Sim sim( 10, 12, 2 );
+  CANBus bus( 10, 12, 2, F("Bus 2") );
+  start( bus );
+
+  unsigned long before = sim.transfers;
+  bus.load_ff_0( 8, 0x7DF, (byte*) payload );
+  CHECK_EQ( sim.transfers - before, 6 + 8 );
+  bus.send_0();
+  bus.load_ff_1( 3, 0x18DB33F1, (byte*) payload, true );
+  bus.send_1();
+  bus.load_ff_2( 1, 0x123, (byte*) payload );
+  bus.send_2();
+  CHECK_EQ( bus.getNextTxBuffer(), -1 );
+
+  hostAdvance( 2000 );
+  sim.update();
+  CHECK_EQ( sim.sent.size(), 3 );
+  CHECK_EQ( bus.getNextTxBuffer(), 0 );
+  if( sim.sent.size() != 3 ) return;
+
+  // TXB0 was on the bus before the others were loaded, then at the same
+  // priority the higher buffer goes first
+  CHECK_EQ( sim.sent[0].id, 0x7DF );
+  CHECK( !sim.sent[0].extended );
+  CHECK( memcmp( sim.sent[0].data, payload, 8 ) == 0 );
+  CHECK_EQ( sim.sent[1].id, 0x123 );
+  CHECK( !sim.sent[1].extended );
+  CHECK_EQ( sim.sent[1].length, 1 );
+  CHECK_EQ( sim.sent[2].id, 0x18DB33F1 );
+  CHECK( sim.sent[2].extended );
+  CHECK_EQ( sim.sent[2].length, 3 );
+}
+
+
+static void testFilters()
+{
+  Mcp2515Sim sim( 10, 12, 2 );
+  CANBus bus( 10, 12, 2, F("Bus 2") );
+  start( bus );
+  byte length, data[8];
+  unsigned long id;
+  bool ext;
+
+  bus.setMode( CONFIGURATION );
+  bus.setFilterExt( 0x18DAF110, 0x18DAF110 );
+  bus.modifyRegister( RXB0CTRL, RXM_MASK, 0 );
+  bus.modifyRegister( RXB1CTRL, RXM_MASK, 0 );
+  bus.setMode( NORMAL );
+
+  CHECK( !sim.receive( 0x110, false, 0, payload ) );
+  CHECK( !sim.receive( 0x18DAF100, true, 0, payload ) );
+  CHECK( sim.receive( 0x18DAF110, true, 0, payload ) );
+  bus.readDATA_ff_0( &length, data, &id, &ext );
+  CHECK_EQ( id, 0x18DAF110 );
+
+  bus.setMode( CONFIGURATION );
+  bus.setFilter( 0x7E8, 0x7E8 );
+  bus.setMode( NORMAL );
+  CHECK( sim.receive( 0x7E8, false, 0, payload ) );
+  bus.readDATA_ff_0( &length, data, &id, &ext );
+  CHECK( !sim.receive( 0x7E0, false, 0, payload ) );
+  CHECK( !sim.receive( 0x18DAF110, true, 0, payload ) );
+}
+
+
+static void testSetBitrate()
+{
+  Mcp2515Sim sim( 10, 12, 2 );
+  CANBus bus( 10, 12, 2, F("Bus 2") );
+  start( bus );
+
+  // Nobody ACKs, the frame is retried until the bitrate change aborts it
+  sim.acked = false;
+  bus.load_ff_0( 8, 0x7DF, (byte*) payload );
+  bus.send_0();
+  hostAdvance( 5000 );
+  CHECK( bus.readRegister( TEC ) > 0 );
+  CHECK_EQ( bus.getNextTxBuffer(), 1 );
+
+  CHECK( bus.setBitrate( 250000 ) );
+  CHECK_EQ( sim.bitRate(), 250000 );
+  CHECK_EQ( bus.bitRate, 250000 );
+  CHECK_EQ( bus.readRegister( CANSTAT ) & 0xE0, 0x00 );
+  CHECK_EQ( bus.readRegister( CANCTRL ) & ABAT, 0 );
+  CHECK_EQ( bus.getNextTxBuffer(), 0 );
+  CHECK( sim.sent.empty() );
+
+  // The mode it was in is kept
+  bus.setMode( LISTEN );
+  CHECK( bus.setBitrate( 125000 ) );
+  CHECK_EQ( bus.readRegister( CANSTAT ) & 0xE0, 0x60 );
+  CHECK( !bus.setBitrate( 1234 ) );
+  CHECK_EQ( bus.bitRate, 125000 );
+}
+
+
+/*
+*  Rates the calculation has to meet, with the MCP2515 limits on every
+*  field (datasheet 5.3): BRP 1-64, PropSeg and PS1 1-8, PS2 2-8, SJW 1-4
+*  and no longer than PS2, PropSeg + PS1 >= PS2, 8-25 Tq a bit. The rate
+*  the simulated controller then runs at must be within 0.5%, and the
+*  sample point near the CiA target for the rate.
+*/
+static void testBitrateTable()
+{
+  static const struct {
+    unsigned long rate;
+    unsigned int samplePoint;       // per mille
+  } rates[] = {
+    { 33333, 875 }, { 83333, 875 }, { 125000, 875 }, { 500000, 875 }, { 800000, 800 }, { 1000000, 750 },
+  };
+
+  Mcp2515Sim sim( 10, 12, 2 );
+  CANBus bus( 10, 12, 2, F("Bus 2") );
+  start( bus );
+
+  for( size_t i=0; i<sizeof(rates)/sizeof(rates[0]); i++ ){
+    struct bitTiming t;
+    CHECK( CANBus::calcBitTiming( rates[i].rate, CAN_OSC_HZ, &t ) );
+    unsigned int ntq = 1 + t.prop + t.ps1 + t.ps2;
+    CHECK( t.brp >= 1 && t.brp <= 64 );
+    CHECK( t.prop >= 1 && t.prop <= 8 );
+    CHECK( t.ps1 >= 1 && t.ps1 <= 8 );
+    CHECK( t.ps2 >= 2 && t.ps2 <= 8 );
+    CHECK( t.sjw >= 1 && t.sjw <= 4 && t.sjw <= t.ps2 );
+    CHECK( t.prop + t.ps1 >= t.ps2 );
+    CHECK( ntq >= 8 && ntq <= 25 );
+
+    unsigned int sp = (1 + t.prop + t.ps1) * 1000 / ntq;
+    CHECK( sp + 50 >= rates[i].samplePoint && sp <= rates[i].samplePoint + 50 );
+
+    CHECK( bus.setBitrate( rates[i].rate ) );
+    unsigned long actual = sim.bitRate();
+    CHECK_EQ( actual, CAN_OSC_HZ / (2UL * t.brp * ntq) );
+    CHECK( labs( (long) actual - (long) rates[i].rate ) * 200 <= (long) rates[i].rate );
+  }
+
+  // Too slow for BRP 64 at 25 Tq, too fast for BRP 1 at 8 Tq, or no divider within 0.5%
+  static const unsigned long unreachable[] = { 0, 1234, 4000, 900000, 1100000, 2000000 };
+  for( size_t i=0; i<sizeof(unreachable)/sizeof(unreachable[0]); i++ ){
+    struct bitTiming t;
+    CHECK( !CANBus::calcBitTiming( unreachable[i], CAN_OSC_HZ, &t ) );
+    CHECK( !bus.setBitrate( unreachable[i] ) );
+  }
+  CHECK_EQ( bus.bitRate, 1000000 );
+  CHECK_EQ( sim.bitRate(), 1000000 );
+}
+
+
+int main()
+{
+  testPackId();
+  testReceive();
+  testTransmit();
+  testFilters();
+  testSetBitrate();
+  testBitrateTable();
+  return checkSummary( "test_canbus" );
+}
@@ -0,0 +1,123 @@
+/*
+*  Cyclic transmit in the running sketch: frames leave bus 1 on their
+*  period and in phase with the first one, with the counter byte stepping
+*  once a frame, and the lateness measured where sendMessage() loads a TX
+*  buffer, so frames held up in the write queue show in the stats.
+*/
+
+#include "sketch.h"
+#include "check.h"
+
+#define PERIOD_US 10000UL
+
+
+static std::vector<SimFrame> framesOn( unsigned long id, size_t from )
+{
+  std::vector<SimFrame> frames;
+  for( size_t i=from; i<sim1.sent.size(); i++ )
+    if( sim1.sent[i].id == id ) frames.push_back( sim1.sent[i] );
+  return frames;
+}
+
+
+static void testPeriodPhase()
+{
+  static byte data[8] = { 0x11, 0x22, 0, 0, 0, 0, 0, 0 };
+  size_t from = sim1.sent.size();
+
+  CyclicTransmit::resetStats();
+  CHECK( CyclicTransmit::setJob( 0, 1, 0x290, 8, data, PERIOD_US / 1000, 7, CYCLIC_NO_BYTE ) );
+  CHECK( CyclicTransmit::setJob( 1, 1, 0x291, 4, data, 25, CYCLIC_NO_BYTE, 3 ) );
+  runFor( 1000 );
+
+  std::vector<SimFrame> f = framesOn( 0x290, from );
+  CHECK( f.size() >= 99 && f.size() <= 101 );
+  CHECK( framesOn( 0x291, from ).size() >= 39 && framesOn( 0x291, from ).size() <= 41 );
+
+  // Every frame on the grid of the first, no drift from one to the next
+  long worst = 0;
+  for( size_t i=1; i<f.size(); i++ ){
+    long phase = (long)(f[i].at - f[0].at) - (long)(i * PERIOD_US);
+    if( labs( phase ) > worst ) worst = labs( phase );
+    CHECK_EQ( (byte)(f[i].data[7] - f[i-1].data[7]), 1 );
+  }
+  CHECK( worst < 500 );
+
+  Serial.take();
+  CyclicTransmit::printStats( &Serial );
+  std::string stats = Serial.take();
+  CHECK( stats.find( "\"slot\":\"0\"" ) != std::string::npos );
+  CHECK( stats.find( "\"jitterUs\":\"" ) != std::string::npos );
+}
+
+
+// A burst queued ahead of it keeps the TX buffers busy for about 40ms, the
+// frames wait in the write queue and that is measured
+static void testTxPathLateness()
+{
+  runFor( 20 );
+  CyclicTransmit::resetStats();
+
+  Message burst;
+  burst.busId = 1;
+  burst.frame_id = 0x100;
+  burst.length = 8;
+  burst.dispatch = true;
+  for( int i=0; i<180; i++ ) writeQueue.push( burst );
+  runFor( 200 );
+
+  Serial.take();
+  CyclicTransmit::printStats( &Serial );
+  std::string stats = Serial.take();
+  size_t at = stats.find( "\"lateMaxUs\":\"" );
+  CHECK( at != std::string::npos );
+  if( at != std::string::npos ) CHECK( strtoul( stats.c_str() + at + 13, NULL, 10 ) > 20000 );
+
+  // In time again once the bus took the backlog
+  size_t from = sim1.sent.size();
+  CyclicTransmit::resetStats();
+  runFor( 200 );
+  CHECK( framesOn( 0x290, from ).size() >= 19 );
+  CyclicTransmit::printStats( &Serial );
+  stats = Serial.take();
+  at = stats.find( "\"lateMaxUs\":\"" );
+  if( at != std::string::npos ) CHECK( strtoul( stats.c_str() + at + 13, NULL, 10 ) < 1000 );
+}
+
+
+// Clearing the last job gives the table back, a new job takes it again
+static void testClearLast()
+{
+  static byte data[8] = { 0 };
+  CyclicTransmit::clearJob( 0 );
+  CyclicTransmit::clearJob( 1 );
+  Serial.take();
+  CyclicTransmit::printStats( &Serial );
+  CHECK( Serial.take().empty() );
+
+  // Frames already queued still go
+  runFor( 10 );
+  size_t from = sim1.sent.size();
+  runFor( 50 );
+  CHECK( framesOn( 0x290, from ).empty() );
+
+  CHECK( CyclicTransmit::setJob( 2, 1, 0x292, 2, data, 10, CYCLIC_NO_BYTE, CYCLIC_NO_BYTE ) );
+  runFor( 100 );
+  CHECK( framesOn( 0x292, from ).size() >= 9 );
+  CyclicTransmit::printStats( &Serial );
+  CHECK( Serial.take().find( "\"slot\":\"2\"" ) != std::string::npos );
+}
+
+
+int main()
+{
+  setup();
+  Serial.take();
+
+  testPeriodPhase();
+  testTxPathLateness();
+  testClearLast();
+
+  CyclicTransmit::clearAll();
+  return checkSummary( "test_cyclic" );
+}
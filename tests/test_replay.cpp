@@ -0,0 +1,185 @@
+/*
+*  Trace replay end to end: the host client in tools/replay streams a trace
+*  over a simulated serial link into the running sketch, which plays it
+*  onto a simulated controller. Checks every frame goes out once, in order
+*  and at its offset, with the link as slow as Bluetooth so frame batches
+*  take many loops to arrive.
+*/
+
+#include "sketch.h"
+#include "../tools/replay/TraceStream.h"
+#include "check.h"
+
+#define BT_US_PER_BYTE 174          // 57600 baud, 10 bits a byte
+
+static TraceStream *stream;
+static unsigned long long linkFreeAt;
+static unsigned long usPerByte;
+
+
+// Host side of the link, between two loop() calls. Bytes reach the sketch
+// one every usPerByte, also while it waits for them.
+static void linkStep()
+{
+  std::string back = Serial.take();
+  if( !back.empty() ) stream->input( (const uint8_t*) back.data(), back.size() );
+
+  std::vector<uint8_t> out;
+  stream->output( (unsigned long) (hostMicros / 1000), &out );
+  if( linkFreeAt < hostMicros ) linkFreeAt = hostMicros;
+  for( size_t i=0; i<out.size(); i++ ){
+    linkFreeAt += usPerByte;
+    Serial.feedAt( out[i], linkFreeAt );
+  }
+}
+
+
+static std::vector<TraceFrame> makeTrace( size_t n, unsigned long spacing )
+{
+  std::vector<TraceFrame> trace;
+  unsigned long offset = 0;
+  for( size_t i=0; i<n; i++ ){
+    TraceFrame f;
+    memset( &f, 0, sizeof(f) );
+    f.offset = offset;
+    f.busId = 1;
+    f.id = 0x300 + (i % 8);
+    f.length = 2 + (i % 7);
+    for( byte k=0; k<f.length; k++ ) f.data[k] = i + k;
+    trace.push_back( f );
+    offset += spacing;
+    if( i == n/2 ) offset += 40000;    // A quiet spell
+  }
+  return trace;
+}
+
+
+static bool play( const std::vector<TraceFrame> &trace, unsigned long linkUs )
+{
+  TraceStream s( trace, 0, 20 );
+  stream = &s;
+  usPerByte = linkUs;
+  Serial.take();
+
+  unsigned long long end = hostMicros + 10000000ULL;
+  while( !s.done() && hostMicros < end ) runFor( 1, linkStep );
+  stream = NULL;
+  return s.done();
+}
+
+
+// Replayed frames sent from sim1 after index from
+static std::vector<SimFrame> replayed( size_t from )
+{
+  std::vector<SimFrame> frames;
+  for( size_t i=from; i<sim1.sent.size(); i++ )
+    if( sim1.sent[i].id >= 0x300 && sim1.sent[i].id < 0x308 ) frames.push_back( sim1.sent[i] );
+  return frames;
+}
+
+
+static void testTiming()
+{
+  std::vector<TraceFrame> trace = makeTrace( 60, 5000 );
+  size_t from = sim1.sent.size();
+
+  CHECK( play( trace, BT_US_PER_BYTE ) );
+  CHECK_EQ( TraceReplay::played, trace.size() );
+  CHECK_EQ( TraceReplay::underruns, 0 );
+  CHECK_EQ( TraceReplay::overflows, 0 );
+
+  std::vector<SimFrame> out = replayed( from );
+  CHECK_EQ( out.size(), trace.size() );
+  if( out.size() != trace.size() ) return;
+
+  long worst = 0;
+  for( size_t i=0; i<trace.size(); i++ ){
+    CHECK_EQ( out[i].id, trace[i].id );
+    CHECK_EQ( out[i].length, trace[i].length );
+    CHECK( memcmp( out[i].data, trace[i].data, trace[i].length ) == 0 );
+
+    // Against the first frame, both end on the bus so its length cancels out
+    long error = (long) (out[i].at - out[0].at) - (long) trace[i].offset
+                 - (long) (sim1.frameMicros( false, trace[i].length ) - sim1.frameMicros( false, trace[0].length ));
+    if( labs( error ) > worst ) worst = labs( error );
+  }
+  CHECK( worst < 1000 );
+
+  // Nothing later than 1ms, the histogram agrees
+  for( byte b=5; b<REPLAY_HIST_BUCKETS; b++ ) CHECK_EQ( TraceReplay::hist[b], 0 );
+}
+
+
+static void testUnderrun()
+{
+  // A frame a millisecond is more than the link carries
+  std::vector<TraceFrame> trace = makeTrace( 80, 1000 );
+  size_t from = sim1.sent.size();
+
+  CHECK( play( trace, BT_US_PER_BYTE ) );
+  CHECK_EQ( TraceReplay::played, trace.size() );
+  CHECK( TraceReplay::underruns > 0 );
+  CHECK_EQ( TraceReplay::overflows, 0 );
+  CHECK_EQ( replayed( from ).size(), trace.size() );
+}
+
+
+// A frame for bus 0 or 4 is dropped with the rest of its batch, never played
+static void testBadBus()
+{
+  static const byte arm[] = { 0x09, 0x01, 0x00, 0x00, 0x00 };
+  static const byte batch[] = { 0x09, 0x02, 0x02,
+                                0, 0, 0, 0,  0x04,  0x03, 0x01,  0x01,  0xAA,
+                                0, 0, 0, 0,  0x01,  0x03, 0x02,  0x01,  0xBB };
+  static const byte abort[] = { 0x09, 0x04 };
+  Mcp2515Sim *sims[] = { &sim1, &sim2, &sim3 };
+  size_t from[3];
+  for( byte b=0; b<3; b++ ) from[b] = sims[b]->sent.size();
+
+  Serial.take();
+  Serial.feed( arm, sizeof(arm) );
+  runFor( 5 );
+  Serial.feed( batch, sizeof(batch) );
+  runFor( 100 );
+
+  std::string reply = Serial.take();
+  CHECK( reply.size() >= 6 && (byte) reply[3] == 0x09 && (byte) reply[5] == 0x0D );
+  CHECK_EQ( TraceReplay::played, 0 );
+  for( byte b=0; b<3; b++ )
+    for( size_t i=from[b]; i<sims[b]->sent.size(); i++ )
+      CHECK( sims[b]->sent[i].id != 0x301 && sims[b]->sent[i].id != 0x302 );
+
+  Serial.feed( abort, sizeof(abort) );
+  runFor( 5 );
+  Serial.take();
+}
+
+
+static void testCandump()
+{
+  TraceFrame f;
+  double t;
+  CHECK( parseCandump( "(1436509052.249713) can1 290#0102AB\n", &f, &t ) );
+  CHECK_EQ( f.busId, 2 );
+  CHECK_EQ( f.id, 0x290 );
+  CHECK_EQ( f.length, 3 );
+  CHECK_EQ( f.data[2], 0xAB );
+  CHECK( parseCandump( "(1.5) can0 7DF#", &f, &t ) );
+  CHECK_EQ( f.length, 0 );
+  CHECK( !parseCandump( "(1.5) can0 18DB33F1#00", &f, &t ) );
+  CHECK( !parseCandump( "(1.5) can0 123#R", &f, &t ) );
+  CHECK( !parseCandump( "(1.5) can0 123#0", &f, &t ) );
+}
+
+
+int main()
+{
+  setup();
+  Serial.take();
+
+  testCandump();
+  testTiming();
+  testUnderrun();
+  testBadBus();
+  return checkSummary( "test_replay" );
+}
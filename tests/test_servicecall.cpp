@@ -0,0 +1,405 @@
+/*
+*  ServiceCall and IsoTp in the running sketch, against a simulated ECU on
+*  bus 2: active PIDs answered in single and multi-frame responses, passive
+*  PIDs read from broadcast frames that happen to look like ISO-TP, first
+*  frames too short to be one, slow ECUs: response pending answers and
+*  consecutive frames far apart, and requests the ECU refuses.
+*/
+
+#include "sketch.h"
+#include "check.h"
+
+#define ECU_REQUEST 0x7E0
+#define ECU_RESPONSE 0x7E8
+
+static const char vin[] = "JM1BL1S58A1234567";
+
+
+/*
+*  Answers mode 0x22 requests for DA85 and F190 on ECU_REQUEST, anything
+*  else with a negative response. Frames go onto the bus no faster than
+*  the bus carries them, consecutive frames once the tester's Flow Control
+*  is in and cfGap apart. With pendingMs set DA85 is answered response
+*  pending first and the value that long after.
+*/
+struct SimEcu {
+  size_t seen;
+  byte response[64];
+  unsigned int length;
+  unsigned int offset;
+  byte sequence;
+  bool awaitFc;
+  unsigned long long nextAt;
+  unsigned long requests;
+  unsigned long flowControls;
+  unsigned long lost;
+  unsigned long afrRequests;
+  unsigned long refused;
+  unsigned long pendingMs;
+  unsigned long cfGap;
+  byte later[8];
+  unsigned int laterLength;
+  unsigned long long laterAt;
+  byte afr;
+
+  void frame( const byte *data )
+  {
+    if( !sim2.receive( ECU_RESPONSE, false, 8, data ) ) lost++;
+    nextAt = hostMicros + sim2.frameMicros( false, 8 );
+  }
+
+  void respond( const byte *data, unsigned int n )
+  {
+    if( hostMicros < nextAt ) hostMicros = nextAt;
+    byte f[8] = {0};
+    if( n <= 7 ){
+      f[0] = n;
+      memcpy( &f[1], data, n );
+      frame( f );
+      return;
+    }
+    memcpy( response, data, n );
+    length = n;
+    f[0] = 0x10 | (n >> 8);
+    f[1] = n & 0xFF;
+    memcpy( &f[2], data, 6 );
+    offset = 6;
+    sequence = 1;
+    awaitFc = true;
+    frame( f );
+  }
+
+  void request( const byte *data, unsigned int n )
+  {
+    requests++;
+    if( n == 3 && data[0] == 0x22 && data[1] == 0xDA && data[2] == 0x85 ){
+      byte r[] = { 0x62, 0xDA, 0x85, afr };
+      afrRequests++;
+      if( pendingMs ){
+        byte p[] = { 0x7F, 0x22, 0x78 };
+        respond( p, sizeof(p) );
+        memcpy( later, r, sizeof(r) );
+        laterLength = sizeof(r);
+        laterAt = hostMicros + pendingMs * 1000ULL;
+        return;
+      }
+      respond( r, sizeof(r) );
+    }else if( n == 3 && data[0] == 0x22 && data[1] == 0xF1 && data[2] == 0x90 ){
+      byte r[3 + sizeof(vin) - 1] = { 0x62, 0xF1, 0x90 };
+      memcpy( &r[3], vin, sizeof(vin) - 1 );
+      respond( r, sizeof(r) );
+    }else{
+      refused++;
+      byte r[] = { 0x7F, data[0], 0x31 };
+      respond( r, sizeof(r) );
+    }
+  }
+
+  void step()
+  {
+    while( seen < sim2.sent.size() ){
+      SimFrame f = sim2.sent[seen++];
+      if( f.id != ECU_REQUEST || f.extended ) continue;
+      byte pci = f.data[0] & 0xF0;
+      if( pci == 0x00 ) request( &f.data[1], f.data[0] & 0x0F );
+      if( pci == 0x30 && awaitFc ){
+        flowControls++;
+        awaitFc = false;
+      }
+    }
+
+    if( laterLength && hostMicros >= laterAt ){
+      respond( later, laterLength );
+      laterLength = 0;
+    }
+
+    // One consecutive frame at a time, the sketch runs in between
+    if( !awaitFc && offset < length && hostMicros >= nextAt ){
+      byte cf[8] = {0};
+      cf[0] = 0x20 | (sequence++ & 0x0F);
+      unsigned int n = min( 7u, length - offset );
+      memcpy( &cf[1], &response[offset], n );
+      offset += n;
+      frame( cf );
+      nextAt += cfGap * 1000ULL;
+    }
+  }
+};
+
+static SimEcu ecu;
+static void ecuStep() { ecu.step(); }
+
+
+static int addPid( int addr, byte busId, unsigned short txId, const byte *req, byte reqLen,
+                   const byte *rxf, byte rxd0, byte bits, unsigned int mult, unsigned int div, const char *name )
+{
+  struct pidDef def;
+  memset( &def, 0, sizeof(def) );
+  def.busId = busId;
+  def.txd[0] = txId >> 8;
+  def.txd[1] = txId & 0xFF;
+  memcpy( &def.txd[2], req, reqLen );
+  if( rxf ) memcpy( def.rxf, rxf, 6 );
+  for( byte k=0; !rxf && k<reqLen && k<3; k++ ){     // Positive response to the request
+    def.rxf[k*2] = 0x04 + k;
+    def.rxf[k*2+1] = k == 0 ? req[0] + 0x40 : req[k];
+  }
+  def.rxd[0] = rxd0;
+  def.rxd[1] = bits;
+  def.mth[0] = mult >> 8; def.mth[1] = mult & 0xFF;
+  def.mth[2] = div >> 8;  def.mth[3] = div & 0xFF;
+  memset( def.name, ' ', sizeof(def.name) );
+  memcpy( def.name, name, strlen( name ) );
+  return Settings::writePid( addr, &def );
+}
+
+
+/*
+*  0 AFR   22 DA 85, single frame, byte after the DID
+*  1 VIN   22 F1 90, multi-frame, 7th VIN character
+*  2 RPM   passive on 0x201, 16 bit from frame_data[0] / 4
+*  3 SPD   passive on 0x4B0, frame_data[2] when frame_data[0] is 0x03
+*  4 BAD   22 12 34, refused by the ECU
+*/
+static void loadTestPids()
+{
+  static const byte afrReq[] = { 0x22, 0xDA, 0x85 };
+  static const byte vinReq[] = { 0x22, 0xF1, 0x90 };
+  static const byte spdMatch[6] = { 0x03, 0x03, 0, 0, 0, 0 };
+  static const byte badReq[] = { 0x22, 0x12, 0x34 };
+
+  int addr = PID_TABLE_START;
+  addr = addPid( addr, 2, ECU_REQUEST, afrReq, 3, NULL, 0x30, 8, 1, 1, "AFR" );
+  addr = addPid( addr, 2, ECU_REQUEST, vinReq, 3, NULL, 0x60, 8, 1, 1, "VIN" );
+  addr = addPid( addr, 2, 0x201 - 8, NULL, 0, NULL, 0x10, 16, 1, 4, "RPM" );
+  addr = addPid( addr, 2, 0x4B0 - 8, NULL, 0, spdMatch, 0x20, 8, 1, 1, "SPD" );
+  addr = addPid( addr, 2, ECU_REQUEST, badReq, 3, NULL, 0x30, 8, 1, 1, "BAD" );
+  Settings::endPids( addr );
+  Settings::seal();
+  Settings::loadPids();
+  PidMatcher::compile();
+}
+
+
+static void testActivePids()
+{
+  ecu.afr = 0x5C;
+  runFor( 300, ecuStep );
+
+  CHECK( ecu.requests > 2 );
+  CHECK( ecu.flowControls > 0 );
+  CHECK_EQ( ecu.lost, 0 );
+  CHECK_EQ( cbt_settings.pids[0].value, 0x5C );
+  CHECK_EQ( cbt_settings.pids[1].value, (byte) vin[6] );
+  CHECK( IsoTp::completed > 0 );
+  CHECK_EQ( IsoTp::sequenceErrors, 0 );
+
+  ecu.afr = 0x61;
+  runFor( 100, ecuStep );
+  CHECK_EQ( cbt_settings.pids[0].value, 0x61 );
+}
+
+
+static unsigned long framesOn( Mcp2515Sim &sim, unsigned long id, size_t from )
+{
+  unsigned long n = 0;
+  for( size_t i=from; i<sim.sent.size(); i++ )
+    if( sim.sent[i].id == id ) n++;
+  return n;
+}
+
+
+static void testPassivePids()
+{
+  size_t from = sim2.sent.size();
+
+  // Byte 0 reads as an ISO-TP first frame, but nobody asked for this
+  static const byte rpm[8] = { 0x12, 0x34, 0, 0, 0, 0, 0, 0 };
+  CHECK( sim2.receive( 0x201, false, 8, rpm ) );
+  runFor( 5, ecuStep );
+  CHECK_EQ( cbt_settings.pids[2].value, 0x1234 / 4 );
+  CHECK_EQ( framesOn( sim2, 0x201 - 8, from ), 0 );
+
+  // And this as a single frame of 3 bytes
+  static const byte speed[8] = { 0x03, 0x00, 0x77, 0, 0, 0, 0, 0 };
+  CHECK( sim2.receive( 0x4B0, false, 8, speed ) );
+  runFor( 5, ecuStep );
+  CHECK_EQ( cbt_settings.pids[3].value, 0x77 );
+
+  // The match bytes still apply
+  static const byte other[8] = { 0x04, 0x00, 0x55, 0, 0, 0, 0, 0 };
+  CHECK( sim2.receive( 0x4B0, false, 8, other ) );
+  runFor( 5, ecuStep );
+  CHECK_EQ( cbt_settings.pids[3].value, 0x77 );
+
+  // Active PIDs keep working alongside
+  CHECK_EQ( cbt_settings.pids[0].value, 0x61 );
+  CHECK( PidMatcher::requested( ECU_RESPONSE ) );
+  CHECK( !PidMatcher::requested( 0x201 ) );
+}
+
+
+static Message frameOf( unsigned long id, const byte *data )
+{
+  Message msg;
+  msg.busId = 2;
+  msg.frame_id = id;
+  msg.extended = false;
+  msg.length = 8;
+  memcpy( msg.frame_data, data, 8 );
+  return msg;
+}
+
+
+static void testShortFirstFrame()
+{
+  unsigned int length;
+  byte req[] = { 0x22, 0x12, 0x34 };
+  while( !writeQueue.isEmpty() ) writeQueue.pop();
+
+  CHECK( IsoTp::send( 2, 0x7E1, req, sizeof(req) ) );
+  CHECK( IsoTp::expecting( 2, 0x7E9 ) );
+  CHECK( !IsoTp::expecting( 2, 0x7E8 + 8 ) );
+  CHECK_EQ( writeQueue.count(), 1 );
+
+  // 5 and 7 bytes fit a single frame, 0 is nothing at all
+  static const byte ff5[8] = { 0x10, 0x05, 0x62, 0x12, 0x34, 0x01, 0x02, 0x00 };
+  static const byte ff7[8] = { 0x10, 0x07, 0x62, 0x12, 0x34, 0x01, 0x02, 0x03 };
+  static const byte ff0[8] = { 0x10, 0x00, 0, 0, 0, 0, 0, 0 };
+  Message msg = frameOf( 0x7E9, ff5 );
+  CHECK( IsoTp::receive( &msg, &length ) == NULL );
+  msg = frameOf( 0x7E9, ff7 );
+  CHECK( IsoTp::receive( &msg, &length ) == NULL );
+  msg = frameOf( 0x7E9, ff0 );
+  CHECK( IsoTp::receive( &msg, &length ) == NULL );
+  CHECK_EQ( writeQueue.count(), 1 );      // No Flow Control for any of them
+
+  // A single frame longer than the frame carrying it
+  static const byte sf[8] = { 0x07, 0x62, 0x12, 0x34, 0x01, 0, 0, 0 };
+  msg = frameOf( 0x7E9, sf );
+  msg.length = 5;
+  CHECK( IsoTp::receive( &msg, &length ) == NULL );
+
+  // The channel is still waiting, an 8 byte response goes through
+  static const byte ff8[8] = { 0x10, 0x08, 0x62, 0x12, 0x34, 0x01, 0x02, 0x03 };
+  static const byte cf[8] = { 0x21, 0x04, 0x05, 0, 0, 0, 0, 0 };
+  msg = frameOf( 0x7E9, ff8 );
+  CHECK( IsoTp::receive( &msg, &length ) == NULL );
+  CHECK_EQ( writeQueue.count(), 2 );
+  msg = frameOf( 0x7E9, cf );
+  byte *payload = IsoTp::receive( &msg, &length );
+  CHECK( payload != NULL );
+  CHECK_EQ( length, 8 );
+  if( payload != NULL ) CHECK_EQ( payload[7], 0x05 );
+  CHECK( !IsoTp::expecting( 2, 0x7E9 ) );
+}
+
+
+// Response pending holds the ECU for the real answer, no timeout and no retry over it
+static void testResponsePending()
+{
+  runFor( 50, ecuStep );
+  ecu.afr = 0x70;
+  ecu.pendingMs = 600;
+  unsigned long requests = ecu.afrRequests;
+  unsigned long timeouts = ServiceCall::timeouts;
+
+  runFor( 150, ecuStep );
+  CHECK_EQ( ecu.afrRequests, requests + 1 );
+  CHECK( ecu.laterLength > 0 );
+  runFor( 400, ecuStep );
+  CHECK_EQ( ecu.afrRequests, requests + 1 );
+  CHECK( cbt_settings.pids[0].value != 0x70 );
+
+  runFor( 100, ecuStep );
+  CHECK_EQ( cbt_settings.pids[0].value, 0x70 );
+  CHECK_EQ( ServiceCall::timeouts, timeouts );
+
+  ecu.pendingMs = 0;
+  runFor( 100, ecuStep );
+  CHECK( ecu.afrRequests > requests + 1 );
+}
+
+
+// Each refusal frees the ECU at once and is counted, never timed out and
+// retried. BAD is displayed next to AFR so both poll as fast as they can
+static void testNegativeResponse()
+{
+  cbt_settings.displayIndex = 4;
+  unsigned long refused = ecu.refused;
+  unsigned long negatives = ServiceCall::negatives;
+  unsigned long timeouts = ServiceCall::timeouts;
+  unsigned long afr = ecu.afrRequests;
+
+  runFor( 1000, ecuStep );
+  CHECK( ecu.refused - refused >= 5 );
+  CHECK_EQ( ServiceCall::negatives - negatives, ecu.refused - refused );
+  CHECK_EQ( ServiceCall::lastNrc, 0x31 );
+  CHECK_EQ( ServiceCall::timeouts, timeouts );
+  CHECK( ecu.afrRequests - afr > 100 );
+  cbt_settings.displayIndex = 0;
+
+  Serial.take();
+  ServiceCall::printRates( &Serial );
+  CHECK( Serial.take().find( "\"pidNegative\", \"count\"" ) != std::string::npos );
+}
+
+
+// Consecutive frames 300ms apart are inside N_Cr, the VIN still arrives whole
+static void testSlowConsecutive()
+{
+  runFor( 50, ecuStep );
+  cbt_settings.pids[1].value = 0;
+  unsigned long completed = IsoTp::completed;
+  unsigned long timeouts = IsoTp::timeouts;
+  ecu.cfGap = 300;
+
+  runFor( 1500, ecuStep );
+  CHECK( IsoTp::completed > completed );
+  CHECK_EQ( IsoTp::timeouts, timeouts );
+  CHECK_EQ( IsoTp::sequenceErrors, 0 );
+  CHECK_EQ( cbt_settings.pids[1].value, (byte) vin[6] );
+  ecu.cfGap = 0;
+}
+
+
+// A long session still follows a step of one count, and min/max/count agree
+static void testStatsMean()
+{
+  PidStats::reset();
+  for( unsigned int n=0; n<10000; n++ ) PidStats::update( 0, 100 );
+  CHECK_EQ( PidStats::mean(0), 100 );
+  for( unsigned int n=0; n<30000; n++ ) PidStats::update( 0, 101 );
+  CHECK_EQ( PidStats::mean(0), 101 );
+  CHECK_EQ( PidStats::stats[0].count, 40000 );
+  CHECK_EQ( PidStats::stats[0].min, 100 );
+  CHECK_EQ( PidStats::stats[0].max, 101 );
+
+  PidStats::reset();
+  CHECK_EQ( PidStats::mean(0), 0 );
+  PidStats::update( 0, 0xFFFF );
+  PidStats::update( 0, 0xFFFE );
+  CHECK_EQ( PidStats::mean(0), 0xFFFF );
+}
+
+
+int main()
+{
+  setup();
+  Serial.take();
+  CHECK_EQ( sim2.bitRate(), Settings::busRate(2) );
+  CHECK_EQ( sim2.mode(), 0x00 );
+
+  loadTestPids();
+  CHECK_EQ( Settings::pidCount, 5 );
+  CHECK_EQ( cbt_settings.pids[2].txLen, 0 );
+
+  testActivePids();
+  testPassivePids();
+  testShortFirstFrame();
+  testResponsePending();
+  testNegativeResponse();
+  testSlowConsecutive();
+  testStatsMean();
+  return checkSummary( "test_servicecall" );
+}
@@ -0,0 +1,150 @@
+/*
+*  Settings in EEPROM: an image in the old fixed layout, 8 struct pidDef
+*  one after the other, migrated to packed records and read back field for
+*  field, then checked against its new CRC. Tables longer than
+*  PID_TABLE_SIZE only load that many.
+*/
+
+#include "sketch.h"
+#include "check.h"
+
+static struct pidDef old[8];
+
+
+static void oldImage()
+{
+  EepromWriter::flush();
+  for( byte i=0; i<8; i++ ) memcpy_P( &old[i], &defaultPids[i], sizeof(struct pidDef) );
+
+  // A passive PID with its own match list, a custom match list, an empty slot
+  memset( &old[3].txd[2], 0, 6 );
+  old[3].txd[0] = 0x01;
+  old[3].txd[1] = 0xF9;
+  byte passiveMatch[6] = { 0x03, 0x01, 0x04, 0x20, 0, 0 };
+  memcpy( old[3].rxf, passiveMatch, 6 );
+  old[5].rxf[5] = 0x19;
+  memset( &old[6], 0, sizeof(struct pidDef) );
+
+  struct cbt_settings header;
+  memset( &header, 0, sizeof(header) );
+  header.firstboot = 1;
+  header.displayEnabled = 1;
+  header.version = SETTINGS_V_FIXED;
+  eeprom_write_block( &header, (void*) 0, SETTINGS_HEADER_SIZE );
+  for( byte i=0; i<8; i++ )
+    eeprom_write_block( &old[i], (void*)(uintptr_t)(PID_TABLE_START + i * sizeof(struct pidDef)), sizeof(struct pidDef) );
+}
+
+
+static void checkPids()
+{
+  CHECK_EQ( Settings::pidCount, 7 );
+  for( byte i=0, k=0; i<8 && k<Settings::pidCount; i++ ){
+    if( i == 6 ) continue;                // The empty slot was dropped
+    struct pidDef def;
+    CHECK( Settings::readPid( k, &def ) );
+    CHECK_EQ( def.busId, old[i].busId );
+    CHECK_EQ( def.settings, old[i].settings );
+    CHECK( memcmp( def.txd, old[i].txd, sizeof(def.txd) ) == 0 );
+    CHECK( memcmp( def.rxf, old[i].rxf, sizeof(def.rxf) ) == 0 );
+    CHECK( memcmp( def.rxd, old[i].rxd, sizeof(def.rxd) ) == 0 );
+    CHECK( memcmp( def.mth, old[i].mth, sizeof(def.mth) ) == 0 );
+    CHECK( memcmp( def.name, old[i].name, sizeof(def.name) ) == 0 );
+    CHECK_EQ( cbt_settings.pids[k].label, old[i].name[0] );
+    k++;
+  }
+}
+
+
+static void testMigrate()
+{
+  oldImage();
+  Serial.take();
+
+  Settings::load( false, &Serial );
+  EepromWriter::flush();
+  CHECK_EQ( cbt_settings.version, SETTINGS_VERSION );
+  checkPids();
+
+  // The packed image now passes its CRC as it is
+  Settings::load( false, &Serial );
+  CHECK( Serial.take().find( "eepromCorrupt" ) == std::string::npos );
+  CHECK_EQ( cbt_settings.version, SETTINGS_VERSION );
+  checkPids();
+
+  // And a changed byte fails it, reported on the stream passed in
+  EepromWriter::flush();
+  byte b = eeprom_read_byte( (uint8_t*) PID_TABLE_START + 10 );
+  eeprom_write_byte( (uint8_t*) PID_TABLE_START + 10, b ^ 0x01 );
+  Serial1.take();
+  Settings::load( false, &Serial1 );
+  CHECK( Serial1.take().find( "eepromCorrupt" ) != std::string::npos );
+  CHECK( Serial.take().find( "eepromCorrupt" ) == std::string::npos );
+  CHECK_EQ( Settings::pidCount, STOCK_PIDS );
+}
+
+
+static void testTableSize()
+{
+  int addr = PID_TABLE_START;
+  for( byte i=0; i<PID_TABLE_SIZE + 2; i++ ){
+    struct pidDef def;
+    memcpy_P( &def, &defaultPids[i], sizeof(struct pidDef) );
+    def.busId = 2;
+    def.txd[0] = 0x07;
+    def.txd[1] = 0xE0;
+    addr = Settings::writePid( addr, &def );
+    CHECK( addr > 0 );
+  }
+  Settings::endPids( addr );
+  Settings::seal();
+  Settings::loadPids();
+  CHECK_EQ( Settings::pidCount, PID_TABLE_SIZE );
+}
+
+
+// Records are queued, not written in the call, and read back before they land
+static void testQueued()
+{
+  EepromWriter::flush();
+  Settings::clear();
+  EepromWriter::flush();
+
+  unsigned long written = EepromWriter::written;
+  int addr = PID_TABLE_START;
+  for( byte i=0; i<STOCK_PIDS; i++ ){
+    struct pidDef def;
+    memcpy_P( &def, &defaultPids[i], sizeof(struct pidDef) );
+    addr = Settings::writePid( addr, &def );
+  }
+  Settings::endPids( addr );
+  Settings::seal();
+  CHECK( EepromWriter::pending() > 0 );
+  CHECK( EepromWriter::written - written < (unsigned long)(addr - PID_TABLE_START) );
+
+  Settings::loadPids();
+  CHECK_EQ( Settings::pidCount, STOCK_PIDS );
+  struct pidDef def;
+  CHECK( Settings::readPid( STOCK_PIDS - 1, &def ) );
+  CHECK( memcmp_P( def.name, defaultPids[STOCK_PIDS - 1].name, PID_NAME_LENGTH ) == 0 );
+
+  // Left to the interrupt, all of it lands and passes its CRC
+  runFor( 3000 );
+  CHECK_EQ( EepromWriter::pending(), 0 );
+  Serial.take();
+  Settings::load( false, &Serial );
+  CHECK( Serial.take().find( "eepromCorrupt" ) == std::string::npos );
+  CHECK_EQ( Settings::pidCount, STOCK_PIDS );
+}
+
+
+int main()
+{
+  setup();
+  Serial.take();
+
+  testMigrate();
+  testTableSize();
+  testQueued();
+  return checkSummary( "test_settings" );
+}
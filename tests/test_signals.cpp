@@ -0,0 +1,165 @@
+/*
+*  Signals in the running sketch: bit fields picked out in Intel and
+*  Motorola order, sign extension and scaling, updates held back inside
+*  the deadband until the heartbeat, and definitions that survive a
+*  reload from EEPROM.
+*/
+
+#include "sketch.h"
+#include "check.h"
+
+struct update {
+  byte index;
+  long value;
+};
+
+
+// Same bytes as the 0x13 0x02 command after the index
+static boolean define( byte i, byte busId, unsigned long id, byte startBit, byte length,
+                       int mult, unsigned int div, int offset, unsigned int deadband, unsigned int heartbeat )
+{
+  byte def[17] = { busId, (byte)(id >> 24), (byte)(id >> 16), (byte)(id >> 8), (byte) id, startBit, length,
+                   (byte)(mult >> 8), (byte) mult, (byte)(div >> 8), (byte) div, (byte)(offset >> 8), (byte) offset,
+                   (byte)(deadband >> 8), (byte) deadband, (byte)(heartbeat >> 8), (byte) heartbeat };
+  return Signals::define( i, def );
+}
+
+
+static void feed( byte busId, unsigned long id, const byte *data )
+{
+  Message msg;
+  msg.busId = busId;
+  msg.frame_id = id;
+  msg.extended = false;
+  msg.length = 8;
+  memcpy( msg.frame_data, data, 8 );
+  Signals::process( &msg );
+}
+
+
+// Updates written since the last call, 0x13 Index Value3-0 0x0D each
+static std::vector<struct update> updates()
+{
+  std::vector<struct update> out;
+  std::string s = Serial.take();
+  for( size_t i=0; i+7<=s.size(); i+=7 ){
+    CHECK_EQ( (byte) s[i], 0x13 );
+    CHECK_EQ( (byte) s[i+6], 0x0D );
+    struct update u;
+    u.index = s[i+1];
+    u.value = (long)(int32_t)( ((uint32_t)(byte) s[i+2] << 24) | ((uint32_t)(byte) s[i+3] << 16) |
+                               ((uint32_t)(byte) s[i+4] << 8) | (byte) s[i+5] );
+    out.push_back( u );
+  }
+  return out;
+}
+
+
+static void testExtract()
+{
+  Signals::clear();
+  // 0 RPM, 16 bit Intel at bit 8, / 4
+  CHECK( define( 0, 2, 0x201, 8, 16, 1, 4, 0, 0, 0 ) );
+  // 1 Motorola, MSB at bit 7 of byte 0, 12 bits: byte 0 and the high nibble of byte 1
+  CHECK( define( 1, 2, 0x201, 7, 12 | SIGNAL_MOTOROLA, 1, 1, 0, 0, 0 ) );
+  // 2 Signed 10 bit Intel at bit 36, * 10 / 4 - 40
+  CHECK( define( 2, 2, 0x201, 36, 10 | SIGNAL_SIGNED, 10, 4, -40, 0, 0 ) );
+  // 3 Another bus, never matches
+  CHECK( define( 3, 3, 0x201, 0, 8, 1, 1, 0, 0, 0 ) );
+
+  Signals::setEnabled( true, &Serial );
+  byte data[8] = { 0xAB, 0x40, 0x1F, 0x00, 0xF0, 0x3F, 0x00, 0x00 };
+  feed( 2, 0x201, data );
+
+  std::vector<struct update> u = updates();
+  CHECK_EQ( u.size(), 3 );
+  if( u.size() != 3 ) return;
+  CHECK_EQ( u[0].index, 0 );
+  CHECK_EQ( u[0].value, 0x1F40 / 4 );
+  CHECK_EQ( u[1].index, 1 );
+  CHECK_EQ( u[1].value, 0xAB4 );
+  CHECK_EQ( u[2].index, 2 );
+  CHECK_EQ( u[2].value, -1 * 10 / 4 - 40 );    // Bits 36-45 all set
+
+  // Definitions out of range
+  CHECK( !define( SIGNALS_MAX, 2, 0x201, 0, 8, 1, 1, 0, 0, 0 ) );
+  CHECK( !define( 4, 2, 0x201, 64, 8, 1, 1, 0, 0, 0 ) );
+  CHECK( !define( 4, 2, 0x201, 0, 0, 1, 1, 0, 0, 0 ) );
+  CHECK( !define( 4, 2, 0x201, 0, 33, 1, 1, 0, 0, 0 ) );
+}
+
+
+static void testDeadband()
+{
+  Signals::clear();
+  // Byte 0, report moves of more than 5 or every 200ms
+  CHECK( define( 0, 1, 0x4B0, 0, 8, 1, 1, 0, 5, 200 ) );
+  Signals::setEnabled( true, &Serial );
+  Signals::resetStats();
+
+  static const byte values[] = { 100, 103, 105, 106, 104, 101, 101, 99 };
+  static const bool sent[]   = { true, false, false, true, false, false, false, true };
+  for( byte i=0; i<sizeof(values); i++ ){
+    byte data[8] = { values[i] };
+    feed( 1, 0x4B0, data );
+    std::vector<struct update> u = updates();
+    CHECK_EQ( u.size(), sent[i] ? 1 : 0 );
+    if( sent[i] && u.size() == 1 ) CHECK_EQ( u[0].value, values[i] );
+  }
+  CHECK_EQ( Signals::frameBytes, sizeof(values) * BT_LOG_RECORD_SIZE );
+  CHECK_EQ( Signals::updateBytes, 3 * SIGNAL_UPDATE_SIZE );
+
+  // Inside the deadband, but the heartbeat is due
+  byte data[8] = { 95 };
+  hostMicros += 199000;
+  feed( 1, 0x4B0, data );
+  CHECK_EQ( updates().size(), 0 );
+  hostMicros += 2000;
+  feed( 1, 0x4B0, data );
+  std::vector<struct update> u = updates();
+  CHECK_EQ( u.size(), 1 );
+  if( u.size() == 1 ) CHECK_EQ( u[0].value, 95 );
+}
+
+
+// The whole table goes to EEPROM and back, larger than 255 bytes on the host
+static void testReload()
+{
+  Signals::clear();
+  for( byte i=0; i<SIGNALS_MAX; i++ )
+    CHECK( define( i, 2, 0x300 + i, 0, 8, 1, 1, i, 0, 0 ) );
+  EepromWriter::flush();
+
+  Signals::init();
+  Signals::setEnabled( true, &Serial );
+  byte data[8] = { 10 };
+  feed( 2, 0x300 + SIGNALS_MAX - 1, data );
+  std::vector<struct update> u = updates();
+  CHECK_EQ( u.size(), 1 );
+  if( u.size() == 1 ){
+    CHECK_EQ( u[0].index, SIGNALS_MAX - 1 );
+    CHECK_EQ( u[0].value, 10 + SIGNALS_MAX - 1 );
+  }
+
+  // Off gives the state back, back on starts over and sends the value again
+  CHECK( Signals::setEnabled( false, &Serial ) );
+  feed( 2, 0x300 + SIGNALS_MAX - 1, data );
+  CHECK_EQ( updates().size(), 0 );
+  CHECK( Signals::setEnabled( true, &Serial ) );
+  feed( 2, 0x300 + SIGNALS_MAX - 1, data );
+  CHECK_EQ( updates().size(), 1 );
+}
+
+
+int main()
+{
+  setup();
+  Serial.take();
+
+  testExtract();
+  testDeadband();
+  testReload();
+
+  Signals::setEnabled( false, &Serial );
+  return checkSummary( "test_signals" );
+}
@@ -0,0 +1,2 @@
+// The whole sketch in one object for ramreport.py to measure
+#include "sketch.h"
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""
+Static RAM of the firmware as the ATmega32U4 lays it out, from the debug
+info of the host build. Every global and static member defined in the
+sketch or its libraries is sized again with AVR widths: int and pointers 2
+bytes, long and float 4, and no padding in structs, which avr-gcc never
+adds. PROGMEM tables stay in flash and are left out, as are the Arduino
+core, the stack and the heap.
+
+    ramreport.py sketch.o
+"""
+
+import re
+import subprocess
+import sys
+
+SOURCES = ( '/CANBusTriple_Mazda', '/libraries/' )
+
+BASE = {
+  'char': 1, 'signed char': 1, 'unsigned char': 1, 'bool': 1,
+  'short int': 2, 'short unsigned int': 2, 'int': 2, 'unsigned int': 2,
+  'long int': 4, 'long unsigned int': 4, 'float': 4, 'double': 4,
+  'long long int': 8, 'long long unsigned int': 8,
+}
+ADDRESS = ( 'DW_TAG_pointer_type', 'DW_TAG_reference_type', 'DW_TAG_rvalue_reference_type', 'DW_TAG_ptr_to_member_type' )
+ALIAS = ( 'DW_TAG_typedef', 'DW_TAG_const_type', 'DW_TAG_volatile_type' )
+
+
+def readelf( obj, what ):
+  return subprocess.run( [ 'readelf', '--debug-dump=' + what, obj ], capture_output=True, text=True, check=True ).stdout
+
+
+# Section of each symbol, PROGMEM ones are in .progmem.data like on the AVR
+def sections( obj ):
+  out = {}
+  for line in subprocess.run( [ 'objdump', '-t', '-C', obj ], capture_output=True, text=True, check=True ).stdout.splitlines():
+    m = re.match( r'[0-9a-f]+ .{7} (\S+)\s+[0-9a-f]+\s+(.*)$', line )
+    if m: out[m.group( 2 )] = m.group( 1 )
+  return out
+
+
+def files( obj ):
+  dirs, names = {}, {}
+  table = None
+  for line in readelf( obj, 'rawline' ).splitlines():
+    if 'The Directory Table' in line: table = dirs
+    elif 'The File Name Table' in line: table = names
+    elif not line.strip(): table = None
+    elif table is not None:
+      m = re.match( r'\s+(\d+)\s+(?:(\d+)\s+)?\(.*\):\s*(.*)$', line )
+      if m: table[int( m.group( 1 ) )] = ( m.group( 2 ), m.group( 3 ) )
+  return { n: dirs[int( d )][1] + '/' + name for n, ( d, name ) in names.items() }
+
+
+# DIEs by offset, each with its tag, attributes, parent and children
+def dies( obj ):
+  out, stack = {}, []
+  die = None
+  for line in readelf( obj, 'info' ).splitlines():
+    m = re.match( r'\s*<(\d+)><([0-9a-f]+)>: Abbrev Number: (\d+)(?: \((\w+)\))?', line )
+    if m:
+      depth, off = int( m.group( 1 ) ), int( m.group( 2 ), 16 )
+      del stack[depth:]
+      die = None
+      if m.group( 3 ) == '0': continue
+      die = { 'tag': m.group( 4 ), 'at': {}, 'kids': [], 'parent': stack[-1] if stack else None }
+      out[off] = die
+      if stack: out[stack[-1]]['kids'].append( off )
+      stack.append( off )
+      continue
+    m = re.match( r'\s*<[0-9a-f]+>\s+(DW_AT_\w+)\s*:\s*(.*)$', line )
+    if m and die is not None:
+      value = m.group( 2 ).strip()
+      ref = re.match( r'<0x([0-9a-f]+)>', value )
+      if ref: value = int( ref.group( 1 ), 16 )
+      elif m.group( 1 ) in ( 'DW_AT_name', 'DW_AT_linkage_name' ): value = value.split( ': ' )[-1]
+      die['at'][m.group( 1 )] = value
+  return out
+
+
+def number( value ):
+  return int( str( value ).split()[0], 0 )
+
+
+def avrSize( d, off ):
+  die = d[off]
+  tag, at = die['tag'], die['at']
+  if tag == 'DW_TAG_base_type': return BASE[at['DW_AT_name']]
+  if tag in ADDRESS: return 2
+  if tag in ALIAS: return avrSize( d, at['DW_AT_type'] )
+  if tag == 'DW_TAG_enumeration_type': return min( number( at['DW_AT_byte_size'] ), 2 )
+  if tag == 'DW_TAG_array_type':
+    count = 1
+    for k in die['kids']:
+      sub = d[k]['at']
+      if 'DW_AT_count' in sub: count *= number( sub['DW_AT_count'] )
+      elif 'DW_AT_upper_bound' in sub: count *= number( sub['DW_AT_upper_bound'] ) + 1
+    return count * avrSize( d, at['DW_AT_type'] )
+  if tag in ( 'DW_TAG_structure_type', 'DW_TAG_class_type', 'DW_TAG_union_type' ):
+    fields = [ avrSize( d, d[k]['at']['DW_AT_type'] ) for k in die['kids']
+               if d[k]['tag'] in ( 'DW_TAG_member', 'DW_TAG_inheritance' ) and 'DW_AT_external' not in d[k]['at'] ]
+    if tag == 'DW_TAG_union_type': return max( fields or [ 0 ] )
+    return sum( fields )
+  raise ValueError( 'no AVR size for %s at 0x%x' % ( tag, off ) )
+
+
+def qualified( d, off ):
+  name = d[off]['at'].get( 'DW_AT_name', '?' )
+  parent = d[off]['parent']
+  while parent is not None and d[parent]['tag'] != 'DW_TAG_compile_unit':
+    scope = d[parent]['at'].get( 'DW_AT_name' )
+    if scope: name = scope + ( '::' if d[parent]['tag'] != 'DW_TAG_subprogram' else '()::' ) + name
+    parent = d[parent]['parent']
+  return name
+
+
+def main():
+  obj = sys.argv[1]
+  paths = files( obj )
+  inSection = sections( obj )
+  d = dies( obj )
+
+  rows = []
+  for off, die in d.items():
+    # At a fixed address, not on the stack
+    if die['tag'] != 'DW_TAG_variable' or 'DW_OP_addr' not in str( die['at'].get( 'DW_AT_location' ) ): continue
+    decl = off
+    if 'DW_AT_specification' in die['at']: decl = die['at']['DW_AT_specification']
+    path = paths.get( number( d[decl]['at'].get( 'DW_AT_decl_file', -1 ) ), '' )
+    if not any( s in path for s in SOURCES ): continue
+    name = qualified( d, decl )
+    if inSection.get( name, '' ).startswith( '.progmem' ): continue
+    size = avrSize( d, die['at'].get( 'DW_AT_type', d[decl]['at'].get( 'DW_AT_type' ) ) )
+    rows.append( ( size, name, path.rsplit( '/', 1 )[-1] ) )
+
+  byFile = {}
+  for size, name, path in rows: byFile[path] = byFile.get( path, 0 ) + size
+
+  print( 'By file' )
+  for path, size in sorted( byFile.items(), key=lambda f: -f[1] ):
+    print( '%6d  %s' % ( size, path ) )
+  print( '\nLargest' )
+  for size, name, path in sorted( rows, reverse=True )[:20]:
+    print( '%6d  %s' % ( size, name ) )
+  print( '\n%6d  bytes of .data and .bss' % sum( r[0] for r in rows ) )
+
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,198 @@
+#include "TraceStream.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+
+bool parseCandump( const std::string &line, TraceFrame *frame, double *seconds )
+{
+  char iface[32];
+  char body[64];
+  if( sscanf( line.c_str(), " (%lf) %31s %63s", seconds, iface, body ) != 3 ) return false;
+
+  // Standard IDs only, the device replays 11 bit frames
+  char *hash = strchr( body, '#' );
+  if( hash == NULL || hash - body != 3 || hash[1] == 'R' ) return false;
+
+  memset( frame, 0, sizeof(*frame) );
+  frame->id = strtoul( std::string( body, 3 ).c_str(), NULL, 16 );
+  if( frame->id > 0x7FF ) return false;
+
+  const char *hex = hash + 1;
+  size_t digits = strlen( hex );
+  if( digits % 2 || digits > 16 ) return false;
+  for( size_t i=0; i<digits; i += 2 ){
+    char b[3] = { hex[i], hex[i+1], 0 };
+    char *end;
+    frame->data[i/2] = strtoul( b, &end, 16 );
+    if( *end ) return false;
+  }
+  frame->length = digits / 2;
+
+  // can0 = bus 1 and so on
+  size_t n = strlen( iface );
+  frame->busId = n && iface[n-1] >= '0' && iface[n-1] <= '2' ? iface[n-1] - '0' + 1 : 1;
+  return true;
+}
+
+
+size_t loadCandump( FILE *in, std::vector<TraceFrame> *frames, size_t *skipped )
+{
+  char buf[256];
+  double first = -1;
+  *skipped = 0;
+
+  while( fgets( buf, sizeof(buf), in ) ){
+    TraceFrame frame;
+    double t;
+    if( !parseCandump( buf, &frame, &t ) ){
+      (*skipped)++;
+      continue;
+    }
+    if( first < 0 ) first = t;
+    frame.offset = (uint32_t) ((t - first) * 1e6 + 0.5);
+    frames->push_back( frame );
+  }
+
+  return frames->size();
+}
+
+
+TraceStream::TraceStream( const std::vector<TraceFrame> &f, uint8_t b, uint16_t lead )
+  : frames( f ), bus( b ), leadMs( lead )
+{
+  batches = polls = timeouts = 0;
+  step = ARM;
+  next = 0;
+  credits = 0;
+  waiting = false;
+  askedAt = 0;
+}
+
+
+// One command at a time, the next waits for the reply to this one
+void TraceStream::ask( unsigned long nowMs, std::vector<uint8_t> *out, const uint8_t *cmd, size_t n )
+{
+  out->insert( out->end(), cmd, cmd + n );
+  waiting = true;
+  askedAt = nowMs;
+}
+
+
+void TraceStream::output( unsigned long nowMs, std::vector<uint8_t> *out )
+{
+  if( waiting ){
+    if( nowMs - askedAt < TRACE_REPLY_TIMEOUT_MS ) return;
+    timeouts++;                       // Reply lost, the next command gets one
+    waiting = false;
+  }
+
+  switch( step ){
+    case ARM: {
+      uint8_t cmd[] = { 0x09, 0x01, bus, (uint8_t)(leadMs >> 8), (uint8_t) leadMs };
+      ask( nowMs, out, cmd, sizeof(cmd) );
+    } break;
+
+    case STREAM:
+      if( next == frames.size() ){
+        uint8_t cmd[] = { 0x09, 0x03 };
+        ask( nowMs, out, cmd, sizeof(cmd) );
+        step = END;
+      }else if( credits > 0 ){
+        size_t n = frames.size() - next;
+        if( n > credits ) n = credits;
+        if( n > TRACE_BATCH_MAX ) n = TRACE_BATCH_MAX;
+
+        std::vector<uint8_t> cmd;
+        cmd.push_back( 0x09 );
+        cmd.push_back( 0x02 );
+        cmd.push_back( n );
+        for( size_t i=0; i<n; i++ ){
+          const TraceFrame &f = frames[next++];
+          uint8_t hdr[8] = { (uint8_t)(f.offset >> 24), (uint8_t)(f.offset >> 16), (uint8_t)(f.offset >> 8), (uint8_t) f.offset,
+                             f.busId, (uint8_t)(f.id >> 8), (uint8_t) f.id, f.length };
+          cmd.insert( cmd.end(), hdr, hdr + 8 );
+          cmd.insert( cmd.end(), f.data, f.data + f.length );
+        }
+        credits = 0;
+        batches++;
+        ask( nowMs, out, &cmd[0], cmd.size() );
+      }else if( nowMs - askedAt >= TRACE_POLL_MS ){
+        uint8_t cmd[] = { 0x09, 0x02, 0x00 };
+        polls++;
+        ask( nowMs, out, cmd, sizeof(cmd) );
+      }
+    break;
+
+    case STATS:
+      if( nowMs - askedAt >= TRACE_POLL_MS ){
+        uint8_t cmd[] = { 0x09, 0x05 };
+        ask( nowMs, out, cmd, sizeof(cmd) );
+      }
+    break;
+
+    default:
+    break;
+  }
+}
+
+
+/*
+*  Credit replies are 0x09 Credits 0x0D. Anything else the device prints is
+*  a JSON line, of which only the replay stats matter here.
+*/
+void TraceStream::input( const uint8_t *data, size_t n )
+{
+  rx.insert( rx.end(), data, data + n );
+
+  while( !rx.empty() ){
+    if( rx[0] == '{' ){
+      std::vector<uint8_t>::iterator nl = std::find( rx.begin(), rx.end(), '\n' );
+      if( nl == rx.end() ) return;
+      statsLine( std::string( rx.begin(), nl ) );
+      rx.erase( rx.begin(), nl + 1 );
+    }else if( rx[0] == 0x09 ){
+      if( rx.size() < 3 ) return;
+      if( rx[2] == 0x0D ){
+        reply( rx[1] );
+        rx.erase( rx.begin(), rx.begin() + 3 );
+      }else{
+        rx.erase( rx.begin() );
+      }
+    }else{
+      rx.erase( rx.begin() );
+    }
+  }
+}
+
+
+void TraceStream::reply( uint8_t c )
+{
+  if( step == STATS || step == DONE ) return;
+  credits = c;
+  waiting = false;
+  if( step == ARM ) step = STREAM;
+  if( step == END ) step = STATS;
+}
+
+
+void TraceStream::statsLine( const std::string &line )
+{
+  if( line.find( "\"event\":\"replay\"" ) == std::string::npos ) return;
+  stats = line;
+  while( !stats.empty() && (stats[stats.size()-1] == '\r' || stats[stats.size()-1] == '\n') )
+    stats.erase( stats.size() - 1 );
+  if( step != STATS ) return;
+  waiting = false;
+
+  // Idle again once everything buffered has played
+  if( line.find( "\"state\":\"0\"" ) != std::string::npos ) step = DONE;
+}
+
+
+void TraceStream::abort( std::vector<uint8_t> *out )
+{
+  uint8_t cmd[] = { 0x09, 0x04 };
+  out->insert( out->end(), cmd, cmd + sizeof(cmd) );
+  step = DONE;
+}
@@ -0,0 +1,74 @@
+/*
+*  Host side of trace replay, 0x09 in SerialCommand.h
+*
+*  TraceStream turns a trace into the byte stream the device expects and
+*  keeps to its credits: it arms replay, sends a batch of no more frames
+*  than the device has free buffer slots, and waits for the reply granting
+*  the next credits before it sends anything else. With no credits left it
+*  asks again every TRACE_POLL_MS. Once the last frame is in it ends the
+*  trace and polls the replay stats until playback is over.
+*
+*  The transport is the caller's: output() gives the bytes to write now,
+*  input() takes what the device sent. cbt-replay.cpp drives a serial port
+*  with it, the host tests drive the simulated sketch.
+*/
+
+#ifndef TraceStream_h
+#define TraceStream_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define TRACE_POLL_MS 5
+#define TRACE_REPLY_TIMEOUT_MS 500
+#define TRACE_BATCH_MAX 255
+
+struct TraceFrame {
+  uint32_t offset;            // us from the first frame
+  uint8_t busId;
+  uint16_t id;
+  uint8_t length;
+  uint8_t data[8];
+};
+
+// candump -l lines: (1436509052.249713) can0 123#DEADBEEF, bus = can index + 1
+bool parseCandump( const std::string &line, TraceFrame *frame, double *seconds );
+size_t loadCandump( FILE *in, std::vector<TraceFrame> *frames, size_t *skipped );
+
+
+class TraceStream
+{
+  public:
+    TraceStream( const std::vector<TraceFrame> &frames, uint8_t bus, uint16_t leadMs );
+    void output( unsigned long nowMs, std::vector<uint8_t> *out );
+    void input( const uint8_t *data, size_t n );
+    void abort( std::vector<uint8_t> *out );
+    bool done() const { return step == DONE; }
+    size_t sent() const { return next; }
+
+    std::string stats;        // Last replay stats line from the device
+    unsigned long batches;
+    unsigned long polls;
+    unsigned long timeouts;
+
+  private:
+    enum Step { ARM, STREAM, END, STATS, DONE };
+
+    const std::vector<TraceFrame> &frames;
+    uint8_t bus;
+    uint16_t leadMs;
+    Step step;
+    size_t next;
+    uint8_t credits;
+    bool waiting;
+    unsigned long askedAt;
+    std::vector<uint8_t> rx;
+
+    void ask( unsigned long nowMs, std::vector<uint8_t> *out, const uint8_t *cmd, size_t n );
+    void reply( uint8_t credits );
+    void statsLine( const std::string &line );
+};
+
+#endif
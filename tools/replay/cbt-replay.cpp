@@ -0,0 +1,136 @@
+/*
+*  Play a candump log back through a CANBus Triple with its original timing
+*
+*    cbt-replay [-b bus] [-l lead_ms] /dev/ttyACM0 trace.log
+*
+*  -b sends every frame on one bus instead of can0 = 1, can1 = 2, can2 = 3.
+*  -l is how long the device buffers before it starts playing, 100ms by
+*  default. The device's replay stats are printed when playback is over,
+*  Ctrl-C aborts it.
+*/
+
+#include "TraceStream.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal( int sig )
+{
+  (void) sig;
+  interrupted = 1;
+}
+
+
+static unsigned long nowMs()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+
+static int openPort( const char *path )
+{
+  int fd = open( path, O_RDWR | O_NOCTTY );
+  if( fd < 0 ) return -1;
+
+  struct termios tio;
+  if( tcgetattr( fd, &tio ) != 0 ){
+    close( fd );
+    return -1;
+  }
+  cfmakeraw( &tio );
+  cfsetispeed( &tio, B115200 );
+  cfsetospeed( &tio, B115200 );
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  tcsetattr( fd, TCSANOW, &tio );
+  tcflush( fd, TCIOFLUSH );
+  return fd;
+}
+
+
+static bool writeAll( int fd, const std::vector<uint8_t> &data )
+{
+  size_t done = 0;
+  while( done < data.size() ){
+    ssize_t n = write( fd, &data[done], data.size() - done );
+    if( n < 0 && errno != EINTR && errno != EAGAIN ) return false;
+    if( n > 0 ) done += n;
+  }
+  return true;
+}
+
+
+int main( int argc, char **argv )
+{
+  int bus = 0;
+  int lead = 100;
+  int opt;
+  while( (opt = getopt( argc, argv, "b:l:" )) != -1 ){
+    switch( opt ){
+      case 'b': bus = atoi( optarg ); break;
+      case 'l': lead = atoi( optarg ); break;
+      default: optind = argc + 1; break;
+    }
+  }
+  if( optind + 2 != argc || bus < 0 || bus > 3 || lead < 0 || lead > 0xFFFF ){
+    fprintf( stderr, "usage: %s [-b bus] [-l lead_ms] port trace.log\n", argv[0] );
+    return 2;
+  }
+
+  FILE *in = fopen( argv[optind+1], "r" );
+  if( in == NULL ){
+    perror( argv[optind+1] );
+    return 1;
+  }
+  std::vector<TraceFrame> frames;
+  size_t skipped;
+  loadCandump( in, &frames, &skipped );
+  fclose( in );
+  fprintf( stderr, "%zu frames, %zu lines skipped\n", frames.size(), skipped );
+
+  int fd = openPort( argv[optind] );
+  if( fd < 0 ){
+    perror( argv[optind] );
+    return 1;
+  }
+
+  signal( SIGINT, onSignal );
+  TraceStream stream( frames, bus, lead );
+  std::vector<uint8_t> out;
+
+  while( !stream.done() ){
+    out.clear();
+    if( interrupted ) stream.abort( &out );
+    else stream.output( nowMs(), &out );
+    if( !out.empty() && !writeAll( fd, out ) ){
+      perror( "write" );
+      return 1;
+    }
+
+    fd_set fds;
+    FD_ZERO( &fds );
+    FD_SET( fd, &fds );
+    struct timeval tv = { 0, 1000 };
+    if( select( fd + 1, &fds, NULL, NULL, &tv ) > 0 ){
+      uint8_t buf[256];
+      ssize_t n = read( fd, buf, sizeof(buf) );
+      if( n > 0 ) stream.input( buf, n );
+    }
+  }
+
+  fprintf( stderr, "%zu frames sent in %lu batches, %lu credit polls, %lu lost replies\n",
+           stream.sent(), stream.batches, stream.polls, stream.timeouts );
+  if( !stream.stats.empty() ) printf( "%s\n", stream.stats.c_str() );
+  close( fd );
+  return interrupted ? 1 : 0;
+}